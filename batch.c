@@ -0,0 +1,505 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/time.h>
+#include "batch.h"
+#include "kaytil.h"
+
+/* Batch runs for scripts and CI. Keys are typed from a script instead of
+   the terminal, and the console output goes as is to a file. The script
+   has one command per line, blank lines and lines starting with '#' are
+   skipped:
+
+     wait TEXT   Hold further keys until TEXT has been output.
+     send TEXT   Type TEXT followed by a carriage return.
+     keys TEXT   Type TEXT only.
+
+   TEXT may use the escapes \r, \n, \t, \e, \\ and \xHH. A wait only
+   matches output written after the keys before it were taken. The run
+   ends when an exit condition is met, or when the program wants a key
+   the script will never give. That read is left blocked, so the machine
+   can be given another script and run on. */
+
+#define BATCH_LINE_MAX 512
+#define BATCH_SLICE_INSTRUCTIONS 100000
+
+
+
+static int batch_unescape(const char *in, char *out)
+{
+  int len = 0;
+  char hex[3];
+  char *end;
+
+  while (*in != '\0') {
+    if (*in != '\\') {
+      out[len++] = *in++;
+      continue;
+    }
+    in++;
+    switch (*in) {
+    case 'r':
+      out[len++] = '\r';
+      break;
+    case 'n':
+      out[len++] = '\n';
+      break;
+    case 't':
+      out[len++] = '\t';
+      break;
+    case 'e':
+      out[len++] = 0x1B;
+      break;
+    case '\\':
+      out[len++] = '\\';
+      break;
+    case 'x':
+      hex[0] = in[1];
+      hex[1] = (hex[0] != '\0') ? in[2] : '\0';
+      hex[2] = '\0';
+      out[len++] = strtol(hex, &end, 16);
+      if (end != &hex[2]) {
+        return -1;
+      }
+      in += 2;
+      break;
+    default:
+      return -1;
+    }
+    in++;
+  }
+  return len;
+}
+
+
+
+static int batch_step_append(batch_t *batch, batch_step_type_t type,
+  const char *text, int len)
+{
+  batch_step_t *new;
+
+  new = realloc(batch->step, (batch->steps + 1) * sizeof(batch_step_t));
+  if (new == NULL) {
+    return -1;
+  }
+  batch->step = new;
+  new = &batch->step[batch->steps];
+  new->text = malloc(len);
+  if (new->text == NULL) {
+    return -1;
+  }
+  memcpy(new->text, text, len);
+  new->len = len;
+  new->type = type;
+  batch->steps++;
+  return 0;
+}
+
+
+
+static int batch_step_add(batch_t *batch, batch_step_type_t type,
+  const char *text, bool cr)
+{
+  char buffer[BATCH_LINE_MAX + 1];
+  int len;
+
+  len = batch_unescape(text, buffer);
+  if (len < 0) {
+    return -1;
+  }
+  if (cr) {
+    buffer[len++] = '\r';
+  }
+  if (len == 0 || (type == BATCH_STEP_WAIT && len > BATCH_TEXT_MAX)) {
+    return -1;
+  }
+  return batch_step_append(batch, type, buffer, len);
+}
+
+
+
+static bool batch_tail_match(batch_t *batch, const char *text, int len,
+  uint32_t since)
+{
+  uint32_t start;
+  int i;
+
+  if (batch->written - since < (uint32_t)len) {
+    return false;
+  }
+  start = batch->written - len;
+  for (i = 0; i < len; i++) {
+    if (batch->tail[(start + i) & (BATCH_TEXT_MAX - 1)] != (uint8_t)text[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+
+static bool batch_at_prompt(batch_t *batch)
+{
+  uint8_t drive;
+
+  /* The CCP prints a new line, the drive and '>' before reading. */
+  if (batch->written < 3 || ! batch_tail_match(batch, ">", 1, 0) ||
+    batch->tail[(batch->written - 3) & (BATCH_TEXT_MAX - 1)] != '\n') {
+    return false;
+  }
+  drive = batch->tail[(batch->written - 2) & (BATCH_TEXT_MAX - 1)];
+  return (drive >= 'a' && drive <= 'p') || (drive >= 'A' && drive <= 'P');
+}
+
+
+
+static void batch_stop(batch_t *batch, int exit_code)
+{
+  if (batch->exit_code == -1) {
+    batch->exit_code = exit_code;
+  }
+  kaytil_stop(batch->machine);
+}
+
+
+
+static void batch_advance(batch_t *batch)
+{
+  batch->current++;
+  batch->pos = 0;
+  batch->since = batch->written;
+}
+
+
+
+static uint8_t batch_status(void *context)
+{
+  batch_t *batch = context;
+
+  if (batch->current < batch->steps &&
+    batch->step[batch->current].type == BATCH_STEP_KEYS) {
+    return 0xFF;
+  }
+  return 0x00;
+}
+
+
+
+static uint8_t batch_read(void *context)
+{
+  batch_t *batch = context;
+  batch_step_t *step;
+  uint8_t value;
+
+  /* Output from before the script was given may already match a wait. */
+  while (batch->current < batch->steps &&
+    batch->step[batch->current].type == BATCH_STEP_WAIT &&
+    batch_tail_match(batch, batch->step[batch->current].text,
+    batch->step[batch->current].len, batch->since)) {
+    batch_advance(batch);
+  }
+
+  if (batch->current >= batch->steps) {
+    batch_stop(batch, (batch->exit_prompt && batch_at_prompt(batch)) ?
+      BATCH_EXIT_DONE : BATCH_EXIT_INPUT);
+    kaytil_block(batch->machine);
+    return 0x1A;
+  }
+  step = &batch->step[batch->current];
+  if (step->type == BATCH_STEP_WAIT) {
+    /* Nothing more is output while waiting for a key. */
+    batch_stop(batch, BATCH_EXIT_INPUT);
+    kaytil_block(batch->machine);
+    return 0x1A;
+  }
+
+  value = step->text[batch->pos++];
+  if (batch->pos >= step->len) {
+    batch_advance(batch);
+  }
+  return value;
+}
+
+
+
+static void batch_capture_add(batch_t *batch, uint8_t value)
+{
+  uint8_t *captured;
+  uint32_t max;
+
+  if (batch->captured_size >= batch->captured_max) {
+    max = (batch->captured_max == 0) ? 4096 : batch->captured_max * 2;
+    captured = realloc(batch->captured, max);
+    if (captured == NULL) {
+      /* Incomplete, so it must not be used at all. */
+      free(batch->captured);
+      batch->captured = NULL;
+      batch->captured_size = 0;
+      batch->captured_max = 0;
+      batch->capture = false;
+      return;
+    }
+    batch->captured = captured;
+    batch->captured_max = max;
+  }
+  batch->captured[batch->captured_size++] = value;
+}
+
+
+
+static void batch_write(void *context, uint8_t value)
+{
+  batch_t *batch = context;
+  batch_step_t *step;
+  int i;
+
+  if (batch->exit_code != -1) {
+    return;
+  }
+  if (batch->output != NULL) {
+    fputc(value, batch->output);
+  }
+  if (batch->capture) {
+    batch_capture_add(batch, value);
+  }
+  batch->tail[batch->written & (BATCH_TEXT_MAX - 1)] = value;
+  batch->written++;
+
+  if (batch->current < batch->steps) {
+    step = &batch->step[batch->current];
+    if (step->type == BATCH_STEP_WAIT &&
+      (uint8_t)step->text[step->len - 1] == value &&
+      batch_tail_match(batch, step->text, step->len, batch->since)) {
+      batch_advance(batch);
+    }
+  }
+
+  for (i = 0; i < batch->exit_texts; i++) {
+    if (batch_tail_match(batch, batch->exit_text[i],
+      strlen(batch->exit_text[i]), 0)) {
+      batch_stop(batch, BATCH_EXIT_DONE);
+    }
+  }
+}
+
+
+
+const io_console_t batch_backend = {
+  batch_status,
+  batch_read,
+  batch_write,
+};
+
+
+
+void batch_init(batch_t *batch)
+{
+  memset(batch, 0, sizeof(batch_t));
+  batch->output = stdout;
+  batch->exit_code = -1;
+}
+
+
+
+void batch_destroy(batch_t *batch)
+{
+  int i;
+
+  for (i = 0; i < batch->steps; i++) {
+    free(batch->step[i].text);
+  }
+  free(batch->step);
+  batch->step = NULL;
+  batch->steps = 0;
+  free(batch->captured);
+  batch->captured = NULL;
+  batch->captured_size = 0;
+  batch->captured_max = 0;
+  batch->capture = false;
+
+  if (batch->output == stdout) {
+    fflush(stdout);
+  } else if (batch->output != NULL) {
+    fclose(batch->output);
+  }
+  batch->output = stdout;
+}
+
+
+
+void batch_reset(batch_t *batch)
+{
+  uint8_t tail[BATCH_TEXT_MAX];
+  uint32_t written;
+
+  /* The output so far is kept, so a first wait can match it. */
+  memcpy(tail, batch->tail, BATCH_TEXT_MAX);
+  written = batch->written;
+  batch_destroy(batch);
+  batch_init(batch);
+  memcpy(batch->tail, tail, BATCH_TEXT_MAX);
+  batch->written = written;
+}
+
+
+
+int batch_script_load(batch_t *batch, const char *filename)
+{
+  FILE *fh;
+  char line[BATCH_LINE_MAX + 2];
+  size_t len;
+  int result = 0;
+
+  fh = fopen(filename, "r");
+  if (fh == NULL) {
+    return -1;
+  }
+
+  while (result == 0 && fgets(line, sizeof(line), fh) != NULL) {
+    len = strlen(line);
+    if (len > BATCH_LINE_MAX) {
+      result = -1; /* Too long. */
+      break;
+    }
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0 || line[0] == '#') {
+      continue;
+    }
+
+    if (strncmp(line, "wait ", 5) == 0) {
+      result = batch_step_add(batch, BATCH_STEP_WAIT, &line[5], false);
+    } else if (strncmp(line, "send ", 5) == 0) {
+      result = batch_step_add(batch, BATCH_STEP_KEYS, &line[5], true);
+    } else if (strcmp(line, "send") == 0) {
+      result = batch_step_add(batch, BATCH_STEP_KEYS, "", true);
+    } else if (strncmp(line, "keys ", 5) == 0) {
+      result = batch_step_add(batch, BATCH_STEP_KEYS, &line[5], false);
+    } else {
+      result = -1;
+    }
+  }
+
+  fclose(fh);
+  return result;
+}
+
+
+
+int batch_keys_add(batch_t *batch, const uint8_t keys[], int len)
+{
+  /* Typed as is after the script, without escapes. */
+  if (len <= 0) {
+    return 0;
+  }
+  return batch_step_append(batch, BATCH_STEP_KEYS, (const char *)keys, len);
+}
+
+
+
+int batch_output_open(batch_t *batch, const char *filename)
+{
+  FILE *fh = NULL;
+
+  /* No file means the output is thrown away. */
+  if (filename != NULL) {
+    fh = fopen(filename, "wb");
+    if (fh == NULL) {
+      return -1;
+    }
+  }
+  if (batch->output != stdout && batch->output != NULL) {
+    fclose(batch->output);
+  }
+  batch->output = fh;
+  return 0;
+}
+
+
+
+int batch_exit_add(batch_t *batch, const char *when)
+{
+  char *end;
+
+  if (strcmp(when, "prompt") == 0) {
+    batch->exit_prompt = true;
+
+  } else if (strncmp(when, "text:", 5) == 0) {
+    if (batch->exit_texts >= BATCH_EXIT_TEXTS_MAX ||
+      strlen(&when[5]) == 0 || strlen(&when[5]) > BATCH_TEXT_MAX) {
+      return -1;
+    }
+    batch->exit_text[batch->exit_texts++] = (char *)&when[5];
+
+  } else if (strncmp(when, "instructions:", 13) == 0) {
+    batch->exit_instructions = strtoull(&when[13], &end, 10);
+    if (end == &when[13] || *end != '\0' || batch->exit_instructions == 0) {
+      return -1;
+    }
+
+  } else if (strncmp(when, "timeout:", 8) == 0) {
+    batch->exit_timeout = strtol(&when[8], &end, 10);
+    if (end == &when[8] || *end != '\0' || batch->exit_timeout <= 0) {
+      return -1;
+    }
+
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+
+
+void batch_capture(batch_t *batch)
+{
+  batch->capture = true;
+}
+
+
+
+int batch_run(batch_t *batch, kaytil_machine_t *machine)
+{
+  struct timeval start, now;
+  uint64_t first, used;
+  uint32_t slice;
+
+  batch->machine = machine;
+  gettimeofday(&start, NULL);
+  first = kaytil_instructions(machine);
+
+  while (batch->exit_code == -1) {
+    slice = BATCH_SLICE_INSTRUCTIONS;
+    if (batch->exit_instructions > 0) {
+      used = kaytil_instructions(machine) - first;
+      if (used >= batch->exit_instructions) {
+        batch->exit_code = BATCH_EXIT_BUDGET;
+        break;
+      }
+      if (batch->exit_instructions - used < slice) {
+        slice = batch->exit_instructions - used;
+      }
+    }
+
+    if (kaytil_run(machine, slice) == KAYTIL_RUN_ERROR) {
+      batch->exit_code = BATCH_EXIT_ERROR;
+      break;
+    }
+
+    if (batch->exit_timeout > 0) {
+      gettimeofday(&now, NULL);
+      if (((now.tv_sec - start.tv_sec) * 1000000) +
+        (now.tv_usec - start.tv_usec) >= batch->exit_timeout * 1000000) {
+        batch->exit_code = BATCH_EXIT_TIMEOUT;
+      }
+    }
+  }
+
+  if (batch->output != NULL) {
+    fflush(batch->output);
+  }
+  return batch->exit_code;
+}
@@ -0,0 +1,68 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "io.h"
+#include "kaytil.h"
+
+/* Exit codes of a batch run. */
+#define BATCH_EXIT_DONE 0 /* Exit text seen or back at the CCP prompt. */
+#define BATCH_EXIT_ERROR 1 /* Emulation error. */
+#define BATCH_EXIT_TIMEOUT 2
+#define BATCH_EXIT_BUDGET 3 /* Instruction budget used up. */
+#define BATCH_EXIT_INPUT 4 /* Input wanted that the script does not give. */
+
+#define BATCH_TEXT_MAX 256 /* Power of two */
+#define BATCH_EXIT_TEXTS_MAX 8
+
+typedef enum {
+  BATCH_STEP_KEYS,
+  BATCH_STEP_WAIT,
+} batch_step_type_t;
+
+typedef struct batch_step_s {
+  batch_step_type_t type;
+  char *text;
+  int len;
+} batch_step_t;
+
+typedef struct batch_s {
+  kaytil_machine_t *machine;
+  batch_step_t *step;
+  int steps;
+  int current;
+  int pos; /* In the keys of the current step. */
+  uint32_t since; /* Output written when the current wait started. */
+
+  FILE *output;
+  uint8_t tail[BATCH_TEXT_MAX]; /* Last output, for matching. */
+  uint32_t written;
+  bool capture; /* Also keep all output in memory, for the result cache. */
+  uint8_t *captured;
+  uint32_t captured_size;
+  uint32_t captured_max;
+
+  char *exit_text[BATCH_EXIT_TEXTS_MAX]; /* Kept as given, not copied. */
+  int exit_texts;
+  bool exit_prompt;
+  uint64_t exit_instructions; /* Of this run, 0 for no budget. */
+  long exit_timeout; /* Seconds, 0 for none. */
+  int exit_code; /* -1 while running. */
+} batch_t;
+
+/* Console backend for batch runs, with the batch_t as context. */
+extern const io_console_t batch_backend;
+
+void batch_init(batch_t *batch);
+void batch_destroy(batch_t *batch);
+void batch_reset(batch_t *batch); /* For another run of the same machine. */
+int batch_script_load(batch_t *batch, const char *filename);
+int batch_keys_add(batch_t *batch, const uint8_t keys[], int len);
+int batch_output_open(batch_t *batch, const char *filename);
+int batch_exit_add(batch_t *batch, const char *when);
+void batch_capture(batch_t *batch);
+int batch_run(batch_t *batch, kaytil_machine_t *machine);
+
+#endif /* _BATCH_H */
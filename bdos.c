@@ -0,0 +1,1073 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "bdos.h"
+#include "z80.h"
+#include "mem.h"
+#include "dpb.h"
+#include "io.h"
+
+/* Native BDOS functions.
+
+   Open, search first/next and sequential read/write are handled here
+   instead of by the BDOS Z80 code, working on the disk images directly.
+   The effect on the FCB, DMA buffer and allocation vector is the same as
+   for the real BDOS. A copy of each directory is cached with a hash index
+   on the file names, and dropped when a directory sector is written.
+   Anything not handled, like opening the next extent, log in of drives
+   and all error cases, falls through to the real BDOS.
+
+   The console functions are also done here, following the BDOS code step
+   by step: tabs are expanded, the column is kept in CURPOS, ^S stops the
+   output and ^C after it reboots, and the line editing of read buffer is
+   the same. Console status, input and output go straight to the console
+   module instead of through the CBIOS and the I/O ports, and the same goes
+   for the reader, punch and list devices. */
+
+/* BDOS code and variable locations in the bundled CP/M 2.2 binary. */
+#define BDOS_FBASE1  0xEC11 /* Entry code, checked to find the layout. */
+#define BDOS_OUTFLAG  0xEF0A
+#define BDOS_STARTING 0xEF0B
+#define BDOS_CURPOS   0xEF0C
+#define BDOS_PRTFLAG  0xEF0D
+#define BDOS_CHARBUF  0xEF0E
+#define BDOS_USERNO  0xEF41
+#define BDOS_ACTIVE  0xEF42
+#define BDOS_PARAMS  0xEF43
+#define BDOS_WRTPRT  0xF9AD
+#define BDOS_LOGIN   0xF9AF
+#define BDOS_USERDMA 0xF9B1
+
+#define BDOS_FN_CONOUT        2
+#define BDOS_FN_READER        3
+#define BDOS_FN_PUNCH         4
+#define BDOS_FN_LIST          5
+#define BDOS_FN_DIRECT_IO     6
+#define BDOS_FN_PRINT_STRING  9
+#define BDOS_FN_READ_BUFFER  10
+#define BDOS_FN_CONSOLE_STAT 11
+#define BDOS_FN_OPEN         15
+#define BDOS_FN_SEARCH_FIRST 17
+#define BDOS_FN_SEARCH_NEXT  18
+#define BDOS_FN_READ_SEQ     20
+#define BDOS_FN_WRITE_SEQ    21
+
+/* Console control characters */
+#define BDOS_CTRL_C 0x03
+#define BDOS_CTRL_E 0x05
+#define BDOS_BS     0x08
+#define BDOS_TAB    0x09
+#define BDOS_LF     0x0A
+#define BDOS_CR     0x0D
+#define BDOS_CTRL_P 0x10
+#define BDOS_CTRL_R 0x12
+#define BDOS_CTRL_S 0x13
+#define BDOS_CTRL_U 0x15
+#define BDOS_CTRL_X 0x18
+#define BDOS_DEL    0x7F
+
+#define BDOS_ENTRY_SIZE 32
+#define BDOS_KEY_SIZE 15
+#define BDOS_NOT_FOUND 0xFF
+
+/* FCB fields */
+#define BDOS_FCB_DR 0
+#define BDOS_FCB_T1 9
+#define BDOS_FCB_EX 12
+#define BDOS_FCB_S2 14
+#define BDOS_FCB_RC 15
+#define BDOS_FCB_AL 16
+#define BDOS_FCB_CR 32
+
+typedef struct bdos_drive_s {
+  uint8_t disk_no;
+  const dpb_t *dpb;
+  uint16_t dph;
+  bdos_dir_t *dir;
+} bdos_drive_t;
+
+void bdos_init(bdos_t *bdos, io_t *io)
+{
+  memset(bdos, 0, sizeof(bdos_t));
+  bdos->io = io;
+  bdos->layout_ok = -1; /* Not checked yet. */
+}
+
+
+
+void bdos_destroy(bdos_t *bdos)
+{
+  int i;
+
+  for (i = 0; i < DPB_DRIVES; i++) {
+    free(bdos->dir[i].entry);
+    free(bdos->dir[i].next);
+    free(bdos->dir[i].hash);
+  }
+}
+
+
+
+/* Disk and console access through the backends of the machine. */
+/* Back to the state of a copy taken earlier, the directory caches are not
+   part of it and are read again when next used. */
+void bdos_restore(bdos_t *bdos, const bdos_t *from)
+{
+  int i;
+
+  bdos->search = from->search;
+  bdos->line = from->line;
+  bdos->layout_ok = from->layout_ok;
+  bdos->reboot = from->reboot;
+  for (i = 0; i < DPB_DRIVES; i++) {
+    bdos->dir[i].valid = false;
+  }
+}
+
+
+
+static const dpb_t *bdos_dpb(bdos_t *bdos, uint8_t disk_no)
+{
+  return bdos->io->disk->dpb(bdos->io->disk_context, disk_no);
+}
+
+
+
+static uint32_t bdos_dir_generation(bdos_t *bdos, uint8_t disk_no)
+{
+  return bdos->io->disk->dir_generation(bdos->io->disk_context, disk_no);
+}
+
+
+
+static int bdos_record_read(bdos_t *bdos, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint8_t data[])
+{
+  return bdos->io->disk->read(bdos->io->disk_context, disk_no,
+    track_no, sector_no, data);
+}
+
+
+
+static int bdos_record_write(bdos_t *bdos, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[])
+{
+  return bdos->io->disk->write(bdos->io->disk_context, disk_no,
+    track_no, sector_no, data);
+}
+
+
+
+static uint8_t bdos_console_status(bdos_t *bdos)
+{
+  return bdos->io->console->status(bdos->io->console_context);
+}
+
+
+
+static uint8_t bdos_console_read(bdos_t *bdos)
+{
+  return bdos->io->console->read(bdos->io->console_context);
+}
+
+
+
+static void bdos_console_write(bdos_t *bdos, uint8_t value)
+{
+  bdos->io->console->write(bdos->io->console_context, value);
+}
+
+
+
+static uint16_t bdos_read_word(mem_t *mem, uint16_t address)
+{
+  return mem_read(mem, address) | (mem_read(mem, address + 1) << 8);
+}
+
+
+
+static bool bdos_layout_check(mem_t *mem)
+{
+  /* "XCHG, SHLD PARAMS" at the start of the BDOS proper. */
+  return mem_read(mem, BDOS_FBASE1) == 0xEB &&
+    mem_read(mem, BDOS_FBASE1 + 1) == 0x22 &&
+    bdos_read_word(mem, BDOS_FBASE1 + 2) == BDOS_PARAMS;
+}
+
+
+
+static uint32_t bdos_hash(const uint8_t name[])
+{
+  uint32_t hash = 2166136261U; /* FNV-1a */
+  int i;
+  for (i = 0; i < 11; i++) {
+    hash ^= name[i] & 0x7F;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+
+
+static void bdos_location(const dpb_t *dpb, uint16_t record,
+  uint16_t *track_no, uint8_t *sector_no)
+{
+  *track_no = (record / dpb->spt) + dpb->off;
+  *sector_no = dpb_sectran(dpb, record % dpb->spt);
+}
+
+
+
+static bdos_dir_t *bdos_dir_get(bdos_t *bdos, uint8_t disk_no,
+  const dpb_t *dpb)
+{
+  bdos_dir_t *dir = &bdos->dir[disk_no];
+  uint32_t entries, buckets, record, bucket;
+  uint16_t track_no;
+  uint8_t sector_no;
+  int i;
+
+  if (dir->valid && dir->generation == bdos_dir_generation(bdos, disk_no)) {
+    return dir;
+  }
+
+  entries = dpb->drm + 1;
+  if (dir->entry == NULL) {
+    buckets = 1;
+    while (buckets < entries) {
+      buckets <<= 1;
+    }
+    dir->hash_mask = buckets - 1;
+    dir->entry = malloc(entries * BDOS_ENTRY_SIZE);
+    dir->next = malloc(entries * sizeof(int));
+    dir->hash = malloc(buckets * sizeof(int));
+    if (dir->entry == NULL || dir->next == NULL || dir->hash == NULL) {
+      return NULL;
+    }
+  }
+
+  for (record = 0; record < entries / 4; record++) {
+    bdos_location(dpb, record, &track_no, &sector_no);
+    if (bdos_record_read(bdos, disk_no, track_no, sector_no,
+      &dir->entry[record * DPB_RECORD_SIZE]) != 0) {
+      dir->valid = false;
+      return NULL;
+    }
+  }
+
+  /* Build the chains backwards so they end up in directory order. */
+  for (i = 0; i <= (int)dir->hash_mask; i++) {
+    dir->hash[i] = -1;
+  }
+  for (i = entries - 1; i >= 0; i--) {
+    bucket = bdos_hash(&dir->entry[(i * BDOS_ENTRY_SIZE) + 1]) &
+      dir->hash_mask;
+    dir->next[i] = dir->hash[bucket];
+    dir->hash[bucket] = i;
+  }
+
+  dir->generation = bdos_dir_generation(bdos, disk_no);
+  dir->valid = true;
+  return dir;
+}
+
+
+
+static bool bdos_drive(bdos_t *bdos, mem_t *mem, uint16_t fcb,
+  bdos_drive_t *drive)
+{
+  uint8_t dr;
+
+  /* Same drive selection as the BDOS auto select,
+     but FCBs with flags in the drive byte are left to the BDOS. */
+  dr = mem_read(mem, fcb + BDOS_FCB_DR);
+  if (dr == 0) {
+    drive->disk_no = mem_read(mem, BDOS_ACTIVE);
+  } else if (dr <= DPB_DRIVES) {
+    drive->disk_no = dr - 1;
+  } else {
+    return false;
+  }
+  if (drive->disk_no >= DPB_DRIVES) {
+    return false;
+  }
+
+  /* Drives not logged in need their allocation vector built first. */
+  if (((bdos_read_word(mem, BDOS_LOGIN) >> drive->disk_no) & 1) == 0) {
+    return false;
+  }
+
+  drive->dpb = bdos_dpb(bdos, drive->disk_no);
+  drive->dph = io_disk_dph(bdos->io, drive->disk_no);
+  if (drive->dpb == NULL || drive->dph == 0) {
+    return false;
+  }
+
+  drive->dir = bdos_dir_get(bdos, drive->disk_no, drive->dpb);
+  return (drive->dir != NULL);
+}
+
+
+
+static bool bdos_match(const uint8_t key[], const uint8_t entry[],
+  uint8_t exm)
+{
+  int i;
+
+  for (i = 0; i < BDOS_KEY_SIZE; i++) {
+    if (key[i] == '?' || i == 13) {
+      continue;
+    }
+    if (i == BDOS_FCB_EX) {
+      if ((((key[i] & ~exm) - (entry[i] & ~exm)) & 0x1F) != 0) {
+        return false;
+      }
+    } else if (((key[i] - entry[i]) & 0x7F) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+
+static int bdos_find(bdos_drive_t *drive, mem_t *mem, const uint8_t key[],
+  uint32_t start)
+{
+  bdos_dir_t *dir = drive->dir;
+  uint32_t limit;
+  bool wildcard;
+  int i, n;
+
+  /* Only entries up to the highest one in use are searched,
+     as tracked by the BDOS in the first DPH scratch word. */
+  limit = bdos_read_word(mem, drive->dph + 2);
+  if (limit > (uint32_t)drive->dpb->drm + 1) {
+    limit = drive->dpb->drm + 1;
+  }
+
+  wildcard = false;
+  for (i = 1; i < 12; i++) {
+    if (key[i] == '?') {
+      wildcard = true;
+      break;
+    }
+  }
+
+  if (wildcard) {
+    for (n = start; n < (int)limit; n++) {
+      if (bdos_match(key, &dir->entry[n * BDOS_ENTRY_SIZE],
+        drive->dpb->exm)) {
+        return n;
+      }
+    }
+  } else {
+    n = dir->hash[bdos_hash(&key[1]) & dir->hash_mask];
+    for (; n >= 0 && n < (int)limit; n = dir->next[n]) {
+      if (n >= (int)start && bdos_match(key, &dir->entry[n * BDOS_ENTRY_SIZE],
+        drive->dpb->exm)) {
+        return n;
+      }
+    }
+  }
+
+  return -1;
+}
+
+
+
+static void bdos_key(mem_t *mem, uint16_t fcb, uint8_t key[])
+{
+  mem_read_area(mem, fcb, key, BDOS_KEY_SIZE);
+  key[0] = mem_read(mem, BDOS_USERNO);
+}
+
+
+
+static bool bdos_open(bdos_t *bdos, mem_t *mem, uint16_t fcb, uint8_t *status)
+{
+  bdos_drive_t drive;
+  uint8_t key[BDOS_KEY_SIZE];
+  uint8_t *entry, dr, ex;
+  int n;
+
+  if (! bdos_drive(bdos, mem, fcb, &drive)) {
+    return false;
+  }
+
+  mem_write(mem, fcb + BDOS_FCB_S2, 0);
+  bdos_key(mem, fcb, key);
+  n = bdos_find(&drive, mem, key, 0);
+  if (n < 0) {
+    *status = BDOS_NOT_FOUND;
+    return true;
+  }
+
+  /* Copy the directory entry, but keep the drive and extent asked for. */
+  entry = &drive.dir->entry[n * BDOS_ENTRY_SIZE];
+  dr = mem_read(mem, fcb + BDOS_FCB_DR);
+  ex = mem_read(mem, fcb + BDOS_FCB_EX);
+  mem_write_area(mem, fcb, entry, BDOS_ENTRY_SIZE);
+  mem_write(mem, fcb + BDOS_FCB_DR, dr);
+  mem_write(mem, fcb + BDOS_FCB_EX, ex);
+  mem_write(mem, fcb + BDOS_FCB_S2, entry[BDOS_FCB_S2] | 0x80);
+  if (entry[BDOS_FCB_EX] == ex) {
+    mem_write(mem, fcb + BDOS_FCB_RC, entry[BDOS_FCB_RC]);
+  } else if (entry[BDOS_FCB_EX] < ex) {
+    mem_write(mem, fcb + BDOS_FCB_RC, 0);
+  } else {
+    mem_write(mem, fcb + BDOS_FCB_RC, 128);
+  }
+
+  *status = n & 3;
+  return true;
+}
+
+
+
+static bool bdos_search_next(bdos_t *bdos, mem_t *mem, uint8_t *status)
+{
+  bdos_drive_t drive;
+  uint8_t key[BDOS_KEY_SIZE];
+  uint32_t last;
+  int n;
+
+  if (! bdos_drive(bdos, mem, bdos->search.fcb, &drive)) {
+    bdos->search.active = false;
+    return false;
+  }
+
+  bdos_key(mem, bdos->search.fcb, key);
+  n = bdos_find(&drive, mem, key, bdos->search.next);
+
+  /* The directory record last looked at is returned in the DMA buffer. */
+  if (n >= 0) {
+    *status = n & 3;
+    bdos->search.next = n + 1;
+    last = n;
+  } else {
+    *status = BDOS_NOT_FOUND;
+    last = bdos_read_word(mem, drive.dph + 2);
+    if (last < bdos->search.next) {
+      last = bdos->search.next;
+    }
+    if (last > drive.dpb->drm) {
+      last = drive.dpb->drm;
+    }
+    bdos->search.next = 0; /* The BDOS starts over. */
+  }
+  mem_write_area(mem, bdos_read_word(mem, BDOS_USERDMA),
+    &drive.dir->entry[(last / 4) * DPB_RECORD_SIZE], DPB_RECORD_SIZE);
+
+  return true;
+}
+
+
+
+static bool bdos_search_first(bdos_t *bdos, mem_t *mem, uint16_t fcb,
+  uint8_t *status)
+{
+  /* Search for all entries is left to the BDOS. */
+  if (mem_read(mem, fcb + BDOS_FCB_DR) == '?') {
+    bdos->search.active = false;
+    return false;
+  }
+  if (mem_read(mem, fcb + BDOS_FCB_EX) != '?') {
+    mem_write(mem, fcb + BDOS_FCB_S2, 0);
+  }
+
+  bdos->search.active = true;
+  bdos->search.fcb = fcb;
+  bdos->search.next = 0;
+  return bdos_search_next(bdos, mem, status);
+}
+
+
+
+static uint16_t bdos_block_index(const dpb_t *dpb, uint8_t cr, uint8_t ex)
+{
+  return ((cr >> dpb->bsh) + ((ex & dpb->exm) << (7 - dpb->bsh))) & 0xFF;
+}
+
+
+
+static uint16_t bdos_block_get(mem_t *mem, const dpb_t *dpb, uint16_t fcb,
+  uint16_t index)
+{
+  if (dpb->dsm > 255) {
+    return bdos_read_word(mem, fcb + BDOS_FCB_AL + (index * 2));
+  } else {
+    return mem_read(mem, fcb + BDOS_FCB_AL + index);
+  }
+}
+
+
+
+static void bdos_block_set(mem_t *mem, const dpb_t *dpb, uint16_t fcb,
+  uint16_t index, uint16_t block)
+{
+  if (dpb->dsm > 255) {
+    mem_write(mem, fcb + BDOS_FCB_AL + (index * 2), block & 0xFF);
+    mem_write(mem, fcb + BDOS_FCB_AL + (index * 2) + 1, block >> 8);
+  } else {
+    mem_write(mem, fcb + BDOS_FCB_AL + index, block);
+  }
+}
+
+
+
+static bool bdos_read_seq(bdos_t *bdos, mem_t *mem, uint16_t fcb,
+  uint8_t *status)
+{
+  bdos_drive_t drive;
+  uint8_t cr, rc, sector_no;
+  uint8_t data[DPB_RECORD_SIZE];
+  uint16_t block, track_no, record;
+
+  if (! bdos_drive(bdos, mem, fcb, &drive)) {
+    return false;
+  }
+
+  cr = mem_read(mem, fcb + BDOS_FCB_CR);
+  rc = mem_read(mem, fcb + BDOS_FCB_RC);
+  if (cr >= rc) {
+    if (cr == 128) {
+      return false; /* Next extent must be opened. */
+    }
+    *status = 1; /* End of file. */
+    return true;
+  }
+
+  block = bdos_block_get(mem, drive.dpb, fcb,
+    bdos_block_index(drive.dpb, cr, mem_read(mem, fcb + BDOS_FCB_EX)));
+  if (block == 0) {
+    *status = 1;
+    return true;
+  }
+
+  record = (block << drive.dpb->bsh) | (cr & drive.dpb->blm);
+  bdos_location(drive.dpb, record, &track_no, &sector_no);
+  if (bdos_record_read(bdos, drive.disk_no, track_no, sector_no, data) != 0) {
+    return false;
+  }
+  mem_write_area(mem, bdos_read_word(mem, BDOS_USERDMA), data,
+    DPB_RECORD_SIZE);
+
+  mem_write(mem, fcb + BDOS_FCB_CR, cr + 1);
+  *status = 0;
+  return true;
+}
+
+
+
+static bool bdos_block_free(mem_t *mem, uint16_t alv, uint16_t block)
+{
+  return (mem_read(mem, alv + (block / 8)) & (0x80 >> (block % 8))) == 0;
+}
+
+
+
+static uint16_t bdos_block_alloc(mem_t *mem, uint16_t alv, uint16_t dsm,
+  uint16_t near)
+{
+  uint16_t low, high, block;
+
+  /* Closest free block on either side, as FNDSPACE in cpm22.asm: one to
+     the left, then one to the right. Once the right reaches DSM only the
+     left is searched (FNDSPA4), so the disk is full when both ends are
+     reached. The retblock0 exit at DSM in the DRI source listing is not
+     in this binary. */
+  low = near;
+  high = near;
+  while (1) {
+    if (low > 0) {
+      low--;
+      if (bdos_block_free(mem, alv, low)) {
+        block = low;
+        break;
+      }
+    }
+    if (high < dsm) {
+      high++;
+      if (bdos_block_free(mem, alv, high)) {
+        block = high;
+        break;
+      }
+    } else if (low == 0) {
+      return 0; /* Disk full. */
+    }
+  }
+
+  mem_write(mem, alv + (block / 8),
+    mem_read(mem, alv + (block / 8)) | (0x80 >> (block % 8)));
+  return block;
+}
+
+
+
+static bool bdos_write_seq(bdos_t *bdos, mem_t *mem, uint16_t fcb,
+  uint8_t *status)
+{
+  bdos_drive_t drive;
+  uint8_t cr, rc, sector_no;
+  uint8_t data[DPB_RECORD_SIZE];
+  uint16_t index, block, track_no, record, alv;
+  bool allocated;
+
+  if (! bdos_drive(bdos, mem, fcb, &drive)) {
+    return false;
+  }
+
+  /* Write protected disks and files are reported by the BDOS. */
+  if ((bdos_read_word(mem, BDOS_WRTPRT) >> drive.disk_no) & 1) {
+    return false;
+  }
+  if (mem_read(mem, fcb + BDOS_FCB_T1) & 0x80) {
+    return false;
+  }
+
+  /* The last record of an extent also opens the next one. */
+  cr = mem_read(mem, fcb + BDOS_FCB_CR);
+  rc = mem_read(mem, fcb + BDOS_FCB_RC);
+  if (cr >= 127) {
+    return false;
+  }
+
+  index = bdos_block_index(drive.dpb, cr, mem_read(mem, fcb + BDOS_FCB_EX));
+  block = bdos_block_get(mem, drive.dpb, fcb, index);
+  allocated = false;
+  if (block == 0) {
+    alv = bdos_read_word(mem, drive.dph + 14);
+    block = bdos_block_alloc(mem, alv, drive.dpb->dsm, (index == 0) ? 0 :
+      bdos_block_get(mem, drive.dpb, fcb, index - 1));
+    if (block == 0) {
+      *status = 2; /* Disk full. */
+      return true;
+    }
+    allocated = true;
+  }
+
+  record = (block << drive.dpb->bsh) | (cr & drive.dpb->blm);
+  bdos_location(drive.dpb, record, &track_no, &sector_no);
+  mem_read_area(mem, bdos_read_word(mem, BDOS_USERDMA), data,
+    DPB_RECORD_SIZE);
+  if (bdos_record_write(bdos, drive.disk_no, track_no, sector_no, data) != 0) {
+    if (allocated) {
+      mem_write(mem, alv + (block / 8),
+        mem_read(mem, alv + (block / 8)) & ~(0x80 >> (block % 8)));
+    }
+    return false;
+  }
+
+  if (allocated) {
+    bdos_block_set(mem, drive.dpb, fcb, index, block);
+  }
+  if (cr >= rc) {
+    mem_write(mem, fcb + BDOS_FCB_RC, cr + 1);
+  }
+  mem_write(mem, fcb + BDOS_FCB_S2, mem_read(mem, fcb + BDOS_FCB_S2) & 0x7F);
+  mem_write(mem, fcb + BDOS_FCB_CR, cr + 1);
+  *status = 0;
+  return true;
+}
+
+
+static uint8_t bdos_conin(bdos_t *bdos)
+{
+  return bdos_console_read(bdos) & 0x7F; /* Parity stripped as by the CBIOS. */
+}
+
+
+
+static uint8_t bdos_getchar(bdos_t *bdos, mem_t *mem)
+{
+  uint8_t c;
+
+  c = mem_read(mem, BDOS_CHARBUF);
+  mem_write(mem, BDOS_CHARBUF, 0);
+  if (c != 0) {
+    return c;
+  }
+  return bdos_conin(bdos);
+}
+
+
+
+static bool bdos_control(uint8_t c)
+{
+  /* Control character other than the carriage control ones. */
+  if (c == BDOS_CR || c == BDOS_LF || c == BDOS_TAB || c == BDOS_BS) {
+    return false;
+  }
+  return c < ' ';
+}
+
+
+
+static uint8_t bdos_ckconsol(bdos_t *bdos, mem_t *mem)
+{
+  uint8_t c;
+
+  if (mem_read(mem, BDOS_CHARBUF) != 0) {
+    return 1;
+  }
+  if ((bdos_console_status(bdos) & 0x01) == 0) {
+    return 0;
+  }
+  c = bdos_conin(bdos);
+  if (c == BDOS_CTRL_S) {
+    c = bdos_conin(bdos);
+    if (bdos->io->blocked) {
+      /* Output can't be parked halfway, so no pause without a key. */
+      bdos->io->blocked = false;
+    } else if (c == BDOS_CTRL_C) {
+      bdos->reboot = true;
+    }
+    return 0;
+  }
+  mem_write(mem, BDOS_CHARBUF, c);
+  return 1;
+}
+
+
+
+static void bdos_outchar(bdos_t *bdos, mem_t *mem, uint8_t c)
+{
+  uint8_t curpos;
+
+  if (bdos->reboot) {
+    return;
+  }
+
+  if (mem_read(mem, BDOS_OUTFLAG) == 0) {
+    bdos_ckconsol(bdos, mem);
+    if (bdos->reboot) {
+      return;
+    }
+    bdos_console_write(bdos, c);
+    if (mem_read(mem, BDOS_PRTFLAG) != 0) {
+      io_list(bdos->io, c);
+    }
+  }
+
+  curpos = mem_read(mem, BDOS_CURPOS);
+  if (c == BDOS_DEL) {
+    return;
+  } else if (c >= ' ') {
+    curpos++;
+  } else if (curpos == 0) {
+    return;
+  } else if (c == BDOS_BS) {
+    curpos--;
+  } else if (c == BDOS_LF) {
+    curpos = 0;
+  }
+  mem_write(mem, BDOS_CURPOS, curpos);
+}
+
+
+
+static void bdos_outcon(bdos_t *bdos, mem_t *mem, uint8_t c)
+{
+  if (c != BDOS_TAB) {
+    bdos_outchar(bdos, mem, c);
+    return;
+  }
+  do {
+    bdos_outchar(bdos, mem, ' ');
+  } while ((mem_read(mem, BDOS_CURPOS) & 0x07) != 0 && ! bdos->reboot);
+}
+
+
+
+static void bdos_showit(bdos_t *bdos, mem_t *mem, uint8_t c)
+{
+  if (bdos_control(c)) {
+    bdos_outchar(bdos, mem, '^');
+    c |= '@';
+  }
+  bdos_outcon(bdos, mem, c);
+}
+
+
+
+static void bdos_backup(bdos_t *bdos)
+{
+  bdos_console_write(bdos, BDOS_BS);
+  bdos_console_write(bdos, ' ');
+  bdos_console_write(bdos, BDOS_BS);
+}
+
+
+
+static void bdos_outcrlf(bdos_t *bdos, mem_t *mem)
+{
+  bdos_outchar(bdos, mem, BDOS_CR);
+  bdos_outchar(bdos, mem, BDOS_LF);
+}
+
+
+
+static void bdos_newline(bdos_t *bdos, mem_t *mem)
+{
+  bdos_outchar(bdos, mem, '#');
+  bdos_outcrlf(bdos, mem);
+  while (mem_read(mem, BDOS_CURPOS) < mem_read(mem, BDOS_STARTING) &&
+    ! bdos->reboot) {
+    bdos_outchar(bdos, mem, ' ');
+  }
+}
+
+
+
+static void bdos_print_string(bdos_t *bdos, mem_t *mem, uint16_t address)
+{
+  uint8_t c;
+  int n;
+
+  for (n = 0; n <= 0xFFFF && ! bdos->reboot; n++) {
+    c = mem_read(mem, address++);
+    if (c == '$') {
+      break;
+    }
+    bdos_outcon(bdos, mem, c);
+  }
+}
+
+
+
+static uint8_t bdos_direct_io(bdos_t *bdos, uint8_t e)
+{
+  if (e == 0xFF) {
+    if (bdos_console_status(bdos) == 0) {
+      return 0;
+    }
+    return bdos_conin(bdos);
+  }
+  bdos_console_write(bdos, e);
+  return 0;
+}
+
+
+
+static void bdos_read_buffer(bdos_t *bdos, mem_t *mem, uint16_t buffer)
+{
+  uint8_t max, count, c, outflag;
+
+  max = mem_read(mem, buffer);
+  if (bdos->line.parked && bdos->line.buffer == buffer) {
+    /* Retried after waiting for a key, the line so far is on screen. */
+    bdos->line.parked = false;
+    count = bdos->line.count;
+    goto resume;
+  }
+
+restart:
+  mem_write(mem, BDOS_STARTING, mem_read(mem, BDOS_CURPOS));
+  count = 0;
+
+resume:
+  while (! bdos->reboot) {
+    c = bdos_getchar(bdos, mem) & 0x7F;
+    if (bdos->io->blocked) {
+      bdos->line.parked = true;
+      bdos->line.buffer = buffer;
+      bdos->line.count = count;
+      return;
+    }
+
+    if (c == BDOS_CR || c == BDOS_LF) {
+      break;
+
+    } else if (c == BDOS_BS || c == BDOS_CTRL_R) {
+      if (c == BDOS_BS) {
+        if (count == 0) {
+          continue;
+        }
+        count--;
+        /* Retype the line with the output off to find the new column. */
+        mem_write(mem, BDOS_OUTFLAG, mem_read(mem, BDOS_CURPOS));
+      }
+      bdos_newline(bdos, mem);
+      for (c = 0; c < count && ! bdos->reboot; c++) {
+        bdos_showit(bdos, mem, mem_read(mem, buffer + 2 + c));
+      }
+      outflag = mem_read(mem, BDOS_OUTFLAG);
+      if (outflag != 0) {
+        outflag -= mem_read(mem, BDOS_CURPOS);
+        do {
+          bdos_backup(bdos);
+        } while (--outflag != 0);
+        mem_write(mem, BDOS_OUTFLAG, 0);
+      }
+      continue;
+
+    } else if (c == BDOS_DEL) {
+      if (count == 0) {
+        continue;
+      }
+      count--;
+      bdos_showit(bdos, mem, mem_read(mem, buffer + 2 + count));
+
+    } else if (c == BDOS_CTRL_E) {
+      bdos_outcrlf(bdos, mem);
+      mem_write(mem, BDOS_STARTING, 0);
+      continue;
+
+    } else if (c == BDOS_CTRL_P) {
+      mem_write(mem, BDOS_PRTFLAG, 1 - mem_read(mem, BDOS_PRTFLAG));
+      continue;
+
+    } else if (c == BDOS_CTRL_X) {
+      while (mem_read(mem, BDOS_STARTING) < mem_read(mem, BDOS_CURPOS)) {
+        mem_write(mem, BDOS_CURPOS, mem_read(mem, BDOS_CURPOS) - 1);
+        bdos_backup(bdos);
+      }
+      goto restart;
+
+    } else if (c == BDOS_CTRL_U) {
+      bdos_newline(bdos, mem);
+      goto restart;
+
+    } else {
+      mem_write(mem, buffer + 2 + count, c);
+      count++;
+      bdos_showit(bdos, mem, c);
+    }
+
+    /* ^C as the first character is an abort. */
+    if (count == 1 && mem_read(mem, buffer + 1 + count) == BDOS_CTRL_C) {
+      bdos->reboot = true;
+    } else if (count >= max) {
+      break;
+    }
+  }
+
+  if (bdos->reboot) {
+    return;
+  }
+  mem_write(mem, buffer + 1, count);
+  bdos_outchar(bdos, mem, BDOS_CR);
+}
+
+
+
+bool bdos_trap(bdos_t *bdos, z80_t *z80, mem_t *mem)
+{
+  uint16_t fcb = z80->u_de.de;
+  uint8_t status;
+  bool handled;
+
+  if (bdos->layout_ok < 0) {
+    bdos->layout_ok = bdos_layout_check(mem);
+    if (! bdos->layout_ok) {
+      fprintf(stderr, "Warning: Unknown BDOS, native functions disabled.\n");
+    }
+  }
+  if (! bdos->layout_ok) {
+    return false;
+  }
+
+  status = 0;
+  bdos->reboot = false;
+  if (z80->u_bc.s_bc.c != BDOS_FN_READ_BUFFER) {
+    bdos->line.parked = false;
+  }
+
+  switch (z80->u_bc.s_bc.c) {
+  case BDOS_FN_CONOUT:
+    bdos_outcon(bdos, mem, z80->u_de.s_de.e);
+    handled = true;
+    break;
+
+  case BDOS_FN_READER:
+    status = io_reader(bdos->io) & 0x7F;
+    handled = true;
+    break;
+
+  case BDOS_FN_PUNCH:
+    io_punch(bdos->io, z80->u_de.s_de.e);
+    handled = true;
+    break;
+
+  case BDOS_FN_LIST:
+    io_list(bdos->io, z80->u_de.s_de.e);
+    handled = true;
+    break;
+
+  case BDOS_FN_DIRECT_IO:
+    /* FEh is not a status request in CP/M 2.2, leave it to the BDOS. */
+    handled = (z80->u_de.s_de.e != 0xFE);
+    if (handled) {
+      status = bdos_direct_io(bdos, z80->u_de.s_de.e);
+    }
+    break;
+
+  case BDOS_FN_PRINT_STRING:
+    bdos_print_string(bdos, mem, z80->u_de.de);
+    handled = true;
+    break;
+
+  case BDOS_FN_READ_BUFFER:
+    bdos_read_buffer(bdos, mem, z80->u_de.de);
+    handled = true;
+    break;
+
+  case BDOS_FN_CONSOLE_STAT:
+    status = bdos_ckconsol(bdos, mem);
+    handled = true;
+    break;
+
+  case BDOS_FN_OPEN:
+    handled = bdos_open(bdos, mem, fcb, &status);
+    break;
+
+  case BDOS_FN_SEARCH_FIRST:
+    handled = bdos_search_first(bdos, mem, fcb, &status);
+    break;
+
+  case BDOS_FN_SEARCH_NEXT:
+    handled = bdos->search.active && bdos_search_next(bdos, mem, &status);
+    break;
+
+  case BDOS_FN_READ_SEQ:
+    handled = bdos_read_seq(bdos, mem, fcb, &status);
+    break;
+
+  case BDOS_FN_WRITE_SEQ:
+    handled = bdos_write_seq(bdos, mem, fcb, &status);
+    break;
+
+  default:
+    handled = false;
+    break;
+  }
+
+  if (! handled) {
+    return false;
+  }
+
+  if (bdos->io->blocked) {
+    return true; /* Parked, the registers are left for the retry. */
+  }
+
+  if (bdos->reboot) {
+    /* The BDOS jumps to 0000h on ^C, which does a warm boot. */
+    z80->sp += 2;
+    z80->pc = 0x0000;
+    return true;
+  }
+
+  /* Return to the caller the same way as the BDOS. */
+  z80->u_hl.hl = status;
+  z80->u_af.s_af.a = status;
+  z80->u_bc.s_bc.b = 0;
+  z80->pc = bdos_read_word(mem, z80->sp);
+  z80->sp += 2;
+  return true;
+}
+
+
+
@@ -0,0 +1,47 @@
+#ifndef _BDOS_H
+#define _BDOS_H
+
+#include <stdbool.h>
+#include "z80.h"
+#include "mem.h"
+#include "io.h"
+#include "dpb.h"
+
+#define BDOS_ENTRY 0x0005
+
+typedef struct bdos_dir_s {
+  uint8_t *entry; /* Copy of the directory, DRM + 1 entries. */
+  int *next; /* Next entry with the same hash, in directory order. */
+  int *hash; /* First entry for each hash bucket. */
+  uint32_t hash_mask;
+  uint32_t generation;
+  bool valid;
+} bdos_dir_t;
+
+typedef struct bdos_search_s {
+  bool active;
+  uint16_t fcb;
+  uint32_t next; /* Next directory entry to check. */
+} bdos_search_t;
+
+typedef struct bdos_line_s {
+  bool parked; /* Waiting for a key, kept for the retried call. */
+  uint16_t buffer;
+  uint8_t count;
+} bdos_line_t;
+
+typedef struct bdos_s {
+  io_t *io;
+  bdos_dir_t dir[DPB_DRIVES];
+  bdos_search_t search;
+  bdos_line_t line;
+  int layout_ok;
+  bool reboot; /* ^C seen, BDOS would jump to 0000h. */
+} bdos_t;
+
+void bdos_init(bdos_t *bdos, io_t *io);
+void bdos_destroy(bdos_t *bdos);
+void bdos_restore(bdos_t *bdos, const bdos_t *from);
+bool bdos_trap(bdos_t *bdos, z80_t *z80, mem_t *mem);
+
+#endif /* _BDOS_H */
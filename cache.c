@@ -0,0 +1,473 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "cache.h"
+#include "batch.h"
+#include "disk.h"
+#include "dpb.h"
+#include "io.h"
+#include "kaytil.h"
+#include "sha256.h"
+
+/* Result cache for batch runs. A batch run only depends on the CP/M and
+   CBIOS binaries, the contents of the drives, the script, the exit
+   conditions and the machine options, so those are hashed into a key and
+   the result is kept in a file named by it in the cache directory: the
+   exit code, the instruction count, the console output and every disk
+   write in order. A run with the same key replays that instead of being
+   run, so the output and any drives written back end up the same. Errors
+   and timeouts are never stored, as they may not happen again. */
+
+#define CACHE_SALT "kaytil result cache 1" /* Changed with the format. */
+#define CACHE_MAGIC "KAYTILC1"
+#define CACHE_MAGIC_SIZE 8
+#define CACHE_HEADER_SIZE (CACHE_MAGIC_SIZE + 1 + 8 + 4)
+#define CACHE_WRITE_SIZE (1 + 2 + 1 + DPB_RECORD_SIZE)
+#define CACHE_PATH_MAX 1024
+
+
+
+void cache_init(cache_t *cache, const char *dir, disk_t *disk)
+{
+  cache->dir = dir;
+  cache->disk = disk;
+  cache->key[0] = '\0';
+  cache->write = NULL;
+  cache->writes = 0;
+  cache->writes_max = 0;
+  cache->lost = false;
+}
+
+
+
+void cache_destroy(cache_t *cache)
+{
+  free(cache->write);
+  cache->write = NULL;
+  cache->writes = 0;
+  cache->writes_max = 0;
+}
+
+
+
+static void cache_put(uint8_t data[], uint64_t value, int size)
+{
+  int i;
+
+  for (i = 0; i < size; i++) {
+    data[i] = value >> (i * 8);
+  }
+}
+
+
+
+static uint64_t cache_get(const uint8_t data[], int size)
+{
+  uint64_t value = 0;
+  int i;
+
+  for (i = size - 1; i >= 0; i--) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+
+
+static void cache_hash_value(sha256_t *sha, uint64_t value, int size)
+{
+  uint8_t data[8];
+
+  cache_put(data, value, size);
+  sha256_update(sha, data, size);
+}
+
+
+
+static void cache_hash_data(sha256_t *sha, const void *data, size_t size)
+{
+  cache_hash_value(sha, size, 8);
+  sha256_update(sha, data, size);
+}
+
+
+
+static int cache_hash_file(sha256_t *sha, const char *filename)
+{
+  sha256_t file;
+  uint8_t buffer[4096];
+  uint8_t digest[SHA256_SIZE];
+  FILE *fh;
+  size_t n;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return -1;
+  }
+  sha256_init(&file);
+  while ((n = fread(buffer, sizeof(uint8_t), sizeof(buffer), fh)) > 0) {
+    sha256_update(&file, buffer, n);
+  }
+  if (ferror(fh)) {
+    fclose(fh);
+    return -1;
+  }
+  fclose(fh);
+  sha256_final(&file, digest);
+  sha256_update(sha, digest, SHA256_SIZE);
+  return 0;
+}
+
+
+
+static bool cache_record_empty(const uint8_t data[])
+{
+  int i;
+
+  for (i = 0; i < DPB_RECORD_SIZE; i++) {
+    if (data[i] != 0xE5) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+
+static int cache_hash_disk(sha256_t *sha, disk_t *disk)
+{
+  uint8_t record[DPB_RECORD_SIZE];
+  const dpb_t *dpb;
+  uint16_t track_no, sector_no;
+  uint32_t empty;
+  uint8_t disk_no;
+
+  for (disk_no = 0; disk_no < DISK_DRIVES; disk_no++) {
+    dpb = disk_dpb(disk, disk_no);
+    if (dpb == NULL) {
+      cache_hash_value(sha, 0, 1);
+      continue;
+    }
+    cache_hash_value(sha, 1, 1);
+    cache_hash_value(sha, dpb->tracks, 2);
+    cache_hash_value(sha, dpb->spt, 2);
+    cache_hash_value(sha, dpb->bsh, 1);
+    cache_hash_value(sha, dpb->blm, 1);
+    cache_hash_value(sha, dpb->exm, 1);
+    cache_hash_value(sha, dpb->dsm, 2);
+    cache_hash_value(sha, dpb->drm, 2);
+    cache_hash_value(sha, dpb->al0, 1);
+    cache_hash_value(sha, dpb->al1, 1);
+    cache_hash_value(sha, dpb->cks, 2);
+    cache_hash_value(sha, dpb->off, 2);
+    cache_hash_value(sha, dpb->skew, 1);
+
+    /* Every record as the machine would read it, whatever the backing.
+       Mostly empty disks are common, so runs of empty records are only
+       counted. */
+    empty = 0;
+    for (track_no = 0; track_no < dpb->tracks; track_no++) {
+      for (sector_no = 1; sector_no <= dpb->spt; sector_no++) {
+        if (disk_record_read(disk, disk_no, track_no, sector_no,
+          record) != 0) {
+          return -1;
+        }
+        if (cache_record_empty(record)) {
+          empty++;
+          continue;
+        }
+        cache_hash_value(sha, empty, 4);
+        sha256_update(sha, record, DPB_RECORD_SIZE);
+        empty = 0;
+      }
+    }
+    cache_hash_value(sha, empty, 4);
+  }
+  return 0;
+}
+
+
+
+int cache_key(cache_t *cache, const kaytil_config_t *config,
+  const char *script, batch_t *batch)
+{
+  uint8_t digest[SHA256_SIZE];
+  sha256_t sha;
+  int i;
+
+  sha256_init(&sha);
+  cache_hash_data(&sha, CACHE_SALT, strlen(CACHE_SALT));
+  cache_hash_data(&sha, config->cpm22, config->cpm22_size);
+  cache_hash_data(&sha, config->cbios, config->cbios_size);
+  cache_hash_value(&sha, config->native_bdos, 1);
+  cache_hash_value(&sha, config->banks, 1);
+
+  cache_hash_value(&sha, batch->exit_prompt, 1);
+  cache_hash_value(&sha, batch->exit_instructions, 8);
+  cache_hash_value(&sha, batch->exit_timeout, 8);
+  cache_hash_value(&sha, batch->exit_texts, 1);
+  for (i = 0; i < batch->exit_texts; i++) {
+    cache_hash_data(&sha, batch->exit_text[i], strlen(batch->exit_text[i]));
+  }
+
+  if (cache_hash_file(&sha, script) != 0) {
+    return -1;
+  }
+  if (cache_hash_disk(&sha, cache->disk) != 0) {
+    return -1;
+  }
+
+  sha256_final(&sha, digest);
+  for (i = 0; i < SHA256_SIZE; i++) {
+    snprintf(&cache->key[i * 2], 3, "%02x", digest[i]);
+  }
+  return 0;
+}
+
+
+
+static bool cache_result_valid(int result)
+{
+  /* Only the results that follow from the inputs alone. */
+  return result == BATCH_EXIT_DONE || result == BATCH_EXIT_BUDGET ||
+    result == BATCH_EXIT_INPUT;
+}
+
+
+
+int cache_replay(cache_t *cache, batch_t *batch, uint64_t *instructions)
+{
+  char path[CACHE_PATH_MAX];
+  uint8_t *data;
+  const uint8_t *p;
+  uint32_t output_size, writes, i;
+  long size;
+  FILE *fh;
+  int result;
+
+  if (cache->key[0] == '\0') {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "%s/%s", cache->dir, cache->key);
+  fh = fopen(path, "rb");
+  if (fh == NULL) {
+    return -1; /* Not cached. */
+  }
+  if (fseek(fh, 0, SEEK_END) != 0 || (size = ftell(fh)) < 0 ||
+    fseek(fh, 0, SEEK_SET) != 0) {
+    fclose(fh);
+    return -1;
+  }
+  data = malloc(size + 1);
+  if (data == NULL) {
+    fclose(fh);
+    return -1;
+  }
+  if (fread(data, sizeof(uint8_t), size, fh) != (size_t)size) {
+    free(data);
+    fclose(fh);
+    return -1;
+  }
+  fclose(fh);
+
+  /* Checked in full before anything is replayed, a broken entry is a miss. */
+  if (size < CACHE_HEADER_SIZE + 4 ||
+    memcmp(data, CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0) {
+    free(data);
+    return -1;
+  }
+  p = &data[CACHE_MAGIC_SIZE];
+  result = p[0];
+  output_size = cache_get(&p[9], 4);
+  if (! cache_result_valid(result) ||
+    (uint32_t)(size - CACHE_HEADER_SIZE - 4) < output_size) {
+    free(data);
+    return -1;
+  }
+  p = &data[CACHE_HEADER_SIZE + output_size];
+  writes = cache_get(p, 4);
+  if ((uint64_t)writes * CACHE_WRITE_SIZE !=
+    (uint64_t)(size - CACHE_HEADER_SIZE - 4 - output_size)) {
+    free(data);
+    return -1;
+  }
+
+  if (batch->output != NULL) {
+    fwrite(&data[CACHE_HEADER_SIZE], sizeof(uint8_t), output_size,
+      batch->output);
+    fflush(batch->output);
+  }
+  p += 4;
+  for (i = 0; i < writes; i++) {
+    if (disk_record_write(cache->disk, p[0], cache_get(&p[1], 2), p[3],
+      &p[4]) != 0) {
+      result = BATCH_EXIT_ERROR;
+      break;
+    }
+    p += CACHE_WRITE_SIZE;
+  }
+
+  *instructions = cache_get(&data[CACHE_MAGIC_SIZE + 1], 8);
+  free(data);
+  return result;
+}
+
+
+
+int cache_store(cache_t *cache, batch_t *batch, int result,
+  uint64_t instructions)
+{
+  char path[CACHE_PATH_MAX];
+  char temp[CACHE_PATH_MAX];
+  uint8_t header[CACHE_HEADER_SIZE];
+  uint8_t record[CACHE_WRITE_SIZE];
+  cache_write_t *write;
+  bool failed = false;
+  FILE *fh;
+  uint32_t i;
+
+  if (cache->key[0] == '\0' || ! cache_result_valid(result)) {
+    return 0;
+  }
+  if (cache->lost || ! batch->capture) {
+    return -1;
+  }
+
+  /* Written aside and renamed, so a reader never sees half an entry. */
+  snprintf(path, sizeof(path), "%s/%s", cache->dir, cache->key);
+  snprintf(temp, sizeof(temp), "%s/%s.%ld.%p.tmp", cache->dir, cache->key,
+    (long)getpid(), (void *)cache);
+  fh = fopen(temp, "wb");
+  if (fh == NULL) {
+    return -1;
+  }
+
+  memcpy(header, CACHE_MAGIC, CACHE_MAGIC_SIZE);
+  header[CACHE_MAGIC_SIZE] = result;
+  cache_put(&header[CACHE_MAGIC_SIZE + 1], instructions, 8);
+  cache_put(&header[CACHE_MAGIC_SIZE + 9], batch->captured_size, 4);
+  if (fwrite(header, sizeof(uint8_t), CACHE_HEADER_SIZE, fh) !=
+    CACHE_HEADER_SIZE ||
+    fwrite(batch->captured, sizeof(uint8_t), batch->captured_size, fh) !=
+    batch->captured_size) {
+    failed = true;
+  }
+
+  cache_put(record, cache->writes, 4);
+  if (fwrite(record, sizeof(uint8_t), 4, fh) != 4) {
+    failed = true;
+  }
+  for (i = 0; i < cache->writes && ! failed; i++) {
+    write = &cache->write[i];
+    record[0] = write->disk_no;
+    cache_put(&record[1], write->track_no, 2);
+    record[3] = write->sector_no;
+    memcpy(&record[4], write->data, DPB_RECORD_SIZE);
+    if (fwrite(record, sizeof(uint8_t), CACHE_WRITE_SIZE, fh) !=
+      CACHE_WRITE_SIZE) {
+      failed = true;
+    }
+  }
+
+  if (fclose(fh) != 0) {
+    failed = true;
+  }
+  if (failed) {
+    remove(temp);
+    return -1;
+  }
+  if (rename(temp, path) != 0) {
+    remove(temp); /* Stored by another run in the meantime on some hosts. */
+  }
+  return 0;
+}
+
+
+
+static void cache_write_add(cache_t *cache, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[])
+{
+  cache_write_t *write;
+  uint32_t max;
+
+  if (cache->lost) {
+    return;
+  }
+  if (cache->writes >= cache->writes_max) {
+    max = (cache->writes_max == 0) ? 64 : cache->writes_max * 2;
+    write = realloc(cache->write, max * sizeof(cache_write_t));
+    if (write == NULL) {
+      cache->lost = true;
+      return;
+    }
+    cache->write = write;
+    cache->writes_max = max;
+  }
+  write = &cache->write[cache->writes++];
+  write->disk_no = disk_no;
+  write->track_no = track_no;
+  write->sector_no = sector_no;
+  memcpy(write->data, data, DPB_RECORD_SIZE);
+}
+
+
+
+static const dpb_t *cache_backend_dpb(void *context, uint8_t disk_no)
+{
+  cache_t *cache = context;
+  return disk_backend.dpb(cache->disk, disk_no);
+}
+
+
+
+static int cache_backend_read(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint8_t data[])
+{
+  cache_t *cache = context;
+  return disk_backend.read(cache->disk, disk_no, track_no, sector_no, data);
+}
+
+
+
+static int cache_backend_write(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[])
+{
+  cache_t *cache = context;
+
+  if (disk_backend.write(cache->disk, disk_no, track_no, sector_no,
+    data) != 0) {
+    return -1;
+  }
+  cache_write_add(cache, disk_no, track_no, sector_no, data);
+  return 0;
+}
+
+
+
+static uint32_t cache_backend_dir_generation(void *context, uint8_t disk_no)
+{
+  cache_t *cache = context;
+  return disk_backend.dir_generation(cache->disk, disk_no);
+}
+
+
+
+static int cache_backend_system(void *context, const uint8_t data[],
+  uint16_t size)
+{
+  cache_t *cache = context;
+  return disk_backend.system(cache->disk, data, size);
+}
+
+
+
+const io_disk_t cache_disk_backend = {
+  cache_backend_dpb,
+  cache_backend_read,
+  cache_backend_write,
+  cache_backend_dir_generation,
+  cache_backend_system,
+};
@@ -0,0 +1,41 @@
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "io.h"
+#include "dpb.h"
+#include "disk.h"
+#include "batch.h"
+#include "kaytil.h"
+#include "sha256.h"
+
+typedef struct cache_write_s {
+  uint8_t disk_no;
+  uint8_t sector_no;
+  uint16_t track_no;
+  uint8_t data[DPB_RECORD_SIZE];
+} cache_write_t;
+
+typedef struct cache_s {
+  const char *dir;
+  disk_t *disk;
+  char key[(SHA256_SIZE * 2) + 1]; /* Hex, empty until computed. */
+  cache_write_t *write; /* Disk writes of the run, in order. */
+  uint32_t writes;
+  uint32_t writes_max;
+  bool lost; /* Out of memory for the writes, so nothing is stored. */
+} cache_t;
+
+/* Disk backend recording the writes, with the cache_t as context. */
+extern const io_disk_t cache_disk_backend;
+
+void cache_init(cache_t *cache, const char *dir, disk_t *disk);
+void cache_destroy(cache_t *cache);
+int cache_key(cache_t *cache, const kaytil_config_t *config,
+  const char *script, batch_t *batch);
+int cache_replay(cache_t *cache, batch_t *batch, uint64_t *instructions);
+int cache_store(cache_t *cache, batch_t *batch, int result,
+  uint64_t instructions);
+
+#endif /* _CACHE_H */
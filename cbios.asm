@@ -35,51 +35,17 @@ wboote: jmp     wboot   ;warm start
         jmp     listst  ;return list status
         jmp     sectran ;sector translate
 ;
-;       fixed data tables for four-drive standard
-;       ibm-compatible 8" disks
-;
-;       disk Parameter header for disk 00
-dpbase: dw      trans, 0000h
-        dw      0000h, 0000h
-        dw      dirbf, dpblk
-        dw      chk00, all00
-;       disk parameter header for disk 01
-        dw      trans, 0000h
-        dw      0000h, 0000h
-        dw      dirbf, dpblk
-        dw      chk01, all01
-;       disk parameter header for disk 02
-        dw      trans, 0000h
-        dw      0000h, 0000h
-        dw      dirbf, dpblk
-        dw      chk02, all02
-;       disk parameter header for disk 03
-        dw      trans, 0000h
-        dw      0000h, 0000h
-        dw      dirbf, dpblk
-        dw      chk03, all03
-;
-;       sector translate vector
-trans:  db       1,  7, 13, 19  ;sectors  1,  2,  3,  4
-        db      25,  5, 11, 17  ;sectors  5,  6,  7,  6
-        db      23,  3,  9, 15  ;sectors  9, 10, 11, 12
-        db      21,  2,  8, 14  ;sectors 13, 14, 15, 16
-        db      20, 26,  6, 12  ;sectors 17, 18, 19, 20
-        db      18, 24,  4, 10  ;sectors 21, 22, 23, 24
-        db      16, 22          ;sectors 25, 26
-;
-dpblk:  ;disk parameter block, common to all disks
-        dw      26              ;sectors per track
-        db      3               ;block shift factor
-        db      7               ;block mask
-        db      0               ;null mask
-        dw      242             ;disk size-1
-        dw      63              ;directory max
-        db      192             ;alloc 0
-        db      0               ;alloc 1
-        dw      16              ;check size
-        dw      2               ;track offset
-
+;       emulator extensions, block transfers with hl=buffer, bc=length,
+;       returning the number of bytes moved in bc (0 is end of file)
+;
+        jmp     rdrblk  ;reader block in
+        jmp     punblk  ;punch block out
+        jmp     lstblk  ;list block out
+;
+;       disk parameter headers, parameter blocks, allocation and check
+;       vectors for the sixteen drives (a-p) are generated by the emulator
+;       at cold start, see 'dpbase' at the end of the cbios
+;
 banner: db      'Kaytil CP/M 2.2', 0Dh, 0Ah
 ;
 ;       end of fixed tables
@@ -89,6 +55,12 @@ boot:   ;simplest case is to just perform parameter initialization
         xra     a               ;zero in the accum
         sta     iobyte          ;clear the iobyte
         sta     cdisk           ;select disk zero
+;
+        ;let the emulator generate the disk tables at dpbase
+        lxi     b, dpbase
+        call    setdma
+        mvi     a, 03h
+        out     15h             ;virtual disk i/o table setup
 ;
         ;print banner on startup
         lxi     d, banner
@@ -152,6 +124,7 @@ load1:  ;load   one more sector
         push    b
         push    d
         push    h
+        mvi     b, 0            ;high order track is always zero here
         call    settrk          ;track address set from register c
         pop     h
         pop     d
@@ -198,20 +171,50 @@ conout: ;console character output from register c
 ;
 list:   ;list character from register c
         mov     a, c            ;character to register a
-        ret                     ;null subroutine
+        out     02h             ;virtual list write
+        ret
 ;
-listst: ;return list status (0 if not ready, 1 if ready)
-        xra     a               ;0 is always ok to return
+listst: ;return list status (0 if not ready, 0ffh if ready)
+        in      02h             ;virtual list status
         ret
 ;
 punch:  ;punch  character from  register C
         mov     a, c            ;character to register a
-        ret                     ;null subroutine
+        out     03h             ;virtual punch write
+        ret
 ;
 ;
 reader: ;reader character into register a from reader device
-        mvi    a, 1ah           ;enter end of file for now (replace later)
-        ani    7fh              ;remember to strip parity bit
+        in      04h             ;virtual reader read, 1ah at end of file
+        ani     7fh             ;remember to strip parity bit
+        ret
+;
+rdrblk: ;reader block into buffer at hl, length bc
+        mvi     e, 01h
+        jmp     blkio
+;
+punblk: ;punch block from buffer at hl, length bc
+        mvi     e, 02h
+        jmp     blkio
+;
+lstblk: ;list block from buffer at hl, length bc
+        mvi     e, 03h
+;
+blkio:  ;block transfer given by register e
+        mov     a, l
+        out     06h             ;virtual block address low
+        mov     a, h
+        out     07h             ;virtual block address high
+        mov     a, c
+        out     08h             ;virtual block length low
+        mov     a, b
+        out     09h             ;virtual block length high
+        mov     a, e
+        out     05h             ;virtual block transfer
+        in      08h             ;virtual block length moved low
+        mov     c, a
+        in      09h             ;virtual block length moved high
+        mov     b, a
         ret
 ;
 ;
@@ -221,7 +224,7 @@ reader: ;reader character into register a from reader device
 ;
 home:   ;move to the track 00   position of current drive
 ;       translate this call into a settrk call with Parameter 00
-        mvi    c, 0             ;select track 0
+        lxi    b, 0             ;select track 0
         call   settrk
         ret                     ;we will move to 00 on first read/write
 ;
@@ -229,13 +232,16 @@ seldsk: ;select disk given by register c
         lxi     h, 0000h        ;error return code
         mov     a, c
         sta     diskno
-        cpi     4               ;must be between 0 and 3
-        rnc                     ;no carry if 4, 5,...
+        cpi     16              ;must be between 0 and 15
+        rnc                     ;no carry if 16, 17,...
 ;       disk number is in the proper range
         out     10h             ;virtual disk select
+        in      10h             ;virtual disk select status
+        ora     a               ;is the drive present?
+        rnz                     ;no, return error code
 ;       compute proper disk Parameter header address
         lda     diskno
-        mov     l, a            ;l=disk number 0, 1, 2, 3
+        mov     l, a            ;l=disk number 0, 1, ..., 15
         mvi     h, 0            ;high order zero
         dad     h               ;*2
         dad     h               ;*4
@@ -245,10 +251,14 @@ seldsk: ;select disk given by register c
         dad     d               ;hl=,dpbase (diskno*16)
         ret
 ;
-settrk: ;set track given by register c
-        mov     a, c
-        sta     track
-        out     11h             ;virtual disk track
+settrk: ;set track given by registers b and c
+        mov     l, c            ;low order track
+        mov     h, b            ;high order track
+        shld    track           ;save the track
+        mov     a, l
+        out     11h             ;virtual disk track low
+        mov     a, h
+        out     16h             ;virtual disk track high
         ret
 ;
 setsec: ;set sector given by register c
@@ -261,11 +271,18 @@ setsec: ;set sector given by register c
 sectran:
         ;translate the sector given by bc using the
         ;translate table given by de
+        mov     a, d            ;any translate table?
+        ora     e
+        jz      notran          ;no, sectors are sequential
         xchg                    ;hl=.trans
         dad     b               ;hl=.trans (sector)
         mov     l, m            ;l=trans (sector)
         mvi     h, 0            ;hl=trans (sector)
         ret                     ;with value in hl
+notran: mov     l, c            ;hl=sector
+        mov     h, b
+        inx     h               ;sectors are numbered from 1
+        ret
 ;
 setdma: ;set    dma address given by registers b and c
         mov     l, c            ;low order address
@@ -293,8 +310,8 @@ waitio: ;enter  here from read  and write to perform the actual i/o
 ;       properly, and 0lh if an error occurs during the read or write
 ;
 ;       in this case, we have saved the disk number in 'diskno' (0, 1)
-;                       the track number in 'track' (0-76)
-;                       the sector number in 'sector' (1-26)
+;                       the track number in 'track' (0-511)
+;                       the sector number in 'sector' (1-128)
 ;                       the dma address in 'dmaad' (0-65535)
         in      15h             ;virtual disk i/o status
         ret                     ;replaced when filled-in
@@ -309,17 +326,14 @@ sector: ds      2               ;two bytes for expansion
 dmaad:  ds      2               ;direct memory address
 diskno: ds      1               ;disk number 0-15
 ;
-;       scratch ram area for bdos use
+;       scratch ram area for bdos use, everything from here up to the
+;       end of memory is filled in by the emulator at cold start:
+;       the disk parameter headers for drives a-p (16 bytes each),
+;       followed by the directory buffer, sector translate vector,
+;       disk parameter blocks and the allocation and check vectors
+;       for the drives that are present
 begdat  equ     $               ;beginning of data area
-dirbf:  ds      128             ;scratch directory area
-all00:  ds      31              ;allocation vector 0
-all01:  ds      31              ;allocation vector 1
-all02:  ds      31              ;allocation vector 2
-all03:  ds      31              ;allocation vector 3
-chk00:  ds      16              ;check vector 0
-chk01:  ds      16              ;check vector 1
-chk02:  ds      16              ;check vector 2
-chk03:  ds      16              ;check vector 3
+dpbase: ds      16*16           ;disk parameter headers
 ;
 enddat  equ     $               ;end of data area
 datsiz  equ     $-begdat;       ;size of data area
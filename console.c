@@ -1,23 +1,598 @@
+#ifndef CONIO_CONSOLE
+/* Threads need more than the base POSIX definitions. */
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+#endif /* CONIO_CONSOLE */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
 #include <termios.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #ifdef CONIO_CONSOLE
 #include <conio.h>
 #else /* !CONIO_CONSOLE */
 #include <poll.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <pthread.h>
+#endif /* CONIO_CONSOLE */
+
+#include "console.h"
+#include "screen.h"
+#include "latency.h"
+
+/* Output goes to the virtual screen, which is rendered before reading
+   input, or when the oldest pending output is older than the interval. The
+   BDOS polls the status after every character written, so a status poll
+   only renders if there is input, the interval covers programs polling. */
+#define CONSOLE_FRAME_INTERVAL 20000 /* Microseconds */
+
+/* Headless mode draws nothing, the screen is instead dumped as text on
+   stdout at exit and whenever a trigger fires. An idle trigger fires once
+   output has stopped for the given time, and is armed again by new output.
+   A text trigger fires when the text shows up on the screen, and is armed
+   again when it is gone. */
+#define CONSOLE_TRIGGERS_MAX 8
+
+typedef enum {
+  CONSOLE_TRIGGER_IDLE,
+  CONSOLE_TRIGGER_TEXT,
+} console_trigger_type_t;
+
+typedef struct console_trigger_s {
+  console_trigger_type_t type;
+  long idle; /* Microseconds */
+  const char *text;
+  bool armed;
+} console_trigger_t;
+
+static screen_t console_screen;
+static bool console_pending = false;
+static struct timeval console_pending_since;
+
+static bool console_is_headless = false;
+static console_trigger_t console_trigger[CONSOLE_TRIGGERS_MAX];
+static int console_triggers = 0;
+static bool console_written = false; /* Since triggers were checked. */
+static struct timeval console_written_last;
+
+#ifdef CONIO_CONSOLE
+#ifndef CONSOLE_BUFFER_SIZE
+#define CONSOLE_BUFFER_SIZE 4096
+#endif
+static char console_buffer[CONSOLE_BUFFER_SIZE];
+
+#else /* !CONIO_CONSOLE */
+/* A host I/O thread owns stdin and stdout, and talks to the emulation
+   through two single producer single consumer rings. Only a full output
+   ring or a read with no input available makes the emulation wait. */
+#define CONSOLE_INPUT_SIZE 4096 /* Power of two */
+#define CONSOLE_OUTPUT_SIZE 65536 /* Power of two */
+#define CONSOLE_INPUT_FULL_WAIT 10 /* Milliseconds */
+
+typedef struct console_ring_s {
+  uint8_t *data;
+  uint32_t mask;
+  uint32_t head; /* Only written by the producer. */
+  uint32_t tail; /* Only written by the consumer. */
+} console_ring_t;
+
+static uint8_t console_input_data[CONSOLE_INPUT_SIZE];
+static struct timeval console_input_time[CONSOLE_INPUT_SIZE]; /* Arrival */
+static uint8_t console_output_data[CONSOLE_OUTPUT_SIZE];
+static console_ring_t console_input =
+  {console_input_data, CONSOLE_INPUT_SIZE - 1, 0, 0};
+static console_ring_t console_output_ring =
+  {console_output_data, CONSOLE_OUTPUT_SIZE - 1, 0, 0};
+
+static pthread_t console_thread;
+static pthread_mutex_t console_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t console_input_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t console_output_cond = PTHREAD_COND_INITIALIZER;
+static int console_wake_pipe[2];
+static bool console_input_eof = false;
+static bool console_stop = false;
+static volatile sig_atomic_t console_resized = 0;
+#endif /* CONIO_CONSOLE */
+static struct timeval console_getc_time; /* Arrival of last character. */
+
+
+
+static void console_error(const char *format, ...)
+{
+  va_list args;
+
+  fprintf(stderr, "Error: ");
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  exit(EXIT_FAILURE);
+}
+
+
+
+#ifndef CONIO_CONSOLE
+static uint32_t console_ring_used(console_ring_t *ring)
+{
+  return __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) -
+    __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
+
+
+
+static bool console_ring_put(console_ring_t *ring, uint8_t value)
+{
+  uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > ring->mask) {
+    return false; /* Full */
+  }
+  ring->data[head & ring->mask] = value;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  return true;
+}
+
+
+
+static int console_ring_get(console_ring_t *ring)
+{
+  uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  uint8_t value;
+
+  if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+    return -1; /* Empty */
+  }
+  value = ring->data[tail & ring->mask];
+  __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+  return value;
+}
+
+
+
+static void console_wake(void)
+{
+  uint8_t dummy = 0;
+
+  if (write(console_wake_pipe[1], &dummy, 1) == -1 && errno != EAGAIN) {
+    console_error("write() failed with errno: %d\n", errno);
+  }
+}
+
+
+
+static void console_thread_input(void)
+{
+  uint8_t buffer[CONSOLE_INPUT_SIZE];
+  struct timeval now;
+  uint32_t space, head;
+  ssize_t i, n;
+
+  space = CONSOLE_INPUT_SIZE - console_ring_used(&console_input);
+  n = read(STDIN_FILENO, buffer, space);
+  if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+    return;
+  }
+
+  if (n > 0 && latency_enabled()) {
+    gettimeofday(&now, NULL);
+    head = __atomic_load_n(&console_input.head, __ATOMIC_RELAXED);
+    for (i = 0; i < n; i++) {
+      console_input_time[(head + i) & console_input.mask] = now;
+    }
+  }
+
+  pthread_mutex_lock(&console_mutex);
+  if (n <= 0) {
+    console_input_eof = true;
+  } else {
+    for (i = 0; i < n; i++) {
+      console_ring_put(&console_input, buffer[i]);
+    }
+  }
+  pthread_cond_signal(&console_input_cond);
+  pthread_mutex_unlock(&console_mutex);
+}
+
+
+
+static void console_thread_output(void)
+{
+  console_ring_t *ring = &console_output_ring;
+  uint32_t tail, used, len;
+  ssize_t n;
+
+  /* Write the contiguous part up to the end of the ring. */
+  used = console_ring_used(ring);
+  tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  len = CONSOLE_OUTPUT_SIZE - (tail & ring->mask);
+  if (len > used) {
+    len = used;
+  }
+
+  n = write(STDOUT_FILENO, &ring->data[tail & ring->mask], len);
+  if (n == -1) {
+    if (errno == EINTR || errno == EAGAIN) {
+      return;
+    }
+    n = len; /* Nowhere to write, so just drop it. */
+  }
+
+  pthread_mutex_lock(&console_mutex);
+  __atomic_store_n(&ring->tail, tail + n, __ATOMIC_RELEASE);
+  pthread_cond_signal(&console_output_cond);
+  pthread_mutex_unlock(&console_mutex);
+}
+
+
+
+static void *console_thread_main(void *arg)
+{
+  struct pollfd fds[3];
+  uint8_t dummy[64];
+  bool input_full;
+  int result;
+
+  (void)arg;
+
+  while (1) {
+    input_full = (console_ring_used(&console_input) >= CONSOLE_INPUT_SIZE);
+
+    fds[0].fd = STDIN_FILENO;
+    fds[0].events = (console_input_eof || input_full) ? 0 : POLLIN;
+    fds[1].fd = STDOUT_FILENO;
+    fds[1].events = (console_ring_used(&console_output_ring) > 0) ?
+      POLLOUT : 0;
+    fds[2].fd = console_wake_pipe[0];
+    fds[2].events = POLLIN;
+
+    if (__atomic_load_n(&console_stop, __ATOMIC_ACQUIRE) &&
+      fds[1].events == 0) {
+      break;
+    }
+
+    result = poll(fds, 3, input_full ? CONSOLE_INPUT_FULL_WAIT : -1);
+    if (result == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      console_error("poll() failed with errno: %d\n", errno);
+    }
+
+    if (fds[2].revents & POLLIN) {
+      while (read(console_wake_pipe[0], dummy, sizeof(dummy)) > 0);
+    }
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      console_thread_input();
+    }
+    if (fds[1].revents & (POLLOUT | POLLHUP | POLLERR)) {
+      console_thread_output();
+    }
+  }
+
+  return NULL;
+}
+
+
+
+static void console_resize_handler(int sig)
+{
+  (void)sig;
+  console_resized = 1;
+}
+
+
+
+static void console_output(void *context, const char *s)
+{
+  (void)context;
+  while (*s != '\0') {
+    if (console_ring_put(&console_output_ring, *s)) {
+      s++;
+      continue;
+    }
+
+    /* Full, so wait for the I/O thread to make room. */
+    console_wake();
+    pthread_mutex_lock(&console_mutex);
+    while (console_ring_used(&console_output_ring) >= CONSOLE_OUTPUT_SIZE) {
+      pthread_cond_wait(&console_output_cond, &console_mutex);
+    }
+    pthread_mutex_unlock(&console_mutex);
+  }
+}
+
+
+
+static int console_getc(void)
+{
+  int value;
+
+  console_getc_time = console_input_time[console_input.tail &
+    console_input.mask];
+  value = console_ring_get(&console_input);
+  if (value != -1) {
+    return value;
+  }
+
+  pthread_mutex_lock(&console_mutex);
+  while (console_ring_used(&console_input) == 0 && ! console_input_eof) {
+    pthread_cond_wait(&console_input_cond, &console_mutex);
+  }
+  pthread_mutex_unlock(&console_mutex);
+
+  console_getc_time = console_input_time[console_input.tail &
+    console_input.mask];
+  value = console_ring_get(&console_input);
+  return (value == -1) ? EOF : value;
+}
+
+
+
+static bool console_input_pending(void)
+{
+  return console_ring_used(&console_input) > 0;
+}
+
+
+
+static bool console_input_wait(const struct timespec *deadline)
+{
+  int result = 0;
+
+  pthread_mutex_lock(&console_mutex);
+  while (console_ring_used(&console_input) == 0 && ! console_input_eof &&
+    result != ETIMEDOUT) {
+    result = pthread_cond_timedwait(&console_input_cond, &console_mutex,
+      deadline);
+  }
+  pthread_mutex_unlock(&console_mutex);
+  return result != ETIMEDOUT;
+}
+
+
+
+#else /* CONIO_CONSOLE */
+static void console_output(void *context, const char *s)
+{
+  (void)context;
+  fputs(s, stdout);
+}
+
+
+
+static int console_getc(void)
+{
+  int value;
+
+  do {
+    value = fgetc(stdin);
+  } while (value == EOF);
+  if (latency_enabled()) {
+    gettimeofday(&console_getc_time, NULL);
+  }
+  return value;
+}
+
+
+
+static bool console_input_pending(void)
+{
+  return kbhit() != 0;
+}
+#endif /* CONIO_CONSOLE */
+
+
+
+static long console_elapsed(const struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return ((now.tv_sec - since->tv_sec) * 1000000) +
+    (now.tv_usec - since->tv_usec);
+}
+
+
+
+static void console_dump(void)
+{
+  screen_dump(&console_screen, console_output, NULL);
+#ifdef CONIO_CONSOLE
+  fflush(stdout);
+#else
+  console_wake();
 #endif /* CONIO_CONSOLE */
+}
+
 
-#include "panic.h"
+
+static void console_triggers_check(void)
+{
+  console_trigger_t *trigger;
+  bool fire = false;
+  int i;
+
+  for (i = 0; i < console_triggers; i++) {
+    trigger = &console_trigger[i];
+    switch (trigger->type) {
+    case CONSOLE_TRIGGER_IDLE:
+      if (console_written) {
+        trigger->armed = true;
+      }
+      if (trigger->armed &&
+        console_elapsed(&console_written_last) >= trigger->idle) {
+        trigger->armed = false;
+        fire = true;
+      }
+      break;
+
+    case CONSOLE_TRIGGER_TEXT:
+      if (! console_written) {
+        break; /* Screen is the same as last time. */
+      }
+      if (! screen_find(&console_screen, trigger->text)) {
+        trigger->armed = true;
+      } else if (trigger->armed) {
+        trigger->armed = false;
+        fire = true;
+      }
+      break;
+    }
+  }
+  console_written = false;
+
+  if (fire) {
+    console_dump();
+  }
+}
+
+
+
+#ifndef CONIO_CONSOLE
+static bool console_idle_deadline(struct timespec *deadline)
+{
+  long idle = -1;
+  int i;
+
+  /* Earliest time an armed idle trigger can fire. */
+  for (i = 0; i < console_triggers; i++) {
+    if (console_trigger[i].type == CONSOLE_TRIGGER_IDLE &&
+      (console_trigger[i].armed || console_written) &&
+      (idle == -1 || console_trigger[i].idle < idle)) {
+      idle = console_trigger[i].idle;
+    }
+  }
+  if (idle == -1) {
+    return false;
+  }
+
+  deadline->tv_sec = console_written_last.tv_sec + (idle / 1000000);
+  deadline->tv_nsec = (console_written_last.tv_usec + (idle % 1000000)) * 1000;
+  if (deadline->tv_nsec >= 1000000000) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000;
+  }
+  return true;
+}
+#endif /* CONIO_CONSOLE */
+
+
+
+int console_headless(const char *trigger)
+{
+  console_trigger_t *new;
+  char *end;
+
+  console_is_headless = true;
+  if (trigger == NULL) {
+    return 0;
+  }
+  if (console_triggers >= CONSOLE_TRIGGERS_MAX) {
+    return -1;
+  }
+
+  new = &console_trigger[console_triggers];
+  if (strncmp(trigger, "idle:", 5) == 0) {
+    new->type = CONSOLE_TRIGGER_IDLE;
+    new->idle = strtol(&trigger[5], &end, 10) * 1000;
+    if (end == &trigger[5] || *end != '\0' || new->idle < 0) {
+      return -1;
+    }
+  } else if (strncmp(trigger, "text:", 5) == 0) {
+    new->type = CONSOLE_TRIGGER_TEXT;
+    new->text = &trigger[5];
+    if (strlen(new->text) == 0 || strlen(new->text) > SCREEN_COLS) {
+      return -1;
+    }
+  } else {
+    return -1;
+  }
+  new->armed = (new->type == CONSOLE_TRIGGER_TEXT);
+  console_triggers++;
+  return 0;
+}
+
+
+
+void console_flush(void)
+{
+  if (console_is_headless) {
+    console_pending = false;
+    console_triggers_check();
+    return;
+  }
+
+  if (console_pending) {
+    screen_render_ansi(&console_screen, console_output, NULL);
+#ifdef CONIO_CONSOLE
+    fflush(stdout);
+#else
+    console_wake();
+#endif /* CONIO_CONSOLE */
+    console_pending = false;
+    latency_flush();
+  }
+}
+
+
+
+void console_tick(void)
+{
+  struct timeval now;
+
+#ifndef CONIO_CONSOLE
+  if (console_resized) {
+    /* The terminal may have lost or moved anything, so draw it all. */
+    console_resized = 0;
+    screen_invalidate(&console_screen);
+    if (! console_pending) {
+      gettimeofday(&console_pending_since, NULL);
+      console_pending = true;
+    }
+  }
+#endif /* CONIO_CONSOLE */
+
+  if (console_is_headless) {
+    console_triggers_check();
+    return;
+  }
+
+  if (! console_pending) {
+    return;
+  }
+  gettimeofday(&now, NULL);
+  if (((now.tv_sec - console_pending_since.tv_sec) * 1000000) +
+    (now.tv_usec - console_pending_since.tv_usec) >= CONSOLE_FRAME_INTERVAL) {
+    console_flush();
+  }
+}
 
 
 
 static void console_exit_handler(void)
 {
+  if (console_is_headless) {
+    console_dump();
+  } else {
+    console_flush();
+    screen_close_ansi(&console_screen, console_output, NULL);
+  }
+#ifdef CONIO_CONSOLE
+  fflush(stdout);
+#else
+  /* Let the I/O thread write out what is left. */
+  __atomic_store_n(&console_stop, true, __ATOMIC_RELEASE);
+  console_wake();
+  pthread_join(console_thread, NULL);
+#endif /* CONIO_CONSOLE */
+
   /* Restore canonical mode and echo. */
   struct termios ts;
   tcgetattr(STDIN_FILENO, &ts);
@@ -29,7 +604,11 @@ static void console_exit_handler(void)
 
 void console_init(void)
 {
-  atexit(console_exit_handler);
+#ifndef CONIO_CONSOLE
+  sigset_t mask, old_mask;
+#endif /* CONIO_CONSOLE */
+
+  screen_init(&console_screen);
 
   /* Turn off canonical mode and echo. */
   struct termios ts;
@@ -37,46 +616,66 @@ void console_init(void)
   ts.c_lflag &= ~ICANON & ~ECHO;
   tcsetattr(STDIN_FILENO, TCSANOW, &ts);
 
-  /* Make stdout unbuffered. */
-  setvbuf(stdout, NULL, _IONBF, 0);
-}
+#ifdef CONIO_CONSOLE
+  /* Make stdout fully buffered, flushed after each render. */
+  setvbuf(stdout, console_buffer, _IOFBF, CONSOLE_BUFFER_SIZE);
 
+#else /* !CONIO_CONSOLE */
+  if (pipe(console_wake_pipe) != 0) {
+    console_error("pipe() failed with errno: %d\n", errno);
+  }
+  fcntl(console_wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(console_wake_pipe[1], F_SETFL, O_NONBLOCK);
 
+  signal(SIGWINCH, console_resize_handler);
 
-#ifdef CONIO_CONSOLE
-uint8_t console_status(void)
-{
-  return (kbhit() == 0) ? 0x00 : 0xFF;
+  /* Signals are handled by the emulation thread only. */
+  sigfillset(&mask);
+  pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+  if (pthread_create(&console_thread, NULL, console_thread_main, NULL) != 0) {
+    console_error("pthread_create() failed\n");
+  }
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+#endif /* CONIO_CONSOLE */
+
+  atexit(console_exit_handler);
 }
-#else /* !CONIO_CONSOLE */
-uint8_t console_status(void)
-{
-  int result;
-  struct pollfd fds[1];
 
-  fds[0].fd = STDIN_FILENO;
-  fds[0].events = POLLIN;
-  result = poll(fds, 1, 0);
-  if (result == -1) {
-    if (errno == EINTR) {
-      return 0x00; /* Handle this as nothing available. */
-    } else {
-      panic("poll() failed with errno: %d\n", errno);
-    }
+
+
+uint8_t console_status(void *context)
+{
+  (void)context;
+  if (! console_input_pending()) {
+    return 0x00;
   }
-  return (result == 0) ? 0x00 : 0xFF;
+  console_flush();
+  return 0xFF;
 }
-#endif /* CONIO_CONSOLE */
 
 
 
-uint8_t console_read(void)
+uint8_t console_read(void *context)
 {
+#ifndef CONIO_CONSOLE
+  struct timespec deadline;
+#endif /* CONIO_CONSOLE */
   int value;
 
-  do {
-    value = fgetc(stdin);
-  } while (value == EOF);
+  (void)context;
+  console_flush();
+#ifndef CONIO_CONSOLE
+  /* Idle triggers still have to fire while waiting for input. */
+  while (console_is_headless && console_idle_deadline(&deadline) &&
+    ! console_input_wait(&deadline)) {
+    console_triggers_check();
+  }
+#endif /* CONIO_CONSOLE */
+  value = console_getc();
+  if (value == EOF) {
+    exit(EXIT_SUCCESS); /* Nothing more will ever come. */
+  }
+  latency_key(&console_getc_time);
 
   switch (value) {
   case 0x0A: /* Convert LF to CR */
@@ -86,15 +685,15 @@ uint8_t console_read(void)
     return 0x08;
 
   case 0x1B: /* Escape */
-    if (fgetc(stdin) == '[') {
-      value = fgetc(stdin);
+    if (console_getc() == '[') {
+      value = console_getc();
       switch (value) {
       case 'A': return 0x0B; /* Cursor Up */
       case 'B': return 0x0A; /* Cursor Down */
       case 'C': return 0x0C; /* Cursor Forward/Right */
       case 'D': return 0x08; /* Cursor Back/Left */
       default:
-        panic("Unhandled console read escape code: 0x%02x\n", value);
+        console_error("Unhandled console read escape code: 0x%02x\n", value);
         break;
       }
     }
@@ -109,91 +708,25 @@ uint8_t console_read(void)
 
 
 
-void console_write(uint8_t value)
+void console_write(void *context, uint8_t value)
 {
-  static int escape = 0;
-  static uint8_t row = 0;
-
-  /* ADM-3A emulation of escape codes. */
-  if (escape == 2) {
-    row = value;
-    escape++;
-    return;
-
-  } else if (escape == 3) {
-    /* ANSI - Cursor Position */
-    fprintf(stdout, "\033[%d;%dH", row - 31, value - 31);
-    escape++;
-    return;
-
-  } else if (escape == 4) {
-    if (value == 0x3D) {
-      /* Repeated escape code. */
-      escape = 2;
-      return;
-
-    } else {
-      escape = 0;
-    }
+  (void)context;
+  if (console_is_headless) {
+    gettimeofday(&console_written_last, NULL);
+    console_written = true;
   }
-
-  /* Pass through regular ASCII characters. */
-  if (value >= 0x20 && value < 0x7F) {
-    if (escape == 0) {
-      fputc(value, stdout);
-      return;
-    }
-  }
-
-  /* Check potential non-printable characters. */
-  switch (value) {
-  case 0x0B:
-    /* ANSI - Cursor Up */
-    fprintf(stdout, "\033[A");
-    break;
-
-  case 0x0C:
-    /* ANSI - Cursor Right */
-    fprintf(stdout, "\033[C");
-    break;
-
-  case 0x1B:
-    if (escape == 0) {
-      escape++;
-    } else {
-      escape = 0;
-    }
-    break;
-
-  case 0x1A:
-    /* ANSI - Erase in Display */
-    fprintf(stdout, "\033[2J");
-    /* Fallthrough! */
-  case 0x1E:
-    /* ANSI - Cursor Home */
-    fprintf(stdout, "\033[H");
-    break;
-
-  case 0x3D:
-    if (escape == 1) {
-      escape++;
-    } else {
-      fputc('=', stdout);
-      escape = 0;
-    }
-    break;
-
-  case 0xA4:
-    /* Copyright Symbol */
-    fputc('c', stdout);
-    break;
-
-  default:
-    /* Passthrough all other characters. */
-    fputc(value, stdout);
-    break;
+  latency_write();
+  if (! console_pending) {
+    gettimeofday(&console_pending_since, NULL);
+    console_pending = true;
   }
+  screen_write(&console_screen, value);
 }
 
 
 
+const io_console_t console_backend = {
+  console_status,
+  console_read,
+  console_write,
+};
@@ -3,10 +3,18 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "io.h"
+
+/* Console backend for a machine, the terminal is shared so the context is
+   not used. */
+extern const io_console_t console_backend;
 
 void console_init(void);
-uint8_t console_status(void);
-uint8_t console_read(void);
-void console_write(uint8_t value);
+uint8_t console_status(void *context);
+uint8_t console_read(void *context);
+void console_write(void *context, uint8_t value);
+void console_flush(void);
+void console_tick(void);
+int console_headless(const char *trigger);
 
 #endif /* _CONSOLE_H */
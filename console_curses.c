@@ -3,8 +3,29 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <curses.h>
+#include <sys/time.h>
 
-#include "panic.h"
+#include "console.h"
+#include "screen.h"
+#include "latency.h"
+
+/* Output goes to the virtual screen, which is copied to curses before
+   reading input, or when the oldest pending output is older than the
+   interval. Curses then works out what to send to the terminal. */
+#define CONSOLE_FRAME_INTERVAL 20000 /* Microseconds */
+
+/* Keys are taken from curses on the tick and kept here, so status checks
+   never have to call getch() and ungetch(). */
+#define CONSOLE_QUEUE_SIZE 64
+
+static screen_t console_screen;
+static bool console_pending = false;
+static struct timeval console_pending_since;
+
+static int console_queue[CONSOLE_QUEUE_SIZE];
+static struct timeval console_queue_time[CONSOLE_QUEUE_SIZE]; /* Arrival */
+static int console_queue_head = 0;
+static int console_queue_tail = 0;
 
 
 
@@ -17,6 +38,7 @@ static void console_exit(void)
 
 void console_init(void)
 {
+  screen_init(&console_screen);
   initscr();
   atexit(console_exit);
   noecho();
@@ -26,29 +48,110 @@ void console_init(void)
 
 
 
-uint8_t console_status(void)
+static void console_run(int row, int col, const uint8_t text[], int len)
+{
+  int i;
+
+  move(row, col);
+  for (i = 0; i < len; i++) {
+    addch(text[i]);
+  }
+}
+
+
+
+void console_flush(void)
+{
+  int row, col;
+
+  if (! console_pending) {
+    return;
+  }
+  screen_update(&console_screen, console_run);
+  if (screen_bell(&console_screen)) {
+    flash();
+  }
+  screen_cursor(&console_screen, &row, &col);
+  move(row, col);
+  wnoutrefresh(stdscr);
+  doupdate();
+  console_pending = false;
+  latency_flush();
+}
+
+
+
+static void console_poll(void)
 {
   int ch;
-  ch = getch();
-  if (ch == ERR) {
+
+  while (((console_queue_head + 1) % CONSOLE_QUEUE_SIZE) !=
+    console_queue_tail) {
+    ch = getch();
+    if (ch == ERR) {
+      break;
+    }
+    console_queue[console_queue_head] = ch;
+    if (latency_enabled()) {
+      gettimeofday(&console_queue_time[console_queue_head], NULL);
+    }
+    console_queue_head = (console_queue_head + 1) % CONSOLE_QUEUE_SIZE;
+  }
+}
+
+
+
+void console_tick(void)
+{
+  struct timeval now;
+
+  console_poll();
+
+  if (! console_pending) {
+    return;
+  }
+  gettimeofday(&now, NULL);
+  if (((now.tv_sec - console_pending_since.tv_sec) * 1000000) +
+    (now.tv_usec - console_pending_since.tv_usec) >= CONSOLE_FRAME_INTERVAL) {
+    console_flush();
+  }
+}
+
+
+
+uint8_t console_status(void *context)
+{
+  (void)context;
+  if (console_queue_head == console_queue_tail) {
     return 0x00;
   } else {
-    ungetch(ch);
+    console_flush();
     return 0xFF;
   }
 }
 
 
 
-uint8_t console_read(void)
+uint8_t console_read(void *context)
 {
+  struct timeval arrival;
   int ch;
 
-  timeout(-1);
-  do {
-    ch = getch(); /* Blocking read here. */
-  } while (ch == ERR);
-  timeout(0);
+  (void)context;
+  console_flush();
+  if (console_queue_head != console_queue_tail) {
+    ch = console_queue[console_queue_tail];
+    arrival = console_queue_time[console_queue_tail];
+    console_queue_tail = (console_queue_tail + 1) % CONSOLE_QUEUE_SIZE;
+  } else {
+    timeout(-1);
+    do {
+      ch = getch(); /* Blocking read here. */
+    } while (ch == ERR);
+    timeout(0);
+    gettimeofday(&arrival, NULL);
+  }
+  latency_key(&arrival);
 
   /* ADM-3A emulation of key presses. */
   switch(ch) {
@@ -79,111 +182,29 @@ uint8_t console_read(void)
 
 
 
-void console_write(uint8_t value)
+void console_write(void *context, uint8_t value)
 {
-  static int escape = 0;
-  static uint8_t row = 0;
-  int y, x;
-
-  /* ADM-3A emulation of escape codes. */
-  if (escape == 2) {
-    row = value;
-    escape++;
-    return;
-
-  } else if (escape == 3) {
-    move(row - 32, value - 32);
-    escape++;
-    refresh();
-    return;
-
-  } else if (escape == 4) {
-    if (value == 0x3D) {
-      /* Repeated escape code. */
-      escape = 2;
-      return;
-
-    } else {
-      escape = 0;
-    }
-  }
-
-  /* Pass through regular ASCII characters. */
-  if (value >= 0x20 && value < 0x7F) {
-    if (escape == 0) {
-      addch(value);
-      refresh();
-      return;
-    }
+  (void)context;
+  if (! console_pending) {
+    gettimeofday(&console_pending_since, NULL);
+    console_pending = true;
   }
+  latency_write();
+  screen_write(&console_screen, value);
+}
 
-  /* Check potential non-printable characters. */
-  switch (value) {
-  case 0x07: /* Bell */
-    flash();
-    break;
-
-  case 0x08: /* Backspace */
-    getyx(stdscr, y, x);
-    move(y, x - 1);
-    break;
-
-  case 0x0A: /* Line Feed */
-    getyx(stdscr, y, x);
-    move(y + 1, 0);
-    break;
-
-  case 0x0B: /* Upline */
-    getyx(stdscr, y, x);
-    move(y - 1, x);
-    break;
-
-  case 0x0C: /* Forward Space */
-    getyx(stdscr, y, x);
-    move(y, x + 1);
-    break;
-
-  case 0x0D: /* Return */
-    getyx(stdscr, y, x);
-    move(y, 0);
-    break;
-
-  case 0x1B: /* Escape */
-    if (escape == 0) {
-      escape++;
-    } else {
-      escape = 0;
-    }
-    break;
-
-  case 0x1A: /* Clear Screen */
-    erase();
-    /* Fallthrough! */
-  case 0x1E: /* Home Cursor */
-    move(0, 0);
-    break;
-
-  case 0x3D:
-    if (escape == 1) {
-      escape++;
-    } else {
-      addch('=');
-      escape = 0;
-    }
-    break;
 
-  case 0xA4: /* Copyright Symbol */
-    addch('c');
-    break;
 
-  default:
-    /* Passthrough all other characters. */
-    addch(value);
-    break;
-  }
-
-  refresh();
+int console_headless(const char *trigger)
+{
+  (void)trigger;
+  return -1; /* Curses always draws. */
 }
 
 
 
+const io_console_t console_backend = {
+  console_status,
+  console_read,
+  console_write,
+};
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "pico/stdlib.h"
+#include "console.h"
 
 
 
@@ -16,17 +17,21 @@ void console_init(void)
 
 
 
-uint8_t console_status(void)
+uint8_t console_status(void *context)
 {
+  (void)context;
   /* Pico SDK specific function! */
   return (uart_is_readable(uart0) == 0) ? 0x00 : 0xFF;
 }
 
 
 
-uint8_t console_read(void)
+uint8_t console_read(void *context)
 {
-  uint8_t value = fgetc(stdin);
+  uint8_t value;
+
+  (void)context;
+  value = fgetc(stdin);
 
   switch (value) {
   case 0x0A: /* Convert LF to CR */
@@ -59,11 +64,12 @@ uint8_t console_read(void)
 
 
 
-void console_write(uint8_t value)
+void console_write(void *context, uint8_t value)
 {
   static int escape = 0;
   static uint8_t row = 0;
 
+  (void)context;
   /* ADM-3A emulation of escape codes. */
   if (escape == 2) {
     row = value;
@@ -147,3 +153,11 @@ void console_write(uint8_t value)
 
 
 
+const io_console_t console_backend = {
+  console_status,
+  console_read,
+  console_write,
+};
+
+
+
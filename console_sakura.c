@@ -1,29 +1,72 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include "panic.h"
+#include "console.h"
+#include "screen.h"
+#include "timer.h"
 #include "uart.h"
 
+/* Output goes to the virtual screen, which is rendered before reading
+   input, or at most every 20ms as counted down by the timer. */
+#define CONSOLE_FRAME_TICKS 2
+
+static screen_t console_screen;
+
+
+
+static void console_output(void *context, const char *s)
+{
+  (void)context;
+  uart0_send((char *)s);
+}
+
 
 
 void console_init(void)
 {
-  /* Not used. */
+  screen_init(&console_screen);
 }
 
 
 
-uint8_t console_status(void)
+void console_flush(void)
 {
-  return (uart0_pending() == 0) ? 0x00 : 0xFF;
+  if (screen_changed(&console_screen)) {
+    screen_render_ansi(&console_screen, console_output, NULL);
+  }
 }
 
 
 
-uint8_t console_read(void)
+void console_tick(void)
+{
+  if (timer_read() == 0) {
+    console_flush();
+    timer_set(CONSOLE_FRAME_TICKS);
+  }
+}
+
+
+
+uint8_t console_status(void *context)
+{
+  (void)context;
+  if (uart0_pending() == 0) {
+    return 0x00;
+  }
+  console_flush();
+  return 0xFF;
+}
+
+
+
+uint8_t console_read(void *context)
 {
   uint8_t value;
-  
+
+  (void)context;
+  console_flush();
+
   /* Wait until there is an actual character available. */
   while ((value = uart0_recv()) == '\0') {
     asm("wait");
@@ -45,8 +88,7 @@ uint8_t console_read(void)
       case 'C': return 0x0C; /* Cursor Forward/Right */
       case 'D': return 0x08; /* Cursor Back/Left */
       default:
-        panic("Unhandled console read escape code: 0x%02x\n", value);
-        break;
+        break; /* Pass on unhandled escape codes as is. */
       }
     }
     break;
@@ -60,126 +102,19 @@ uint8_t console_read(void)
 
 
 
-void console_write(uint8_t value)
+void console_write(void *context, uint8_t value)
 {
-  static int escape = 0;
-  static uint8_t row = 0;
-  char single[2];
-
-  /* ADM-3A emulation of escape codes. */
-  if (escape == 2) {
-    row = value;
-    escape++;
-    return;
-
-  } else if (escape == 3) {
-    /* ANSI - Cursor Position */
-    /* Lite implementation of: printf("\e[%d;%dH", row - 31, value - 31); */
-
-    single[1] = '\0';
-    uart0_send("\e[");
-
-    if ((row - 31) >= 10) {
-      single[0] = ((row - 31) / 10) + 0x30;
-      uart0_send(single);
-      single[0] = ((row - 31) % 10) + 0x30;
-      uart0_send(single);
-    } else {
-      single[0] = (row - 31) + 0x30;
-      uart0_send(single);
-    }
-    uart0_send(";");
-
-    if ((value - 31) >= 10) {
-      single[0] = ((value - 31) / 10) + 0x30;
-      uart0_send(single);
-      single[0] = ((value - 31) % 10) + 0x30;
-      uart0_send(single);
-    } else {
-      single[0] = (value - 31) + 0x30;
-      uart0_send(single);
-    }
-
-    uart0_send("H");
-    escape++;
-    return;
-
-  } else if (escape == 4) {
-    if (value == 0x3D) {
-      /* Repeated escape code. */
-      escape = 2;
-      return;
-
-    } else {
-      escape = 0;
-    }
-  }
-
-  /* Pass through regular ASCII characters. */
-  if (value >= 0x20 && value < 0x7F) {
-    if (escape == 0) {
-      single[0] = value;
-      single[1] = '\0';
-      uart0_send(single);
-      return;
-    }
-  }
-
-  /* Check potential non-printable characters. */
-  switch (value) {
-  case 0x0B:
-    /* ANSI - Cursor Up */
-    uart0_send("\e[A");
-    break;
-
-  case 0x0C:
-    /* ANSI - Cursor Right */
-    uart0_send("\e[C");
-    break;
-
-  case 0x1B:
-    if (escape == 0) {
-      escape++;
-    } else {
-      escape = 0;
-    }
-    break;
-
-  case 0x1A:
-    /* ANSI - Erase in Display */
-    uart0_send("\e[2J");
-    /* Fallthrough! */
-  case 0x1E:
-    /* ANSI - Cursor Home */
-    uart0_send("\e[H");
-    break;
+  (void)context;
+  screen_write(&console_screen, value);
+}
 
-  case 0x3D:
-    if (escape == 1) {
-      escape++;
-    } else {
-      single[0] = '=';
-      single[1] = '\0';
-      uart0_send(single);
-      escape = 0;
-    }
-    break;
 
-  case 0xA4:
-    /* Copyright Symbol */
-    single[0] = 'c';
-    single[1] = '\0';
-    uart0_send(single);
-    break;
 
-  default:
-    /* Passthrough all other characters. */
-    single[0] = value;
-    single[1] = '\0';
-    uart0_send(single);
-    break;
-  }
-}
+const io_console_t console_backend = {
+  console_status,
+  console_read,
+  console_write,
+};
 
 
 
@@ -1,120 +1,723 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
-#include <limits.h>
+#include <sys/stat.h>
 #include "disk.h"
+#include "dpb.h"
+#include "hostdir.h"
+#include "kdi.h"
 #include "mem.h"
-#include "panic.h"
+#include "store.h"
+#include "io.h"
 
-#define DISKS 4
+struct disk_drive_s {
+  const dpb_t *dpb;
+  bool dpb_fixed;
+  uint32_t **track; /* Store ID of each sector, NULL for an empty track. */
+  uint8_t *kdi_data; /* Compressed image, read from until first write. */
+  kdi_t kdi;
+  FILE *fh; /* Only open if changes are written back. */
+  hostdir_t *hostdir; /* Set if a host directory is mounted instead. */
+  uint32_t dir_generation; /* Incremented on every directory write. */
+  uint8_t *ram; /* Set for a RAM disk, the whole disk in host memory. */
+  dpb_t ram_dpb; /* Geometry computed from the RAM disk size. */
+  char *ram_file; /* Saved to at exit, if set. */
+};
 
-typedef struct disk_s {
-  char filename[PATH_MAX];
-  uint8_t data[DISK_SIZE];
-  bool write_changes;
-} disk_t;
+struct disk_s {
+  disk_drive_t drive[DISK_DRIVES];
+  store_t store; /* Sector contents shared by all drives. */
+  kdi_cache_t kdi_cache;
+};
 
-static disk_t disk[DISKS];
 
 
+disk_t *disk_create(void)
+{
+  disk_drive_t *drive;
+  disk_t *disk;
+  int i;
+
+  disk = malloc(sizeof(disk_t));
+  if (disk == NULL) {
+    return NULL;
+  }
+  store_init(&disk->store);
+  kdi_cache_init(&disk->kdi_cache);
+
+  /* Drive A to D are always present, and what CP/M sees as empty disks. */
+  for (i = 0; i < DISK_DRIVES; i++) {
+    drive = &disk->drive[i];
+    drive->dpb = (i < 4) ? &dpb_types[DPB_TYPE_8_SSSD] : NULL;
+    drive->dpb_fixed = false;
+    drive->track = NULL;
+    drive->kdi_data = NULL;
+    drive->fh = NULL;
+    drive->hostdir = NULL;
+    drive->dir_generation = 0;
+    drive->ram = NULL;
+    drive->ram_file = NULL;
+  }
+  return disk;
+}
+
 
-void disk_init(void)
+
+void disk_destroy(disk_t *disk)
 {
+  disk_drive_t *drive;
+  uint16_t track_no;
   int i;
-  /* Create what CP/M sees as empty disks. */
-  for (i = 0; i < DISKS; i++) {
-    memset(disk[i].data, 0xE5, DISK_SIZE);
+
+  for (i = 0; i < DISK_DRIVES; i++) {
+    drive = &disk->drive[i];
+    if (drive->track != NULL) {
+      for (track_no = 0; track_no < drive->dpb->tracks; track_no++) {
+        free(drive->track[track_no]);
+      }
+      free(drive->track);
+    }
+    free(drive->kdi_data);
+    if (drive->fh != NULL) {
+      fclose(drive->fh);
+    }
+    hostdir_close(drive->hostdir);
+    free(drive->ram);
+    free(drive->ram_file);
   }
+  store_destroy(&disk->store);
+  free(disk);
 }
 
 
 
-int disk_image_load(uint8_t disk_no, const char *filename, bool write_changes)
+static bool disk_record_empty(const uint8_t data[])
 {
-  FILE *fh;
+  int i;
+  for (i = 0; i < DPB_RECORD_SIZE; i++) {
+    if (data[i] != 0xE5) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+
+static int disk_record_store(disk_t *disk, uint8_t disk_no,
+  uint32_t record, const uint8_t data[])
+{
+  disk_drive_t *drive = &disk->drive[disk_no];
+  const dpb_t *dpb = drive->dpb;
+  uint32_t **track = &drive->track[record / dpb->spt];
+  uint32_t id;
+  int i;
+
+  /* Empty sectors are not kept, only the contents of the others. */
+  if (disk_record_empty(data)) {
+    id = STORE_NONE;
+  } else {
+    id = store_insert(&disk->store, data);
+    if (id == STORE_NONE) {
+      return -1;
+    }
+  }
+
+  if (*track == NULL) {
+    if (id == STORE_NONE) {
+      return 0;
+    }
+    *track = malloc(dpb->spt * sizeof(uint32_t));
+    if (*track == NULL) {
+      store_release(&disk->store, id);
+      return -1;
+    }
+    for (i = 0; i < dpb->spt; i++) {
+      (*track)[i] = STORE_NONE;
+    }
+  }
+
+  /* Other sectors sharing the old contents keep their copy. */
+  if ((*track)[record % dpb->spt] != STORE_NONE) {
+    store_release(&disk->store, (*track)[record % dpb->spt]);
+  }
+  (*track)[record % dpb->spt] = id;
+  return 0;
+}
+
+
+
+static int disk_alloc(disk_t *disk, uint8_t disk_no)
+{
+  disk_drive_t *drive = &disk->drive[disk_no];
+  uint8_t record[DPB_RECORD_SIZE];
+  uint16_t track_no, sector_no;
+  const dpb_t *dpb;
+
+  if (drive->track != NULL) {
+    return 0;
+  }
 
-  if (disk_no >= DISKS) {
+  dpb = drive->dpb;
+  drive->track = calloc(dpb->tracks, sizeof(uint32_t *));
+  if (drive->track == NULL) {
     return -1;
   }
 
-  fh = fopen(filename, "rb");
-  if (fh == NULL) {
+  /* Writing to a compressed image expands it. */
+  if (drive->kdi_data != NULL) {
+    for (track_no = 0; track_no < dpb->tracks; track_no++) {
+      for (sector_no = 1; sector_no <= dpb->spt; sector_no++) {
+        if (kdi_sector_read(&drive->kdi, track_no, sector_no,
+          record) != 0) {
+          return -1;
+        }
+        if (disk_record_store(disk, disk_no,
+          ((uint32_t)track_no * dpb->spt) + (sector_no - 1), record) != 0) {
+          return -1;
+        }
+      }
+    }
+    free(drive->kdi_data);
+    drive->kdi_data = NULL;
+  }
+  return 0;
+}
+
+
+
+int disk_type_set(disk_t *disk, uint8_t disk_no, const dpb_t *dpb)
+{
+  disk_drive_t *drive;
+
+  if (disk_no >= DISK_DRIVES) {
     return -1;
   }
-  fread(disk[disk_no].data, sizeof(uint8_t), DISK_SIZE, fh);
-  fclose(fh);
+  drive = &disk->drive[disk_no];
+  if (drive->track != NULL || drive->kdi_data != NULL ||
+    drive->hostdir != NULL || drive->ram != NULL) {
+    return -1; /* Already mounted. */
+  }
+  if (disk_no == 0 && dpb != &dpb_types[DPB_TYPE_8_SSSD]) {
+    return -1; /* The CBIOS boots from drive A. */
+  }
 
-  disk[disk_no].write_changes = write_changes;
-  strncpy(disk[disk_no].filename, filename, PATH_MAX);
+  drive->dpb = dpb;
+  drive->dpb_fixed = true;
   return 0;
 }
 
 
 
-void disk_sys_write(mem_t *mem, uint16_t address, uint16_t size)
+static int disk_hostdir_load(disk_t *disk, uint8_t disk_no,
+  const char *path, bool write_changes)
 {
+  disk_drive_t *drive = &disk->drive[disk_no];
+
+  /* Use the largest geometry unless specified, drive A must boot. */
+  if (! drive->dpb_fixed) {
+    drive->dpb = (disk_no == 0) ? &dpb_types[DPB_TYPE_8_SSSD] :
+      &dpb_types[DPB_TYPE_HD_8MB];
+  }
+
+  drive->hostdir = hostdir_open(path, drive->dpb, write_changes);
+  if (drive->hostdir == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+
+
+static int disk_kdi_load(disk_t *disk, uint8_t disk_no, FILE *fh)
+{
+  disk_drive_t *drive = &disk->drive[disk_no];
+  const dpb_t *dpb;
+  long size;
   int i;
-  for (i = 0; i < DISKS; i++) {
-    /* Skip cold start loader in first sector. */
-    mem_read_area(mem, address, &disk[i].data[DISK_SECTOR_SIZE], size);
+
+  fseek(fh, 0, SEEK_END);
+  size = ftell(fh);
+  fseek(fh, 0, SEEK_SET);
+
+  drive->kdi_data = malloc(size);
+  if (drive->kdi_data == NULL) {
+    return -1;
+  }
+  if (fread(drive->kdi_data, sizeof(uint8_t), size, fh) !=
+    (size_t)size ||
+    kdi_open(&drive->kdi, drive->kdi_data, size, &disk->kdi_cache) != 0) {
+    free(drive->kdi_data);
+    drive->kdi_data = NULL;
+    return -1;
+  }
+
+  /* Geometry is given by the image itself. */
+  dpb = NULL;
+  for (i = 0; i < DPB_TYPES; i++) {
+    if (dpb_types[i].tracks == drive->kdi.tracks &&
+      dpb_types[i].spt == drive->kdi.spt) {
+      dpb = &dpb_types[i];
+      break;
+    }
+  }
+  if (dpb == NULL || (drive->dpb_fixed && dpb != drive->dpb) ||
+    (disk_no == 0 && dpb != &dpb_types[DPB_TYPE_8_SSSD])) {
+    free(drive->kdi_data);
+    drive->kdi_data = NULL;
+    return -1;
   }
+  drive->dpb = dpb;
+  return 0;
 }
 
 
 
-int disk_sector_read(uint8_t disk_no,
-  uint8_t track_no, uint8_t sector_no, mem_t *mem, uint16_t address)
+int disk_image_load(disk_t *disk, uint8_t disk_no, const char *filename,
+  bool write_changes)
 {
-  if (disk_no >= DISKS) {
+  disk_drive_t *drive;
+  FILE *fh;
+  long size;
+  struct stat st;
+  uint8_t magic[KDI_HEADER_SIZE];
+  uint8_t record[DPB_RECORD_SIZE];
+  uint32_t records, n;
+  int i;
+
+  if (disk_no >= DISK_DRIVES) {
     return -1;
   }
-  if (track_no >= DISK_TRACKS) {
+  drive = &disk->drive[disk_no];
+  if (drive->track != NULL || drive->kdi_data != NULL ||
+    drive->hostdir != NULL || drive->ram != NULL) {
     return -1;
   }
-  if (sector_no == 0 || sector_no >= (DISK_SECTORS + 1)) {
+
+  if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode)) {
+    return disk_hostdir_load(disk, disk_no, filename, write_changes);
+  }
+
+  fh = fopen(filename, write_changes ? "r+b" : "rb");
+  if (fh == NULL) {
     return -1;
   }
 
-  mem_write_area(mem, address, &disk[disk_no].data
-    [(track_no * DISK_SECTORS * DISK_SECTOR_SIZE) +
-    ((sector_no - 1) * DISK_SECTOR_SIZE)], DISK_SECTOR_SIZE);
+  /* Compressed images are read only, convert to raw for write back. */
+  size = fread(magic, sizeof(uint8_t), KDI_HEADER_SIZE, fh);
+  fseek(fh, 0, SEEK_SET);
+  if (kdi_detect(magic, size)) {
+    i = (write_changes) ? -1 : disk_kdi_load(disk, disk_no, fh);
+    fclose(fh);
+    return i;
+  }
+
+  /* Select the geometry from the image size unless specified. */
+  if (! drive->dpb_fixed) {
+    fseek(fh, 0, SEEK_END);
+    size = ftell(fh);
+    fseek(fh, 0, SEEK_SET);
+
+    drive->dpb = NULL;
+    for (i = 0; i < DPB_TYPES; i++) {
+      if (size <= (long)dpb_size(&dpb_types[i])) {
+        drive->dpb = &dpb_types[i];
+        break;
+      }
+    }
+    if (drive->dpb == NULL ||
+      (disk_no == 0 && drive->dpb != &dpb_types[DPB_TYPE_8_SSSD])) {
+      fclose(fh);
+      return -1;
+    }
+  }
+
+  if (disk_alloc(disk, disk_no) != 0) {
+    fclose(fh);
+    return -1;
+  }
+
+  size = 0;
+  records = dpb_size(drive->dpb) / DPB_RECORD_SIZE;
+  for (n = 0; n < records; n++) {
+    i = fread(record, sizeof(uint8_t), DPB_RECORD_SIZE, fh);
+    if (i <= 0) {
+      break;
+    }
+    size += i;
+    memset(&record[i], 0xE5, DPB_RECORD_SIZE - i);
+    if (disk_record_store(disk, disk_no, n, record) != 0) {
+      fclose(fh);
+      return -1;
+    }
+  }
+
+  if (write_changes) {
+    /* Extend short images so every sector has a place in the file. */
+    if (size < (long)dpb_size(drive->dpb)) {
+      fseek(fh, size, SEEK_SET);
+      memset(record, 0xE5, DPB_RECORD_SIZE);
+      while (size < (long)dpb_size(drive->dpb)) {
+        i = dpb_size(drive->dpb) - size;
+        if (i > DPB_RECORD_SIZE) {
+          i = DPB_RECORD_SIZE;
+        }
+        fwrite(record, sizeof(uint8_t), i, fh);
+        size += i;
+      }
+      fflush(fh);
+    }
+    drive->fh = fh;
+  } else {
+    fclose(fh);
+  }
 
   return 0;
 }
 
 
 
-int disk_sector_write(uint8_t disk_no,
-  uint8_t track_no, uint8_t sector_no, mem_t *mem, uint16_t address)
+int disk_ram_create(disk_t *disk, uint8_t disk_no, uint32_t size,
+  const char *filename)
 {
+  disk_drive_t *drive;
   FILE *fh;
 
-  if (disk_no >= DISKS) {
+  if (disk_no == 0 || disk_no >= DISK_DRIVES) {
+    return -1; /* The CBIOS boots from drive A. */
+  }
+  drive = &disk->drive[disk_no];
+  if (drive->track != NULL || drive->kdi_data != NULL ||
+    drive->hostdir != NULL || drive->ram != NULL) {
     return -1;
   }
-  if (track_no >= DISK_TRACKS) {
+  if (dpb_ram(&drive->ram_dpb, size) != 0) {
     return -1;
   }
-  if (sector_no == 0 || sector_no >= (DISK_SECTORS + 1)) {
+
+  drive->ram = malloc(size);
+  if (drive->ram == NULL) {
     return -1;
   }
+  memset(drive->ram, 0xE5, size);
+
+  /* Start from the saved contents if there are any. */
+  if (filename != NULL) {
+    drive->ram_file = malloc(strlen(filename) + 1);
+    if (drive->ram_file == NULL) {
+      return -1;
+    }
+    strcpy(drive->ram_file, filename);
+    fh = fopen(filename, "rb");
+    if (fh != NULL) {
+      if (fread(drive->ram, sizeof(uint8_t), size, fh) == 0 &&
+        ferror(fh)) {
+        fclose(fh);
+        return -1;
+      }
+      fclose(fh);
+    }
+  }
+
+  drive->dpb = &drive->ram_dpb;
+  drive->dpb_fixed = true;
+  return 0;
+}
+
+
 
-  mem_read_area(mem, address, &disk[disk_no].data
-    [(track_no * DISK_SECTORS * DISK_SECTOR_SIZE) +
-    ((sector_no - 1) * DISK_SECTOR_SIZE)], DISK_SECTOR_SIZE);
+void disk_ram_save(disk_t *disk)
+{
+  disk_drive_t *drive;
+  FILE *fh;
+  int i;
 
-  if (disk[disk_no].write_changes) {
-    fh = fopen(disk[disk_no].filename, "wb");
+  for (i = 0; i < DISK_DRIVES; i++) {
+    drive = &disk->drive[i];
+    if (drive->ram == NULL || drive->ram_file == NULL) {
+      continue;
+    }
+    fh = fopen(drive->ram_file, "wb");
     if (fh == NULL) {
-      panic("fopen() failed for: %s\n", disk[disk_no].filename);
+      fprintf(stderr, "Error: Failed to save RAM disk %c: %s\n", i + 0x41,
+        drive->ram_file);
+      continue;
+    }
+    if (fwrite(drive->ram, sizeof(uint8_t), dpb_size(drive->dpb), fh) !=
+      dpb_size(drive->dpb)) {
+      fprintf(stderr, "Error: Failed to save RAM disk %c: %s\n", i + 0x41,
+        drive->ram_file);
     }
-    fwrite(disk[disk_no].data, sizeof(uint8_t), DISK_SIZE, fh);
     fclose(fh);
   }
+}
+
+
 
+const dpb_t *disk_dpb(disk_t *disk, uint8_t disk_no)
+{
+  if (disk_no >= DISK_DRIVES) {
+    return NULL;
+  }
+  return disk->drive[disk_no].dpb;
+}
+
+
+
+uint32_t disk_tables_size(disk_t *disk)
+{
+  const dpb_t *dpb[DISK_DRIVES];
+  int i;
+
+  for (i = 0; i < DISK_DRIVES; i++) {
+    dpb[i] = disk->drive[i].dpb;
+  }
+  return dpb_tables_size(dpb);
+}
+
+
+
+static int disk_system(void *context, const uint8_t data[], uint16_t size)
+{
+  disk_t *disk = context;
+  disk_drive_t *drive;
+  uint16_t i, n;
+
+  for (i = 0; i < DISK_DRIVES; i++) {
+    drive = &disk->drive[i];
+    if (drive->dpb != &dpb_types[DPB_TYPE_8_SSSD]) {
+      continue;
+    }
+    if (drive->hostdir != NULL) {
+      for (n = 0; n < size; n += DPB_RECORD_SIZE) {
+        if (hostdir_write(drive->hostdir, (n / DPB_RECORD_SIZE) + 1,
+          &data[n]) != 0) {
+          return -1;
+        }
+      }
+      continue;
+    }
+    /* Only drive A is needed for booting, the others if already present. */
+    if (i != 0 && drive->track == NULL && drive->kdi_data == NULL) {
+      continue;
+    }
+    if (disk_alloc(disk, i) != 0) {
+      return -1;
+    }
+    /* Skip cold start loader in first sector. */
+    for (n = 0; n < size; n += DPB_RECORD_SIZE) {
+      if (disk_record_store(disk, i, (n / DPB_RECORD_SIZE) + 1,
+        &data[n]) != 0) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+
+
+static int disk_sector_offset(disk_t *disk, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint32_t *offset)
+{
+  const dpb_t *dpb;
+
+  if (disk_no >= DISK_DRIVES) {
+    return -1;
+  }
+  dpb = disk->drive[disk_no].dpb;
+  if (dpb == NULL) {
+    return -1;
+  }
+  if (track_no >= dpb->tracks) {
+    return -1;
+  }
+  if (sector_no == 0 || sector_no >= (dpb->spt + 1)) {
+    return -1;
+  }
+
+  *offset = (((uint32_t)track_no * dpb->spt) + (sector_no - 1)) *
+    DPB_RECORD_SIZE;
+  return 0;
+}
+
+
+
+static uint32_t disk_hostdir_record(const dpb_t *dpb, uint16_t track_no,
+  uint8_t sector_no)
+{
+  /* The reserved tracks are kept as they are laid out, the rest of the
+     host directory by logical record, so the skew is undone. */
+  if (track_no < dpb->off) {
+    return ((uint32_t)track_no * dpb->spt) + (sector_no - 1);
+  }
+  return ((uint32_t)track_no * dpb->spt) +
+    dpb_sector_logical(dpb, sector_no);
+}
+
+
+
+static void disk_dir_check(disk_t *disk, uint8_t disk_no, uint16_t track_no,
+  uint8_t sector_no)
+{
+  disk_drive_t *drive = &disk->drive[disk_no];
+  const dpb_t *dpb = drive->dpb;
+  uint32_t record;
+
+  /* Note any write to the directory so cached copies can be dropped. */
+  if (track_no < dpb->off) {
+    return;
+  }
+  record = ((uint32_t)(track_no - dpb->off) * dpb->spt) +
+    dpb_sector_logical(dpb, sector_no);
+  if (record < ((uint32_t)dpb->drm + 1) / 4) {
+    drive->dir_generation++;
+  }
+}
+
+
+
+int disk_record_read(disk_t *disk, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint8_t data[])
+{
+  disk_drive_t *drive;
+  uint32_t offset;
+  uint32_t *track;
+
+  if (disk_sector_offset(disk, disk_no, track_no, sector_no, &offset) != 0) {
+    return -1;
+  }
+  drive = &disk->drive[disk_no];
+
+  if (drive->hostdir != NULL) {
+    return hostdir_read(drive->hostdir,
+      disk_hostdir_record(drive->dpb, track_no, sector_no), data);
+  }
+
+  if (drive->ram != NULL) {
+    memcpy(data, &drive->ram[offset], DPB_RECORD_SIZE);
+    return 0;
+  }
+
+  if (drive->track == NULL) {
+    if (drive->kdi_data != NULL) {
+      return kdi_sector_read(&drive->kdi, track_no, sector_no, data);
+    }
+    /* Nothing written yet, so an empty disk. */
+    memset(data, 0xE5, DPB_RECORD_SIZE);
+    return 0;
+  }
+
+  track = drive->track[track_no];
+  if (track == NULL || track[sector_no - 1] == STORE_NONE) {
+    memset(data, 0xE5, DPB_RECORD_SIZE);
+  } else {
+    memcpy(data, store_data(&disk->store, track[sector_no - 1]),
+      DPB_RECORD_SIZE);
+  }
   return 0;
 }
 
 
 
+int disk_record_write(disk_t *disk, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[])
+{
+  disk_drive_t *drive;
+  uint32_t offset;
+
+  if (disk_sector_offset(disk, disk_no, track_no, sector_no, &offset) != 0) {
+    return -1;
+  }
+  drive = &disk->drive[disk_no];
+  disk_dir_check(disk, disk_no, track_no, sector_no);
+
+  if (drive->hostdir != NULL) {
+    return hostdir_write(drive->hostdir,
+      disk_hostdir_record(drive->dpb, track_no, sector_no), data);
+  }
+
+  if (drive->ram != NULL) {
+    memcpy(&drive->ram[offset], data, DPB_RECORD_SIZE);
+    return 0;
+  }
+
+  if (disk_alloc(disk, disk_no) != 0) {
+    return -1;
+  }
+
+  if (disk_record_store(disk, disk_no, offset / DPB_RECORD_SIZE, data) != 0) {
+    return -1;
+  }
+
+  if (drive->fh != NULL) {
+    /* Only the changed sector is written back. */
+    if (fseek(drive->fh, offset, SEEK_SET) != 0 ||
+      fwrite(data, sizeof(uint8_t), DPB_RECORD_SIZE, drive->fh) !=
+      DPB_RECORD_SIZE) {
+      return -1;
+    }
+    fflush(drive->fh);
+  }
+
+  return 0;
+}
+
+
+
+uint32_t disk_dir_generation(disk_t *disk, uint8_t disk_no)
+{
+  if (disk_no >= DISK_DRIVES) {
+    return 0;
+  }
+  return disk->drive[disk_no].dir_generation;
+}
+
+
+
+static const dpb_t *disk_backend_dpb(void *context, uint8_t disk_no)
+{
+  return disk_dpb(context, disk_no);
+}
+
+
+
+static int disk_backend_read(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint8_t data[])
+{
+  return disk_record_read(context, disk_no, track_no, sector_no, data);
+}
+
+
+
+static int disk_backend_write(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[])
+{
+  return disk_record_write(context, disk_no, track_no, sector_no, data);
+}
+
+
+
+static uint32_t disk_backend_dir_generation(void *context, uint8_t disk_no)
+{
+  return disk_dir_generation(context, disk_no);
+}
+
+
+
+const io_disk_t disk_backend = {
+  disk_backend_dpb,
+  disk_backend_read,
+  disk_backend_write,
+  disk_backend_dir_generation,
+  disk_system,
+};
+
+
+
+void disk_stats_dump(disk_t *disk, FILE *fh)
+{
+  store_dump(&disk->store, fh);
+}
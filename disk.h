@@ -1,9 +1,11 @@
 #ifndef _DISK_H
 #define _DISK_H
 
+#include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
-#include "mem.h"
+#include "dpb.h"
+#include "io.h"
 
 /* IBM 3740 8-inch floppy emulation */
 #define DISK_TRACKS 77
@@ -11,12 +13,29 @@
 #define DISK_SECTOR_SIZE 128
 #define DISK_SIZE (DISK_TRACKS * DISK_SECTORS * DISK_SECTOR_SIZE) /* 256256 */
 
-void disk_init(void);
-int disk_image_load(uint8_t disk_no, const char *filename, bool write_changes);
-void disk_sys_write(mem_t *mem, uint16_t address, uint16_t size);
-int disk_sector_read(uint8_t disk_no,
-  uint8_t track_no, uint8_t sector_no, mem_t *mem, uint16_t address);
-int disk_sector_write(uint8_t disk_no,
-  uint8_t track_no, uint8_t sector_no, mem_t *mem, uint16_t address);
+#define DISK_DRIVES DPB_DRIVES /* A to P */
+
+typedef struct disk_drive_s disk_drive_t;
+typedef struct disk_s disk_t;
+
+/* Disk backend for a machine, with the disk_t as context. */
+extern const io_disk_t disk_backend;
+
+disk_t *disk_create(void);
+void disk_destroy(disk_t *disk);
+int disk_type_set(disk_t *disk, uint8_t disk_no, const dpb_t *dpb);
+int disk_image_load(disk_t *disk, uint8_t disk_no, const char *filename,
+  bool write_changes);
+int disk_ram_create(disk_t *disk, uint8_t disk_no, uint32_t size,
+  const char *filename);
+void disk_ram_save(disk_t *disk);
+const dpb_t *disk_dpb(disk_t *disk, uint8_t disk_no);
+uint32_t disk_tables_size(disk_t *disk);
+int disk_record_read(disk_t *disk, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint8_t data[]);
+int disk_record_write(disk_t *disk, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[]);
+uint32_t disk_dir_generation(disk_t *disk, uint8_t disk_no);
+void disk_stats_dump(disk_t *disk, FILE *fh);
 
 #endif /* _DISK_H */
@@ -3,7 +3,7 @@
 #include <string.h>
 #include "pico/stdlib.h"
 #include "disk.h"
-#include "mem.h"
+#include "kdi.h"
 
 extern uint8_t _binary_cpm22_bin_start[];
 
@@ -16,14 +16,56 @@ extern uint8_t _binary_disk_b_img_end[];
 extern uint8_t _binary_disk_c_img_end[];
 extern uint8_t _binary_disk_d_img_end[];
 
+static kdi_t disk_kdi[4];
+static kdi_cache_t disk_kdi_cache;
 
 
-int disk_sector_read(uint8_t disk_no,
-  uint8_t track_no, uint8_t sector_no, mem_t *mem, uint16_t address)
+
+static const dpb_t *disk_backend_dpb(void *context, uint8_t disk_no)
+{
+  (void)context;
+  /* Only drive A to D as IBM 3740 8-inch floppies. */
+  return (disk_no < 4) ? &dpb_types[DPB_TYPE_8_SSSD] : NULL;
+}
+
+
+
+static int disk_image_read(uint8_t disk_no, const uint8_t *image,
+  uint32_t size, uint16_t track_no, uint8_t sector_no, uint8_t out[])
 {
   uint32_t index;
-  uint32_t disk_size;
 
+  /* Linked image may be in the compressed format. */
+  if (kdi_detect(image, size)) {
+    if (disk_kdi[disk_no].data != image) {
+      if (kdi_open(&disk_kdi[disk_no], image, size,
+        &disk_kdi_cache) != 0) {
+        return -1;
+      }
+    }
+    return kdi_sector_read(&disk_kdi[disk_no], track_no, sector_no, out);
+  }
+
+  index = (track_no * DISK_SECTORS * DISK_SECTOR_SIZE) +
+          ((sector_no - 1) * DISK_SECTOR_SIZE);
+  if (index + DISK_SECTOR_SIZE > size) {
+    /* Return uninitialized bytes on overflow. */
+    memset(out, 0xE5, DISK_SECTOR_SIZE);
+  } else {
+    memcpy(out, &image[index], DISK_SECTOR_SIZE);
+  }
+  return 0;
+}
+
+
+
+static int disk_backend_read(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint8_t data[])
+{
+  const uint8_t *start;
+  const uint8_t *end;
+
+  (void)context;
   if (track_no >= DISK_TRACKS) {
     return -1;
   }
@@ -33,12 +75,12 @@ int disk_sector_read(uint8_t disk_no,
 
   /* Return CP/M copy when reading the disk system sectors. */
   if (track_no == 0 && sector_no >= 2) {
-    mem_write_area(mem, address,
+    memcpy(data,
       &_binary_cpm22_bin_start[(sector_no - 2) * DISK_SECTOR_SIZE],
         DISK_SECTOR_SIZE);
     return 0;
   } else if (track_no == 1) {
-    mem_write_area(mem, address,
+    memcpy(data,
       &_binary_cpm22_bin_start[((DISK_SECTORS - 1) * DISK_SECTOR_SIZE) +
         (sector_no - 1) * DISK_SECTOR_SIZE], DISK_SECTOR_SIZE);
     return 0;
@@ -48,66 +90,36 @@ int disk_sector_read(uint8_t disk_no,
   gpio_put(PICO_DEFAULT_LED_PIN, 1);
 #endif /* PICO_DEFAULT_LED_PIN */
 
-  index = (track_no * DISK_SECTORS * DISK_SECTOR_SIZE) +
-          ((sector_no - 1) * DISK_SECTOR_SIZE);
-
   switch (disk_no) {
   case 0:
-    disk_size = _binary_disk_a_img_end - _binary_disk_a_img_start;
-    if (index + DISK_SECTOR_SIZE > disk_size) {
-      /* Return uninitialized bytes on overflow. */
-      for (int i = 0; i < DISK_SECTOR_SIZE; i++) {
-        mem_write(mem, address + i, 0xE5);
-      }
-    } else {
-      mem_write_area(mem, address,
-        &_binary_disk_a_img_start[index], DISK_SECTOR_SIZE);
-    }
+    start = _binary_disk_a_img_start;
+    end = _binary_disk_a_img_end;
     break;
 
   case 1:
-    disk_size = _binary_disk_b_img_end - _binary_disk_b_img_start;
-    if (index + DISK_SECTOR_SIZE > disk_size) {
-      /* Return uninitialized bytes on overflow. */
-      for (int i = 0; i < DISK_SECTOR_SIZE; i++) {
-        mem_write(mem, address + i, 0xE5);
-      }
-    } else {
-      mem_write_area(mem, address,
-        &_binary_disk_b_img_start[index], DISK_SECTOR_SIZE);
-    }
+    start = _binary_disk_b_img_start;
+    end = _binary_disk_b_img_end;
     break;
 
   case 2:
-    disk_size = _binary_disk_c_img_end - _binary_disk_c_img_start;
-    if (index + DISK_SECTOR_SIZE > disk_size) {
-      /* Return uninitialized bytes on overflow. */
-      for (int i = 0; i < DISK_SECTOR_SIZE; i++) {
-        mem_write(mem, address + i, 0xE5);
-      }
-    } else {
-      mem_write_area(mem, address,
-        &_binary_disk_c_img_start[index], DISK_SECTOR_SIZE);
-    }
+    start = _binary_disk_c_img_start;
+    end = _binary_disk_c_img_end;
     break;
 
   case 3:
-    disk_size = _binary_disk_d_img_end - _binary_disk_d_img_start;
-    if (index + DISK_SECTOR_SIZE > disk_size) {
-      /* Return uninitialized bytes on overflow. */
-      for (int i = 0; i < DISK_SECTOR_SIZE; i++) {
-        mem_write(mem, address + i, 0xE5);
-      }
-    } else {
-      mem_write_area(mem, address,
-        &_binary_disk_d_img_start[index], DISK_SECTOR_SIZE);
-    }
+    start = _binary_disk_d_img_start;
+    end = _binary_disk_d_img_end;
     break;
 
   default:
     return -1;
   }
 
+  if (disk_image_read(disk_no, start, end - start,
+    track_no, sector_no, data) != 0) {
+    return -1;
+  }
+
   /* Only turned off if OK! */
 #ifdef PICO_DEFAULT_LED_PIN
   gpio_put(PICO_DEFAULT_LED_PIN, 0);
@@ -118,17 +130,37 @@ int disk_sector_read(uint8_t disk_no,
 
 
 
-int disk_sector_write(uint8_t disk_no,
-  uint8_t track_no, uint8_t sector_no, mem_t *mem, uint16_t address)
+static int disk_backend_write(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[])
 {
   /* Not supported. */
+  (void)context;
   (void)disk_no;
   (void)track_no;
   (void)sector_no;
-  (void)mem;
-  (void)address;
+  (void)data;
   return 0;
 }
 
 
 
+static uint32_t disk_backend_dir_generation(void *context, uint8_t disk_no)
+{
+  /* Images are read-only, so the directory never changes. */
+  (void)context;
+  (void)disk_no;
+  return 0;
+}
+
+
+
+const io_disk_t disk_backend = {
+  disk_backend_dpb,
+  disk_backend_read,
+  disk_backend_write,
+  disk_backend_dir_generation,
+  NULL, /* System tracks are taken from the linked CP/M binary. */
+};
+
+
+
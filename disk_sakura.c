@@ -3,8 +3,6 @@
 #include <string.h>
 #include <limits.h>
 #include "disk.h"
-#include "mem.h"
-#include "panic.h"
 #include "fat16.h"
 #include "led.h"
 
@@ -12,16 +10,25 @@ extern unsigned char binary_cpm22_bin_start[];
 
 #define DISKS 4
 
-static uint8_t disk_data[DISK_SECTOR_SIZE];
 static int current_disk = -1;
 
 
 
-int disk_sector_read(uint8_t disk_no,
-  uint8_t track_no, uint8_t sector_no, mem_t *mem, uint16_t address)
+static const dpb_t *disk_backend_dpb(void *context, uint8_t disk_no)
+{
+  (void)context;
+  /* Only drive A to D as IBM 3740 8-inch floppies. */
+  return (disk_no < 4) ? &dpb_types[DPB_TYPE_8_SSSD] : NULL;
+}
+
+
+
+static int disk_backend_read(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint8_t data[])
 {
   char *file = NULL;
 
+  (void)context;
   if (track_no >= DISK_TRACKS) {
     return -1;
   }
@@ -31,12 +38,12 @@ int disk_sector_read(uint8_t disk_no,
 
   /* Return CP/M copy when reading the disk system sectors. */
   if (track_no == 0 && sector_no >= 2) {
-    mem_write_area(mem, address,
+    memcpy(data,
       &binary_cpm22_bin_start[(sector_no - 2) * DISK_SECTOR_SIZE],
         DISK_SECTOR_SIZE);
     return 0;
   } else if (track_no == 1) {
-    mem_write_area(mem, address,
+    memcpy(data,
       &binary_cpm22_bin_start[((DISK_SECTORS - 1) * DISK_SECTOR_SIZE) +
         (sector_no - 1) * DISK_SECTOR_SIZE], DISK_SECTOR_SIZE);
     return 0;
@@ -72,16 +79,14 @@ int disk_sector_read(uint8_t disk_no,
   if (fat16_read(file,
     (track_no * DISK_SECTORS * DISK_SECTOR_SIZE) +
     ((sector_no - 1) * DISK_SECTOR_SIZE),
-    disk_data, DISK_SECTOR_SIZE) != 0) {
+    data, DISK_SECTOR_SIZE) != 0) {
 
     /* In case of any error, return uninitialized bytes. */
     for (int i = 0; i < DISK_SECTOR_SIZE; i++) {
-      disk_data[i] = 0xE5;
+      data[i] = 0xE5;
     }
   }
 
-  mem_write_area(mem, address, disk_data, DISK_SECTOR_SIZE);
-
   switch (disk_no) {
   case 0:
     led_d1_command(LED_OFF);
@@ -104,17 +109,37 @@ int disk_sector_read(uint8_t disk_no,
 
 
 
-int disk_sector_write(uint8_t disk_no,
-  uint8_t track_no, uint8_t sector_no, mem_t *mem, uint16_t address)
+static int disk_backend_write(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[])
 {
   /* Not supported. */
+  (void)context;
   (void)disk_no;
   (void)track_no;
   (void)sector_no;
-  (void)mem;
-  (void)address;
+  (void)data;
+  return 0;
+}
+
+
+
+static uint32_t disk_backend_dir_generation(void *context, uint8_t disk_no)
+{
+  /* Images are read-only, so the directory never changes. */
+  (void)context;
+  (void)disk_no;
   return 0;
 }
 
 
 
+const io_disk_t disk_backend = {
+  disk_backend_dpb,
+  disk_backend_read,
+  disk_backend_write,
+  disk_backend_dir_generation,
+  NULL, /* System tracks are taken from the linked CP/M binary. */
+};
+
+
+
@@ -0,0 +1,234 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "dpb.h"
+#include "mem.h"
+
+#define DPB_DPH_SIZE 16
+#define DPB_DPB_SIZE 15
+
+const dpb_t dpb_types[DPB_TYPES] = {
+  /* name    trk  spt bsh  blm exm  dsm   drm  al0   al1 cks off skew */
+  {"sssd",    77,  26,  3,   7,  0, 242,   63, 0xC0, 0x00, 16,  2, true},
+  {"dsdd",    80,  40,  4,  15,  1, 196,   63, 0x80, 0x00, 16,  1, false},
+  {"hd",     512, 128,  7, 127,  7, 511, 1023, 0xC0, 0x00,  0,  0, false},
+};
+
+/* IBM 3740 standard 6:1 skew. */
+static const uint8_t dpb_trans[26] = {
+   1,  7, 13, 19, 25,  5, 11, 17, 23,  3,  9, 15, 21,
+   2,  8, 14, 20, 26,  6, 12, 18, 24,  4, 10, 16, 22};
+
+
+
+const dpb_t *dpb_find(const char *name)
+{
+  int i;
+  for (i = 0; i < DPB_TYPES; i++) {
+    if (strcmp(dpb_types[i].name, name) == 0) {
+      return &dpb_types[i];
+    }
+  }
+  return NULL;
+}
+
+
+
+uint32_t dpb_size(const dpb_t *dpb)
+{
+  return (uint32_t)dpb->tracks * dpb->spt * DPB_RECORD_SIZE;
+}
+
+
+
+int dpb_ram(dpb_t *dpb, uint32_t size)
+{
+  /* RAM disk of 'size' bytes: 16K tracks, no reserved tracks and no check
+     vector. Block size is the smallest that keeps DSM within 511, so the
+     allocation vector stays as small as for the hard disk type. */
+  uint32_t block_size, blocks, dir_blocks;
+  uint16_t al;
+
+  if (size < DPB_RAM_SIZE_MIN || size > DPB_RAM_SIZE_MAX ||
+    (size % DPB_RAM_TRACK_SIZE) != 0) {
+    return -1;
+  }
+
+  dpb->name = "ram";
+  dpb->tracks = size / DPB_RAM_TRACK_SIZE;
+  dpb->spt = DPB_RAM_TRACK_SIZE / DPB_RECORD_SIZE;
+  dpb->bsh = 3;
+  block_size = 1024;
+  while ((size / block_size) > ((block_size == 1024) ? 256 : 512)) {
+    dpb->bsh++;
+    block_size *= 2;
+  }
+  blocks = size / block_size;
+  dpb->blm = (1 << dpb->bsh) - 1;
+  dpb->exm = (blocks > 256) ? (block_size / 2048) - 1 : (block_size / 1024) - 1;
+  dpb->dsm = blocks - 1;
+  dpb->drm = ((blocks > 256) ? 256 : 64) - 1;
+  if ((uint32_t)(dpb->drm + 1) * 32 < block_size) {
+    dpb->drm = (block_size / 32) - 1; /* Fill at least one block. */
+  }
+
+  dir_blocks = (((uint32_t)dpb->drm + 1) * 32) / block_size;
+  al = ~(0xFFFF >> dir_blocks);
+  dpb->al0 = al >> 8;
+  dpb->al1 = al & 0xFF;
+  dpb->cks = 0;
+  dpb->off = 0;
+  dpb->skew = false;
+  return 0;
+}
+
+
+
+uint16_t dpb_sectran(const dpb_t *dpb, uint16_t sector)
+{
+  return (dpb->skew) ? dpb_trans[sector] : sector + 1;
+}
+
+
+
+uint16_t dpb_sector_logical(const dpb_t *dpb, uint16_t sector)
+{
+  uint16_t i;
+
+  if (dpb->skew) {
+    for (i = 0; i < sizeof(dpb_trans); i++) {
+      if (dpb_trans[i] == sector) {
+        return i;
+      }
+    }
+  }
+  return sector - 1;
+}
+
+
+
+static void dpb_write_word(mem_t *mem, uint16_t address, uint16_t value)
+{
+  mem_write(mem, address,     value & 0xFF);
+  mem_write(mem, address + 1, value >> 8);
+}
+
+
+
+static void dpb_write_dpb(mem_t *mem, uint16_t address, const dpb_t *dpb)
+{
+  dpb_write_word(mem, address,      dpb->spt);
+  mem_write     (mem, address + 2,  dpb->bsh);
+  mem_write     (mem, address + 3,  dpb->blm);
+  mem_write     (mem, address + 4,  dpb->exm);
+  dpb_write_word(mem, address + 5,  dpb->dsm);
+  dpb_write_word(mem, address + 7,  dpb->drm);
+  mem_write     (mem, address + 9,  dpb->al0);
+  mem_write     (mem, address + 10, dpb->al1);
+  dpb_write_word(mem, address + 11, dpb->cks);
+  dpb_write_word(mem, address + 13, dpb->off);
+}
+
+
+
+uint32_t dpb_tables_size(const dpb_t *dpb[DPB_DRIVES])
+{
+  /* Size of the tables as laid out by dpb_setup(). */
+  uint32_t size;
+  int i, j;
+
+  size = (DPB_DRIVES * DPB_DPH_SIZE) + DPB_RECORD_SIZE + sizeof(dpb_trans);
+  for (i = 0; i < DPB_DRIVES; i++) {
+    if (dpb[i] == NULL) {
+      continue;
+    }
+    for (j = 0; j < i; j++) {
+      if (dpb[j] == dpb[i]) {
+        break;
+      }
+    }
+    if (j == i) {
+      size += DPB_DPB_SIZE;
+    }
+    size += dpb[i]->cks + (dpb[i]->dsm / 8) + 1;
+  }
+  return size;
+}
+
+
+
+int dpb_setup(mem_t *mem, uint16_t address, const dpb_t *dpb[DPB_DRIVES])
+{
+  /* Layout: DPH for all drives, directory buffer, translate vector,
+     one DPB for each distinct type in use, then check and allocation
+     vectors. Drives sharing a DPB share its address. */
+  uint32_t next;
+  uint16_t dirbf, trans, vectors, xlt, dpb_address[DPB_DRIVES];
+  uint16_t csv, alv;
+  int i, j;
+
+  dirbf = address + (DPB_DRIVES * DPB_DPH_SIZE);
+  next = dirbf + DPB_RECORD_SIZE;
+
+  trans = next;
+  next += sizeof(dpb_trans);
+
+  for (i = 0; i < DPB_DRIVES; i++) {
+    dpb_address[i] = 0;
+    if (dpb[i] == NULL) {
+      continue;
+    }
+    for (j = 0; j < i; j++) {
+      if (dpb[j] == dpb[i]) {
+        dpb_address[i] = dpb_address[j];
+        break;
+      }
+    }
+    if (dpb_address[i] == 0) {
+      dpb_address[i] = next;
+      next += DPB_DPB_SIZE;
+    }
+  }
+
+  vectors = next;
+  if ((uint32_t)address + dpb_tables_size(dpb) > UINT16_MAX + 1) {
+    return -1; /* Does not fit below the top of memory. */
+  }
+
+  /* Tables fit, so fill them in. */
+  for (i = 0; i < (int)sizeof(dpb_trans); i++) {
+    mem_write(mem, trans + i, dpb_trans[i]);
+  }
+  for (i = 0; i < DPB_DRIVES; i++) {
+    if (dpb[i] != NULL) {
+      dpb_write_dpb(mem, dpb_address[i], dpb[i]);
+    }
+  }
+
+  next = vectors;
+  for (i = 0; i < DPB_DRIVES; i++) {
+    for (j = 0; j < DPB_DPH_SIZE; j++) {
+      mem_write(mem, address + (i * DPB_DPH_SIZE) + j, 0x00);
+    }
+    if (dpb[i] == NULL) {
+      continue;
+    }
+
+    csv = next;
+    next += dpb[i]->cks;
+    alv = next;
+    next += (dpb[i]->dsm / 8) + 1;
+    xlt = (dpb[i]->skew) ? trans : 0;
+
+    dpb_write_word(mem, address + (i * DPB_DPH_SIZE),      xlt);
+    dpb_write_word(mem, address + (i * DPB_DPH_SIZE) + 8,  dirbf);
+    dpb_write_word(mem, address + (i * DPB_DPH_SIZE) + 10, dpb_address[i]);
+    dpb_write_word(mem, address + (i * DPB_DPH_SIZE) + 12, csv);
+    dpb_write_word(mem, address + (i * DPB_DPH_SIZE) + 14, alv);
+  }
+
+  return 0;
+}
+
+
+
@@ -0,0 +1,53 @@
+#ifndef _DPB_H
+#define _DPB_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mem.h"
+
+#define DPB_DRIVES 16
+#define DPB_RECORD_SIZE 128
+
+/* The disk tables are filled in from 'dpbase' in the CBIOS up to the top
+   of memory, which is room for A and about 10 hard disk drives. */
+#define DPB_TABLES_ADDRESS 0xFB86
+#define DPB_TABLES_SIZE_MAX (UINT16_MAX + 1 - DPB_TABLES_ADDRESS)
+
+#define DPB_RAM_TRACK_SIZE 16384
+#define DPB_RAM_SIZE_MIN (4 * DPB_RAM_TRACK_SIZE)
+#define DPB_RAM_SIZE_MAX (512 * DPB_RAM_TRACK_SIZE) /* 8MB */
+
+typedef enum {
+  DPB_TYPE_8_SSSD,      /* IBM 3740 8-inch, 77 tracks * 26 sectors */
+  DPB_TYPE_KAYPRO_DSDD, /* Kaypro 5.25-inch DSDD, 80 tracks * 40 records */
+  DPB_TYPE_HD_8MB,      /* 8MB hard disk, 512 tracks * 128 records */
+  DPB_TYPES,
+} dpb_type_t;
+
+typedef struct dpb_s {
+  const char *name;
+  uint16_t tracks;
+  uint16_t spt; /* Sectors (records) per track */
+  uint8_t bsh;  /* Block shift factor */
+  uint8_t blm;  /* Block mask */
+  uint8_t exm;  /* Extent mask */
+  uint16_t dsm; /* Disk size - 1 in blocks */
+  uint16_t drm; /* Directory entries - 1 */
+  uint8_t al0;  /* Directory allocation 0 */
+  uint8_t al1;  /* Directory allocation 1 */
+  uint16_t cks; /* Check vector size */
+  uint16_t off; /* Reserved tracks */
+  bool skew;    /* Use the 8-inch 6:1 sector translate vector */
+} dpb_t;
+
+extern const dpb_t dpb_types[DPB_TYPES];
+
+const dpb_t *dpb_find(const char *name);
+uint32_t dpb_size(const dpb_t *dpb);
+int dpb_ram(dpb_t *dpb, uint32_t size);
+uint16_t dpb_sectran(const dpb_t *dpb, uint16_t sector);
+uint16_t dpb_sector_logical(const dpb_t *dpb, uint16_t sector);
+uint32_t dpb_tables_size(const dpb_t *dpb[DPB_DRIVES]);
+int dpb_setup(mem_t *mem, uint16_t address, const dpb_t *dpb[DPB_DRIVES]);
+
+#endif /* _DPB_H */
@@ -0,0 +1,494 @@
+/* Processes need more than the base POSIX definitions. */
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <getopt.h>
+
+#include "kaytil.h"
+#include "disk.h"
+#include "batch.h"
+#include "panic.h"
+
+/* Fork server for short batch jobs. A machine is booted once, up to where
+   it first wants a key the boot script does not give, normally the CCP
+   prompt. Then each request line read from the control pipe is a job:
+
+     NAME SCRIPT [WHEN]...
+
+   where WHEN is an exit condition as for the emulator -e option. A child
+   process is forked for the job, which goes on from the booted machine
+   with the job script, sharing the memory and disks of the parent copy on
+   write. So a job starts without loading or booting anything. The output
+   seen during the boot is kept for the script, and a result line is
+   written by the child when its job is done. */
+
+#define DEFAULT_CPM22_LOCATION "cpm22.bin"
+#define DEFAULT_CBIOS_LOCATION "cbios.bin"
+
+#define FORKSERVER_CHILDREN_MAX 256
+#define FORKSERVER_LINE_MAX 1024
+#define FORKSERVER_TOKENS_MAX 32
+#define FORKSERVER_BOOT_TIMEOUT "timeout:60"
+#define FORKSERVER_RESULT_SETUP -1 /* Job could not be started. */
+
+typedef struct forkserver_job_s {
+  char line[FORKSERVER_LINE_MAX + 1]; /* Tokens point into it. */
+  const char *name;
+  const char *script;
+  const char *token[FORKSERVER_TOKENS_MAX];
+  int tokens;
+  struct timeval start;
+} forkserver_job_t;
+
+static uint8_t forkserver_cpm22[KAYTIL_CBIOS_ADDRESS - KAYTIL_CPM22_ADDRESS];
+static uint8_t forkserver_cbios[UINT16_MAX + 1 - KAYTIL_CBIOS_ADDRESS];
+static const char *forkserver_image[DISK_DRIVES];
+
+static kaytil_machine_t *forkserver_machine = NULL;
+static disk_t *forkserver_disk = NULL;
+static batch_t forkserver_batch;
+static uint64_t forkserver_boot_instructions = 0;
+static const char *forkserver_log_dir = NULL;
+
+static int forkserver_children = 0;
+static uint32_t forkserver_jobs = 0;
+static uint32_t forkserver_failed = 0;
+static double forkserver_fork_seconds = 0;
+
+
+
+static double forkserver_elapsed(const struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) +
+    ((now.tv_usec - since->tv_usec) / 1000000.0);
+}
+
+
+
+static int forkserver_binary_load(const char *filename, uint8_t data[],
+  uint16_t max, uint16_t *size)
+{
+  FILE *fh;
+  size_t n;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return -1;
+  }
+  n = fread(data, sizeof(uint8_t), max, fh);
+  fclose(fh);
+  if (n == 0) {
+    return -1;
+  }
+  *size = n;
+  return 0;
+}
+
+
+
+static int forkserver_boot(const char *cpm22_location,
+  const char *cbios_location, const char *script, bool native_bdos)
+{
+  kaytil_config_t config;
+  int i, result;
+
+  memset(&config, 0, sizeof(kaytil_config_t));
+  if (forkserver_binary_load(cpm22_location, forkserver_cpm22,
+    sizeof(forkserver_cpm22), &config.cpm22_size) != 0) {
+    fprintf(stderr, "Error: Failed to load CP/M 2.2 binary!\n");
+    return -1;
+  }
+  if (forkserver_binary_load(cbios_location, forkserver_cbios,
+    sizeof(forkserver_cbios), &config.cbios_size) != 0) {
+    fprintf(stderr, "Error: Failed to load CBIOS binary!\n");
+    return -1;
+  }
+
+  forkserver_disk = disk_create();
+  if (forkserver_disk == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    return -1;
+  }
+  for (i = 0; i < DISK_DRIVES; i++) {
+    if (forkserver_image[i] != NULL &&
+      disk_image_load(forkserver_disk, i, forkserver_image[i], false) != 0) {
+      fprintf(stderr, "Error: Failed to load disk image '%s'\n",
+        forkserver_image[i]);
+      return -1;
+    }
+  }
+  if (disk_tables_size(forkserver_disk) > DPB_TABLES_SIZE_MAX) {
+    fprintf(stderr, "Error: Disk tables need %lu bytes, only %d fit in CBIOS "
+      "memory\n", (unsigned long)disk_tables_size(forkserver_disk), DPB_TABLES_SIZE_MAX);
+    return -1;
+  }
+
+  batch_init(&forkserver_batch);
+  batch_output_open(&forkserver_batch, NULL);
+  batch_exit_add(&forkserver_batch, "prompt");
+  batch_exit_add(&forkserver_batch, FORKSERVER_BOOT_TIMEOUT);
+  if (script != NULL && batch_script_load(&forkserver_batch, script) != 0) {
+    fprintf(stderr, "Error: Failed to load boot script: %s\n", script);
+    return -1;
+  }
+
+  config.cpm22 = forkserver_cpm22;
+  config.cbios = forkserver_cbios;
+  config.console = &batch_backend;
+  config.console_context = &forkserver_batch;
+  config.disk = &disk_backend;
+  config.disk_context = forkserver_disk;
+  config.native_bdos = native_bdos;
+  config.banks = 1;
+  forkserver_machine = kaytil_create(&config);
+  if (forkserver_machine == NULL) {
+    fprintf(stderr, "Error: Failed to create machine!\n");
+    return -1;
+  }
+
+  /* Done at the prompt, or waiting for a key elsewhere after the script. */
+  result = batch_run(&forkserver_batch, forkserver_machine);
+  if (result != BATCH_EXIT_DONE && result != BATCH_EXIT_INPUT) {
+    fprintf(stderr, "Error: Boot failed with exit code %d\n", result);
+    if (result == BATCH_EXIT_ERROR) {
+      fprintf(stderr, "%s", kaytil_error(forkserver_machine));
+    }
+    return -1;
+  }
+  forkserver_boot_instructions = kaytil_instructions(forkserver_machine);
+  return 0;
+}
+
+
+
+static int forkserver_job_parse(forkserver_job_t *job)
+{
+  char *token;
+
+  job->tokens = 0;
+  job->name = strtok(job->line, " \t");
+  job->script = strtok(NULL, " \t");
+  while ((token = strtok(NULL, " \t")) != NULL) {
+    if (job->tokens >= FORKSERVER_TOKENS_MAX) {
+      break;
+    }
+    job->token[job->tokens++] = token;
+  }
+  return (job->script == NULL || token != NULL) ? -1 : 0;
+}
+
+
+
+static int forkserver_job_setup(forkserver_job_t *job, char error[])
+{
+  char log[FORKSERVER_LINE_MAX];
+  int i;
+
+  batch_reset(&forkserver_batch);
+  if (forkserver_log_dir != NULL) {
+    snprintf(log, sizeof(log), "%s/%s.log", forkserver_log_dir, job->name);
+  }
+  if (batch_output_open(&forkserver_batch,
+    (forkserver_log_dir != NULL) ? log : NULL) != 0) {
+    snprintf(error, PANIC_MESSAGE_SIZE, "Unable to open log file");
+    return -1;
+  }
+  if (batch_script_load(&forkserver_batch, job->script) != 0) {
+    snprintf(error, PANIC_MESSAGE_SIZE, "Failed to load script '%s'",
+      job->script);
+    return -1;
+  }
+  for (i = 0; i < job->tokens; i++) {
+    if (batch_exit_add(&forkserver_batch, job->token[i]) != 0) {
+      snprintf(error, PANIC_MESSAGE_SIZE, "Invalid option '%s'",
+        job->token[i]);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+static void forkserver_child(forkserver_job_t *job)
+{
+  char error[PANIC_MESSAGE_SIZE];
+  char line[FORKSERVER_LINE_MAX + PANIC_MESSAGE_SIZE];
+  uint64_t instructions = 0;
+  int result = FORKSERVER_RESULT_SETUP;
+  int len;
+
+  error[0] = '\0';
+  if (forkserver_job_setup(job, error) == 0) {
+    result = batch_run(&forkserver_batch, forkserver_machine);
+    if (result == BATCH_EXIT_ERROR) {
+      snprintf(error, sizeof(error), "%s", kaytil_error(forkserver_machine));
+      error[strcspn(error, "\n")] = '\0';
+    }
+    instructions = kaytil_instructions(forkserver_machine) -
+      forkserver_boot_instructions;
+  }
+  batch_destroy(&forkserver_batch);
+
+  /* One write, so lines from children running at once are not mixed. */
+  len = snprintf(line, sizeof(line), "%s %d %llu %.3f%s%s\n", job->name,
+    result, (unsigned long long)instructions, forkserver_elapsed(&job->start),
+    (error[0] != '\0') ? " " : "", error);
+  if (len > (int)sizeof(line) - 1) {
+    len = sizeof(line) - 1;
+  }
+  if (write(STDOUT_FILENO, line, len) != len) {
+    result = FORKSERVER_RESULT_SETUP;
+  }
+  _exit(result & 0xFF);
+}
+
+
+
+static void forkserver_reap(bool wait)
+{
+  pid_t pid;
+  int status;
+
+  while (forkserver_children > 0) {
+    pid = waitpid(-1, &status, wait ? 0 : WNOHANG);
+    if (pid == -1 && errno == EINTR) {
+      continue;
+    }
+    if (pid <= 0) {
+      break;
+    }
+    forkserver_children--;
+    if (! WIFEXITED(status) || WEXITSTATUS(status) != BATCH_EXIT_DONE) {
+      forkserver_failed++;
+    }
+    wait = false; /* One is enough. */
+  }
+}
+
+
+
+static void forkserver_serve(FILE *fh, int children_max)
+{
+  forkserver_job_t job;
+  struct timeval forked;
+  size_t len;
+  pid_t pid;
+
+  while (fgets(job.line, sizeof(job.line), fh) != NULL) {
+    gettimeofday(&job.start, NULL);
+    len = strlen(job.line);
+    if (len >= FORKSERVER_LINE_MAX) {
+      fprintf(stderr, "Error: Request line too long\n");
+      while (len > 0 && job.line[len - 1] != '\n' &&
+        fgets(job.line, sizeof(job.line), fh) != NULL) {
+        len = strlen(job.line); /* Skip the rest of it. */
+      }
+      continue;
+    }
+    while (len > 0 &&
+      (job.line[len - 1] == '\n' || job.line[len - 1] == '\r')) {
+      job.line[--len] = '\0';
+    }
+    len = strspn(job.line, " \t");
+    if (job.line[len] == '\0' || job.line[len] == '#') {
+      continue;
+    }
+    if (forkserver_job_parse(&job) != 0) {
+      fprintf(stderr, "Error: Invalid request\n");
+      continue;
+    }
+
+    forkserver_reap(forkserver_children >= children_max);
+    fflush(NULL);
+    gettimeofday(&forked, NULL);
+    pid = fork();
+    if (pid == 0) {
+      forkserver_child(&job);
+    }
+    if (pid == -1) {
+      fprintf(stderr, "Error: fork() failed with errno: %d\n", errno);
+      forkserver_failed++;
+    } else {
+      forkserver_fork_seconds += forkserver_elapsed(&forked);
+      forkserver_children++;
+    }
+    forkserver_jobs++;
+  }
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stderr, "Usage: %s <options>\n", progname);
+  fprintf(stderr, "Options:\n"
+     "  -C FIFO    Read requests from FIFO, reopened when the writers close\n"
+     "  -B SCRIPT  Boot with the batch SCRIPT before serving requests\n"
+     "  -j JOBS    Run up to JOBS at once instead of one per CPU\n"
+     "  -o DIR     Write the console output of each job to DIR/NAME.log\n"
+     "  -a IMAGE   Load disk IMAGE in drive A\n"
+     "  -b IMAGE   Load disk IMAGE in drive B\n"
+     "  -c IMAGE   Load disk IMAGE in drive C\n"
+     "  -d IMAGE   Load disk IMAGE in drive D\n"
+     "  -i X:IMAGE Load disk IMAGE in drive X (A to P)\n"
+     "  -n         Use native BDOS functions for speed\n"
+     "  -m FILE    Load CP/M 2.2 binary from FILE instead of '%s'\n"
+     "  -s FILE    Load CBIOS binary from FILE instead of '%s'\n"
+     "\n"
+     "The machine is booted until it wants a key that the boot script does\n"
+     "not give, usually the CCP prompt. Each request line from stdin (or\n"
+     "FIFO) is then a job: NAME SCRIPT [WHEN]... where SCRIPT is a batch\n"
+     "script and WHEN an exit condition, as for the emulator -X and -e\n"
+     "options. The job is run by a child process going on from the booted\n"
+     "machine, which writes the line 'NAME EXIT INSTRUCTIONS SECONDS\n"
+     "[ERROR]' when done. Images are never written back.\n"
+     "\n",
+     DEFAULT_CPM22_LOCATION,
+     DEFAULT_CBIOS_LOCATION);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  int c;
+  const char *cpm22_location = DEFAULT_CPM22_LOCATION;
+  const char *cbios_location = DEFAULT_CBIOS_LOCATION;
+  const char *control = NULL;
+  const char *boot_script = NULL;
+  bool native_bdos = false;
+  int children_max;
+  struct timeval start;
+  double seconds;
+  FILE *fh;
+
+  children_max = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((c = getopt(argc, argv, "C:B:j:o:a:b:c:d:i:nm:s:h")) != -1) {
+    switch (c) {
+    case 'C':
+      control = optarg;
+      break;
+
+    case 'B':
+      boot_script = optarg;
+      break;
+
+    case 'j':
+      children_max = atoi(optarg);
+      if (children_max < 1 || children_max > FORKSERVER_CHILDREN_MAX) {
+        fprintf(stderr, "Error: Invalid number of jobs: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'o':
+      forkserver_log_dir = optarg;
+      break;
+
+    case 'a':
+    case 'b':
+    case 'c':
+    case 'd':
+      forkserver_image[c - 0x61] = optarg;
+      break;
+
+    case 'i':
+      if (optarg[0] >= 'a' && optarg[0] <= 'p' && optarg[1] == ':') {
+        forkserver_image[optarg[0] - 0x61] = &optarg[2];
+      } else if (optarg[0] >= 'A' && optarg[0] <= 'P' && optarg[1] == ':') {
+        forkserver_image[optarg[0] - 0x41] = &optarg[2];
+      } else {
+        fprintf(stderr, "Error: Invalid drive specification: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'n':
+      native_bdos = true;
+      break;
+
+    case 'm':
+      cpm22_location = optarg;
+      break;
+
+    case 's':
+      cbios_location = optarg;
+      break;
+
+    case 'h':
+      display_help(argv[0]);
+      return EXIT_SUCCESS;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc != optind) {
+    display_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (children_max < 1) {
+    children_max = 1;
+  } else if (children_max > FORKSERVER_CHILDREN_MAX) {
+    children_max = FORKSERVER_CHILDREN_MAX;
+  }
+
+  if (forkserver_boot(cpm22_location, cbios_location, boot_script,
+    native_bdos) != 0) {
+    return EXIT_FAILURE;
+  }
+
+  gettimeofday(&start, NULL);
+  if (control == NULL) {
+    forkserver_serve(stdin, children_max);
+  } else {
+    /* Serves until killed. */
+    signal(SIGPIPE, SIG_IGN);
+    while (1) {
+      fh = fopen(control, "r");
+      if (fh == NULL) {
+        fprintf(stderr, "Error: Unable to open '%s'\n", control);
+        return EXIT_FAILURE;
+      }
+      forkserver_serve(fh, children_max);
+      fclose(fh);
+    }
+  }
+  while (forkserver_children > 0) {
+    forkserver_reap(true);
+  }
+  seconds = forkserver_elapsed(&start);
+  if (seconds <= 0) {
+    seconds = 0.000001;
+  }
+
+  fprintf(stderr, "Jobs: %u, %u failed\n", forkserver_jobs,
+    forkserver_failed);
+  fprintf(stderr, "Fork: %.3f ms average\n", (forkserver_jobs > 0) ?
+    forkserver_fork_seconds * 1000.0 / forkserver_jobs : 0.0);
+  fprintf(stderr, "Time: %.3fs\n", seconds);
+  fprintf(stderr, "Throughput: %.2f jobs/s\n", forkserver_jobs / seconds);
+
+  kaytil_destroy(forkserver_machine);
+  batch_destroy(&forkserver_batch);
+  disk_destroy(forkserver_disk);
+  return (forkserver_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,1195 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "kaytil.h"
+#include "disk.h"
+#include "dpb.h"
+#include "batch.h"
+#include "sha256.h"
+
+/* Snapshot fuzzing of CP/M programs. The machine is booted once, up to
+   where it first wants a key the boot script does not give, and a
+   snapshot is taken there. Each case then goes on from the snapshot: the
+   memory pages the case before wrote are put back, and disk writes go to
+   an overlay that is dropped. The input is typed as keys after the case
+   script, or put on a drive as a file before it. A case runs until back
+   at the CCP prompt, until it wants more keys, or until the instruction
+   budget is used up. Emulation errors, such as a HALT or a read of an
+   unknown port, are the findings.
+
+   Built with FUZZ_LIBFUZZER this is a libFuzzer target instead, taking its
+   options from the KAYTIL_FUZZ environment variable, and counting the
+   guest edges in the libFuzzer extra counters. Findings then abort, so
+   libFuzzer keeps the input. */
+
+#define DEFAULT_CPM22_LOCATION "cpm22.bin"
+#define DEFAULT_CBIOS_LOCATION "cbios.bin"
+
+#define FUZZ_MAP_SIZE 65536 /* Power of two */
+#define FUZZ_BUDGET "instructions:10000000"
+#define FUZZ_BOOT_TIMEOUT "timeout:60"
+#define FUZZ_INPUT_MAX 65536
+#define FUZZ_MUTATED_MAX 4096 /* Mutations grow cases up to this. */
+#define FUZZ_CORPUS_MAX 4096
+#define FUZZ_EXITS_MAX 8
+#define FUZZ_FINDINGS_MAX 256 /* Messages kept to tell new ones. */
+#define FUZZ_OPTIONS_MAX 64
+#define FUZZ_OVERLAY_BUCKETS 1024 /* Power of two */
+#define FUZZ_NAME_SIZE 11
+#define FUZZ_PATH_MAX 1024
+#define FUZZ_CASE_SKIPPED -1 /* Input does not fit on the drive. */
+
+typedef struct fuzz_record_s {
+  uint8_t disk_no;
+  uint8_t sector_no;
+  uint16_t track_no;
+  int32_t next; /* In the same bucket, -1 for none. */
+  uint8_t data[DPB_RECORD_SIZE];
+} fuzz_record_t;
+
+typedef struct fuzz_case_s {
+  uint8_t *data;
+  size_t size;
+} fuzz_case_t;
+
+static uint8_t fuzz_cpm22[KAYTIL_CBIOS_ADDRESS - KAYTIL_CPM22_ADDRESS];
+static uint8_t fuzz_cbios[UINT16_MAX + 1 - KAYTIL_CBIOS_ADDRESS];
+static const char *fuzz_image[DISK_DRIVES];
+static const char *fuzz_cpm22_location = DEFAULT_CPM22_LOCATION;
+static const char *fuzz_cbios_location = DEFAULT_CBIOS_LOCATION;
+static const char *fuzz_boot_script = NULL;
+static const char *fuzz_case_script = NULL;
+static const char *fuzz_output_dir = NULL;
+static const char *fuzz_exit[FUZZ_EXITS_MAX];
+static int fuzz_exits = 0;
+static bool fuzz_native_bdos = false;
+static bool fuzz_verbose = false;
+static unsigned long fuzz_runs = 0; /* Mutated, without libFuzzer. */
+
+static kaytil_machine_t *fuzz_machine = NULL;
+static kaytil_snapshot_t *fuzz_snapshot = NULL;
+static disk_t *fuzz_disk = NULL;
+static batch_t fuzz_batch;
+static uint8_t fuzz_tail[BATCH_TEXT_MAX]; /* Output when booted. */
+static uint32_t fuzz_written;
+
+/* Disk records written by the current case, on top of the disks. */
+static bool fuzz_overlay = false; /* Set once booted. */
+static fuzz_record_t *fuzz_record = NULL;
+static uint32_t fuzz_records = 0;
+static uint32_t fuzz_records_max = 0;
+static int32_t fuzz_bucket[FUZZ_OVERLAY_BUCKETS];
+static uint32_t fuzz_generation[DISK_DRIVES];
+
+/* Drive and name of the input as a file, with what is free there. */
+static int fuzz_file_drive = -1;
+static uint8_t fuzz_file_name[FUZZ_NAME_SIZE];
+static const dpb_t *fuzz_file_dpb = NULL;
+static uint16_t *fuzz_file_entry = NULL;
+static uint32_t fuzz_file_entries = 0;
+static uint16_t *fuzz_file_block = NULL;
+static uint32_t fuzz_file_blocks = 0;
+
+#ifdef FUZZ_LIBFUZZER
+__attribute__((section("__libfuzzer_extra_counters")))
+#endif /* FUZZ_LIBFUZZER */
+static uint8_t fuzz_map[FUZZ_MAP_SIZE];
+
+static char *fuzz_finding[FUZZ_FINDINGS_MAX];
+static int fuzz_findings_unique = 0;
+static uint32_t fuzz_cases = 0;
+static uint32_t fuzz_findings = 0;
+static uint32_t fuzz_skipped = 0;
+static uint32_t fuzz_budget_used = 0;
+static uint64_t fuzz_dirty_pages = 0;
+
+
+
+static int fuzz_binary_load(const char *filename, uint8_t data[],
+  uint16_t max, uint16_t *size)
+{
+  FILE *fh;
+  size_t n;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return -1;
+  }
+  n = fread(data, sizeof(uint8_t), max, fh);
+  fclose(fh);
+  if (n == 0) {
+    return -1;
+  }
+  *size = n;
+  return 0;
+}
+
+
+
+static uint32_t fuzz_overlay_hash(uint8_t disk_no, uint16_t track_no,
+  uint8_t sector_no)
+{
+  return ((disk_no * 7919) + (track_no * 131) + sector_no) &
+    (FUZZ_OVERLAY_BUCKETS - 1);
+}
+
+
+
+static fuzz_record_t *fuzz_overlay_find(uint8_t disk_no, uint16_t track_no,
+  uint8_t sector_no)
+{
+  int32_t i;
+
+  i = fuzz_bucket[fuzz_overlay_hash(disk_no, track_no, sector_no)];
+  while (i != -1) {
+    if (fuzz_record[i].disk_no == disk_no &&
+      fuzz_record[i].track_no == track_no &&
+      fuzz_record[i].sector_no == sector_no) {
+      return &fuzz_record[i];
+    }
+    i = fuzz_record[i].next;
+  }
+  return NULL;
+}
+
+
+
+static void fuzz_overlay_dir_check(uint8_t disk_no, uint16_t track_no,
+  uint8_t sector_no)
+{
+  const dpb_t *dpb = disk_dpb(fuzz_disk, disk_no);
+  uint32_t record;
+
+  /* As the disks do, so the native BDOS reads the directory again. */
+  if (dpb == NULL || track_no < dpb->off) {
+    return;
+  }
+  record = ((uint32_t)(track_no - dpb->off) * dpb->spt) +
+    dpb_sector_logical(dpb, sector_no);
+  if (record < ((uint32_t)dpb->drm + 1) / 4) {
+    fuzz_generation[disk_no]++;
+  }
+}
+
+
+
+static int fuzz_overlay_write(uint8_t disk_no, uint16_t track_no,
+  uint8_t sector_no, const uint8_t data[])
+{
+  fuzz_record_t *record;
+  uint32_t max, hash;
+
+  record = fuzz_overlay_find(disk_no, track_no, sector_no);
+  if (record == NULL) {
+    if (fuzz_records >= fuzz_records_max) {
+      max = (fuzz_records_max == 0) ? 256 : fuzz_records_max * 2;
+      record = realloc(fuzz_record, max * sizeof(fuzz_record_t));
+      if (record == NULL) {
+        return -1;
+      }
+      fuzz_record = record;
+      fuzz_records_max = max;
+    }
+    hash = fuzz_overlay_hash(disk_no, track_no, sector_no);
+    record = &fuzz_record[fuzz_records];
+    record->disk_no = disk_no;
+    record->track_no = track_no;
+    record->sector_no = sector_no;
+    record->next = fuzz_bucket[hash];
+    fuzz_bucket[hash] = fuzz_records++;
+  }
+  memcpy(record->data, data, DPB_RECORD_SIZE);
+  fuzz_overlay_dir_check(disk_no, track_no, sector_no);
+  return 0;
+}
+
+
+
+static void fuzz_overlay_clear(void)
+{
+  int i;
+
+  fuzz_records = 0;
+  for (i = 0; i < FUZZ_OVERLAY_BUCKETS; i++) {
+    fuzz_bucket[i] = -1;
+  }
+  for (i = 0; i < DISK_DRIVES; i++) {
+    fuzz_generation[i]++;
+  }
+}
+
+
+
+static const dpb_t *fuzz_backend_dpb(void *context, uint8_t disk_no)
+{
+  return disk_backend.dpb(context, disk_no);
+}
+
+
+
+static int fuzz_backend_read(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, uint8_t data[])
+{
+  fuzz_record_t *record;
+
+  if (fuzz_overlay) {
+    record = fuzz_overlay_find(disk_no, track_no, sector_no);
+    if (record != NULL) {
+      memcpy(data, record->data, DPB_RECORD_SIZE);
+      return 0;
+    }
+  }
+  return disk_backend.read(context, disk_no, track_no, sector_no, data);
+}
+
+
+
+static int fuzz_backend_write(void *context, uint8_t disk_no,
+  uint16_t track_no, uint8_t sector_no, const uint8_t data[])
+{
+  if (fuzz_overlay) {
+    if (disk_dpb(context, disk_no) == NULL) {
+      return -1;
+    }
+    return fuzz_overlay_write(disk_no, track_no, sector_no, data);
+  }
+  return disk_backend.write(context, disk_no, track_no, sector_no, data);
+}
+
+
+
+static uint32_t fuzz_backend_dir_generation(void *context, uint8_t disk_no)
+{
+  return disk_backend.dir_generation(context, disk_no) +
+    fuzz_generation[disk_no];
+}
+
+
+
+static int fuzz_backend_system(void *context, const uint8_t data[],
+  uint16_t size)
+{
+  return disk_backend.system(context, data, size);
+}
+
+
+
+static const io_disk_t fuzz_disk_backend = {
+  fuzz_backend_dpb,
+  fuzz_backend_read,
+  fuzz_backend_write,
+  fuzz_backend_dir_generation,
+  fuzz_backend_system,
+};
+
+
+
+static int fuzz_file_name_parse(const char *spec)
+{
+  const char *p;
+  int i, len;
+
+  if (! isalpha((unsigned char)spec[0]) || spec[1] != ':') {
+    return -1;
+  }
+  fuzz_file_drive = toupper((unsigned char)spec[0]) - 'A';
+  if (fuzz_file_drive >= DISK_DRIVES) {
+    return -1;
+  }
+
+  memset(fuzz_file_name, ' ', FUZZ_NAME_SIZE);
+  p = &spec[2];
+  len = strcspn(p, ".");
+  if (len == 0 || len > 8) {
+    return -1;
+  }
+  for (i = 0; i < len; i++) {
+    fuzz_file_name[i] = toupper((unsigned char)p[i]);
+  }
+  p += len;
+  if (*p == '.') {
+    p++;
+    len = strlen(p);
+    if (len > 3) {
+      return -1;
+    }
+    for (i = 0; i < len; i++) {
+      fuzz_file_name[8 + i] = toupper((unsigned char)p[i]);
+    }
+  }
+  for (i = 0; i < FUZZ_NAME_SIZE; i++) {
+    if (fuzz_file_name[i] <= ' ' && fuzz_file_name[i] != ' ') {
+      return -1;
+    }
+    if (strchr("*?.:;,<>=[]", fuzz_file_name[i]) != NULL) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+static void fuzz_file_location(uint32_t record, uint16_t *track_no,
+  uint8_t *sector_no)
+{
+  /* Logical records are laid out as the BDOS does. */
+  *track_no = (record / fuzz_file_dpb->spt) + fuzz_file_dpb->off;
+  *sector_no = dpb_sectran(fuzz_file_dpb, record % fuzz_file_dpb->spt);
+}
+
+
+
+static int fuzz_file_setup(void)
+{
+  const dpb_t *dpb;
+  uint8_t data[DPB_RECORD_SIZE];
+  uint8_t *entry, *used;
+  uint16_t track_no, block;
+  uint8_t sector_no;
+  uint32_t i, j;
+  bool wide;
+  int result = -1;
+
+  dpb = disk_dpb(fuzz_disk, fuzz_file_drive);
+  if (dpb == NULL) {
+    fprintf(stderr, "Error: No drive %c for the input file\n",
+      fuzz_file_drive + 'A');
+    return -1;
+  }
+  fuzz_file_dpb = dpb;
+  wide = dpb->dsm > 255;
+  used = calloc((uint32_t)dpb->dsm + 1, sizeof(uint8_t));
+  fuzz_file_entry = malloc(((uint32_t)dpb->drm + 1) * sizeof(uint16_t));
+  fuzz_file_block = malloc(((uint32_t)dpb->dsm + 1) * sizeof(uint16_t));
+  if (used == NULL || fuzz_file_entry == NULL || fuzz_file_block == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    goto fuzz_file_setup_end;
+  }
+
+  for (i = 0; i < 16 && i <= dpb->dsm; i++) {
+    if (((dpb->al0 << 8) | dpb->al1) & (0x8000 >> i)) {
+      used[i] = 1; /* Directory */
+    }
+  }
+
+  /* Free entries and blocks as the drive is when booted. */
+  for (i = 0; i <= dpb->drm; i++) {
+    if (i % 4 == 0) {
+      fuzz_file_location(i / 4, &track_no, &sector_no);
+      if (disk_record_read(fuzz_disk, fuzz_file_drive, track_no, sector_no,
+        data) != 0) {
+        fprintf(stderr, "Error: Failed to read the directory of drive %c\n",
+          fuzz_file_drive + 'A');
+        goto fuzz_file_setup_end;
+      }
+    }
+    entry = &data[(i % 4) * 32];
+    if (entry[0] == 0xE5) {
+      fuzz_file_entry[fuzz_file_entries++] = i;
+      continue;
+    }
+    if (entry[0] == 0) {
+      for (j = 0; j < FUZZ_NAME_SIZE; j++) {
+        if ((entry[1 + j] & 0x7F) != fuzz_file_name[j]) {
+          break;
+        }
+      }
+      if (j == FUZZ_NAME_SIZE) {
+        fprintf(stderr, "Error: Input file already on drive %c\n",
+          fuzz_file_drive + 'A');
+        goto fuzz_file_setup_end;
+      }
+    }
+    for (j = 0; j < (wide ? 8u : 16u); j++) {
+      block = wide ? (entry[16 + (j * 2)] | (entry[17 + (j * 2)] << 8)) :
+        entry[16 + j];
+      if (block != 0 && block <= dpb->dsm) {
+        used[block] = 1;
+      }
+    }
+  }
+  for (i = 0; i <= dpb->dsm; i++) {
+    if (! used[i]) {
+      fuzz_file_block[fuzz_file_blocks++] = i;
+    }
+  }
+  result = 0;
+
+fuzz_file_setup_end:
+  free(used);
+  return result;
+}
+
+
+
+static int fuzz_file_put(const uint8_t data[], size_t size)
+{
+  const dpb_t *dpb = fuzz_file_dpb;
+  uint8_t record[DPB_RECORD_SIZE];
+  uint8_t *entry;
+  uint32_t records, per_entry, entries, blocks, extent, count, block;
+  uint32_t i, j, r;
+  uint16_t track_no;
+  uint8_t sector_no;
+  bool wide;
+
+  wide = dpb->dsm > 255;
+  records = (size + DPB_RECORD_SIZE - 1) / DPB_RECORD_SIZE;
+  blocks = (records + dpb->blm) >> dpb->bsh;
+  per_entry = (wide ? 8 : 16) << dpb->bsh;
+  entries = (records == 0) ? 1 : (records + per_entry - 1) / per_entry;
+  if (entries > fuzz_file_entries || blocks > fuzz_file_blocks) {
+    return -1;
+  }
+
+  /* Data records, the last one padded with ^Z as text files are. */
+  for (r = 0; r < records; r++) {
+    memset(record, 0x1A, DPB_RECORD_SIZE);
+    memcpy(record, &data[r * DPB_RECORD_SIZE],
+      (size - (r * DPB_RECORD_SIZE) < DPB_RECORD_SIZE) ?
+      size - (r * DPB_RECORD_SIZE) : DPB_RECORD_SIZE);
+    block = fuzz_file_block[r >> dpb->bsh];
+    fuzz_file_location((block << dpb->bsh) | (r & dpb->blm), &track_no,
+      &sector_no);
+    if (fuzz_overlay_write(fuzz_file_drive, track_no, sector_no,
+      record) != 0) {
+      return -1;
+    }
+  }
+
+  /* Directory entries, each with the records of its blocks. */
+  for (i = 0; i < entries; i++) {
+    fuzz_file_location(fuzz_file_entry[i] / 4, &track_no, &sector_no);
+    if (fuzz_backend_read(fuzz_disk, fuzz_file_drive, track_no, sector_no,
+      record) != 0) {
+      return -1;
+    }
+    entry = &record[(fuzz_file_entry[i] % 4) * 32];
+    memset(entry, 0, 32);
+    memcpy(&entry[1], fuzz_file_name, FUZZ_NAME_SIZE);
+
+    count = (records - (i * per_entry) < per_entry) ?
+      records - (i * per_entry) : per_entry;
+    extent = (i * (dpb->exm + 1)) + ((count > 0) ? (count - 1) / 128 : 0);
+    entry[12] = extent & 0x1F;
+    entry[14] = extent >> 5;
+    entry[15] = (count > 0) ? count - (((count - 1) / 128) * 128) : 0;
+    for (j = 0; j < ((count + dpb->blm) >> dpb->bsh); j++) {
+      block = fuzz_file_block[((i * per_entry) >> dpb->bsh) + j];
+      if (wide) {
+        entry[16 + (j * 2)] = block & 0xFF;
+        entry[17 + (j * 2)] = block >> 8;
+      } else {
+        entry[16 + j] = block;
+      }
+    }
+    if (fuzz_overlay_write(fuzz_file_drive, track_no, sector_no,
+      record) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+static int fuzz_boot(void)
+{
+  kaytil_config_t config;
+  struct stat st;
+  int i, result;
+
+  /* Checked once here, or every case would fail to be saved. */
+  if (fuzz_output_dir != NULL) {
+    mkdir(fuzz_output_dir, 0777); /* Fine if it is there already. */
+    if (stat(fuzz_output_dir, &st) != 0 || ! S_ISDIR(st.st_mode) ||
+      access(fuzz_output_dir, W_OK) != 0) {
+      fprintf(stderr, "Error: Unable to use output directory '%s'\n",
+        fuzz_output_dir);
+      return -1;
+    }
+  }
+
+  memset(&config, 0, sizeof(kaytil_config_t));
+  if (fuzz_binary_load(fuzz_cpm22_location, fuzz_cpm22,
+    sizeof(fuzz_cpm22), &config.cpm22_size) != 0) {
+    fprintf(stderr, "Error: Failed to load CP/M 2.2 binary!\n");
+    return -1;
+  }
+  if (fuzz_binary_load(fuzz_cbios_location, fuzz_cbios,
+    sizeof(fuzz_cbios), &config.cbios_size) != 0) {
+    fprintf(stderr, "Error: Failed to load CBIOS binary!\n");
+    return -1;
+  }
+
+  fuzz_disk = disk_create();
+  if (fuzz_disk == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    return -1;
+  }
+  for (i = 0; i < DISK_DRIVES; i++) {
+    if (fuzz_image[i] != NULL &&
+      disk_image_load(fuzz_disk, i, fuzz_image[i], false) != 0) {
+      fprintf(stderr, "Error: Failed to load disk image '%s'\n",
+        fuzz_image[i]);
+      return -1;
+    }
+  }
+  if (disk_tables_size(fuzz_disk) > DPB_TABLES_SIZE_MAX) {
+    fprintf(stderr, "Error: Disk tables need %lu bytes, only %d fit in CBIOS "
+      "memory\n", (unsigned long)disk_tables_size(fuzz_disk), DPB_TABLES_SIZE_MAX);
+    return -1;
+  }
+
+  batch_init(&fuzz_batch);
+  batch_output_open(&fuzz_batch, NULL);
+  batch_exit_add(&fuzz_batch, "prompt");
+  batch_exit_add(&fuzz_batch, FUZZ_BOOT_TIMEOUT);
+  if (fuzz_boot_script != NULL &&
+    batch_script_load(&fuzz_batch, fuzz_boot_script) != 0) {
+    fprintf(stderr, "Error: Failed to load boot script: %s\n",
+      fuzz_boot_script);
+    return -1;
+  }
+
+  config.cpm22 = fuzz_cpm22;
+  config.cbios = fuzz_cbios;
+  config.console = &batch_backend;
+  config.console_context = &fuzz_batch;
+  config.disk = &fuzz_disk_backend;
+  config.disk_context = fuzz_disk;
+  config.native_bdos = fuzz_native_bdos;
+  config.banks = 1;
+  fuzz_machine = kaytil_create(&config);
+  if (fuzz_machine == NULL) {
+    fprintf(stderr, "Error: Failed to create machine!\n");
+    return -1;
+  }
+
+  /* Waiting at the prompt, or for a key elsewhere after the script. */
+  result = batch_run(&fuzz_batch, fuzz_machine);
+  if (result != BATCH_EXIT_DONE && result != BATCH_EXIT_INPUT) {
+    fprintf(stderr, "Error: Boot failed with exit code %d\n", result);
+    if (result == BATCH_EXIT_ERROR) {
+      fprintf(stderr, "%s", kaytil_error(fuzz_machine));
+    }
+    return -1;
+  }
+  memcpy(fuzz_tail, fuzz_batch.tail, BATCH_TEXT_MAX);
+  fuzz_written = fuzz_batch.written;
+
+  if (fuzz_file_drive != -1 && fuzz_file_setup() != 0) {
+    return -1;
+  }
+  fuzz_snapshot = kaytil_snapshot(fuzz_machine);
+  if (fuzz_snapshot == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    return -1;
+  }
+  fuzz_overlay = true;
+  fuzz_overlay_clear();
+  kaytil_coverage(fuzz_machine, fuzz_map, FUZZ_MAP_SIZE);
+  return 0;
+}
+
+
+
+static void fuzz_destroy(void)
+{
+  int i;
+
+  if (fuzz_snapshot != NULL) {
+    kaytil_snapshot_free(fuzz_snapshot);
+  }
+  if (fuzz_machine != NULL) {
+    kaytil_destroy(fuzz_machine);
+  }
+  batch_destroy(&fuzz_batch);
+  if (fuzz_disk != NULL) {
+    disk_destroy(fuzz_disk);
+  }
+  free(fuzz_record);
+  free(fuzz_file_entry);
+  free(fuzz_file_block);
+  for (i = 0; i < fuzz_findings_unique; i++) {
+    free(fuzz_finding[i]);
+  }
+}
+
+
+
+/* Runs one case from the snapshot, returning the batch exit code. */
+static int fuzz_case(const uint8_t data[], size_t size)
+{
+  int i, result;
+
+  fuzz_dirty_pages += kaytil_private_pages(fuzz_machine);
+  kaytil_restore(fuzz_machine, fuzz_snapshot);
+  fuzz_overlay_clear();
+  fuzz_cases++;
+
+  batch_reset(&fuzz_batch);
+  memcpy(fuzz_batch.tail, fuzz_tail, BATCH_TEXT_MAX);
+  fuzz_batch.written = fuzz_written;
+  batch_output_open(&fuzz_batch, NULL);
+  if (fuzz_verbose) {
+    fuzz_batch.output = stdout;
+  }
+  batch_exit_add(&fuzz_batch, "prompt");
+  for (i = 0; i < fuzz_exits; i++) {
+    batch_exit_add(&fuzz_batch, fuzz_exit[i]);
+  }
+  if (fuzz_batch.exit_instructions == 0) {
+    batch_exit_add(&fuzz_batch, FUZZ_BUDGET);
+  }
+
+  if (fuzz_file_drive != -1 && fuzz_file_put(data, size) != 0) {
+    fuzz_skipped++;
+    return FUZZ_CASE_SKIPPED;
+  }
+  if (fuzz_case_script != NULL &&
+    batch_script_load(&fuzz_batch, fuzz_case_script) != 0) {
+    fuzz_skipped++;
+    return FUZZ_CASE_SKIPPED;
+  }
+  if (fuzz_file_drive == -1 && (size > FUZZ_INPUT_MAX ||
+    batch_keys_add(&fuzz_batch, data, size) != 0)) {
+    fuzz_skipped++;
+    return FUZZ_CASE_SKIPPED;
+  }
+
+  result = batch_run(&fuzz_batch, fuzz_machine);
+  if (result == BATCH_EXIT_ERROR) {
+    fuzz_findings++;
+  } else if (result == BATCH_EXIT_BUDGET) {
+    fuzz_budget_used++;
+  }
+  return result;
+}
+
+
+
+/* Returns 1 for help, -1 on errors. */
+static int fuzz_options(int argc, char *argv[])
+{
+  batch_t check;
+  char *end;
+  int c, result;
+
+  while ((c = getopt(argc, argv, "B:R:f:e:r:o:vna:b:c:d:i:m:s:h")) != -1) {
+    switch (c) {
+    case 'B':
+      fuzz_boot_script = optarg;
+      break;
+
+    case 'R':
+      fuzz_case_script = optarg;
+      break;
+
+    case 'f':
+      if (fuzz_file_name_parse(optarg) != 0) {
+        fprintf(stderr, "Error: Invalid input file: %s\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'e':
+      batch_init(&check);
+      result = batch_exit_add(&check, optarg);
+      batch_destroy(&check);
+      if (fuzz_exits >= FUZZ_EXITS_MAX || result != 0) {
+        fprintf(stderr, "Error: Invalid exit condition: %s\n", optarg);
+        return -1;
+      }
+      fuzz_exit[fuzz_exits++] = optarg;
+      break;
+
+    case 'r':
+      fuzz_runs = strtoul(optarg, &end, 10);
+      if (end == optarg || *end != '\0') {
+        fprintf(stderr, "Error: Invalid number of runs: %s\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'o':
+      fuzz_output_dir = optarg;
+      break;
+
+    case 'v':
+      fuzz_verbose = true;
+      break;
+
+    case 'n':
+      fuzz_native_bdos = true;
+      break;
+
+    case 'a':
+    case 'b':
+    case 'c':
+    case 'd':
+      fuzz_image[c - 0x61] = optarg;
+      break;
+
+    case 'i':
+      if (optarg[0] >= 'a' && optarg[0] <= 'p' && optarg[1] == ':') {
+        fuzz_image[optarg[0] - 0x61] = &optarg[2];
+      } else if (optarg[0] >= 'A' && optarg[0] <= 'P' && optarg[1] == ':') {
+        fuzz_image[optarg[0] - 0x41] = &optarg[2];
+      } else {
+        fprintf(stderr, "Error: Invalid drive specification: %s\n", optarg);
+        return -1;
+      }
+      break;
+
+    case 'm':
+      fuzz_cpm22_location = optarg;
+      break;
+
+    case 's':
+      fuzz_cbios_location = optarg;
+      break;
+
+    case 'h':
+      return 1;
+
+    case '?':
+    default:
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stderr, "Usage: %s <options> [CASE]...\n", progname);
+  fprintf(stderr, "Options:\n"
+     "  -B SCRIPT  Boot with the batch SCRIPT before the snapshot\n"
+     "  -R SCRIPT  Go on with the batch SCRIPT for each case\n"
+     "  -f X:NAME  Put the input on drive X as file NAME, else typed\n"
+     "  -e WHEN    Exit condition for each case, as for the emulator\n"
+     "  -r RUNS    Run RUNS mutated cases after the ones given\n"
+     "  -o DIR     Write findings and new edge cases to DIR, made if needed\n"
+     "  -v         Show the console output of each case\n"
+     "  -a IMAGE   Load disk IMAGE in drive A\n"
+     "  -b IMAGE   Load disk IMAGE in drive B\n"
+     "  -c IMAGE   Load disk IMAGE in drive C\n"
+     "  -d IMAGE   Load disk IMAGE in drive D\n"
+     "  -i X:IMAGE Load disk IMAGE in drive X (A to P)\n"
+     "  -n         Use native BDOS functions for speed\n"
+     "  -m FILE    Load CP/M 2.2 binary from FILE instead of '%s'\n"
+     "  -s FILE    Load CBIOS binary from FILE instead of '%s'\n"
+     "\n"
+     "The machine is booted until it wants a key that the boot script does\n"
+     "not give, usually the CCP prompt, and each case goes on from there.\n"
+     "The input is typed after the case script, or put on drive X before\n"
+     "it, where the drive should not have been used yet when booted. A\n"
+     "case ends back at the prompt, when it wants more keys, or after the\n"
+     "WHEN conditions, by default %s. Emulation errors are\n"
+     "findings. Images are never written back.\n"
+     "\n",
+     DEFAULT_CPM22_LOCATION,
+     DEFAULT_CBIOS_LOCATION,
+     FUZZ_BUDGET);
+}
+
+
+
+#ifdef FUZZ_LIBFUZZER
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+  static char *option[FUZZ_OPTIONS_MAX + 1];
+  char *options, *token;
+  int n = 0;
+
+  (void)argc;
+  option[n++] = (*argv)[0];
+  options = getenv("KAYTIL_FUZZ");
+  if (options != NULL) {
+    options = strcpy(malloc(strlen(options) + 1), options);
+    token = strtok(options, " \t");
+    while (token != NULL && n < FUZZ_OPTIONS_MAX) {
+      option[n++] = token;
+      token = strtok(NULL, " \t");
+    }
+  }
+  option[n] = NULL;
+
+  optind = 1;
+  if (fuzz_options(n, option) != 0 || optind != n) {
+    display_help(option[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (fuzz_boot() != 0) {
+    exit(EXIT_FAILURE);
+  }
+  atexit(fuzz_destroy);
+  return 0;
+}
+
+
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+  if (fuzz_case(data, size) == BATCH_EXIT_ERROR) {
+    fprintf(stderr, "Finding: %s", kaytil_error(fuzz_machine));
+    kaytil_dump(fuzz_machine, stderr);
+    abort();
+  }
+  return 0;
+}
+
+
+
+#else
+static uint8_t fuzz_seen[FUZZ_MAP_SIZE]; /* Hit count classes per edge. */
+static uint32_t fuzz_edges = 0;
+static fuzz_case_t fuzz_corpus[FUZZ_CORPUS_MAX];
+static uint32_t fuzz_corpus_size = 0;
+static uint32_t fuzz_random_state = 1;
+
+
+
+static double fuzz_elapsed(const struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) +
+    ((now.tv_usec - since->tv_usec) / 1000000.0);
+}
+
+
+
+static uint32_t fuzz_random(void)
+{
+  uint32_t x = fuzz_random_state; /* Xorshift */
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  fuzz_random_state = x;
+  return x;
+}
+
+
+
+static uint8_t fuzz_count_class(uint8_t count)
+{
+  /* As AFL does, so loops only count when they run a new number of times
+     in powers of two. */
+  if (count <= 2) {
+    return count;
+  } else if (count == 3) {
+    return 4;
+  } else if (count < 8) {
+    return 8;
+  } else if (count < 16) {
+    return 16;
+  } else if (count < 32) {
+    return 32;
+  } else if (count < 128) {
+    return 64;
+  }
+  return 128;
+}
+
+
+
+/* Notes the edges of the case just run, true if any is new. */
+static bool fuzz_coverage_new(void)
+{
+  uint64_t word;
+  uint8_t class;
+  bool found = false;
+  uint32_t i, j;
+
+  for (i = 0; i < FUZZ_MAP_SIZE; i += sizeof(uint64_t)) {
+    memcpy(&word, &fuzz_map[i], sizeof(uint64_t));
+    if (word == 0) {
+      continue;
+    }
+    for (j = i; j < i + sizeof(uint64_t); j++) {
+      class = fuzz_count_class(fuzz_map[j]);
+      if ((class & ~fuzz_seen[j]) != 0) {
+        if (fuzz_seen[j] == 0) {
+          fuzz_edges++;
+        }
+        fuzz_seen[j] |= class;
+        found = true;
+      }
+    }
+  }
+  return found;
+}
+
+
+
+/* Whether the message of the finding just seen is a new one. */
+static bool fuzz_finding_new(void)
+{
+  const char *message = kaytil_error(fuzz_machine);
+  int i;
+
+  for (i = 0; i < fuzz_findings_unique; i++) {
+    if (strcmp(fuzz_finding[i], message) == 0) {
+      return false;
+    }
+  }
+  if (fuzz_findings_unique < FUZZ_FINDINGS_MAX) {
+    fuzz_finding[fuzz_findings_unique] = malloc(strlen(message) + 1);
+    if (fuzz_finding[fuzz_findings_unique] != NULL) {
+      strcpy(fuzz_finding[fuzz_findings_unique++], message);
+    }
+  }
+  return true;
+}
+
+
+
+static void fuzz_save(const char *prefix, const uint8_t data[], size_t size)
+{
+  char path[FUZZ_PATH_MAX];
+  uint8_t digest[SHA256_SIZE];
+  sha256_t sha;
+  FILE *fh;
+  int i, n;
+
+  if (fuzz_output_dir == NULL) {
+    return;
+  }
+  sha256_init(&sha);
+  sha256_update(&sha, data, size);
+  sha256_final(&sha, digest);
+  n = snprintf(path, sizeof(path), "%s/%s-", fuzz_output_dir, prefix);
+  for (i = 0; i < 8 && n + 2 < (int)sizeof(path); i++) {
+    n += snprintf(&path[n], sizeof(path) - n, "%02x", digest[i]);
+  }
+
+  fh = fopen(path, "wb");
+  if (fh == NULL || fwrite(data, sizeof(uint8_t), size, fh) != size) {
+    fprintf(stderr, "Error: Unable to write '%s'\n", path);
+  }
+  if (fh != NULL) {
+    fclose(fh);
+  }
+}
+
+
+
+static void fuzz_corpus_add(const uint8_t data[], size_t size)
+{
+  fuzz_case_t *entry;
+
+  if (fuzz_corpus_size >= FUZZ_CORPUS_MAX) {
+    return;
+  }
+  entry = &fuzz_corpus[fuzz_corpus_size];
+  entry->data = malloc((size > 0) ? size : 1);
+  if (entry->data == NULL) {
+    return;
+  }
+  memcpy(entry->data, data, size);
+  entry->size = size;
+  fuzz_corpus_size++;
+}
+
+
+
+/* Runs a case and takes note of what it found. */
+static void fuzz_try(const char *name, const uint8_t data[], size_t size,
+  bool keep)
+{
+  int result;
+
+  memset(fuzz_map, 0, FUZZ_MAP_SIZE);
+  result = fuzz_case(data, size);
+  if (result == FUZZ_CASE_SKIPPED) {
+    if (name != NULL) {
+      fprintf(stderr, "Error: Case '%s' does not fit\n", name);
+    }
+    return;
+  }
+
+  if (result == BATCH_EXIT_ERROR && fuzz_finding_new()) {
+    fprintf(stderr, "Finding: %s%s%s", (name != NULL) ? name : "",
+      (name != NULL) ? ": " : "", kaytil_error(fuzz_machine));
+    fuzz_save("finding", data, size);
+  }
+  if (fuzz_coverage_new() || keep) {
+    fuzz_corpus_add(data, size);
+    if (name == NULL) {
+      fuzz_save("case", data, size);
+    }
+  }
+}
+
+
+
+static size_t fuzz_mutate(uint8_t data[], size_t size)
+{
+  static const uint8_t interesting[] = {
+    0x00, 0x01, 0x0D, 0x0A, 0x1A, 0x20, 0x7F, 0x80, 0xFF, '$', '*', '?',
+  };
+  uint32_t pos, len, from, n, i;
+
+  n = 1 + (fuzz_random() % 4);
+  for (i = 0; i < n; i++) {
+    pos = (size > 0) ? fuzz_random() % size : 0;
+    switch (fuzz_random() % 6) {
+    case 0:
+      if (size > 0) {
+        data[pos] ^= 1 << (fuzz_random() % 8);
+      }
+      break;
+
+    case 1:
+      if (size > 0) {
+        data[pos] = fuzz_random();
+      }
+      break;
+
+    case 2:
+      if (size > 0) {
+        data[pos] = interesting[fuzz_random() % sizeof(interesting)];
+      }
+      break;
+
+    case 3:
+      if (size < FUZZ_MUTATED_MAX) {
+        memmove(&data[pos + 1], &data[pos], size - pos);
+        data[pos] = fuzz_random();
+        size++;
+      }
+      break;
+
+    case 4:
+      if (size > 1) {
+        memmove(&data[pos], &data[pos + 1], size - pos - 1);
+        size--;
+      }
+      break;
+
+    default:
+      /* Copies a part of the case over another. */
+      if (size > 1) {
+        len = 1 + (fuzz_random() % ((size < 32) ? size : 32));
+        from = fuzz_random() % (size - len + 1);
+        pos = fuzz_random() % (size - len + 1);
+        memmove(&data[pos], &data[from], len);
+      }
+      break;
+    }
+  }
+  return size;
+}
+
+
+
+static uint8_t *fuzz_case_load(const char *filename, size_t *size)
+{
+  uint8_t *data;
+  FILE *fh;
+
+  data = malloc(FUZZ_INPUT_MAX + 1);
+  if (data == NULL) {
+    return NULL;
+  }
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    free(data);
+    return NULL;
+  }
+  *size = fread(data, sizeof(uint8_t), FUZZ_INPUT_MAX + 1, fh);
+  fclose(fh);
+  if (*size > FUZZ_INPUT_MAX) {
+    free(data);
+    return NULL;
+  }
+  return data;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  uint8_t mutated[FUZZ_MUTATED_MAX];
+  fuzz_case_t *entry;
+  struct timeval start;
+  unsigned long run;
+  uint8_t *data;
+  size_t size;
+  double seconds;
+  int i;
+
+  i = fuzz_options(argc, argv);
+  if (i != 0) {
+    display_help(argv[0]);
+    return (i == 1) ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  if (fuzz_boot() != 0) {
+    fuzz_destroy();
+    return EXIT_FAILURE;
+  }
+
+  gettimeofday(&start, NULL);
+  for (i = optind; i < argc; i++) {
+    data = fuzz_case_load(argv[i], &size);
+    if (data == NULL) {
+      fprintf(stderr, "Error: Failed to load case '%s'\n", argv[i]);
+      continue;
+    }
+    fuzz_try(argv[i], data, size, true);
+    free(data);
+  }
+
+  if (fuzz_runs > 0) {
+    fuzz_random_state = (uint32_t)time(NULL) | 1;
+    if (fuzz_corpus_size == 0) {
+      fuzz_try(NULL, mutated, 0, true);
+    }
+    for (run = 0; run < fuzz_runs && fuzz_corpus_size > 0; run++) {
+      entry = &fuzz_corpus[fuzz_random() % fuzz_corpus_size];
+      size = (entry->size < FUZZ_MUTATED_MAX) ? entry->size :
+        FUZZ_MUTATED_MAX;
+      memcpy(mutated, entry->data, size);
+      size = fuzz_mutate(mutated, size);
+      fuzz_try(NULL, mutated, size, false);
+    }
+  }
+  seconds = fuzz_elapsed(&start);
+  if (seconds <= 0) {
+    seconds = 0.000001;
+  }
+
+  fprintf(stderr, "Cases: %u, %u findings (%d unique), %u over budget, "
+    "%u skipped\n", fuzz_cases, fuzz_findings, fuzz_findings_unique,
+    fuzz_budget_used, fuzz_skipped);
+  fprintf(stderr, "Edges: %u\n", fuzz_edges);
+  fprintf(stderr, "Corpus: %u cases\n", fuzz_corpus_size);
+  fprintf(stderr, "Restore: %.1f pages of 4K average\n", (fuzz_cases > 0) ?
+    (double)fuzz_dirty_pages / fuzz_cases : 0.0);
+  fprintf(stderr, "Time: %.3fs\n", seconds);
+  fprintf(stderr, "Throughput: %.2f cases/s\n", fuzz_cases / seconds);
+
+  for (run = 0; run < fuzz_corpus_size; run++) {
+    free(fuzz_corpus[run].data);
+  }
+  i = (fuzz_findings == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+  fuzz_destroy();
+  return i;
+}
+#endif /* FUZZ_LIBFUZZER */
@@ -0,0 +1,853 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "hostdir.h"
+#include "dpb.h"
+
+/* Host directory mounted as a CP/M drive.
+
+   The directory and allocation of the drive are synthesised from the host
+   files when mounted, with the file contents loaded block by block on first
+   access. When the CP/M side writes a directory sector, the changed entries
+   are compared against a shadow copy and the affected files are written,
+   created or removed in the host directory. Only user 0 is mapped. */
+
+#define HOSTDIR_ENTRY_SIZE 32
+#define HOSTDIR_NAME_SIZE 11
+#define HOSTDIR_HOST_NAME_SIZE 13 /* "NAMENAME.EXT" */
+#define HOSTDIR_UNUSED 0xE5
+#define HOSTDIR_EOF 0x1A
+
+typedef struct hostdir_file_s {
+  uint8_t name[HOSTDIR_NAME_SIZE]; /* CP/M name and type, attributes masked */
+  char host_name[HOSTDIR_HOST_NAME_SIZE];
+  long host_size; /* Size of the host file, -1 if none exists. */
+  int *entry; /* Directory entries holding the extents. */
+  int entries;
+  int entries_max;
+  bool affected;
+  int next; /* Hash chain. */
+} hostdir_file_t;
+
+struct hostdir_s {
+  char *path;
+  const dpb_t *dpb;
+  bool sync;
+  uint32_t block_size;
+  uint32_t blocks;
+  uint32_t entries;
+  uint32_t system_records;
+  uint32_t dir_records;
+
+  uint8_t *system; /* Reserved tracks. */
+  uint8_t *dir; /* Directory blocks. */
+  uint8_t *shadow; /* Directory as last synced to the host. */
+  int *entry_file; /* File index for each directory entry, or -1. */
+  bool *entry_changed;
+
+  uint8_t **block; /* Cached block contents, NULL if not loaded. */
+  int *origin_file; /* Host file to load block from, or -1. */
+  uint32_t *origin_offset; /* Block number in host file. */
+  int *owner; /* Directory entry the block belongs to, or -1. */
+  bool *dirty;
+  uint32_t *dirty_list;
+  uint32_t dirty_count;
+
+  hostdir_file_t *file;
+  int files;
+  int files_max;
+  int *affected;
+  int affected_count;
+  int *hash;
+  uint32_t hash_mask;
+
+  FILE *read_fh; /* Last host file used for loading blocks. */
+  int read_file;
+};
+
+
+
+static uint32_t hostdir_hash(const uint8_t name[])
+{
+  uint32_t hash = 2166136261U; /* FNV-1a */
+  int i;
+  for (i = 0; i < HOSTDIR_NAME_SIZE; i++) {
+    hash ^= name[i] & 0x7F;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+
+
+static bool hostdir_name_equal(const uint8_t a[], const uint8_t b[])
+{
+  int i;
+  for (i = 0; i < HOSTDIR_NAME_SIZE; i++) {
+    if ((a[i] & 0x7F) != (b[i] & 0x7F)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+
+static int hostdir_file_find(hostdir_t *hd, const uint8_t name[], bool add)
+{
+  uint32_t bucket;
+  hostdir_file_t *f, *file;
+  int i, n, files_max, *affected;
+
+  bucket = hostdir_hash(name) & hd->hash_mask;
+  for (n = hd->hash[bucket]; n >= 0; n = hd->file[n].next) {
+    if (hostdir_name_equal(hd->file[n].name, name)) {
+      return n;
+    }
+  }
+  if (! add) {
+    return -1;
+  }
+
+  if (hd->files >= hd->files_max) {
+    files_max = (hd->files_max == 0) ? 64 : hd->files_max * 2;
+    file = realloc(hd->file, files_max * sizeof(hostdir_file_t));
+    if (file == NULL) {
+      return -1;
+    }
+    hd->file = file;
+    affected = realloc(hd->affected, files_max * sizeof(int));
+    if (affected == NULL) {
+      return -1;
+    }
+    hd->affected = affected;
+    hd->files_max = files_max;
+  }
+
+  n = hd->files++;
+  f = &hd->file[n];
+  for (i = 0; i < HOSTDIR_NAME_SIZE; i++) {
+    f->name[i] = name[i] & 0x7F;
+  }
+  f->host_name[0] = '\0';
+  f->host_size = -1;
+  f->entry = NULL;
+  f->entries = 0;
+  f->entries_max = 0;
+  f->affected = false;
+  f->next = hd->hash[bucket];
+  hd->hash[bucket] = n;
+  return n;
+}
+
+
+
+static void hostdir_file_affected(hostdir_t *hd, int n)
+{
+  if (! hd->file[n].affected) {
+    hd->file[n].affected = true;
+    hd->affected[hd->affected_count++] = n;
+  }
+}
+
+
+
+static int hostdir_entry_attach(hostdir_t *hd, int n, int e)
+{
+  hostdir_file_t *f = &hd->file[n];
+  int entries_max, *entry;
+
+  if (f->entries >= f->entries_max) {
+    entries_max = (f->entries_max == 0) ? 4 : f->entries_max * 2;
+    entry = realloc(f->entry, entries_max * sizeof(int));
+    if (entry == NULL) {
+      return -1;
+    }
+    f->entry = entry;
+    f->entries_max = entries_max;
+  }
+  f->entry[f->entries++] = e;
+  hd->entry_file[e] = n;
+  return 0;
+}
+
+
+
+static void hostdir_entry_detach(hostdir_t *hd, int e)
+{
+  hostdir_file_t *f;
+  int i;
+
+  if (hd->entry_file[e] < 0) {
+    return;
+  }
+  f = &hd->file[hd->entry_file[e]];
+  for (i = 0; i < f->entries; i++) {
+    if (f->entry[i] == e) {
+      f->entry[i] = f->entry[--f->entries];
+      break;
+    }
+  }
+  hd->entry_file[e] = -1;
+}
+
+
+
+static uint8_t *hostdir_entry(uint8_t *dir, int e)
+{
+  return &dir[e * HOSTDIR_ENTRY_SIZE];
+}
+
+
+
+static bool hostdir_entry_mapped(const uint8_t *entry)
+{
+  return entry[0] == 0; /* User 0 only. */
+}
+
+
+
+static int hostdir_entry_slots(hostdir_t *hd)
+{
+  return (hd->dpb->dsm < 256) ? 16 : 8;
+}
+
+
+
+static uint32_t hostdir_entry_block(hostdir_t *hd, const uint8_t *entry,
+  int slot)
+{
+  if (hd->dpb->dsm < 256) {
+    return entry[16 + slot];
+  } else {
+    return entry[16 + (slot * 2)] | (entry[17 + (slot * 2)] << 8);
+  }
+}
+
+
+
+static uint32_t hostdir_entry_first_record(hostdir_t *hd,
+  const uint8_t *entry)
+{
+  uint32_t extent = ((entry[14] & 0x3F) << 5) | (entry[12] & 0x1F);
+  return (extent & ~hd->dpb->exm) * 128;
+}
+
+
+
+static uint32_t hostdir_entry_records(hostdir_t *hd, const uint8_t *entry)
+{
+  return ((entry[12] & hd->dpb->exm) * 128) + entry[15];
+}
+
+
+
+static void hostdir_entry_own(hostdir_t *hd, const uint8_t *entry, int e,
+  bool own)
+{
+  uint32_t b;
+  int slot;
+
+  for (slot = 0; slot < hostdir_entry_slots(hd); slot++) {
+    b = hostdir_entry_block(hd, entry, slot);
+    if (b == 0 || b >= hd->blocks) {
+      continue;
+    }
+    if (own) {
+      hd->owner[b] = e;
+    } else if (hd->owner[b] == e) {
+      hd->owner[b] = -1;
+    }
+  }
+}
+
+
+
+static void hostdir_host_path(hostdir_t *hd, hostdir_file_t *f, char *path,
+  size_t size)
+{
+  snprintf(path, size, "%s/%s", hd->path, f->host_name);
+}
+
+
+
+static uint8_t *hostdir_block(hostdir_t *hd, uint32_t b, bool alloc)
+{
+  char path[FILENAME_MAX];
+  size_t n;
+
+  if (hd->block[b] != NULL) {
+    return hd->block[b];
+  }
+  if (hd->origin_file[b] < 0 && ! alloc) {
+    return NULL;
+  }
+
+  hd->block[b] = malloc(hd->block_size);
+  if (hd->block[b] == NULL) {
+    return NULL;
+  }
+  memset(hd->block[b], HOSTDIR_UNUSED, hd->block_size);
+
+  if (hd->origin_file[b] >= 0) {
+    if (hd->read_fh == NULL || hd->read_file != hd->origin_file[b]) {
+      if (hd->read_fh != NULL) {
+        fclose(hd->read_fh);
+      }
+      hostdir_host_path(hd, &hd->file[hd->origin_file[b]], path,
+        sizeof(path));
+      hd->read_fh = fopen(path, "rb");
+      hd->read_file = hd->origin_file[b];
+    }
+    n = 0;
+    if (hd->read_fh != NULL &&
+      fseek(hd->read_fh, hd->origin_offset[b] * hd->block_size, SEEK_SET) == 0) {
+      n = fread(hd->block[b], sizeof(uint8_t), hd->block_size, hd->read_fh);
+    }
+    /* Pad the last record of the file. */
+    while (n % DPB_RECORD_SIZE != 0) {
+      hd->block[b][n++] = HOSTDIR_EOF;
+    }
+    hd->origin_file[b] = -1;
+  }
+
+  return hd->block[b];
+}
+
+
+
+static int hostdir_file_release(hostdir_t *hd, int n)
+{
+  uint32_t b;
+
+  /* Load any blocks still in use before the host file is changed. */
+  for (b = 0; b < hd->blocks; b++) {
+    if (hd->origin_file[b] == n) {
+      if (hd->owner[b] >= 0 && hostdir_block(hd, b, false) == NULL) {
+        return -1;
+      }
+      hd->origin_file[b] = -1;
+    }
+  }
+  if (hd->read_fh != NULL && hd->read_file == n) {
+    fclose(hd->read_fh);
+    hd->read_fh = NULL;
+  }
+  return 0;
+}
+
+
+
+static int hostdir_file_sync(hostdir_t *hd, int n)
+{
+  uint8_t empty[DPB_RECORD_SIZE];
+  hostdir_file_t *f = &hd->file[n];
+  char path[FILENAME_MAX];
+  uint8_t *entry, *data;
+  uint32_t first, records, done, chunk, b;
+  long size;
+  bool full;
+  FILE *fh;
+  int i, j, slot;
+
+  if (hostdir_file_release(hd, n) != 0) {
+    return -1;
+  }
+
+  if (f->entries == 0) {
+    if (f->host_size >= 0) {
+      hostdir_host_path(hd, f, path, sizeof(path));
+      remove(path);
+      f->host_size = -1;
+    }
+    return 0;
+  }
+
+  if (f->host_name[0] == '\0') {
+    /* New file, use lowercase "name.ext" on the host. */
+    j = 0;
+    for (i = 0; i < 8 && f->name[i] != ' '; i++) {
+      f->host_name[j++] = tolower(f->name[i]);
+    }
+    if (f->name[8] != ' ') {
+      f->host_name[j++] = '.';
+    }
+    for (i = 8; i < HOSTDIR_NAME_SIZE && f->name[i] != ' '; i++) {
+      f->host_name[j++] = tolower(f->name[i]);
+    }
+    f->host_name[j] = '\0';
+  }
+
+  size = 0;
+  for (i = 0; i < f->entries; i++) {
+    entry = hostdir_entry(hd->dir, f->entry[i]);
+    first = hostdir_entry_first_record(hd, entry);
+    records = hostdir_entry_records(hd, entry);
+    if ((long)(first + records) * DPB_RECORD_SIZE > size) {
+      size = (first + records) * DPB_RECORD_SIZE;
+    }
+  }
+
+  /* Only the changed extents are written, unless the file shrinks. */
+  full = (f->host_size < 0 || size < f->host_size);
+  hostdir_host_path(hd, f, path, sizeof(path));
+  fh = fopen(path, full ? "wb" : "r+b");
+  if (fh == NULL) {
+    return -1;
+  }
+
+  memset(empty, HOSTDIR_UNUSED, sizeof(empty));
+  for (i = 0; i < f->entries; i++) {
+    if (! full && ! hd->entry_changed[f->entry[i]]) {
+      continue;
+    }
+    hd->entry_changed[f->entry[i]] = false;
+    entry = hostdir_entry(hd->dir, f->entry[i]);
+    first = hostdir_entry_first_record(hd, entry);
+    records = hostdir_entry_records(hd, entry);
+
+    if (fseek(fh, first * DPB_RECORD_SIZE, SEEK_SET) != 0) {
+      fclose(fh);
+      return -1;
+    }
+    for (done = 0; done < records; done += chunk) {
+      slot = (done * DPB_RECORD_SIZE) / hd->block_size;
+      chunk = (hd->block_size / DPB_RECORD_SIZE) -
+        (done % (hd->block_size / DPB_RECORD_SIZE));
+      if (chunk > records - done) {
+        chunk = records - done;
+      }
+      b = hostdir_entry_block(hd, entry, slot);
+      data = (b != 0 && b < hd->blocks) ? hostdir_block(hd, b, false) : NULL;
+      if (data != NULL) {
+        hd->dirty[b] = false;
+        fwrite(&data[(done * DPB_RECORD_SIZE) % hd->block_size],
+          DPB_RECORD_SIZE, chunk, fh);
+      } else {
+        /* Unallocated block in a sparse file. */
+        for (j = 0; j < (int)chunk; j++) {
+          fwrite(empty, DPB_RECORD_SIZE, 1, fh);
+        }
+      }
+    }
+  }
+
+  if (fclose(fh) != 0) {
+    return -1;
+  }
+  if (full || size > f->host_size) {
+    f->host_size = size;
+  }
+  return 0;
+}
+
+
+
+static int hostdir_dir_sync(hostdir_t *hd, uint32_t first, uint32_t count)
+{
+  uint8_t *entry, *old;
+  uint32_t e, i, kept;
+  int n, owner, result;
+
+  result = 0;
+  for (e = first; e < first + count && e < hd->entries; e++) {
+    entry = hostdir_entry(hd->dir, e);
+    old = hostdir_entry(hd->shadow, e);
+    if (memcmp(entry, old, HOSTDIR_ENTRY_SIZE) == 0) {
+      continue;
+    }
+
+    if (hostdir_entry_mapped(old)) {
+      hostdir_entry_own(hd, old, e, false);
+      if (hd->entry_file[e] >= 0) {
+        hostdir_file_affected(hd, hd->entry_file[e]);
+      }
+      hostdir_entry_detach(hd, e);
+    }
+    if (hostdir_entry_mapped(entry)) {
+      n = hostdir_file_find(hd, &entry[1], true);
+      if (n < 0 || hostdir_entry_attach(hd, n, e) != 0) {
+        return -1;
+      }
+      hostdir_entry_own(hd, entry, e, true);
+      hostdir_file_affected(hd, n);
+      hd->entry_changed[e] = true;
+    }
+    memcpy(old, entry, HOSTDIR_ENTRY_SIZE);
+  }
+
+  /* Data written to blocks of files already in the directory. */
+  for (i = 0; i < hd->dirty_count; i++) {
+    owner = hd->owner[hd->dirty_list[i]];
+    if (owner >= 0 && hd->entry_file[owner] >= 0) {
+      hd->entry_changed[owner] = true;
+      hostdir_file_affected(hd, hd->entry_file[owner]);
+    }
+  }
+
+  for (i = 0; i < (uint32_t)hd->affected_count; i++) {
+    hd->file[hd->affected[i]].affected = false;
+    if (hostdir_file_sync(hd, hd->affected[i]) != 0) {
+      result = -1;
+    }
+  }
+  hd->affected_count = 0;
+
+  /* Blocks not yet in any file stay dirty. */
+  kept = 0;
+  for (i = 0; i < hd->dirty_count; i++) {
+    if (hd->dirty[hd->dirty_list[i]]) {
+      hd->dirty_list[kept++] = hd->dirty_list[i];
+    }
+  }
+  hd->dirty_count = kept;
+  return result;
+}
+
+
+
+static bool hostdir_name_convert(const char *host_name, uint8_t name[])
+{
+  const char *valid = "!#$%&'()-@^_`{}~";
+  int i, part, len;
+
+  memset(name, ' ', HOSTDIR_NAME_SIZE);
+  part = 0;
+  len = 0;
+  for (i = 0; host_name[i] != '\0'; i++) {
+    if (host_name[i] == '.') {
+      if (part == 1 || len == 0) {
+        return false;
+      }
+      part = 1;
+      len = 0;
+      continue;
+    }
+    if (! isalnum((unsigned char)host_name[i]) &&
+      strchr(valid, host_name[i]) == NULL) {
+      return false;
+    }
+    if (len >= ((part == 0) ? 8 : 3)) {
+      return false;
+    }
+    name[(part * 8) + len++] = toupper((unsigned char)host_name[i]);
+  }
+  return (part == 1 || len > 0);
+}
+
+
+
+static int hostdir_scan(hostdir_t *hd)
+{
+  DIR *dh;
+  struct dirent *de;
+  struct stat st;
+  char path[FILENAME_MAX];
+  uint8_t name[HOSTDIR_NAME_SIZE];
+  uint8_t *entry;
+  uint32_t next_block, next_entry, records, entries, blocks, per_entry;
+  uint32_t i, k, b;
+  int n, slot;
+
+  dh = opendir(hd->path);
+  if (dh == NULL) {
+    return -1;
+  }
+
+  /* Directory blocks are allocated first. */
+  next_block = 0;
+  for (i = 0; i < 16; i++) {
+    if (((hd->dpb->al0 << 8) | hd->dpb->al1) & (0x8000 >> i)) {
+      next_block = i + 1;
+    }
+  }
+  next_entry = 0;
+  per_entry = (hd->dpb->exm + 1) * 128;
+
+  while ((de = readdir(dh)) != NULL) {
+    if (de->d_name[0] == '.') {
+      continue;
+    }
+    snprintf(path, sizeof(path), "%s/%s", hd->path, de->d_name);
+    if (stat(path, &st) != 0 || ! S_ISREG(st.st_mode)) {
+      continue;
+    }
+    if (strlen(de->d_name) >= HOSTDIR_HOST_NAME_SIZE ||
+      ! hostdir_name_convert(de->d_name, name)) {
+      fprintf(stderr, "Warning: Skipping host file with invalid name: %s\n",
+        path);
+      continue;
+    }
+    if (hostdir_file_find(hd, name, false) >= 0) {
+      fprintf(stderr, "Warning: Skipping host file with duplicate name: %s\n",
+        path);
+      continue;
+    }
+
+    records = (st.st_size + DPB_RECORD_SIZE - 1) / DPB_RECORD_SIZE;
+    blocks = ((records * DPB_RECORD_SIZE) + hd->block_size - 1) /
+      hd->block_size;
+    entries = (records + per_entry - 1) / per_entry;
+    if (entries == 0) {
+      entries = 1;
+    }
+    if (next_entry + entries > hd->entries ||
+      next_block + blocks > hd->blocks) {
+      fprintf(stderr, "Warning: Skipping host file, drive is full: %s\n",
+        path);
+      continue;
+    }
+
+    n = hostdir_file_find(hd, name, true);
+    if (n < 0) {
+      closedir(dh);
+      return -1;
+    }
+    strcpy(hd->file[n].host_name, de->d_name);
+    hd->file[n].host_size = st.st_size;
+
+    for (k = 0; k < entries; k++) {
+      uint32_t first = k * per_entry;
+      uint32_t count = (records - first < per_entry) ? records - first :
+        per_entry;
+      uint32_t last = (count > 0) ? (count - 1) / 128 : 0;
+      uint32_t extent = (k * (hd->dpb->exm + 1)) + last;
+
+      entry = hostdir_entry(hd->dir, next_entry);
+      memset(entry, 0, HOSTDIR_ENTRY_SIZE);
+      memcpy(&entry[1], name, HOSTDIR_NAME_SIZE);
+      entry[12] = extent & 0x1F;
+      entry[14] = (extent >> 5) & 0x3F;
+      entry[15] = count - (last * 128);
+
+      for (slot = 0; slot < hostdir_entry_slots(hd); slot++) {
+        if ((first * DPB_RECORD_SIZE) + (slot * hd->block_size) >=
+          records * DPB_RECORD_SIZE) {
+          break;
+        }
+        b = next_block++;
+        hd->origin_file[b] = n;
+        hd->origin_offset[b] = ((first * DPB_RECORD_SIZE) / hd->block_size) +
+          slot;
+        hd->owner[b] = next_entry;
+        if (hd->dpb->dsm < 256) {
+          entry[16 + slot] = b;
+        } else {
+          entry[16 + (slot * 2)] = b & 0xFF;
+          entry[17 + (slot * 2)] = b >> 8;
+        }
+      }
+
+      if (hostdir_entry_attach(hd, n, next_entry) != 0) {
+        closedir(dh);
+        return -1;
+      }
+      next_entry++;
+    }
+  }
+
+  closedir(dh);
+  memcpy(hd->shadow, hd->dir, hd->entries * HOSTDIR_ENTRY_SIZE);
+  return 0;
+}
+
+
+
+hostdir_t *hostdir_open(const char *path, const dpb_t *dpb, bool sync)
+{
+  hostdir_t *hd;
+  uint32_t i, buckets;
+
+  hd = calloc(1, sizeof(hostdir_t));
+  if (hd == NULL) {
+    return NULL;
+  }
+
+  hd->path = malloc(strlen(path) + 1);
+  if (hd->path == NULL) {
+    hostdir_close(hd);
+    return NULL;
+  }
+  strcpy(hd->path, path);
+  hd->dpb = dpb;
+  hd->sync = sync;
+  hd->block_size = DPB_RECORD_SIZE << dpb->bsh;
+  hd->blocks = dpb->dsm + 1;
+  hd->entries = dpb->drm + 1;
+  hd->system_records = dpb->off * dpb->spt;
+  hd->dir_records = ((hd->entries * HOSTDIR_ENTRY_SIZE) + DPB_RECORD_SIZE - 1)
+    / DPB_RECORD_SIZE;
+
+  buckets = 1;
+  while (buckets < hd->entries) {
+    buckets <<= 1;
+  }
+  hd->hash_mask = buckets - 1;
+
+  hd->system = malloc((hd->system_records * DPB_RECORD_SIZE) + 1);
+  hd->dir = malloc(hd->dir_records * DPB_RECORD_SIZE);
+  hd->shadow = malloc(hd->dir_records * DPB_RECORD_SIZE);
+  hd->entry_file = malloc(hd->entries * sizeof(int));
+  hd->entry_changed = calloc(hd->entries, sizeof(bool));
+  hd->block = calloc(hd->blocks, sizeof(uint8_t *));
+  hd->origin_file = malloc(hd->blocks * sizeof(int));
+  hd->origin_offset = calloc(hd->blocks, sizeof(uint32_t));
+  hd->owner = malloc(hd->blocks * sizeof(int));
+  hd->dirty = calloc(hd->blocks, sizeof(bool));
+  hd->dirty_list = malloc(hd->blocks * sizeof(uint32_t));
+  hd->hash = malloc(buckets * sizeof(int));
+  if (hd->system == NULL || hd->dir == NULL || hd->shadow == NULL ||
+    hd->entry_file == NULL || hd->entry_changed == NULL ||
+    hd->block == NULL || hd->origin_file == NULL ||
+    hd->origin_offset == NULL || hd->owner == NULL || hd->dirty == NULL ||
+    hd->dirty_list == NULL || hd->hash == NULL) {
+    hostdir_close(hd);
+    return NULL;
+  }
+
+  memset(hd->system, HOSTDIR_UNUSED, hd->system_records * DPB_RECORD_SIZE);
+  memset(hd->dir, HOSTDIR_UNUSED, hd->dir_records * DPB_RECORD_SIZE);
+  for (i = 0; i < hd->entries; i++) {
+    hd->entry_file[i] = -1;
+  }
+  for (i = 0; i < hd->blocks; i++) {
+    hd->origin_file[i] = -1;
+    hd->owner[i] = -1;
+  }
+  for (i = 0; i < buckets; i++) {
+    hd->hash[i] = -1;
+  }
+
+  if (hostdir_scan(hd) != 0) {
+    hostdir_close(hd);
+    return NULL;
+  }
+  return hd;
+}
+
+
+
+void hostdir_close(hostdir_t *hd)
+{
+  uint32_t i;
+  int n;
+
+  if (hd == NULL) {
+    return;
+  }
+  if (hd->block != NULL) {
+    for (i = 0; i < hd->blocks; i++) {
+      free(hd->block[i]);
+    }
+  }
+  for (n = 0; n < hd->files; n++) {
+    free(hd->file[n].entry);
+  }
+  if (hd->read_fh != NULL) {
+    fclose(hd->read_fh);
+  }
+  free(hd->path);
+  free(hd->system);
+  free(hd->dir);
+  free(hd->shadow);
+  free(hd->entry_file);
+  free(hd->entry_changed);
+  free(hd->block);
+  free(hd->origin_file);
+  free(hd->origin_offset);
+  free(hd->owner);
+  free(hd->dirty);
+  free(hd->dirty_list);
+  free(hd->file);
+  free(hd->affected);
+  free(hd->hash);
+  free(hd);
+}
+
+
+
+static int hostdir_locate(hostdir_t *hd, uint32_t record, uint32_t *block,
+  uint32_t *offset)
+{
+  record -= hd->system_records;
+  *block = record >> hd->dpb->bsh;
+  *offset = (record & hd->dpb->blm) * DPB_RECORD_SIZE;
+  return (*block < hd->blocks) ? 0 : -1;
+}
+
+
+
+int hostdir_read(hostdir_t *hd, uint32_t record, uint8_t data[])
+{
+  uint32_t b, offset;
+  uint8_t *block;
+
+  if (record < hd->system_records) {
+    memcpy(data, &hd->system[record * DPB_RECORD_SIZE], DPB_RECORD_SIZE);
+    return 0;
+  }
+  if (record - hd->system_records < hd->dir_records) {
+    memcpy(data, &hd->dir[(record - hd->system_records) * DPB_RECORD_SIZE],
+      DPB_RECORD_SIZE);
+    return 0;
+  }
+
+  block = NULL;
+  if (hostdir_locate(hd, record, &b, &offset) == 0) {
+    block = hostdir_block(hd, b, false);
+    if (block == NULL && hd->origin_file[b] >= 0) {
+      return -1; /* Out of memory. */
+    }
+  }
+  if (block == NULL) {
+    memset(data, HOSTDIR_UNUSED, DPB_RECORD_SIZE);
+  } else {
+    memcpy(data, &block[offset], DPB_RECORD_SIZE);
+  }
+  return 0;
+}
+
+
+
+int hostdir_write(hostdir_t *hd, uint32_t record, const uint8_t data[])
+{
+  uint32_t b, offset;
+  uint8_t *block;
+
+  if (record < hd->system_records) {
+    memcpy(&hd->system[record * DPB_RECORD_SIZE], data, DPB_RECORD_SIZE);
+    return 0;
+  }
+  if (record - hd->system_records < hd->dir_records) {
+    record -= hd->system_records;
+    memcpy(&hd->dir[record * DPB_RECORD_SIZE], data, DPB_RECORD_SIZE);
+    if (hd->sync) {
+      return hostdir_dir_sync(hd,
+        record * (DPB_RECORD_SIZE / HOSTDIR_ENTRY_SIZE),
+        DPB_RECORD_SIZE / HOSTDIR_ENTRY_SIZE);
+    }
+    return 0;
+  }
+
+  if (hostdir_locate(hd, record, &b, &offset) != 0) {
+    return 0; /* Beyond the last block, just ignore. */
+  }
+  block = hostdir_block(hd, b, true);
+  if (block == NULL) {
+    return -1;
+  }
+  memcpy(&block[offset], data, DPB_RECORD_SIZE);
+  if (hd->sync && ! hd->dirty[b]) {
+    hd->dirty[b] = true;
+    hd->dirty_list[hd->dirty_count++] = b;
+  }
+  return 0;
+}
+
+
+
@@ -0,0 +1,15 @@
+#ifndef _HOSTDIR_H
+#define _HOSTDIR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "dpb.h"
+
+typedef struct hostdir_s hostdir_t;
+
+hostdir_t *hostdir_open(const char *path, const dpb_t *dpb, bool sync);
+void hostdir_close(hostdir_t *hd);
+int hostdir_read(hostdir_t *hd, uint32_t record, uint8_t data[]);
+int hostdir_write(hostdir_t *hd, uint32_t record, const uint8_t data[]);
+
+#endif /* _HOSTDIR_H */
@@ -1,8 +1,8 @@
+#include <stdio.h>
 #include <stdint.h>
 #include "io.h"
 #include "mem.h"
-#include "disk.h"
-#include "console.h"
+#include "dpb.h"
 #include "panic.h"
 
 
@@ -10,37 +10,287 @@
 /* Input/Output ports as used in the CBIOS */
 #define IO_PORT_VIRTUAL_CONSOLE_STATUS 0x00 /* Console status */
 #define IO_PORT_VIRTUAL_CONSOLE_IO     0x01 /* Console input/output */
-#define IO_PORT_VIRTUAL_DISK_SELECT    0x10 /* Disk   0 to 3 */
-#define IO_PORT_VIRTUAL_DISK_TRACK     0x11 /* Track  0 to 76 */
-#define IO_PORT_VIRTUAL_DISK_SECTOR    0x12 /* Sector 1 to 26 */
+#define IO_PORT_VIRTUAL_LIST           0x02 /* List output/status */
+#define IO_PORT_VIRTUAL_PUNCH          0x03 /* Punch output */
+#define IO_PORT_VIRTUAL_READER         0x04 /* Reader input */
+#define IO_PORT_VIRTUAL_BLOCK_IO       0x05 /* Perform block transfer */
+#define IO_PORT_VIRTUAL_BLOCK_ADDR_L   0x06 /* Block address low */
+#define IO_PORT_VIRTUAL_BLOCK_ADDR_H   0x07 /* Block address high */
+#define IO_PORT_VIRTUAL_BLOCK_LEN_L    0x08 /* Block length low */
+#define IO_PORT_VIRTUAL_BLOCK_LEN_H    0x09 /* Block length high */
+#define IO_PORT_VIRTUAL_BANK_SELECT    0x0A /* Memory bank select */
+#define IO_PORT_VIRTUAL_BANK_COUNT     0x0B /* Memory banks present */
+#define IO_PORT_VIRTUAL_DISK_SELECT    0x10 /* Disk   0 to 15 */
+#define IO_PORT_VIRTUAL_DISK_TRACK     0x11 /* Track  low */
+#define IO_PORT_VIRTUAL_DISK_SECTOR    0x12 /* Sector 1 to 128 */
 #define IO_PORT_VIRTUAL_DISK_DMA_L     0x13 /* DMA low address */
 #define IO_PORT_VIRTUAL_DISK_DMA_H     0x14 /* DMA high address */
 #define IO_PORT_VIRTUAL_DISK_IO        0x15 /* Perform disk I/O */
+#define IO_PORT_VIRTUAL_DISK_TRACK_H   0x16 /* Track  high */
 
 
 
-static uint8_t io_disk_select = 0;
-static uint8_t io_disk_track  = 0;
-static uint8_t io_disk_sector = 0;
-static uint16_t io_disk_dma   = 0;
-static uint8_t io_disk_status = 0;
+/* LIST, PUNCH and READER go to host files through stdio buffering, and
+   block transfers move a whole buffer per port write. Without a file the
+   output is dropped and the reader is at end of file. */
+#define IO_BLOCK_BUFFER_SIZE 4096
+#define IO_READER_EOF 0x1A
 
 
 
-uint8_t io_read(uint8_t port, uint8_t upper_address)
+void io_init(io_t *io, panic_t *panic,
+  const io_console_t *console, void *console_context,
+  const io_disk_t *disk, void *disk_context)
+{
+  int i;
+
+  io->console = console;
+  io->console_context = console_context;
+  io->disk = disk;
+  io->disk_context = disk_context;
+  io->panic = panic;
+  io->blocked = false;
+
+  io->disk_select = 0;
+  io->disk_track = 0;
+  io->disk_sector = 0;
+  io->disk_dma = 0;
+  io->disk_status = 0;
+  io->disk_tables = 0;
+
+  for (i = 0; i < IO_DEVICES; i++) {
+    io->device[i] = NULL;
+  }
+  io->block_address = 0;
+  io->block_length = 0;
+}
+
+
+
+static void io_disk_setup(io_t *io, mem_t *mem)
+{
+  const dpb_t *dpb[DPB_DRIVES];
+  int i;
+
+  for (i = 0; i < DPB_DRIVES; i++) {
+    dpb[i] = io->disk->dpb(io->disk_context, i);
+  }
+
+  if (dpb_setup(mem, io->disk_dma, dpb) != 0) {
+    panic_raise(io->panic, "Disk tables do not fit in CBIOS memory at: %04x\n",
+      io->disk_dma);
+  }
+  io->disk_tables = io->disk_dma;
+}
+
+
+
+static int io_disk_read(io_t *io, mem_t *mem)
+{
+  uint8_t record[DPB_RECORD_SIZE];
+  uint8_t *data;
+  int result;
+
+  if (io->disk_select >= DPB_DRIVES) {
+    return -1;
+  }
+
+  /* Straight into the Z80 memory unless split between pages. */
+  data = mem_area(mem, io->disk_dma, DPB_RECORD_SIZE);
+  if (data != NULL) {
+    return io->disk->read(io->disk_context, io->disk_select, io->disk_track,
+      io->disk_sector, data);
+  }
+  result = io->disk->read(io->disk_context, io->disk_select, io->disk_track,
+    io->disk_sector, record);
+  if (result != 0) {
+    return result;
+  }
+  mem_write_area(mem, io->disk_dma, record, DPB_RECORD_SIZE);
+  return 0;
+}
+
+
+
+static int io_disk_write(io_t *io, mem_t *mem)
+{
+  uint8_t record[DPB_RECORD_SIZE];
+  uint8_t *data;
+
+  if (io->disk_select >= DPB_DRIVES) {
+    return -1;
+  }
+
+  data = mem_area(mem, io->disk_dma, DPB_RECORD_SIZE);
+  if (data == NULL) {
+    mem_read_area(mem, io->disk_dma, record, DPB_RECORD_SIZE);
+    data = record;
+  }
+  return io->disk->write(io->disk_context, io->disk_select, io->disk_track,
+    io->disk_sector, data);
+}
+
+
+
+static void io_disk_done(io_t *io, int result)
+{
+  if (result == IO_DISK_PENDING) {
+    io->blocked = true; /* The status is set when it is retried. */
+  } else {
+    io->disk_status = (result == 0) ? 0 : 1;
+  }
+}
+
+
+
+uint16_t io_disk_dph(io_t *io, uint8_t disk_no)
+{
+  /* Disk parameter headers are placed first in the tables. */
+  if (io->disk_tables == 0 || disk_no >= DPB_DRIVES ||
+    io->disk->dpb(io->disk_context, disk_no) == NULL) {
+    return 0;
+  }
+  return io->disk_tables + (disk_no * 16);
+}
+
+
+
+int io_device_open(io_t *io, io_device_t device, const char *filename)
+{
+  FILE *fh;
+
+  fh = fopen(filename, (device == IO_DEVICE_READER) ? "rb" : "wb");
+  if (fh == NULL) {
+    return -1;
+  }
+  if (io->device[device] != NULL) {
+    fclose(io->device[device]);
+  }
+  io->device[device] = fh;
+  return 0;
+}
+
+
+
+void io_close(io_t *io)
+{
+  int i;
+
+  for (i = 0; i < IO_DEVICES; i++) {
+    if (io->device[i] != NULL) {
+      fclose(io->device[i]);
+      io->device[i] = NULL;
+    }
+  }
+}
+
+
+
+void io_list(io_t *io, uint8_t value)
+{
+  if (io->device[IO_DEVICE_LIST] != NULL) {
+    fputc(value, io->device[IO_DEVICE_LIST]);
+  }
+}
+
+
+
+void io_punch(io_t *io, uint8_t value)
+{
+  if (io->device[IO_DEVICE_PUNCH] != NULL) {
+    fputc(value, io->device[IO_DEVICE_PUNCH]);
+  }
+}
+
+
+
+uint8_t io_reader(io_t *io)
+{
+  int c;
+
+  if (io->device[IO_DEVICE_READER] == NULL) {
+    return IO_READER_EOF;
+  }
+  c = fgetc(io->device[IO_DEVICE_READER]);
+  return (c == EOF) ? IO_READER_EOF : c;
+}
+
+
+
+static void io_block(io_t *io, io_device_t device, mem_t *mem)
+{
+  uint8_t buffer[IO_BLOCK_BUFFER_SIZE];
+  FILE *fh = io->device[device];
+  uint32_t length, done, n;
+
+  /* Stop at the top of memory instead of wrapping. */
+  length = io->block_length;
+  if (length > 0x10000U - io->block_address) {
+    length = 0x10000U - io->block_address;
+  }
+
+  done = 0;
+  while (done < length) {
+    n = length - done;
+    if (n > IO_BLOCK_BUFFER_SIZE) {
+      n = IO_BLOCK_BUFFER_SIZE;
+    }
+    if (device == IO_DEVICE_READER) {
+      n = (fh != NULL) ? fread(buffer, 1, n, fh) : 0;
+      if (n == 0) {
+        break;
+      }
+      mem_write_area(mem, io->block_address + done, buffer, n);
+    } else {
+      mem_read_area(mem, io->block_address + done, buffer, n);
+      if (fh != NULL) {
+        fwrite(buffer, 1, n, fh);
+      }
+    }
+    done += n;
+  }
+  io->block_length = done;
+}
+
+
+
+uint8_t io_read(io_t *io, uint8_t port, uint8_t upper_address, mem_t *mem)
 {
   switch (port) {
   case IO_PORT_VIRTUAL_CONSOLE_STATUS:
-    return console_status();
+    return io->console->status(io->console_context);
 
   case IO_PORT_VIRTUAL_CONSOLE_IO:
-    return console_read();
+    return io->console->read(io->console_context);
+
+  case IO_PORT_VIRTUAL_LIST:
+    return 0xFF; /* Always ready. */
+
+  case IO_PORT_VIRTUAL_READER:
+    return io_reader(io);
+
+  case IO_PORT_VIRTUAL_BLOCK_LEN_L:
+    return io->block_length & 0xFF;
+
+  case IO_PORT_VIRTUAL_BLOCK_LEN_H:
+    return io->block_length >> 8;
+
+  case IO_PORT_VIRTUAL_BANK_SELECT:
+    return mem->bank_selected;
+
+  case IO_PORT_VIRTUAL_BANK_COUNT:
+    return mem->banks;
+
+  case IO_PORT_VIRTUAL_DISK_SELECT:
+    return (io->disk_select < DPB_DRIVES &&
+      io->disk->dpb(io->disk_context, io->disk_select) != NULL) ? 0 : 1;
 
   case IO_PORT_VIRTUAL_DISK_IO:
-    return io_disk_status;
+    return io->disk_status;
 
   default:
-    panic("Unknown IO port read: %02x (upper: %02x)\n", port, upper_address);
+    panic_raise(io->panic, "Unknown IO port read: %02x (upper: %02x)\n",
+      port, upper_address);
     break;
   }
 
@@ -49,57 +299,96 @@ uint8_t io_read(uint8_t port, uint8_t upper_address)
 
 
 
-void io_write(uint8_t port, uint8_t upper_address, uint8_t value, mem_t *mem)
+void io_write(io_t *io, uint8_t port, uint8_t upper_address, uint8_t value,
+  mem_t *mem)
 {
   switch (port) {
   case IO_PORT_VIRTUAL_CONSOLE_IO:
-    console_write(value);
+    io->console->write(io->console_context, value);
+    break;
+
+  case IO_PORT_VIRTUAL_LIST:
+    io_list(io, value);
+    break;
+
+  case IO_PORT_VIRTUAL_PUNCH:
+    io_punch(io, value);
+    break;
+
+  case IO_PORT_VIRTUAL_BLOCK_ADDR_L:
+    io->block_address = (io->block_address & 0xFF00) | value;
+    break;
+
+  case IO_PORT_VIRTUAL_BLOCK_ADDR_H:
+    io->block_address = (io->block_address & 0x00FF) | (value << 8);
+    break;
+
+  case IO_PORT_VIRTUAL_BLOCK_LEN_L:
+    io->block_length = (io->block_length & 0xFF00) | value;
+    break;
+
+  case IO_PORT_VIRTUAL_BLOCK_LEN_H:
+    io->block_length = (io->block_length & 0x00FF) | (value << 8);
+    break;
+
+  case IO_PORT_VIRTUAL_BLOCK_IO:
+    if (value == 0x01) {
+      io_block(io, IO_DEVICE_READER, mem);
+    } else if (value == 0x02) {
+      io_block(io, IO_DEVICE_PUNCH, mem);
+    } else if (value == 0x03) {
+      io_block(io, IO_DEVICE_LIST, mem);
+    } else {
+      panic_raise(io->panic, "Unhandled virtual block IO: %02x\n", value);
+    }
+    break;
+
+  case IO_PORT_VIRTUAL_BANK_SELECT:
+    mem_bank_select(mem, value);
     break;
 
   case IO_PORT_VIRTUAL_DISK_SELECT:
-    io_disk_select = value;
+    io->disk_select = value;
     break;
 
   case IO_PORT_VIRTUAL_DISK_TRACK:
-    io_disk_track = value;
+    io->disk_track = (io->disk_track & 0xFF00) | value;
+    break;
+
+  case IO_PORT_VIRTUAL_DISK_TRACK_H:
+    io->disk_track = (io->disk_track & 0x00FF) | (value << 8);
     break;
 
   case IO_PORT_VIRTUAL_DISK_SECTOR:
-    io_disk_sector = value;
+    io->disk_sector = value;
     break;
 
   case IO_PORT_VIRTUAL_DISK_DMA_L:
-    io_disk_dma = (io_disk_dma & 0xFF00) | value;
+    io->disk_dma = (io->disk_dma & 0xFF00) | value;
     break;
 
   case IO_PORT_VIRTUAL_DISK_DMA_H:
-    io_disk_dma = (io_disk_dma & 0x00FF) | (value << 8);
+    io->disk_dma = (io->disk_dma & 0x00FF) | (value << 8);
     break;
 
   case IO_PORT_VIRTUAL_DISK_IO:
     if (value == 0x01) { /* Read */
-      if (0 == disk_sector_read(io_disk_select, io_disk_track, io_disk_sector,
-        mem, io_disk_dma)) {
-        io_disk_status = 0;
-      } else {
-        io_disk_status = 1;
-      }
+      io_disk_done(io, io_disk_read(io, mem));
 
     } else if (value == 0x02) { /* Write */
-      if (0 == disk_sector_write(io_disk_select, io_disk_track, io_disk_sector,
-        mem, io_disk_dma)) {
-        io_disk_status = 0;
-      } else {
-        io_disk_status = 1;
-      }
+      io_disk_done(io, io_disk_write(io, mem));
+
+    } else if (value == 0x03) { /* Setup disk tables at DMA address */
+      io_disk_setup(io, mem);
 
     } else {
-      panic("Unhandled virtual disk IO: %02x\n", value);
+      panic_raise(io->panic, "Unhandled virtual disk IO: %02x\n", value);
     }
     break;
 
   default:
-    panic("Unknown IO port write: %02x (upper: %02x) (value: %02x)\n",
+    panic_raise(io->panic,
+      "Unknown IO port write: %02x (upper: %02x) (value: %02x)\n",
       port, upper_address, value);
     break;
   }
@@ -1,10 +1,76 @@
 #ifndef _IO_H
 #define _IO_H
 
+#include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "mem.h"
+#include "dpb.h"
+#include "panic.h"
 
-uint8_t io_read(uint8_t port, uint8_t upper_address);
-void io_write(uint8_t port, uint8_t upper_address, uint8_t value, mem_t *mem);
+typedef enum {
+  IO_DEVICE_LIST,
+  IO_DEVICE_PUNCH,
+  IO_DEVICE_READER,
+  IO_DEVICES,
+} io_device_t;
+
+/* Console backend, called with the context given to io_init(). */
+typedef struct io_console_s {
+  uint8_t (*status)(void *context); /* 0xFF if a key is waiting, else 0x00. */
+  uint8_t (*read)(void *context); /* Waits for a key, or blocks. */
+  void (*write)(void *context, uint8_t value);
+} io_console_t;
+
+/* Disk backend, called with the context given to io_init(). Sectors are
+   128 byte records, numbered from 1 as seen by the CBIOS. The system is
+   called once when a machine is started with the CP/M binary for the
+   reserved tracks, and may be NULL if the backend provides them itself.
+   A read or write that can't be done yet may return IO_DISK_PENDING, the
+   machine then blocks and makes the same call again on its next run. */
+#define IO_DISK_PENDING 1
+
+typedef struct io_disk_s {
+  const dpb_t *(*dpb)(void *context, uint8_t disk_no); /* NULL if absent. */
+  int (*read)(void *context, uint8_t disk_no,
+    uint16_t track_no, uint8_t sector_no, uint8_t data[]);
+  int (*write)(void *context, uint8_t disk_no,
+    uint16_t track_no, uint8_t sector_no, const uint8_t data[]);
+  uint32_t (*dir_generation)(void *context, uint8_t disk_no);
+  int (*system)(void *context, const uint8_t data[], uint16_t size);
+} io_disk_t;
+
+typedef struct io_s {
+  const io_console_t *console;
+  void *console_context;
+  const io_disk_t *disk;
+  void *disk_context;
+  panic_t *panic;
+  bool blocked; /* Set when the port access is to be retried later. */
+
+  uint8_t disk_select;
+  uint16_t disk_track;
+  uint8_t disk_sector;
+  uint16_t disk_dma;
+  uint8_t disk_status;
+  uint16_t disk_tables;
+
+  FILE *device[IO_DEVICES];
+  uint16_t block_address;
+  uint16_t block_length;
+} io_t;
+
+void io_init(io_t *io, panic_t *panic,
+  const io_console_t *console, void *console_context,
+  const io_disk_t *disk, void *disk_context);
+uint8_t io_read(io_t *io, uint8_t port, uint8_t upper_address, mem_t *mem);
+uint16_t io_disk_dph(io_t *io, uint8_t disk_no);
+void io_write(io_t *io, uint8_t port, uint8_t upper_address, uint8_t value,
+  mem_t *mem);
+int io_device_open(io_t *io, io_device_t device, const char *filename);
+void io_close(io_t *io);
+void io_list(io_t *io, uint8_t value);
+void io_punch(io_t *io, uint8_t value);
+uint8_t io_reader(io_t *io);
 
 #endif /* _IO_H */
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "kaytil.h"
+#include "z80.h"
+#include "mem.h"
+#include "io.h"
+#include "bdos.h"
+#include "panic.h"
+
+struct kaytil_machine_s {
+  z80_t z80;
+  mem_t mem;
+  io_t io;
+  bdos_t bdos;
+  panic_t panic;
+  bool native_bdos;
+  uint64_t instructions; /* Before the current run. */
+  uint32_t run; /* Instructions of the current run. */
+  uint32_t remaining; /* Left of them, cleared to stop early. */
+  uint8_t *coverage;
+  uint32_t coverage_mask;
+  uint16_t coverage_prev;
+};
+
+struct kaytil_snapshot_s {
+  z80_t z80;
+  mem_snapshot_t mem;
+  io_t io;
+  bdos_t bdos; /* Without the directory caches. */
+  panic_t panic;
+  uint64_t instructions;
+};
+
+
+
+kaytil_machine_t *kaytil_create(const kaytil_config_t *config)
+{
+  kaytil_machine_t *machine;
+  uint8_t system[KAYTIL_SYSTEM_SIZE];
+
+  if (config->cpm22_size > (KAYTIL_CBIOS_ADDRESS - KAYTIL_CPM22_ADDRESS) ||
+    config->cbios_size > (UINT16_MAX + 1 - KAYTIL_CBIOS_ADDRESS)) {
+    return NULL;
+  }
+
+  machine = malloc(sizeof(kaytil_machine_t));
+  if (machine == NULL) {
+    return NULL;
+  }
+
+  panic_init(&machine->panic);
+  z80_init(&machine->z80, &machine->panic);
+#ifndef DISABLE_Z80_TRACE
+  z80_trace_init(&machine->z80);
+#endif /* DISABLE_Z80_TRACE */
+  mem_init(&machine->mem, &machine->panic);
+  io_init(&machine->io, &machine->panic,
+    config->console, config->console_context,
+    config->disk, config->disk_context);
+  bdos_init(&machine->bdos, &machine->io);
+  machine->native_bdos = config->native_bdos;
+  machine->instructions = 0;
+  machine->run = 0;
+  machine->remaining = 0;
+  machine->coverage = NULL;
+  machine->coverage_mask = 0;
+  machine->coverage_prev = 0;
+
+  if (mem_banks_enable(&machine->mem, config->banks) != 0) {
+    kaytil_destroy(machine);
+    return NULL;
+  }
+
+  /* Load CP/M 2.2 and CBIOS. */
+  mem_write_area(&machine->mem, KAYTIL_CPM22_ADDRESS,
+    config->cpm22, config->cpm22_size);
+  mem_write_area(&machine->mem, KAYTIL_CBIOS_ADDRESS,
+    config->cbios, config->cbios_size);
+
+  /* Machines booted from the same images then start out sharing all of
+     their memory, each only keeping the pages it writes afterwards. */
+  mem_share(&machine->mem);
+
+  /* Need to set the PC directly to the BIOS,
+     since this one will initialize the data area in the zero page. */
+  machine->z80.pc = KAYTIL_CBIOS_ADDRESS;
+
+  /* Load CP/M into the disks system sectors so the BIOS can reload it later,
+     which is required for other programs that may use this memory area. */
+  if (config->disk->system != NULL) {
+    mem_read_area(&machine->mem, KAYTIL_CPM22_ADDRESS, system,
+      KAYTIL_SYSTEM_SIZE);
+    if (config->disk->system(config->disk_context, system,
+      KAYTIL_SYSTEM_SIZE) != 0) {
+      kaytil_destroy(machine);
+      return NULL;
+    }
+  }
+
+  return machine;
+}
+
+
+
+void kaytil_destroy(kaytil_machine_t *machine)
+{
+  io_close(&machine->io);
+  bdos_destroy(&machine->bdos);
+  mem_destroy(&machine->mem);
+  free(machine);
+}
+
+
+
+int kaytil_run(kaytil_machine_t *machine, uint32_t instructions)
+{
+  if (machine->panic.raised) {
+    return KAYTIL_RUN_ERROR;
+  }
+
+  machine->io.blocked = false;
+  machine->run = instructions;
+  machine->remaining = instructions;
+  while (machine->remaining > 0) {
+    machine->remaining--;
+    if (machine->native_bdos && machine->z80.pc == BDOS_ENTRY) {
+      bdos_trap(&machine->bdos, &machine->z80, &machine->mem);
+      if (machine->io.blocked) {
+        break; /* Called again with the same registers. */
+      }
+    }
+    z80_execute(&machine->z80, &machine->mem, &machine->io);
+    if (machine->coverage != NULL) {
+      machine->coverage[(machine->z80.pc ^ machine->coverage_prev) &
+        machine->coverage_mask]++;
+      machine->coverage_prev = machine->z80.pc >> 1;
+    }
+    if (machine->panic.raised || machine->io.blocked) {
+      break;
+    }
+  }
+
+  machine->instructions += machine->run - machine->remaining;
+  machine->run = 0;
+  machine->remaining = 0;
+  if (machine->panic.raised) {
+    return KAYTIL_RUN_ERROR;
+  }
+  if (machine->io.blocked) {
+    machine->instructions--; /* Not done, it is retried on the next run. */
+    return KAYTIL_RUN_BLOCKED;
+  }
+  return KAYTIL_RUN_DONE;
+}
+
+
+
+kaytil_snapshot_t *kaytil_snapshot(kaytil_machine_t *machine)
+{
+  kaytil_snapshot_t *snapshot;
+
+  snapshot = malloc(sizeof(kaytil_snapshot_t));
+  if (snapshot == NULL) {
+    return NULL;
+  }
+  if (mem_snapshot(&machine->mem, &snapshot->mem) != 0) {
+    mem_snapshot_free(&snapshot->mem);
+    free(snapshot);
+    return NULL;
+  }
+  snapshot->z80 = machine->z80;
+  snapshot->io = machine->io;
+  snapshot->bdos = machine->bdos;
+  memset(snapshot->bdos.dir, 0, sizeof(snapshot->bdos.dir));
+  snapshot->panic = machine->panic;
+  snapshot->instructions = machine->instructions;
+  return snapshot;
+}
+
+
+
+void kaytil_restore(kaytil_machine_t *machine,
+  const kaytil_snapshot_t *snapshot)
+{
+  mem_restore(&machine->mem, &snapshot->mem);
+  machine->z80 = snapshot->z80;
+  machine->io = snapshot->io;
+  bdos_restore(&machine->bdos, &snapshot->bdos);
+  machine->panic = snapshot->panic;
+  machine->instructions = snapshot->instructions;
+  machine->run = 0;
+  machine->remaining = 0;
+  machine->coverage_prev = 0;
+}
+
+
+
+void kaytil_snapshot_free(kaytil_snapshot_t *snapshot)
+{
+  mem_snapshot_free(&snapshot->mem);
+  free(snapshot);
+}
+
+
+
+void kaytil_coverage(kaytil_machine_t *machine, uint8_t map[],
+  uint32_t size)
+{
+  machine->coverage = map;
+  machine->coverage_mask = size - 1;
+  machine->coverage_prev = 0;
+}
+
+
+
+void kaytil_stop(kaytil_machine_t *machine)
+{
+  machine->run -= machine->remaining;
+  machine->remaining = 0;
+}
+
+
+
+void kaytil_block(kaytil_machine_t *machine)
+{
+  machine->io.blocked = true;
+}
+
+
+
+const char *kaytil_error(kaytil_machine_t *machine)
+{
+  return machine->panic.raised ? machine->panic.message : NULL;
+}
+
+
+
+uint64_t kaytil_instructions(kaytil_machine_t *machine)
+{
+  /* Also counts the current run when called from a backend. */
+  return machine->instructions + (machine->run - machine->remaining);
+}
+
+
+
+int kaytil_device_open(kaytil_machine_t *machine, io_device_t device,
+  const char *filename)
+{
+  return io_device_open(&machine->io, device, filename);
+}
+
+
+
+uint32_t kaytil_private_pages(kaytil_machine_t *machine)
+{
+  mem_stats_t stats;
+
+  mem_stats(&machine->mem, &stats);
+  return stats.private;
+}
+
+
+
+void kaytil_stats_dump(kaytil_machine_t *machine, FILE *fh)
+{
+  mem_stats_dump(&machine->mem, fh);
+}
+
+
+
+void kaytil_dump(kaytil_machine_t *machine, FILE *fh)
+{
+#ifndef DISABLE_Z80_TRACE
+  fprintf(fh, "\n");
+
+  fprintf(fh, "Stack:\n");
+  mem_dump(fh, &machine->mem,
+    (machine->z80.sp & 0xFFF0) - 0x20,
+    (machine->z80.sp & 0xFFF0) + 0x2F);
+
+  fprintf(fh, "Trace:\n");
+  z80_trace_dump(fh, &machine->z80);
+  z80_dump(fh, &machine->z80, &machine->mem);
+  fprintf(fh, "\n");
+#else
+  (void)machine;
+  (void)fh;
+#endif /* DISABLE_Z80_TRACE */
+}
@@ -0,0 +1,84 @@
+#ifndef _KAYTIL_H
+#define _KAYTIL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "io.h"
+
+/* Embeddable machine: a Z80 with memory, I/O and native BDOS, running
+   CP/M 2.2 with the console and disks provided by the caller as backends.
+   Machines share no mutable state, so any number can be run in the same
+   process, each from one thread at a time. Fatal emulation errors stop
+   the machine and are returned instead of ending the process. */
+
+#define KAYTIL_CPM22_ADDRESS 0xE400
+#define KAYTIL_CBIOS_ADDRESS 0xFA00
+#define KAYTIL_SYSTEM_SIZE 0x1600 /* CCP and BDOS, kept on the system tracks. */
+
+/* Results of kaytil_run(). */
+#define KAYTIL_RUN_DONE 0 /* Ran all the instructions, or stopped early. */
+#define KAYTIL_RUN_ERROR -1
+#define KAYTIL_RUN_BLOCKED 1 /* Waiting for a backend, run again to retry. */
+
+typedef struct kaytil_machine_s kaytil_machine_t;
+
+typedef struct kaytil_config_s {
+  const uint8_t *cpm22; /* Loaded at KAYTIL_CPM22_ADDRESS. */
+  uint16_t cpm22_size;
+  const uint8_t *cbios; /* Loaded at KAYTIL_CBIOS_ADDRESS. */
+  uint16_t cbios_size;
+  const io_console_t *console;
+  void *console_context;
+  const io_disk_t *disk;
+  void *disk_context;
+  bool native_bdos;
+  uint8_t banks; /* 1 for no banking. */
+} kaytil_config_t;
+
+kaytil_machine_t *kaytil_create(const kaytil_config_t *config);
+void kaytil_destroy(kaytil_machine_t *machine);
+
+/* Runs up to the given number of instructions. When a backend can't go on
+   without waiting, the instruction needing it is parked undone and the run
+   ends with KAYTIL_RUN_BLOCKED. The next run starts by retrying it, so a
+   single thread can drive many machines, running each when what it waits
+   for is there. */
+int kaytil_run(kaytil_machine_t *machine, uint32_t instructions);
+
+/* Machine state to come back to, e.g. to run many inputs from the same
+   point. The memory stays shared with the machine, so a restore only puts
+   back the pages written since. The backends are not part of it, the
+   caller handles them. */
+typedef struct kaytil_snapshot_s kaytil_snapshot_t;
+
+kaytil_snapshot_t *kaytil_snapshot(kaytil_machine_t *machine);
+void kaytil_restore(kaytil_machine_t *machine,
+  const kaytil_snapshot_t *snapshot);
+void kaytil_snapshot_free(kaytil_snapshot_t *snapshot);
+
+/* Counts the edges taken from one instruction to the next in map, at a
+   hash of the two PCs as AFL does. The size must be a power of two, and
+   a NULL map stops the counting. */
+void kaytil_coverage(kaytil_machine_t *machine, uint8_t map[],
+  uint32_t size);
+
+/* Called from a backend to end the current run early. */
+void kaytil_stop(kaytil_machine_t *machine);
+
+/* Called from a console read that has no key yet, whatever it returns is
+   ignored. Disk backends return IO_DISK_PENDING instead. */
+void kaytil_block(kaytil_machine_t *machine);
+
+const char *kaytil_error(kaytil_machine_t *machine);
+uint64_t kaytil_instructions(kaytil_machine_t *machine);
+int kaytil_device_open(kaytil_machine_t *machine, io_device_t device,
+  const char *filename);
+
+/* Memory pages of 4K the machine has written and holds a copy of, all
+   others are shared with the machines booted from the same images. */
+uint32_t kaytil_private_pages(kaytil_machine_t *machine);
+void kaytil_stats_dump(kaytil_machine_t *machine, FILE *fh);
+void kaytil_dump(kaytil_machine_t *machine, FILE *fh);
+
+#endif /* _KAYTIL_H */
@@ -0,0 +1,437 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "kdi.h"
+
+#define KDI_LZ_WINDOW 4095
+#define KDI_LZ_MATCH_MIN 3
+#define KDI_LZ_MATCH_MAX 18
+#define KDI_LZ_HASH_SIZE 4096
+#define KDI_LZ_CHAIN_MAX 32
+
+
+
+
+static uint16_t kdi_read_16(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8);
+}
+
+
+
+static uint32_t kdi_read_32(const uint8_t *p)
+{
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+
+static void kdi_write_16(uint8_t *p, uint16_t value)
+{
+  p[0] = value & 0xFF;
+  p[1] = value >> 8;
+}
+
+
+
+static void kdi_write_32(uint8_t *p, uint32_t value)
+{
+  p[0] = value & 0xFF;
+  p[1] = (value >> 8) & 0xFF;
+  p[2] = (value >> 16) & 0xFF;
+  p[3] = value >> 24;
+}
+
+
+
+static uint32_t kdi_bitmap_size(uint16_t tracks, uint16_t spt)
+{
+  return (((uint32_t)tracks * spt) + 7) / 8;
+}
+
+
+
+static const uint8_t *kdi_bitmap(kdi_t *kdi)
+{
+  return &kdi->data[KDI_HEADER_SIZE];
+}
+
+
+
+static const uint8_t *kdi_track_entry(kdi_t *kdi, uint16_t track_no)
+{
+  return &kdi->data[KDI_HEADER_SIZE + kdi_bitmap_size(kdi->tracks, kdi->spt) +
+    (track_no * KDI_TRACK_ENTRY_SIZE)];
+}
+
+
+
+static bool kdi_present(kdi_t *kdi, uint32_t sector)
+{
+  return (kdi_bitmap(kdi)[sector / 8] >> (sector % 8)) & 1;
+}
+
+
+
+bool kdi_detect(const uint8_t *data, uint32_t size)
+{
+  return size >= KDI_HEADER_SIZE && memcmp(data, "KDI1", 4) == 0;
+}
+
+
+
+void kdi_cache_init(kdi_cache_t *cache)
+{
+  int i;
+  for (i = 0; i < KDI_CACHE_TRACKS; i++) {
+    cache->entry[i].data = NULL;
+    cache->entry[i].used = 0;
+  }
+  cache->clock = 0;
+}
+
+
+
+int kdi_open(kdi_t *kdi, const uint8_t *data, uint32_t size,
+  kdi_cache_t *cache)
+{
+  if (! kdi_detect(data, size)) {
+    return -1;
+  }
+
+  kdi->data = data;
+  kdi->cache = cache;
+  kdi->size = size;
+  kdi->tracks = kdi_read_16(&data[4]);
+  kdi->spt = kdi_read_16(&data[6]);
+  kdi->filler = data[10];
+
+  if (kdi_read_16(&data[8]) != KDI_SECTOR_SIZE) {
+    return -1;
+  }
+  if (kdi->spt == 0 || kdi->spt > 255) {
+    return -1;
+  }
+  if (kdi_read_32(&data[12]) != size) {
+    return -1; /* Truncated. */
+  }
+  if (KDI_HEADER_SIZE + kdi_bitmap_size(kdi->tracks, kdi->spt) +
+    ((uint32_t)kdi->tracks * KDI_TRACK_ENTRY_SIZE) > size) {
+    return -1;
+  }
+  return 0;
+}
+
+
+
+static int kdi_lz_decode(const uint8_t *in, uint32_t in_size,
+  uint8_t *out, uint32_t out_size)
+{
+  uint32_t i, o, offset, length;
+  uint8_t control;
+  int bit;
+
+  i = 0;
+  o = 0;
+  while (o < out_size) {
+    if (i >= in_size) {
+      return -1;
+    }
+    control = in[i++];
+    for (bit = 0; bit < 8 && o < out_size; bit++) {
+      if (control & (1 << bit)) {
+        if (i >= in_size) {
+          return -1;
+        }
+        out[o++] = in[i++];
+      } else {
+        if (i + 2 > in_size) {
+          return -1;
+        }
+        offset = in[i] | ((in[i + 1] & 0xF0) << 4);
+        length = (in[i + 1] & 0x0F) + KDI_LZ_MATCH_MIN;
+        i += 2;
+        if (offset == 0 || offset > o || o + length > out_size) {
+          return -1;
+        }
+        while (length-- > 0) {
+          out[o] = out[o - offset];
+          o++;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+
+
+static uint8_t *kdi_track_get(kdi_t *kdi, uint16_t track_no,
+  const uint8_t *entry, uint32_t raw_size)
+{
+  kdi_cache_entry_t *cache, *entries = kdi->cache->entry;
+  int i, oldest;
+
+  oldest = 0;
+  for (i = 0; i < KDI_CACHE_TRACKS; i++) {
+    if (entries[i].data == kdi->data && entries[i].track_no == track_no) {
+      entries[i].used = ++kdi->cache->clock;
+      return entries[i].track;
+    }
+    if (entries[i].used < entries[oldest].used) {
+      oldest = i;
+    }
+  }
+
+  cache = &entries[oldest];
+  if (raw_size > sizeof(cache->track)) {
+    return NULL;
+  }
+  if (kdi_lz_decode(&kdi->data[kdi_read_32(&entry[0])], kdi_read_16(&entry[4]),
+    cache->track, raw_size) != 0) {
+    cache->data = NULL;
+    return NULL;
+  }
+  cache->data = kdi->data;
+  cache->track_no = track_no;
+  cache->used = ++kdi->cache->clock;
+  return cache->track;
+}
+
+
+
+int kdi_sector_read(kdi_t *kdi, uint16_t track_no, uint8_t sector_no,
+  uint8_t out[])
+{
+  const uint8_t *entry, *track;
+  uint32_t first, index, present, i;
+
+  if (track_no >= kdi->tracks || sector_no == 0 || sector_no > kdi->spt) {
+    return -1;
+  }
+
+  first = (uint32_t)track_no * kdi->spt;
+  if (! kdi_present(kdi, first + sector_no - 1)) {
+    memset(out, kdi->filler, KDI_SECTOR_SIZE);
+    return 0;
+  }
+
+  /* Position among the sectors stored for this track. */
+  index = 0;
+  present = 0;
+  for (i = 0; i < kdi->spt; i++) {
+    if (kdi_present(kdi, first + i)) {
+      if (i < (uint32_t)(sector_no - 1)) {
+        index++;
+      }
+      present++;
+    }
+  }
+
+  entry = kdi_track_entry(kdi, track_no);
+  if (kdi_read_32(&entry[0]) + kdi_read_16(&entry[4]) > kdi->size) {
+    return -1;
+  }
+
+  if (entry[6] == KDI_METHOD_STORED) {
+    if (kdi_read_16(&entry[4]) != present * KDI_SECTOR_SIZE) {
+      return -1;
+    }
+    track = &kdi->data[kdi_read_32(&entry[0])];
+  } else if (entry[6] == KDI_METHOD_LZ) {
+    track = kdi_track_get(kdi, track_no, entry, present * KDI_SECTOR_SIZE);
+    if (track == NULL) {
+      return -1;
+    }
+  } else {
+    return -1;
+  }
+
+  memcpy(out, &track[index * KDI_SECTOR_SIZE], KDI_SECTOR_SIZE);
+  return 0;
+}
+
+
+
+int kdi_expand(kdi_t *kdi, uint8_t *raw)
+{
+  uint16_t track_no, sector_no;
+
+  for (track_no = 0; track_no < kdi->tracks; track_no++) {
+    for (sector_no = 1; sector_no <= kdi->spt; sector_no++) {
+      if (kdi_sector_read(kdi, track_no, sector_no, raw) != 0) {
+        return -1;
+      }
+      raw += KDI_SECTOR_SIZE;
+    }
+  }
+  return 0;
+}
+
+
+
+/* Match finder state, only needed while creating an image. */
+typedef struct kdi_lz_s {
+  int32_t head[KDI_LZ_HASH_SIZE];
+  int32_t prev[KDI_TRACK_SIZE_MAX];
+} kdi_lz_t;
+
+
+
+static uint32_t kdi_lz_hash(const uint8_t *p)
+{
+  return ((p[0] << 4) ^ (p[1] << 2) ^ p[2]) & (KDI_LZ_HASH_SIZE - 1);
+}
+
+
+
+static uint32_t kdi_lz_encode(kdi_lz_t *lz, const uint8_t *in,
+  uint32_t in_size, uint8_t *out, uint32_t out_max)
+{
+  int32_t *head = lz->head;
+  int32_t *prev = lz->prev;
+  uint32_t i, o, control, best_length, best_offset, length, h;
+  int32_t candidate;
+  int bit, chain;
+
+  for (i = 0; i < KDI_LZ_HASH_SIZE; i++) {
+    head[i] = -1;
+  }
+
+  i = 0;
+  o = 0;
+  while (i < in_size) {
+    if (o + 1 + (8 * 2) > out_max) {
+      return 0; /* Does not get smaller. */
+    }
+    control = o++;
+    out[control] = 0;
+    for (bit = 0; bit < 8 && i < in_size; bit++) {
+      /* Longest match within the window, following the hash chain. */
+      best_length = 0;
+      best_offset = 0;
+      if (i + KDI_LZ_MATCH_MIN <= in_size) {
+        h = kdi_lz_hash(&in[i]);
+        candidate = head[h];
+        for (chain = 0; candidate >= 0 && chain < KDI_LZ_CHAIN_MAX &&
+          i - candidate <= KDI_LZ_WINDOW; chain++) {
+          length = 0;
+          while (length < KDI_LZ_MATCH_MAX && i + length < in_size &&
+            in[candidate + length] == in[i + length]) {
+            length++;
+          }
+          if (length > best_length) {
+            best_length = length;
+            best_offset = i - candidate;
+          }
+          candidate = prev[candidate];
+        }
+      }
+
+      if (best_length >= KDI_LZ_MATCH_MIN) {
+        out[o++] = best_offset & 0xFF;
+        out[o++] = ((best_offset >> 4) & 0xF0) |
+          (best_length - KDI_LZ_MATCH_MIN);
+      } else {
+        out[control] |= (1 << bit);
+        out[o++] = in[i];
+        best_length = 1;
+      }
+
+      /* Add the covered positions to the hash chains. */
+      while (best_length-- > 0) {
+        if (i + KDI_LZ_MATCH_MIN <= in_size) {
+          h = kdi_lz_hash(&in[i]);
+          prev[i] = head[h];
+          head[h] = i;
+        }
+        i++;
+      }
+    }
+  }
+  return o;
+}
+
+
+
+uint8_t *kdi_create(const uint8_t *raw, uint16_t tracks, uint16_t spt,
+  bool compress, uint32_t *size)
+{
+  uint8_t *kdi, *bitmap, *entry;
+  uint8_t track[KDI_TRACK_SIZE_MAX];
+  kdi_lz_t *lz;
+  uint32_t bitmap_size, next, sector, length, compressed;
+  uint16_t track_no, sector_no, i;
+  const uint8_t *p;
+
+  if (spt == 0 || spt > 255 ||
+    (uint32_t)spt * KDI_SECTOR_SIZE > KDI_TRACK_SIZE_MAX) {
+    return NULL;
+  }
+
+  /* Stored data is never larger than the raw image. */
+  bitmap_size = kdi_bitmap_size(tracks, spt);
+  next = KDI_HEADER_SIZE + bitmap_size + (tracks * KDI_TRACK_ENTRY_SIZE);
+  kdi = calloc(next + ((uint32_t)tracks * spt * KDI_SECTOR_SIZE), 1);
+  if (kdi == NULL) {
+    return NULL;
+  }
+  lz = NULL;
+  if (compress) {
+    lz = malloc(sizeof(kdi_lz_t));
+    if (lz == NULL) {
+      free(kdi);
+      return NULL;
+    }
+  }
+
+  memcpy(kdi, "KDI1", 4);
+  kdi_write_16(&kdi[4], tracks);
+  kdi_write_16(&kdi[6], spt);
+  kdi_write_16(&kdi[8], KDI_SECTOR_SIZE);
+  kdi[10] = 0xE5;
+  bitmap = &kdi[KDI_HEADER_SIZE];
+
+  for (track_no = 0; track_no < tracks; track_no++) {
+    length = 0;
+    for (sector_no = 0; sector_no < spt; sector_no++) {
+      sector = ((uint32_t)track_no * spt) + sector_no;
+      p = &raw[sector * KDI_SECTOR_SIZE];
+      for (i = 0; i < KDI_SECTOR_SIZE; i++) {
+        if (p[i] != 0xE5) {
+          break;
+        }
+      }
+      if (i < KDI_SECTOR_SIZE) {
+        bitmap[sector / 8] |= 1 << (sector % 8);
+        memcpy(&track[length], p, KDI_SECTOR_SIZE);
+        length += KDI_SECTOR_SIZE;
+      }
+    }
+
+    entry = &kdi[KDI_HEADER_SIZE + bitmap_size +
+      (track_no * KDI_TRACK_ENTRY_SIZE)];
+    kdi_write_32(&entry[0], next);
+    compressed = (compress && length > 0) ?
+      kdi_lz_encode(lz, track, length, &kdi[next], length) : 0;
+    if (compressed > 0 && compressed < length) {
+      kdi_write_16(&entry[4], compressed);
+      entry[6] = KDI_METHOD_LZ;
+      next += compressed;
+    } else {
+      memcpy(&kdi[next], track, length);
+      kdi_write_16(&entry[4], length);
+      entry[6] = KDI_METHOD_STORED;
+      next += length;
+    }
+  }
+
+  free(lz);
+  kdi_write_32(&kdi[12], next);
+  *size = next;
+  return kdi;
+}
+
+
+
@@ -0,0 +1,70 @@
+#ifndef _KDI_H
+#define _KDI_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Kaytil Disk Image, a sparse and optionally compressed container.
+
+   Header (16 bytes, little endian):
+     0  "KDI1"
+     4  Tracks
+     6  Sectors per track
+     8  Sector size (128)
+     10 Filler byte for sectors not stored (0xE5)
+     11 Reserved
+     12 Size of the whole file
+   Followed by the sector presence bitmap, one bit per sector in track
+   order with the LSB first, then the track table with an entry for each
+   track (32-bit data offset, 16-bit stored length, 8-bit method, 8-bit
+   reserved). The data for a track is the present sectors in order, either
+   stored as is (method 0) or LZ compressed (method 1). */
+
+#define KDI_HEADER_SIZE 16
+#define KDI_TRACK_ENTRY_SIZE 8
+#define KDI_SECTOR_SIZE 128
+
+#define KDI_METHOD_STORED 0
+#define KDI_METHOD_LZ     1
+
+/* Tracks decompressed at the same time, and largest track supported. */
+#ifndef KDI_CACHE_TRACKS
+#define KDI_CACHE_TRACKS 2
+#endif
+#ifndef KDI_TRACK_SIZE_MAX
+#define KDI_TRACK_SIZE_MAX (128 * KDI_SECTOR_SIZE)
+#endif
+
+/* Decompressed tracks, may be shared by any number of images. */
+typedef struct kdi_cache_entry_s {
+  const uint8_t *data; /* Image the track belongs to, NULL if unused. */
+  uint16_t track_no;
+  uint32_t used;
+  uint8_t track[KDI_TRACK_SIZE_MAX];
+} kdi_cache_entry_t;
+
+typedef struct kdi_cache_s {
+  kdi_cache_entry_t entry[KDI_CACHE_TRACKS];
+  uint32_t clock;
+} kdi_cache_t;
+
+typedef struct kdi_s {
+  const uint8_t *data;
+  kdi_cache_t *cache;
+  uint32_t size;
+  uint16_t tracks;
+  uint16_t spt;
+  uint8_t filler;
+} kdi_t;
+
+bool kdi_detect(const uint8_t *data, uint32_t size);
+void kdi_cache_init(kdi_cache_t *cache);
+int kdi_open(kdi_t *kdi, const uint8_t *data, uint32_t size,
+  kdi_cache_t *cache);
+int kdi_sector_read(kdi_t *kdi, uint16_t track_no, uint8_t sector_no,
+  uint8_t out[]);
+int kdi_expand(kdi_t *kdi, uint8_t *raw);
+uint8_t *kdi_create(const uint8_t *raw, uint16_t tracks, uint16_t spt,
+  bool compress, uint32_t *size);
+
+#endif /* _KDI_H */
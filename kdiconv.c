@@ -0,0 +1,237 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef _POSIX_C_SOURCE
+#include <getopt.h>
+#endif
+
+#include "dpb.h"
+#include "kdi.h"
+
+
+
+static uint8_t *file_read(const char *filename, uint32_t *size)
+{
+  FILE *fh;
+  long file_size;
+  uint8_t *data;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Unable to open '%s'\n", filename);
+    return NULL;
+  }
+  fseek(fh, 0, SEEK_END);
+  file_size = ftell(fh);
+  fseek(fh, 0, SEEK_SET);
+
+  data = malloc((file_size > 0) ? file_size : 1);
+  if (data == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    fclose(fh);
+    return NULL;
+  }
+  if (fread(data, sizeof(uint8_t), file_size, fh) != (size_t)file_size) {
+    fprintf(stderr, "Error: Unable to read '%s'\n", filename);
+    free(data);
+    fclose(fh);
+    return NULL;
+  }
+  fclose(fh);
+
+  *size = file_size;
+  return data;
+}
+
+
+
+static int file_write(const char *filename, const uint8_t *data,
+  uint32_t size)
+{
+  FILE *fh;
+
+  fh = fopen(filename, "wb");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Unable to open '%s'\n", filename);
+    return -1;
+  }
+  if (fwrite(data, sizeof(uint8_t), size, fh) != size) {
+    fprintf(stderr, "Error: Unable to write '%s'\n", filename);
+    fclose(fh);
+    return -1;
+  }
+  fclose(fh);
+  return 0;
+}
+
+
+
+static int convert_create(const char *in, const char *out,
+  const dpb_t *dpb, bool compress)
+{
+  uint8_t *data, *raw, *kdi;
+  uint32_t size, kdi_size;
+  int i;
+
+  data = file_read(in, &size);
+  if (data == NULL) {
+    return -1;
+  }
+
+  /* Select the geometry from the image size unless specified. */
+  if (dpb == NULL) {
+    dpb = &dpb_types[DPB_TYPE_8_SSSD];
+    for (i = 0; i < DPB_TYPES; i++) {
+      if (size == dpb_size(&dpb_types[i])) {
+        dpb = &dpb_types[i];
+        break;
+      }
+    }
+  }
+  if (size > dpb_size(dpb)) {
+    fprintf(stderr, "Error: '%s' is larger than the geometry\n", in);
+    free(data);
+    return -1;
+  }
+
+  /* Short images are padded like when loaded by the emulator. */
+  raw = malloc(dpb_size(dpb));
+  if (raw == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    free(data);
+    return -1;
+  }
+  memset(raw, 0xE5, dpb_size(dpb));
+  memcpy(raw, data, size);
+  free(data);
+
+  kdi = kdi_create(raw, dpb->tracks, dpb->spt, compress, &kdi_size);
+  free(raw);
+  if (kdi == NULL) {
+    fprintf(stderr, "Error: Unable to create KDI image\n");
+    return -1;
+  }
+
+  i = file_write(out, kdi, kdi_size);
+  if (i == 0) {
+    fprintf(stderr, "%s: %u -> %u bytes (%s)\n", out, dpb_size(dpb),
+      kdi_size, dpb->name);
+  }
+  free(kdi);
+  return i;
+}
+
+
+
+static int convert_expand(const char *in, const char *out)
+{
+  static kdi_cache_t cache;
+  uint8_t *data, *raw;
+  uint32_t size;
+  kdi_t kdi;
+  int result;
+
+  data = file_read(in, &size);
+  if (data == NULL) {
+    return -1;
+  }
+  kdi_cache_init(&cache);
+  if (kdi_open(&kdi, data, size, &cache) != 0) {
+    fprintf(stderr, "Error: '%s' is not a valid KDI image\n", in);
+    free(data);
+    return -1;
+  }
+
+  raw = malloc((uint32_t)kdi.tracks * kdi.spt * KDI_SECTOR_SIZE);
+  if (raw == NULL) {
+    fprintf(stderr, "Error: Out of memory\n");
+    free(data);
+    return -1;
+  }
+  if (kdi_expand(&kdi, raw) != 0) {
+    fprintf(stderr, "Error: '%s' is corrupt\n", in);
+    result = -1;
+  } else {
+    result = file_write(out, raw,
+      (uint32_t)kdi.tracks * kdi.spt * KDI_SECTOR_SIZE);
+  }
+
+  free(raw);
+  free(data);
+  return result;
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stderr, "Usage: %s <options> INPUT OUTPUT\n", progname);
+  fprintf(stderr, "Options:\n"
+     "  -c         Create compressed KDI image from raw INPUT (default)\n"
+     "  -s         Create sparse KDI image without compression\n"
+     "  -x         Expand KDI image INPUT to a raw image\n"
+     "  -g TYPE    Use geometry TYPE (sssd, dsdd or hd) for raw INPUT\n"
+     "\n"
+     "The geometry is otherwise selected from the size of the raw image.\n"
+     "\n");
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  int c;
+  bool expand = false;
+  bool compress = true;
+  const dpb_t *dpb = NULL;
+
+  while ((c = getopt(argc, argv, "csxg:h")) != -1) {
+    switch (c) {
+    case 'c':
+      compress = true;
+      expand = false;
+      break;
+
+    case 's':
+      compress = false;
+      expand = false;
+      break;
+
+    case 'x':
+      expand = true;
+      break;
+
+    case 'g':
+      dpb = dpb_find(optarg);
+      if (dpb == NULL) {
+        fprintf(stderr, "Error: Unknown geometry: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'h':
+      display_help(argv[0]);
+      return EXIT_SUCCESS;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 2) {
+    display_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  if (expand) {
+    c = convert_expand(argv[optind], argv[optind + 1]);
+  } else {
+    c = convert_create(argv[optind], argv[optind + 1], dpb, compress);
+  }
+  return (c == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/time.h>
+#include "latency.h"
+
+/* Keypress to display latency.
+
+   Each key taken by the emulation is followed from the time it arrived at
+   the host, to when it was read, to the first console output after that,
+   and finally to the flush that sent that output to the host. The time is
+   split on those points, and the number of Z80 instructions from the read
+   to the output is kept too. A key read before any output is only counted
+   as queued. Samples are kept as is and sorted for the report at exit. */
+
+#define LATENCY_SAMPLES_MIN 256
+#define LATENCY_HISTOGRAM_BUCKETS 12 /* Powers of two in milliseconds. */
+#define LATENCY_HISTOGRAM_WIDTH 40
+
+typedef enum {
+  LATENCY_QUEUED,
+  LATENCY_EMULATION,
+  LATENCY_OUTPUT,
+  LATENCY_TOTAL,
+  LATENCY_INSTRUCTIONS,
+  LATENCY_SERIES,
+} latency_series_t;
+
+typedef enum {
+  LATENCY_IDLE,
+  LATENCY_WAIT_WRITE,
+  LATENCY_WAIT_FLUSH,
+} latency_state_t;
+
+typedef struct latency_samples_s {
+  uint32_t *value;
+  uint32_t count;
+  uint32_t max;
+} latency_samples_t;
+
+static const char *latency_name[LATENCY_SERIES] = {
+  "Queued", "Emulation", "Output", "Total", "Instructions",
+};
+
+static bool latency_on = false;
+static latency_state_t latency_state = LATENCY_IDLE;
+static latency_samples_t latency_samples[LATENCY_SERIES];
+static uint32_t latency_keys = 0;
+static latency_counter_t latency_counter = NULL;
+static uint64_t latency_instructions = 0; /* Count when the key was read. */
+static struct timeval latency_arrival;
+static struct timeval latency_read;
+static struct timeval latency_written;
+
+
+
+static uint32_t latency_since(const struct timeval *then,
+  const struct timeval *now)
+{
+  long diff;
+
+  diff = ((now->tv_sec - then->tv_sec) * 1000000) +
+    (now->tv_usec - then->tv_usec);
+  return (diff < 0) ? 0 : diff;
+}
+
+
+
+static void latency_add(latency_series_t series, uint32_t value)
+{
+  latency_samples_t *samples = &latency_samples[series];
+  uint32_t *new;
+  uint32_t max;
+
+  if (samples->count >= samples->max) {
+    max = (samples->max == 0) ? LATENCY_SAMPLES_MIN : samples->max * 2;
+    new = realloc(samples->value, max * sizeof(uint32_t));
+    if (new == NULL) {
+      return; /* Just lose the sample. */
+    }
+    samples->value = new;
+    samples->max = max;
+  }
+  samples->value[samples->count++] = value;
+}
+
+
+
+void latency_enable(latency_counter_t counter)
+{
+  latency_counter = counter;
+  latency_on = true;
+}
+
+
+
+bool latency_enabled(void)
+{
+  return latency_on;
+}
+
+
+
+void latency_key(const struct timeval *arrival)
+{
+  if (! latency_on) {
+    return;
+  }
+
+  gettimeofday(&latency_read, NULL);
+  latency_arrival = *arrival;
+  latency_add(LATENCY_QUEUED, latency_since(arrival, &latency_read));
+  latency_instructions = latency_counter();
+  latency_keys++;
+  latency_state = LATENCY_WAIT_WRITE;
+}
+
+
+
+void latency_write(void)
+{
+  if (latency_state != LATENCY_WAIT_WRITE) {
+    return;
+  }
+
+  gettimeofday(&latency_written, NULL);
+  latency_add(LATENCY_EMULATION,
+    latency_since(&latency_read, &latency_written));
+  latency_add(LATENCY_INSTRUCTIONS, latency_counter() - latency_instructions);
+  latency_state = LATENCY_WAIT_FLUSH;
+}
+
+
+
+void latency_flush(void)
+{
+  struct timeval now;
+
+  if (latency_state != LATENCY_WAIT_FLUSH) {
+    return;
+  }
+
+  gettimeofday(&now, NULL);
+  latency_add(LATENCY_OUTPUT, latency_since(&latency_written, &now));
+  latency_add(LATENCY_TOTAL, latency_since(&latency_arrival, &now));
+  latency_state = LATENCY_IDLE;
+}
+
+
+
+static int latency_compare(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+
+
+static uint32_t latency_percentile(latency_samples_t *samples, int percent)
+{
+  uint32_t rank;
+
+  /* Nearest rank, on sorted samples. */
+  rank = ((samples->count * percent) + 99) / 100;
+  return samples->value[(rank > 0) ? rank - 1 : 0];
+}
+
+
+
+static void latency_histogram(FILE *fh, latency_samples_t *samples)
+{
+  uint32_t count[LATENCY_HISTOGRAM_BUCKETS];
+  uint32_t i, most, limit;
+  int bucket, last, bar;
+
+  memset(count, 0, sizeof(count));
+  for (i = 0; i < samples->count; i++) {
+    bucket = 0;
+    limit = 1000; /* Microseconds */
+    while (samples->value[i] >= limit &&
+      bucket < (LATENCY_HISTOGRAM_BUCKETS - 1)) {
+      limit *= 2;
+      bucket++;
+    }
+    count[bucket]++;
+  }
+
+  most = 1;
+  last = 0;
+  for (bucket = 0; bucket < LATENCY_HISTOGRAM_BUCKETS; bucket++) {
+    if (count[bucket] > most) {
+      most = count[bucket];
+    }
+    if (count[bucket] > 0) {
+      last = bucket;
+    }
+  }
+
+  fprintf(fh, "  Total histogram:\n");
+  limit = 1;
+  for (bucket = 0; bucket <= last; bucket++) {
+    if (bucket < (LATENCY_HISTOGRAM_BUCKETS - 1)) {
+      fprintf(fh, "    < %4ums %6u", limit, count[bucket]);
+    } else {
+      fprintf(fh, "    >=%4ums %6u", limit / 2, count[bucket]);
+    }
+    bar = (count[bucket] * LATENCY_HISTOGRAM_WIDTH) / most;
+    if (bar > 0) {
+      fputc(' ', fh);
+    }
+    for (; bar > 0; bar--) {
+      fputc('#', fh);
+    }
+    fputc('\n', fh);
+    limit *= 2;
+  }
+}
+
+
+
+void latency_dump(FILE *fh)
+{
+  latency_samples_t *samples;
+  int i;
+
+  fprintf(fh, "Keypress latency: %u keys, %u with output\n", latency_keys,
+    latency_samples[LATENCY_TOTAL].count);
+  if (latency_samples[LATENCY_QUEUED].count == 0) {
+    return;
+  }
+
+  fprintf(fh, "  %-12s %10s %10s %10s %10s\n",
+    "", "p50", "p95", "p99", "max");
+  for (i = 0; i < LATENCY_SERIES; i++) {
+    samples = &latency_samples[i];
+    if (samples->count == 0) {
+      continue;
+    }
+    qsort(samples->value, samples->count, sizeof(uint32_t), latency_compare);
+    if (i == LATENCY_INSTRUCTIONS) {
+      fprintf(fh, "  %-12s %10u %10u %10u %10u\n", latency_name[i],
+        latency_percentile(samples, 50),
+        latency_percentile(samples, 95),
+        latency_percentile(samples, 99),
+        samples->value[samples->count - 1]);
+    } else {
+      fprintf(fh, "  %-12s %8.2fms %8.2fms %8.2fms %8.2fms\n",
+        latency_name[i],
+        latency_percentile(samples, 50) / 1000.0,
+        latency_percentile(samples, 95) / 1000.0,
+        latency_percentile(samples, 99) / 1000.0,
+        samples->value[samples->count - 1] / 1000.0);
+    }
+  }
+
+  if (latency_samples[LATENCY_TOTAL].count > 0) {
+    latency_histogram(fh, &latency_samples[LATENCY_TOTAL]);
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef _LATENCY_H
+#define _LATENCY_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+/* Z80 instructions executed so far. */
+typedef uint64_t (*latency_counter_t)(void);
+
+void latency_enable(latency_counter_t counter);
+bool latency_enabled(void);
+void latency_key(const struct timeval *arrival);
+void latency_write(void);
+void latency_flush(void);
+void latency_dump(FILE *fh);
+
+#endif /* _LATENCY_H */
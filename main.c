@@ -3,7 +3,6 @@
 #include <stdint.h>
 #include <string.h>
 #include <signal.h>
-#include <stdarg.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/time.h>
@@ -14,71 +13,86 @@
 #include <getopt.h>
 #endif
 
-#include "z80.h"
+#include "kaytil.h"
 #include "mem.h"
 #include "disk.h"
+#include "dpb.h"
+#include "io.h"
+#include "latency.h"
 #include "console.h"
-#include "panic.h"
+#include "batch.h"
+#include "cache.h"
 
 
 
 #define DEFAULT_CPM22_LOCATION "cpm22.bin"
 #define DEFAULT_CBIOS_LOCATION "cbios.bin"
 
+#define CONSOLE_TICK_INSTRUCTIONS 1000
 
 
-static z80_t z80;
-static mem_t mem;
+
+static disk_t *disk = NULL;
+static kaytil_machine_t *machine = NULL;
+static batch_t batch;
+static cache_t cache;
+
+static uint8_t cpm22[KAYTIL_CBIOS_ADDRESS - KAYTIL_CPM22_ADDRESS];
+static uint8_t cbios[UINT16_MAX + 1 - KAYTIL_CBIOS_ADDRESS];
 
 
 
 static void crash_dump(void)
-{ 
-#ifndef DISABLE_Z80_TRACE
-  fprintf(stderr, "\n");
-
-  fprintf(stderr, "Stack:\n");
-  mem_dump(stderr, &mem,
-    (z80.sp & 0xFFF0) - 0x20,
-    (z80.sp & 0xFFF0) + 0x2F);
-
-  fprintf(stderr, "Trace:\n");
-  z80_trace_dump(stderr);
-  z80_dump(stderr, &z80, &mem);
-  fprintf(stderr, "\n");
-#endif /* DISABLE_Z80_TRACE */
+{
+  if (machine != NULL) {
+    kaytil_dump(machine, stderr);
+  }
 }
 
 
 
-static void sig_handler(int sig)
+static uint64_t instructions_counter(void)
 {
-  switch (sig) {
-  case SIGINT:
-    fprintf(stderr, "\n");
-    crash_dump();
-    exit(EXIT_SUCCESS);
+  return (machine != NULL) ? kaytil_instructions(machine) : 0;
+}
 
-  default:
-    break;
+
+
+static void stats_exit_handler(void)
+{
+  disk_stats_dump(disk, stderr);
+  if (machine != NULL) {
+    kaytil_stats_dump(machine, stderr);
   }
 }
 
 
 
-void panic(const char *format, ...)
+static void latency_exit_handler(void)
 {
-#ifndef IGNORE_PANIC
-  va_list args;
+  latency_dump(stderr);
+}
 
-  crash_dump();
 
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
 
-  exit(EXIT_FAILURE);
-#endif /* IGNORE_PANIC */
+static void ram_disk_exit_handler(void)
+{
+  disk_ram_save(disk);
+}
+
+
+
+static void sig_handler(int sig)
+{
+  switch (sig) {
+  case SIGINT:
+    fprintf(stderr, "\n");
+    crash_dump();
+    exit(EXIT_SUCCESS);
+
+  default:
+    break;
+  }
 }
 
 
@@ -91,12 +105,50 @@ void display_help(const char *progname)
      "  -b IMAGE   Load disk IMAGE in drive B\n"
      "  -c IMAGE   Load disk IMAGE in drive C\n"
      "  -d IMAGE   Load disk IMAGE in drive D\n"
+     "  -i X:IMAGE Load disk IMAGE in drive X (A to P)\n"
+     "  -g X:TYPE  Use drive X (A to P) with geometry TYPE\n"
+     "  -R X:KB[:FILE] Use drive X (B to P) as a RAM disk of KB kilobytes,\n"
+     "             loaded from and saved to FILE at exit if given\n"
+     "  -l FILE    Write LIST device (LST:) output to FILE\n"
+     "  -p FILE    Write PUNCH device (PUN:) output to FILE\n"
+     "  -r FILE    Read READER device (RDR:) input from FILE\n"
+     "  -n         Use native BDOS functions for speed\n"
+     "  -S         Show statistics on exit\n"
+     "  -L         Show keypress to display latency on exit\n"
+     "  -H         Headless, dump the screen as text on exit instead\n"
+     "  -w WHEN    Also dump the screen on 'idle:MS' or 'text:STRING' (-H)\n"
+     "  -X SCRIPT  Batch mode, type keys from SCRIPT at full speed\n"
+     "  -o FILE    Write console output to FILE instead of stdout (-X)\n"
+     "  -e WHEN    Exit on 'text:STRING', 'prompt', 'instructions:N' or\n"
+     "             'timeout:SECONDS' (-X)\n"
+     "  -K DIR     Reuse the result of an identical earlier run from DIR,\n"
+     "             or store it there (-X)\n"
+     "  -M BANKS   Enable BANKS (2 to 16) memory banks, switched below C000\n"
      "  -m FILE    Load CP/M 2.2 binary from FILE instead of '%s'\n"
      "  -s FILE    Load CBIOS binary from FILE instead of '%s'\n"
      "\n"
-     "Using uppercase (-A, -B, -C or -D) will cause changes to the disk\n"
+     "Using uppercase (-A, -B, -C, -D or -I) will cause changes to the disk\n"
      "to be written back to the file instead of just being temporary.\n"
      "Instead of options, a disk image for drive A can be specified directly.\n"
+     "An IMAGE may also be a host directory, the files in it are then seen\n"
+     "as user 0 files on the drive, and written back when uppercase is used.\n"
+     "Compressed KDI images made with kdiconv are supported in lowercase.\n"
+     "\n"
+     "Geometry TYPEs:\n"
+     "  sssd       IBM 3740 8-inch SSSD, 250KB (drive A to D default)\n"
+     "  dsdd       Kaypro 5.25-inch DSDD, 400KB\n"
+     "  hd         Hard disk, 8MB\n"
+     "The geometry is otherwise selected from the size of the disk image.\n"
+     "Drive A is always 8-inch SSSD since it holds the CP/M system tracks.\n"
+     "A RAM disk is 64 to 8192KB in steps of 16KB, for example -R M:1024.\n"
+     "The disk tables must fit above the CBIOS, which is room for 16 drives\n"
+     "with DSDD geometry, 15 with SSSD, or drive A and 10 hard/RAM disks.\n"
+     "\n"
+     "Batch SCRIPT lines are 'wait TEXT' to hold the keys until TEXT is\n"
+     "output, 'send TEXT' to type TEXT and Return, or 'keys TEXT' to type\n"
+     "TEXT only. Escapes \\r, \\n, \\t, \\e, \\\\ and \\xHH are allowed.\n"
+     "Exit codes are 0 when done, 1 on errors, 2 on timeout, 3 when out of\n"
+     "instructions and 4 when input is wanted after the end of the script.\n"
      "\n",
      DEFAULT_CPM22_LOCATION,
      DEFAULT_CBIOS_LOCATION);
@@ -104,6 +156,46 @@ void display_help(const char *progname)
 
 
 
+static int drive_option(const char *arg, uint8_t *disk_no, const char **rest)
+{
+  /* Parse "X:..." where X is a drive letter. */
+  if (arg[0] >= 'a' && arg[0] <= 'p') {
+    *disk_no = arg[0] - 0x61;
+  } else if (arg[0] >= 'A' && arg[0] <= 'P') {
+    *disk_no = arg[0] - 0x41;
+  } else {
+    return -1;
+  }
+  if (arg[1] != ':' || arg[2] == '\0') {
+    return -1;
+  }
+  *rest = &arg[2];
+  return 0;
+}
+
+
+
+static int binary_load(const char *filename, uint8_t data[], uint16_t max,
+  uint16_t *size)
+{
+  FILE *fh;
+  size_t n;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return -1;
+  }
+  n = fread(data, sizeof(uint8_t), max, fh);
+  fclose(fh);
+  if (n == 0) {
+    return -1;
+  }
+  *size = n;
+  return 0;
+}
+
+
+
 #ifdef BUSYWAIT_SLOWDOWN
 /* Based on: https://www.gnu.org/software/libc/manual/html_node/Calculating-Elapsed-Time.html */
 void timeval_diff(struct timeval *r, struct timeval *a, struct timeval *b)
@@ -133,16 +225,41 @@ int main(int argc, char *argv[])
   int c;
   char *cpm22_location = NULL;
   char *cbios_location = NULL;
+  const char *rest;
+  const dpb_t *dpb;
+  uint8_t disk_no;
+  bool ram_disk_save = false;
+  unsigned long ram_size;
+  char *end;
+  int banks = 1;
+  const char *device_file[IO_DEVICES] = {NULL, NULL, NULL};
+  kaytil_config_t config;
+  io_device_t device;
+  uint32_t slice;
+  bool batch_mode = false;
+  bool batch_options = false;
+  const char *batch_output = NULL;
+  const char *batch_script = NULL;
+  const char *cache_dir = NULL;
+  uint64_t instructions;
+  int result;
+
+  disk = disk_create();
+  if (disk == NULL) {
+    fprintf(stderr, "Error: Out of memory for disks!\n");
+    return EXIT_FAILURE;
+  }
+  memset(&config, 0, sizeof(config));
+  batch_init(&batch);
 
-  disk_init();
-
-  while ((c = getopt(argc, argv, "a:b:c:d:A:B:C:D:m:s:h")) != -1) {
+  while ((c = getopt(argc, argv,
+    "a:b:c:d:A:B:C:D:i:I:g:R:l:p:r:nSLHw:X:o:e:K:M:m:s:h")) != -1) {
     switch (c) {
     case 'a':
     case 'b':
     case 'c':
     case 'd':
-      if (disk_image_load(c - 0x61, optarg, false) != 0) {
+      if (disk_image_load(disk, c - 0x61, optarg, false) != 0) {
         fprintf(stderr, "Error: Failed to load disk image: %s\n", optarg);
         return EXIT_FAILURE;
       }
@@ -152,12 +269,127 @@ int main(int argc, char *argv[])
     case 'B':
     case 'C':
     case 'D':
-      if (disk_image_load(c - 0x41, optarg, true) != 0) {
+      if (disk_image_load(disk, c - 0x41, optarg, true) != 0) {
         fprintf(stderr, "Error: Failed to load disk image: %s\n", optarg);
         return EXIT_FAILURE;
       }
       break;
 
+    case 'i':
+    case 'I':
+      if (drive_option(optarg, &disk_no, &rest) != 0) {
+        fprintf(stderr, "Error: Invalid drive specification: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      if (disk_image_load(disk, disk_no, rest, (c == 'I')) != 0) {
+        fprintf(stderr, "Error: Failed to load disk image: %s\n", rest);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'g':
+      if (drive_option(optarg, &disk_no, &rest) != 0) {
+        fprintf(stderr, "Error: Invalid drive specification: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      dpb = dpb_find(rest);
+      if (dpb == NULL || disk_type_set(disk, disk_no, dpb) != 0) {
+        fprintf(stderr, "Error: Invalid geometry for drive %c: %s\n",
+          disk_no + 0x41, rest);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'R':
+      if (drive_option(optarg, &disk_no, &rest) != 0) {
+        fprintf(stderr, "Error: Invalid drive specification: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      ram_size = strtoul(rest, &end, 10);
+      if (end == rest || (*end != '\0' && *end != ':') ||
+        ram_size > (UINT32_MAX / 1024) ||
+        disk_ram_create(disk, disk_no, ram_size * 1024,
+        (*end == ':') ? end + 1 : NULL) != 0) {
+        fprintf(stderr, "Error: Invalid RAM disk for drive %c: %s\n",
+          disk_no + 0x41, rest);
+        return EXIT_FAILURE;
+      }
+      if (*end == ':' && ! ram_disk_save) {
+        atexit(ram_disk_exit_handler);
+        ram_disk_save = true;
+      }
+      break;
+
+    case 'l':
+    case 'p':
+    case 'r':
+      /* Opened for the machine once it is created. */
+      device_file[(c == 'l') ? IO_DEVICE_LIST :
+        (c == 'p') ? IO_DEVICE_PUNCH : IO_DEVICE_READER] = optarg;
+      break;
+
+    case 'n':
+      config.native_bdos = true;
+      break;
+
+    case 'S':
+      atexit(stats_exit_handler);
+      break;
+
+    case 'L':
+      latency_enable(instructions_counter);
+      atexit(latency_exit_handler);
+      break;
+
+    case 'H':
+      if (console_headless(NULL) != 0) {
+        fprintf(stderr, "Error: Headless mode not supported by console\n");
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'w':
+      if (console_headless(optarg) != 0) {
+        fprintf(stderr, "Error: Invalid screen dump trigger: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'X':
+      if (batch_script_load(&batch, optarg) != 0) {
+        fprintf(stderr, "Error: Failed to load batch script: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      batch_script = optarg;
+      batch_mode = true;
+      break;
+
+    case 'o':
+      batch_output = optarg;
+      batch_options = true;
+      break;
+
+    case 'e':
+      if (batch_exit_add(&batch, optarg) != 0) {
+        fprintf(stderr, "Error: Invalid exit condition: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      batch_options = true;
+      break;
+
+    case 'K':
+      cache_dir = optarg;
+      batch_options = true;
+      break;
+
+    case 'M':
+      banks = atoi(optarg);
+      if (banks < 2 || banks > MEM_BANKS_MAX) {
+        fprintf(stderr, "Error: Invalid number of memory banks: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
     case 'm':
       cpm22_location = optarg;
       break;
@@ -177,42 +409,114 @@ int main(int argc, char *argv[])
     }
   }
 
+  if (batch_options && ! batch_mode) {
+    fprintf(stderr, "Error: Options -o, -e and -K are only used with -X\n");
+    return EXIT_FAILURE;
+  }
+  if (cache_dir != NULL && (device_file[IO_DEVICE_LIST] != NULL ||
+    device_file[IO_DEVICE_PUNCH] != NULL ||
+    device_file[IO_DEVICE_READER] != NULL)) {
+    fprintf(stderr, "Error: Option -K can't be used with -l, -p or -r\n");
+    return EXIT_FAILURE;
+  }
+  if (batch_output != NULL && batch_output_open(&batch, batch_output) != 0) {
+    fprintf(stderr, "Error: Failed to open output file: %s\n", batch_output);
+    return EXIT_FAILURE;
+  }
+
   /* Quick direct image loading. */
   if (argc > optind) {
-    if (disk_image_load(0, argv[optind], false) != 0) {
+    if (disk_image_load(disk, 0, argv[optind], false) != 0) {
       fprintf(stderr, "Error: Failed to load disk image: %s\n", argv[1]);
       return EXIT_FAILURE;
     }
   }
-
-  signal(SIGINT, sig_handler);
-#ifndef DISABLE_Z80_TRACE
-  z80_trace_init();
-#endif /* DISABLE_Z80_TRACE */
-  z80_init(&z80);
-  mem_init(&mem);
+  if (disk_tables_size(disk) > DPB_TABLES_SIZE_MAX) {
+    fprintf(stderr, "Error: Disk tables need %lu bytes, only %d fit in CBIOS "
+      "memory\n", (unsigned long)disk_tables_size(disk), DPB_TABLES_SIZE_MAX);
+    return EXIT_FAILURE;
+  }
 
   /* Load CP/M 2.2 and CBIOS. */
-  if (mem_load_from_file(&mem, (cpm22_location) ? 
-    cpm22_location : DEFAULT_CPM22_LOCATION, 0xE400) != 0) {
+  if (binary_load((cpm22_location) ? cpm22_location : DEFAULT_CPM22_LOCATION,
+    cpm22, sizeof(cpm22), &config.cpm22_size) != 0) {
     fprintf(stderr, "Error: Failed to load CP/M 2.2 binary!\n");
     return EXIT_FAILURE;
   }
-  if (mem_load_from_file(&mem, (cbios_location) ? 
-    cbios_location : DEFAULT_CBIOS_LOCATION, 0xFA00) != 0) {
+  if (binary_load((cbios_location) ? cbios_location : DEFAULT_CBIOS_LOCATION,
+    cbios, sizeof(cbios), &config.cbios_size) != 0) {
     fprintf(stderr, "Error: Failed to load CBIOS binary!\n");
     return EXIT_FAILURE;
   }
 
-  console_init();
+  config.cpm22 = cpm22;
+  config.cbios = cbios;
+  if (batch_mode) {
+    config.console = &batch_backend;
+    config.console_context = &batch;
+  } else {
+    config.console = &console_backend;
+    config.console_context = NULL;
+  }
+  config.disk = &disk_backend;
+  config.disk_context = disk;
+  config.banks = banks;
+
+  if (cache_dir != NULL) {
+    /* Keyed on the drives before the machine puts the system on them. */
+    cache_init(&cache, cache_dir, disk);
+    if (cache_key(&cache, &config, batch_script, &batch) != 0) {
+      fprintf(stderr, "Error: Failed to read the inputs for the cache\n");
+      return EXIT_FAILURE;
+    }
+    result = cache_replay(&cache, &batch, &instructions);
+    if (result != -1) {
+      batch_destroy(&batch);
+      cache_destroy(&cache);
+      return result;
+    }
+    config.disk = &cache_disk_backend;
+    config.disk_context = &cache;
+    batch_capture(&batch);
+  }
 
-  /* Need to set the PC directly to the BIOS,
-     since this one will initialize the data area in the zero page. */
-  z80.pc = 0xFA00;
+  machine = kaytil_create(&config);
+  if (machine == NULL) {
+    fprintf(stderr, "Error: Failed to create machine!\n");
+    return EXIT_FAILURE;
+  }
 
-  /* Load CP/M into the disks system sectors so the BIOS can reload it later,
-     which is required for other programs that may use this memory area. */
-  disk_sys_write(&mem, 0xE400, 0x1600);
+  for (device = 0; device < IO_DEVICES; device++) {
+    if (device_file[device] != NULL &&
+      kaytil_device_open(machine, device, device_file[device]) != 0) {
+      fprintf(stderr, "Error: Failed to open device file: %s\n",
+        device_file[device]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  signal(SIGINT, sig_handler);
+
+  if (batch_mode) {
+    /* No terminal and no slowdown, just run to an exit condition. */
+    result = batch_run(&batch, machine);
+    if (result == BATCH_EXIT_ERROR) {
+      crash_dump();
+      fprintf(stderr, "%s", kaytil_error(machine));
+    }
+    if (cache_dir != NULL) {
+      if (cache_store(&cache, &batch, result,
+        kaytil_instructions(machine)) != 0) {
+        fprintf(stderr, "Error: Failed to store the result in: %s\n",
+          cache_dir);
+      }
+      cache_destroy(&cache);
+    }
+    batch_destroy(&batch);
+    return result;
+  }
+
+  console_init();
 
 #ifndef DISABLE_SLOWDOWN
   int count = 0;
@@ -254,14 +558,22 @@ int main(int argc, char *argv[])
 #endif /* BUSYWAIT_SLOWDOWN */
 #endif /* DISABLE_SLOWDOWN */
 
+  slice = CONSOLE_TICK_INSTRUCTIONS;
   while (1) {
-    z80_execute(&z80, &mem);
+    if (kaytil_run(machine, slice) == KAYTIL_RUN_ERROR) {
+      crash_dump();
+      fprintf(stderr, "%s", kaytil_error(machine));
+      return EXIT_FAILURE;
+    }
+
+    /* Let buffered console output out now and then. */
+    console_tick();
 
 #ifndef DISABLE_SLOWDOWN
-    count++;
+    count += slice;
 
 #ifdef BUSYWAIT_SLOWDOWN
-    if (count > 50000) {
+    if (count >= 50000) {
       count = 0;
       /* Busy-wait using clock to slow down. */
       do {
@@ -273,7 +585,7 @@ int main(int argc, char *argv[])
     }
 
 #elif WINDOWS_SLOWDOWN
-    if (count > 10000) {
+    if (count >= 10000) {
       count = 0;
       if (WaitForSingleObject(timer, INFINITE) != WAIT_OBJECT_0) {
         fprintf(stderr, "WaitForSingleObject() failed: %lu\n", GetLastError());
@@ -282,7 +594,7 @@ int main(int argc, char *argv[])
     }
 
 #else /* !BUSYWAIT_SLOWDOWN */
-    if (count > 5000) {
+    if (count >= 5000) {
       count = 0;
       pause(); /* Wait for SIGALRM. */
     }
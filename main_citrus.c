@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include "z80.h"
 #include "mem.h"
+#include "io.h"
 #include "disk.h"
 #include "console.h"
 #include "panic.h"
@@ -16,15 +17,17 @@ extern uint8_t binary_cpm22_bin_end[];
 
 
 
+#define CONSOLE_TICK_INSTRUCTIONS 1000
+
 static z80_t z80;
 static mem_t mem;
+static io_t io;
+static panic_t fatal;
 
 
 
-void panic(const char *format, ...)
+static void halt(void)
 {
-  (void)format;
-
   /* Light the LED in the event of a panic. */
   led_command(LED_ON);
 
@@ -37,6 +40,8 @@ void panic(const char *format, ...)
 
 int main(void)
 {
+  int ticks = 0;
+
   /* GR-CITRUS specific initalization. */
   asm("clrpsw i");
   led_setup();
@@ -44,8 +49,11 @@ int main(void)
   uart0_setup();
   asm("setpsw i");
 
-  z80_init(&z80);
-  mem_init(&mem);
+  console_init();
+  panic_init(&fatal);
+  z80_init(&z80, &fatal);
+  mem_init(&mem, &fatal);
+  io_init(&io, &fatal, &console_backend, NULL, &disk_backend, NULL);
 
   /* Load CP/M 2.2 and CBIOS. */
   mem_write_area(&mem, 0xE400, binary_cpm22_bin_start,
@@ -57,7 +65,16 @@ int main(void)
   z80.pc = 0xFA00;
 
   while (1) {
-    z80_execute(&z80, &mem);
+    z80_execute(&z80, &mem, &io);
+    if (fatal.raised) {
+      halt();
+    }
+
+    /* Let the console render now and then. */
+    if (++ticks >= CONSOLE_TICK_INSTRUCTIONS) {
+      ticks = 0;
+      console_tick();
+    }
   }
 
   return 0;
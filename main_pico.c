@@ -3,6 +3,7 @@
 #include "pico/stdlib.h"
 #include "z80.h"
 #include "mem.h"
+#include "io.h"
 #include "disk.h"
 #include "console.h"
 #include "panic.h"
@@ -16,6 +17,8 @@ extern uint8_t _binary_cpm22_bin_end[];
 
 static z80_t z80;
 static mem_t mem;
+static io_t io;
+static panic_t fatal;
 
 
 
@@ -29,8 +32,10 @@ int main(void)
 #endif /* PICO_DEFAULT_LED_PIN */
 
   console_init();
-  z80_init(&z80);
-  mem_init(&mem);
+  panic_init(&fatal);
+  z80_init(&z80, &fatal);
+  mem_init(&mem, &fatal);
+  io_init(&io, &fatal, &console_backend, NULL, &disk_backend, NULL);
 
   /* Load CP/M 2.2 and CBIOS. */
   mem_write_area(&mem, 0xE400, _binary_cpm22_bin_start,
@@ -42,7 +47,10 @@ int main(void)
   z80.pc = 0xFA00;
 
   while (1) {
-    z80_execute(&z80, &mem);
+    z80_execute(&z80, &mem, &io);
+    if (fatal.raised) {
+      panic("%s\n", fatal.message); /* Pico SDK specific function! */
+    }
   }
 
   return 0;
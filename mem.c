@@ -2,51 +2,340 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif /* _REENTRANT */
 
 #include "mem.h"
+#include "panic.h"
 
+/* Memory is accessed through a table of host pointers, one for each 4K
+   page. Without banking the table maps bank 0 as is. With banking, the
+   pages below the common area are switched to the selected bank.
 
+   Pages are shared between memories until written. A page never written
+   is the zero page, and mem_share() moves the pages of a memory into a
+   pool for all memories, where pages with the same contents are kept
+   once. Reads go straight through the table. Writes go through a second
+   table that only has the private pages, and a write to any other page
+   first makes a private copy of it. */
 
-void mem_init(mem_t *mem)
+#define MEM_POOL_BUCKETS 256 /* Power of two */
+
+typedef struct mem_pool_page_s {
+  struct mem_pool_page_s *next;
+  uint32_t hash;
+  uint32_t refs;
+  uint8_t data[MEM_PAGE_SIZE];
+} mem_pool_page_t;
+
+static const uint8_t mem_zero[MEM_PAGE_SIZE];
+static mem_pool_page_t *mem_pool[MEM_POOL_BUCKETS];
+static mem_pool_stats_t mem_pool_stat;
+
+#ifdef _REENTRANT
+/* Built with threads, so machines may be created and run from several. */
+static pthread_mutex_t mem_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define mem_pool_lock() pthread_mutex_lock(&mem_pool_mutex)
+#define mem_pool_unlock() pthread_mutex_unlock(&mem_pool_mutex)
+#else
+#define mem_pool_lock()
+#define mem_pool_unlock()
+#endif /* _REENTRANT */
+
+
+
+static uint32_t mem_hash(const uint8_t data[])
 {
+  uint32_t hash = 0x9E3779B9;
+  uint32_t word;
   int i;
-  for (i = 0; i <= UINT16_MAX; i++) {
-    mem->ram[i] = 0x0;
+
+  for (i = 0; i < MEM_PAGE_SIZE; i += 4) {
+    word = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) |
+      ((uint32_t)data[i + 3] << 24);
+    hash = (hash ^ word) * 0x01000193;
+    hash = (hash << 13) | (hash >> 19);
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6B;
+  hash ^= hash >> 13;
+  return hash;
+}
+
+
+
+static uint8_t *mem_pool_get(const uint8_t data[])
+{
+  mem_pool_page_t *page;
+  uint32_t hash;
+
+  hash = mem_hash(data);
+  mem_pool_lock();
+  mem_pool_stat.lookups++;
+  for (page = mem_pool[hash & (MEM_POOL_BUCKETS - 1)]; page != NULL;
+    page = page->next) {
+    if (page->hash == hash && memcmp(page->data, data, MEM_PAGE_SIZE) == 0) {
+      mem_pool_stat.hits++;
+      break;
+    }
+  }
+
+  if (page == NULL) {
+    page = malloc(sizeof(mem_pool_page_t));
+    if (page == NULL) {
+      mem_pool_unlock();
+      return NULL;
+    }
+    memcpy(page->data, data, MEM_PAGE_SIZE);
+    page->hash = hash;
+    page->refs = 0;
+    page->next = mem_pool[hash & (MEM_POOL_BUCKETS - 1)];
+    mem_pool[hash & (MEM_POOL_BUCKETS - 1)] = page;
+    mem_pool_stat.pages++;
+  }
+  page->refs++;
+  mem_pool_stat.refs++;
+  mem_pool_unlock();
+  return page->data;
+}
+
+
+
+static void mem_pool_put(uint8_t *data)
+{
+  mem_pool_page_t *page, **prev;
+
+  page = (mem_pool_page_t *)(data - offsetof(mem_pool_page_t, data));
+  mem_pool_lock();
+  mem_pool_stat.refs--;
+  if (--page->refs == 0) {
+    prev = &mem_pool[page->hash & (MEM_POOL_BUCKETS - 1)];
+    while (*prev != page) {
+      prev = &(*prev)->next;
+    }
+    *prev = page->next;
+    free(page);
+    mem_pool_stat.pages--;
+  }
+  mem_pool_unlock();
+}
+
+
+
+static void mem_pool_retain(uint8_t *data)
+{
+  mem_pool_page_t *page;
+
+  if (data == mem_zero) {
+    return;
+  }
+  page = (mem_pool_page_t *)(data - offsetof(mem_pool_page_t, data));
+  mem_pool_lock();
+  page->refs++;
+  mem_pool_stat.refs++;
+  mem_pool_unlock();
+}
+
+
+
+static int mem_bank_of(mem_t *mem, int page_no)
+{
+  return (page_no < MEM_BANKED_PAGES) ? mem->bank_selected : 0;
+}
+
+
+
+static int mem_bank_pages(int bank)
+{
+  return (bank == 0) ? MEM_PAGES : MEM_BANKED_PAGES;
+}
+
+
+
+static void mem_map(mem_t *mem, int page_no)
+{
+  int bank = mem_bank_of(mem, page_no);
+
+  mem->page[page_no] = mem->frame[bank][page_no];
+  mem->page_write[page_no] = (mem->private[bank] & (1 << page_no)) ?
+    mem->frame[bank][page_no] : NULL;
+}
+
+
+
+static void mem_frame_release(mem_t *mem, int bank, int page_no)
+{
+  uint8_t *frame = mem->frame[bank][page_no];
+
+  if (mem->private[bank] & (1 << page_no)) {
+    free(frame);
+  } else if (frame != mem_zero) {
+    mem_pool_put(frame);
   }
+  mem->frame[bank][page_no] = (uint8_t *)mem_zero;
+  mem->private[bank] &= ~(1 << page_no);
 }
 
 
 
-uint8_t mem_read(mem_t *mem, uint16_t address)
+void mem_init(mem_t *mem, panic_t *panic)
 {
-  return mem->ram[address];
+  int i, bank;
+
+  for (bank = 0; bank < MEM_BANKS_MAX; bank++) {
+    for (i = 0; i < MEM_PAGES; i++) {
+      mem->frame[bank][i] = (uint8_t *)mem_zero;
+    }
+    mem->private[bank] = 0;
+  }
+  mem->copies = 0;
+  mem->panic = panic;
+  mem->banks = 1;
+  mem->bank_selected = 0;
+  for (i = 0; i < MEM_PAGES; i++) {
+    mem_map(mem, i);
+  }
+}
+
+
+
+void mem_destroy(mem_t *mem)
+{
+  int i, bank;
+
+  for (bank = 0; bank < MEM_BANKS_MAX; bank++) {
+    for (i = 0; i < mem_bank_pages(bank); i++) {
+      mem_frame_release(mem, bank, i);
+    }
+  }
+  for (i = 0; i < MEM_PAGES; i++) {
+    mem_map(mem, i);
+  }
+}
+
+
+
+int mem_banks_enable(mem_t *mem, uint8_t banks)
+{
+  if (banks < 1 || banks > MEM_BANKS_MAX) {
+    return -1;
+  }
+
+  /* Nothing to allocate, the new banks start as zero pages. */
+  mem->banks = banks;
+  return 0;
+}
+
+
+
+void mem_bank_select(mem_t *mem, uint8_t bank)
+{
+  int i;
+
+  if (bank >= mem->banks) {
+    return; /* Not present, keep the current one. */
+  }
+
+  mem->bank_selected = bank;
+  for (i = 0; i < MEM_BANKED_PAGES; i++) {
+    mem_map(mem, i);
+  }
+}
+
+
+
+uint8_t *mem_page_copy(mem_t *mem, uint8_t page_no)
+{
+  int bank = mem_bank_of(mem, page_no);
+  uint8_t *copy;
+
+  copy = malloc(MEM_PAGE_SIZE);
+  if (copy == NULL) {
+    panic_raise(mem->panic, "Out of memory for a copy of page: %02x\n",
+      page_no);
+    return NULL;
+  }
+  memcpy(copy, mem->frame[bank][page_no], MEM_PAGE_SIZE);
+  mem_frame_release(mem, bank, page_no);
+  mem->frame[bank][page_no] = copy;
+  mem->private[bank] |= 1 << page_no;
+  mem->copies++;
+  mem_map(mem, page_no);
+  return copy;
+}
+
+
+
+static uint8_t *mem_page_writable(mem_t *mem, uint16_t address)
+{
+  uint8_t *page = mem->page_write[address >> MEM_PAGE_SHIFT];
+
+  if (page == NULL) {
+    page = mem_page_copy(mem, address >> MEM_PAGE_SHIFT);
+    if (page == NULL) {
+      return NULL;
+    }
+  }
+  return &page[address & MEM_PAGE_MASK];
 }
 
 
 
 void mem_read_area(mem_t *mem, uint16_t address, uint8_t data[], size_t size)
 {
-  size_t i;
-  for (i = 0; i < size; i++) {
-    data[i] = mem->ram[address + i];
+  size_t n;
+
+  /* Copy a page at a time, wrapping at the top of memory. */
+  while (size > 0) {
+    n = MEM_PAGE_SIZE - (address & MEM_PAGE_MASK);
+    if (n > size) {
+      n = size;
+    }
+    memcpy(data,
+      &mem->page[address >> MEM_PAGE_SHIFT][address & MEM_PAGE_MASK], n);
+    data += n;
+    address += n;
+    size -= n;
   }
 }
 
 
 
-void mem_write(mem_t *mem, uint16_t address, uint8_t value)
+void mem_write_area(mem_t *mem, uint16_t address, const uint8_t data[],
+  size_t size)
 {
-  mem->ram[address] = value;
+  uint8_t *target;
+  size_t n;
+
+  while (size > 0) {
+    n = MEM_PAGE_SIZE - (address & MEM_PAGE_MASK);
+    if (n > size) {
+      n = size;
+    }
+    target = mem_page_writable(mem, address);
+    if (target == NULL) {
+      return; /* Out of memory, the machine stops. */
+    }
+    memcpy(target, data, n);
+    data += n;
+    address += n;
+    size -= n;
+  }
 }
 
 
 
-void mem_write_area(mem_t *mem, uint16_t address, uint8_t data[], size_t size)
+uint8_t *mem_area(mem_t *mem, uint16_t address, size_t size)
 {
-  size_t i;
-  for (i = 0; i < size; i++) {
-    mem->ram[address + i] = data[i];
+  /* Host pointer to an area, but only if it lies within a single page and
+     there is memory for a private copy of it. */
+  if ((address & MEM_PAGE_MASK) + size > MEM_PAGE_SIZE) {
+    return NULL;
   }
+  return mem_page_writable(mem, address);
 }
 
 
@@ -62,7 +351,7 @@ int mem_load_from_file(mem_t *mem, const char *filename, uint16_t address)
   }
 
   while ((c = fgetc(fh)) != EOF) {
-    mem->ram[address] = c;
+    mem_write(mem, address, c);
     address++; /* Just overflow... */
   }
 
@@ -79,7 +368,7 @@ void mem_dump(FILE *fh, mem_t *mem, uint16_t start, uint16_t end)
     if (i % 16 == 0) {
       fprintf(fh, "%04x   ", i);
     }
-    fprintf(fh, "%02x ", mem->ram[i]);
+    fprintf(fh, "%02x ", mem_read(mem, i));
     if (i % 16 == 15) {
       fprintf(fh, "\n");
     }
@@ -88,3 +377,150 @@ void mem_dump(FILE *fh, mem_t *mem, uint16_t start, uint16_t end)
 
 
 
+void mem_share(mem_t *mem)
+{
+  uint8_t *shared;
+  int i, bank;
+
+  for (bank = 0; bank < mem->banks; bank++) {
+    for (i = 0; i < mem_bank_pages(bank); i++) {
+      if ((mem->private[bank] & (1 << i)) == 0) {
+        continue;
+      }
+      if (memcmp(mem->frame[bank][i], mem_zero, MEM_PAGE_SIZE) == 0) {
+        shared = (uint8_t *)mem_zero;
+      } else {
+        shared = mem_pool_get(mem->frame[bank][i]);
+        if (shared == NULL) {
+          continue; /* Kept private. */
+        }
+      }
+      free(mem->frame[bank][i]);
+      mem->frame[bank][i] = shared;
+      mem->private[bank] &= ~(1 << i);
+    }
+  }
+  for (i = 0; i < MEM_PAGES; i++) {
+    mem_map(mem, i);
+  }
+}
+
+
+
+void mem_stats(mem_t *mem, mem_stats_t *stats)
+{
+  int i, bank;
+
+  memset(stats, 0, sizeof(mem_stats_t));
+  for (bank = 0; bank < mem->banks; bank++) {
+    for (i = 0; i < mem_bank_pages(bank); i++) {
+      if (mem->private[bank] & (1 << i)) {
+        stats->private++;
+      } else if (mem->frame[bank][i] == mem_zero) {
+        stats->zero++;
+      } else {
+        stats->shared++;
+      }
+    }
+  }
+  stats->copies = mem->copies;
+}
+
+
+
+void mem_pool_stats(mem_pool_stats_t *stats)
+{
+  mem_pool_lock();
+  *stats = mem_pool_stat;
+  mem_pool_unlock();
+}
+
+
+
+void mem_stats_dump(mem_t *mem, FILE *fh)
+{
+  mem_stats_t stats;
+  mem_pool_stats_t pool;
+
+  mem_stats(mem, &stats);
+  mem_pool_stats(&pool);
+  fprintf(fh, "Memory pages:\n");
+  fprintf(fh, "  Private:    %u pages, %u bytes\n", stats.private,
+    stats.private * MEM_PAGE_SIZE);
+  fprintf(fh, "  Shared:     %u pages\n", stats.shared);
+  fprintf(fh, "  Zero:       %u pages\n", stats.zero);
+  fprintf(fh, "  Copies:     %u\n", stats.copies);
+  fprintf(fh, "Page pool:\n");
+  fprintf(fh, "  Lookups:    %u\n", pool.lookups);
+  fprintf(fh, "  Hits:       %u (%.1f%%)\n", pool.hits,
+    (pool.lookups > 0) ? (pool.hits * 100.0) / pool.lookups : 0.0);
+  fprintf(fh, "  Unique:     %u pages, %u bytes\n", pool.pages,
+    pool.pages * MEM_PAGE_SIZE);
+  fprintf(fh, "  Referenced: %u pages, %u bytes\n", pool.refs,
+    pool.refs * MEM_PAGE_SIZE);
+}
+
+
+
+int mem_snapshot(mem_t *mem, mem_snapshot_t *snapshot)
+{
+  int i, bank;
+
+  mem_share(mem);
+  for (bank = 0; bank < MEM_BANKS_MAX; bank++) {
+    if (mem->private[bank] != 0) {
+      return -1; /* Out of memory for the pool. */
+    }
+  }
+
+  for (bank = 0; bank < MEM_BANKS_MAX; bank++) {
+    for (i = 0; i < MEM_PAGES; i++) {
+      snapshot->frame[bank][i] = mem->frame[bank][i];
+      mem_pool_retain(snapshot->frame[bank][i]);
+    }
+  }
+  snapshot->banks = mem->banks;
+  snapshot->bank_selected = mem->bank_selected;
+  return 0;
+}
+
+
+
+void mem_restore(mem_t *mem, const mem_snapshot_t *snapshot)
+{
+  int i, bank;
+
+  /* Only pages written since, or shared again, differ from the snapshot. */
+  for (bank = 0; bank < MEM_BANKS_MAX; bank++) {
+    for (i = 0; i < mem_bank_pages(bank); i++) {
+      if (mem->frame[bank][i] == snapshot->frame[bank][i] &&
+        (mem->private[bank] & (1 << i)) == 0) {
+        continue;
+      }
+      mem_frame_release(mem, bank, i);
+      mem->frame[bank][i] = snapshot->frame[bank][i];
+      mem_pool_retain(mem->frame[bank][i]);
+    }
+  }
+  mem->banks = snapshot->banks;
+  mem->bank_selected = snapshot->bank_selected;
+  for (i = 0; i < MEM_PAGES; i++) {
+    mem_map(mem, i);
+  }
+}
+
+
+
+void mem_snapshot_free(mem_snapshot_t *snapshot)
+{
+  int i, bank;
+
+  for (bank = 0; bank < MEM_BANKS_MAX; bank++) {
+    for (i = 0; i < MEM_PAGES; i++) {
+      if (snapshot->frame[bank][i] != mem_zero) {
+        mem_pool_put(snapshot->frame[bank][i]);
+      }
+      snapshot->frame[bank][i] = (uint8_t *)mem_zero;
+    }
+  }
+}
@@ -3,17 +3,86 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include "panic.h"
+
+#define MEM_PAGE_SHIFT 12
+#define MEM_PAGE_SIZE (1 << MEM_PAGE_SHIFT) /* 4K */
+#define MEM_PAGE_MASK (MEM_PAGE_SIZE - 1)
+#define MEM_PAGES ((UINT16_MAX + 1) / MEM_PAGE_SIZE)
+
+#define MEM_BANKS_MAX 16
+#define MEM_COMMON_BASE 0xC000 /* Common to all banks from here and up. */
+#define MEM_BANKED_PAGES (MEM_COMMON_BASE / MEM_PAGE_SIZE)
+
+typedef struct mem_stats_s {
+  uint32_t private; /* Pages owned, copied on the first write. */
+  uint32_t shared; /* Pages referenced in the pool. */
+  uint32_t zero; /* Pages never written. */
+  uint32_t copies;
+} mem_stats_t;
+
+typedef struct mem_pool_stats_s {
+  uint32_t lookups;
+  uint32_t hits;
+  uint32_t pages; /* Unique pages held. */
+  uint32_t refs; /* References to them from all memories. */
+} mem_pool_stats_t;
+
+/* Pages of a memory at some point, all shared, to go back to later. */
+typedef struct mem_snapshot_s {
+  uint8_t *frame[MEM_BANKS_MAX][MEM_PAGES];
+  uint8_t banks;
+  uint8_t bank_selected;
+} mem_snapshot_t;
 
 typedef struct mem_s {
-  uint8_t ram[UINT16_MAX + 1];
+  uint8_t *page[MEM_PAGES]; /* Host memory mapped at each 4K page. */
+  uint8_t *page_write[MEM_PAGES]; /* The same if private, else NULL. */
+  uint8_t *frame[MEM_BANKS_MAX][MEM_PAGES]; /* Common pages in bank 0. */
+  uint16_t private[MEM_BANKS_MAX]; /* Bit set for each private frame. */
+  uint32_t copies;
+  panic_t *panic; /* Raised when out of memory for a copy. */
+  uint8_t banks;
+  uint8_t bank_selected;
 } mem_t;
 
-void mem_init(mem_t *mem);
-uint8_t mem_read(mem_t *mem, uint16_t address);
+void mem_init(mem_t *mem, panic_t *panic);
+void mem_destroy(mem_t *mem);
+int mem_banks_enable(mem_t *mem, uint8_t banks);
+void mem_bank_select(mem_t *mem, uint8_t bank);
+uint8_t *mem_page_copy(mem_t *mem, uint8_t page_no);
+
+/* Inline, since every Z80 memory access goes through these. */
+static inline uint8_t mem_read(mem_t *mem, uint16_t address)
+{
+  return mem->page[address >> MEM_PAGE_SHIFT][address & MEM_PAGE_MASK];
+}
+
+static inline void mem_write(mem_t *mem, uint16_t address, uint8_t value)
+{
+  uint8_t *page = mem->page_write[address >> MEM_PAGE_SHIFT];
+
+  if (page == NULL) {
+    page = mem_page_copy(mem, address >> MEM_PAGE_SHIFT);
+    if (page == NULL) {
+      return; /* Out of memory, the machine stops. */
+    }
+  }
+  page[address & MEM_PAGE_MASK] = value;
+}
+
 void mem_read_area(mem_t *mem, uint16_t address, uint8_t data[], size_t size);
-void mem_write(mem_t *mem, uint16_t address, uint8_t value);
-void mem_write_area(mem_t *mem, uint16_t address, uint8_t data[], size_t size);
+void mem_write_area(mem_t *mem, uint16_t address, const uint8_t data[],
+  size_t size);
+uint8_t *mem_area(mem_t *mem, uint16_t address, size_t size);
 int mem_load_from_file(mem_t *mem, const char *filename, uint16_t address);
 void mem_dump(FILE *fh, mem_t *mem, uint16_t start, uint16_t end);
+void mem_share(mem_t *mem);
+void mem_stats(mem_t *mem, mem_stats_t *stats);
+void mem_pool_stats(mem_pool_stats_t *stats);
+void mem_stats_dump(mem_t *mem, FILE *fh);
+int mem_snapshot(mem_t *mem, mem_snapshot_t *snapshot);
+void mem_restore(mem_t *mem, const mem_snapshot_t *snapshot);
+void mem_snapshot_free(mem_snapshot_t *snapshot);
 
 #endif /* _MEM_H */
@@ -0,0 +1,28 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include "panic.h"
+
+
+
+void panic_init(panic_t *panic)
+{
+  panic->raised = false;
+  panic->message[0] = '\0';
+}
+
+
+
+void panic_raise(panic_t *panic, const char *format, ...)
+{
+  va_list args;
+
+  if (panic->raised) {
+    return;
+  }
+
+  va_start(args, format);
+  vsnprintf(panic->message, PANIC_MESSAGE_SIZE, format, args);
+  va_end(args);
+  panic->raised = true;
+}
@@ -1,8 +1,19 @@
 #ifndef _PANIC_H
 #define _PANIC_H
 
+#include <stdbool.h>
 #include <stdarg.h>
 
-void panic(const char *format, ...);
+#define PANIC_MESSAGE_SIZE 256
+
+/* Fatal emulation error. The first one raised is kept, and the machine
+   it belongs to stops after the current instruction. */
+typedef struct panic_s {
+  bool raised;
+  char message[PANIC_MESSAGE_SIZE];
+} panic_t;
+
+void panic_init(panic_t *panic);
+void panic_raise(panic_t *panic, const char *format, ...);
 
 #endif /* _PANIC_H */
@@ -0,0 +1,658 @@
+/* Threads need more than the base POSIX definitions. */
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <getopt.h>
+
+#include "kaytil.h"
+#include "disk.h"
+#include "batch.h"
+#include "cache.h"
+#include "panic.h"
+
+/* Parallel batch runner, for many independent jobs in one process. Each
+   manifest line is a job, with a name, a batch script and then any of:
+
+     X:IMAGE     Load disk IMAGE (or host directory) in drive X, read-only.
+     native      Use native BDOS functions.
+     WHEN        Exit condition as for the emulator -e option.
+
+   Jobs are dealt out in blocks to a fixed pool of worker threads, each
+   with its own deque of jobs. A worker takes jobs from the bottom of its
+   own deque, and when that is empty it steals from the top of the others,
+   so the order is kept locally and workers only meet when balancing. A job
+   is run to its end on a machine of its own, in instruction slices by the
+   batch console. */
+
+#define DEFAULT_CPM22_LOCATION "cpm22.bin"
+#define DEFAULT_CBIOS_LOCATION "cbios.bin"
+
+#define RUNNER_WORKERS_MAX 256
+#define RUNNER_LINE_MAX 1024
+#define RUNNER_TOKENS_MAX 32
+#define RUNNER_RESULT_SETUP -1 /* Job could not be started. */
+
+typedef struct runner_job_s {
+  char *line; /* Tokens point into it. */
+  const char *name;
+  const char *script;
+  const char *token[RUNNER_TOKENS_MAX];
+  int tokens;
+
+  int result; /* Batch exit code. */
+  char error[PANIC_MESSAGE_SIZE];
+  uint64_t instructions;
+  uint32_t pages; /* Private memory pages at the end. */
+  double seconds;
+  bool cached; /* Replayed from the result cache. */
+  bool unstored; /* Not replayed, and failed to go into the cache. */
+} runner_job_t;
+
+/* Jobs are only added before the workers start, so a deque is a fixed
+   range of job numbers. Top and bottom are packed into one word, both
+   ends are then taken with a single compare and swap. */
+typedef struct runner_deque_s {
+  uint32_t *job;
+  uint64_t range; /* Top in upper half, bottom in lower half. */
+} runner_deque_t;
+
+typedef struct runner_worker_s {
+  pthread_t thread;
+  int id;
+  runner_deque_t deque;
+  uint32_t jobs;
+  uint32_t stolen;
+  uint64_t instructions;
+} runner_worker_t;
+
+static uint8_t runner_cpm22[KAYTIL_CBIOS_ADDRESS - KAYTIL_CPM22_ADDRESS];
+static uint8_t runner_cbios[UINT16_MAX + 1 - KAYTIL_CBIOS_ADDRESS];
+static uint16_t runner_cpm22_size;
+static uint16_t runner_cbios_size;
+
+static runner_job_t *runner_job = NULL;
+static uint32_t runner_jobs = 0;
+static runner_worker_t runner_worker[RUNNER_WORKERS_MAX];
+static int runner_workers = 0;
+static const char *runner_log_dir = NULL;
+static const char *runner_cache_dir = NULL;
+
+
+
+static double runner_elapsed(const struct timeval *since)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - since->tv_sec) +
+    ((now.tv_usec - since->tv_usec) / 1000000.0);
+}
+
+
+
+static int runner_binary_load(const char *filename, uint8_t data[],
+  uint16_t max, uint16_t *size)
+{
+  FILE *fh;
+  size_t n;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return -1;
+  }
+  n = fread(data, sizeof(uint8_t), max, fh);
+  fclose(fh);
+  if (n == 0) {
+    return -1;
+  }
+  *size = n;
+  return 0;
+}
+
+
+
+static int runner_manifest_load(const char *filename)
+{
+  FILE *fh;
+  char line[RUNNER_LINE_MAX + 2];
+  runner_job_t *new, *job;
+  char *token;
+  size_t len;
+  uint32_t line_no = 0;
+
+  fh = fopen(filename, "r");
+  if (fh == NULL) {
+    fprintf(stderr, "Error: Unable to open '%s'\n", filename);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), fh) != NULL) {
+    line_no++;
+    len = strlen(line);
+    if (len > RUNNER_LINE_MAX) {
+      fprintf(stderr, "Error: Line %u too long in manifest\n", line_no);
+      fclose(fh);
+      return -1;
+    }
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    token = line + strspn(line, " \t");
+    if (*token == '\0' || *token == '#') {
+      continue;
+    }
+
+    new = realloc(runner_job, (runner_jobs + 1) * sizeof(runner_job_t));
+    if (new == NULL) {
+      fprintf(stderr, "Error: Out of memory\n");
+      fclose(fh);
+      return -1;
+    }
+    runner_job = new;
+    job = &runner_job[runner_jobs];
+    memset(job, 0, sizeof(runner_job_t));
+    job->line = malloc(len + 1);
+    if (job->line == NULL) {
+      fprintf(stderr, "Error: Out of memory\n");
+      fclose(fh);
+      return -1;
+    }
+    memcpy(job->line, line, len + 1);
+
+    job->name = strtok(job->line, " \t");
+    job->script = strtok(NULL, " \t");
+    while ((token = strtok(NULL, " \t")) != NULL) {
+      if (job->tokens >= RUNNER_TOKENS_MAX) {
+        break;
+      }
+      job->token[job->tokens++] = token;
+    }
+    if (job->script == NULL || token != NULL) {
+      fprintf(stderr, "Error: Invalid job on line %u in manifest\n",
+        line_no);
+      free(job->line);
+      fclose(fh);
+      return -1;
+    }
+    runner_jobs++;
+  }
+
+  fclose(fh);
+  return 0;
+}
+
+
+
+static int runner_drive(const char *token, uint8_t *disk_no)
+{
+  if (token[0] >= 'a' && token[0] <= 'p') {
+    *disk_no = token[0] - 0x61;
+  } else if (token[0] >= 'A' && token[0] <= 'P') {
+    *disk_no = token[0] - 0x41;
+  } else {
+    return -1;
+  }
+  return (token[1] == ':' && token[2] != '\0') ? 0 : -1;
+}
+
+
+
+static int runner_job_setup(runner_job_t *job, batch_t *batch,
+  disk_t *disk, kaytil_config_t *config)
+{
+  char log[RUNNER_LINE_MAX];
+  uint8_t disk_no;
+  int i;
+
+  if (runner_log_dir != NULL) {
+    snprintf(log, sizeof(log), "%s/%s.log", runner_log_dir, job->name);
+  }
+  if (batch_output_open(batch, (runner_log_dir != NULL) ? log : NULL) != 0) {
+    snprintf(job->error, sizeof(job->error), "Unable to open log file");
+    return -1;
+  }
+  if (batch_script_load(batch, job->script) != 0) {
+    snprintf(job->error, sizeof(job->error), "Failed to load script '%s'",
+      job->script);
+    return -1;
+  }
+
+  memset(config, 0, sizeof(kaytil_config_t));
+  for (i = 0; i < job->tokens; i++) {
+    if (runner_drive(job->token[i], &disk_no) == 0) {
+      if (disk_image_load(disk, disk_no, &job->token[i][2], false) != 0) {
+        snprintf(job->error, sizeof(job->error),
+          "Failed to load disk image '%s'", &job->token[i][2]);
+        return -1;
+      }
+    } else if (strcmp(job->token[i], "native") == 0) {
+      config->native_bdos = true;
+    } else if (batch_exit_add(batch, job->token[i]) != 0) {
+      snprintf(job->error, sizeof(job->error),
+        "Invalid option '%s'", job->token[i]);
+      return -1;
+    }
+  }
+  if (disk_tables_size(disk) > DPB_TABLES_SIZE_MAX) {
+    snprintf(job->error, sizeof(job->error),
+      "Disk tables need %lu bytes, only %d fit in CBIOS memory",
+      (unsigned long)disk_tables_size(disk), DPB_TABLES_SIZE_MAX);
+    return -1;
+  }
+
+  config->cpm22 = runner_cpm22;
+  config->cpm22_size = runner_cpm22_size;
+  config->cbios = runner_cbios;
+  config->cbios_size = runner_cbios_size;
+  config->console = &batch_backend;
+  config->console_context = batch;
+  config->disk = &disk_backend;
+  config->disk_context = disk;
+  config->banks = 1;
+  return 0;
+}
+
+
+
+static bool runner_job_replay(runner_job_t *job, cache_t *cache,
+  batch_t *batch, kaytil_config_t *config)
+{
+  int result;
+
+  if (runner_cache_dir == NULL ||
+    cache_key(cache, config, job->script, batch) != 0) {
+    return false; /* Just run, and not stored. */
+  }
+  result = cache_replay(cache, batch, &job->instructions);
+  if (result != -1) {
+    job->result = result;
+    job->cached = true;
+    return true;
+  }
+
+  /* Not seen before, so record what is needed to store it after. */
+  config->disk = &cache_disk_backend;
+  config->disk_context = cache;
+  batch_capture(batch);
+  return false;
+}
+
+
+
+static void runner_job_run(runner_job_t *job)
+{
+  kaytil_config_t config;
+  kaytil_machine_t *machine;
+  disk_t *disk;
+  batch_t batch;
+  cache_t cache;
+  struct timeval start;
+
+  gettimeofday(&start, NULL);
+  job->result = RUNNER_RESULT_SETUP;
+
+  disk = disk_create();
+  if (disk == NULL) {
+    snprintf(job->error, sizeof(job->error), "Out of memory");
+    return;
+  }
+  batch_init(&batch);
+  cache_init(&cache, runner_cache_dir, disk);
+
+  if (runner_job_setup(job, &batch, disk, &config) == 0 &&
+    ! runner_job_replay(job, &cache, &batch, &config)) {
+    machine = kaytil_create(&config);
+    if (machine == NULL) {
+      snprintf(job->error, sizeof(job->error), "Failed to create machine");
+    } else {
+      job->result = batch_run(&batch, machine);
+      if (job->result == BATCH_EXIT_ERROR) {
+        snprintf(job->error, sizeof(job->error), "%s",
+          kaytil_error(machine));
+        job->error[strcspn(job->error, "\n")] = '\0';
+      }
+      job->instructions = kaytil_instructions(machine);
+      job->pages = kaytil_private_pages(machine);
+      kaytil_destroy(machine);
+      if (cache_store(&cache, &batch, job->result, job->instructions) != 0) {
+        job->unstored = true;
+      }
+    }
+  }
+
+  cache_destroy(&cache);
+  batch_destroy(&batch);
+  disk_destroy(disk);
+  job->seconds = runner_elapsed(&start);
+}
+
+
+
+static int runner_pop(runner_deque_t *deque)
+{
+  uint64_t range, new;
+  uint32_t top, bottom;
+
+  range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+  do {
+    top = range >> 32;
+    bottom = range & 0xFFFFFFFF;
+    if (top >= bottom) {
+      return -1;
+    }
+    new = ((uint64_t)top << 32) | (bottom - 1);
+  } while (! __atomic_compare_exchange_n(&deque->range, &range, new,
+    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return deque->job[bottom - 1];
+}
+
+
+
+static int runner_steal(runner_deque_t *deque)
+{
+  uint64_t range, new;
+  uint32_t top, bottom;
+
+  range = __atomic_load_n(&deque->range, __ATOMIC_ACQUIRE);
+  do {
+    top = range >> 32;
+    bottom = range & 0xFFFFFFFF;
+    if (top >= bottom) {
+      return -1;
+    }
+    new = ((uint64_t)(top + 1) << 32) | bottom;
+  } while (! __atomic_compare_exchange_n(&deque->range, &range, new,
+    false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  return deque->job[top];
+}
+
+
+
+static int runner_next(runner_worker_t *worker)
+{
+  int i, job;
+
+  job = runner_pop(&worker->deque);
+  if (job != -1) {
+    return job;
+  }
+
+  /* Nothing more is ever added, so once all are empty the work is done. */
+  for (i = 1; i < runner_workers; i++) {
+    job = runner_steal(&runner_worker[(worker->id + i) % runner_workers].deque);
+    if (job != -1) {
+      worker->stolen++;
+      return job;
+    }
+  }
+  return -1;
+}
+
+
+
+static void *runner_worker_main(void *arg)
+{
+  runner_worker_t *worker = arg;
+  int job;
+
+  while ((job = runner_next(worker)) != -1) {
+    runner_job_run(&runner_job[job]);
+    worker->jobs++;
+    if (! runner_job[job].cached) {
+      worker->instructions += runner_job[job].instructions;
+    }
+  }
+  return NULL;
+}
+
+
+
+static int runner_workers_start(void)
+{
+  runner_worker_t *worker;
+  uint32_t i, first, last;
+  int n;
+
+  for (n = 0; n < runner_workers; n++) {
+    worker = &runner_worker[n];
+    worker->id = n;
+    worker->jobs = 0;
+    worker->stolen = 0;
+    worker->instructions = 0;
+
+    /* A block of jobs in manifest order, first one at the bottom. */
+    first = ((uint64_t)runner_jobs * n) / runner_workers;
+    last = ((uint64_t)runner_jobs * (n + 1)) / runner_workers;
+    worker->deque.job = malloc((last - first + 1) * sizeof(uint32_t));
+    if (worker->deque.job == NULL) {
+      fprintf(stderr, "Error: Out of memory\n");
+      return -1;
+    }
+    for (i = 0; i < last - first; i++) {
+      worker->deque.job[i] = last - 1 - i;
+    }
+    worker->deque.range = last - first;
+  }
+
+  for (n = 0; n < runner_workers; n++) {
+    if (pthread_create(&runner_worker[n].thread, NULL, runner_worker_main,
+      &runner_worker[n]) != 0) {
+      fprintf(stderr, "Error: pthread_create() failed\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+static void runner_results(FILE *fh)
+{
+  runner_job_t *job;
+  uint32_t i;
+
+  for (i = 0; i < runner_jobs; i++) {
+    job = &runner_job[i];
+    fprintf(fh, "%s %d %llu %.3f", job->name, job->result,
+      (unsigned long long)job->instructions, job->seconds);
+    if (job->error[0] != '\0') {
+      fprintf(fh, " %s", job->error);
+    }
+    fprintf(fh, "\n");
+  }
+}
+
+
+
+static void runner_summary(FILE *fh, double seconds)
+{
+  uint64_t instructions = 0, pages = 0;
+  uint32_t failed = 0, stolen = 0, cached = 0, unstored = 0;
+  uint32_t i;
+  int n;
+
+  for (i = 0; i < runner_jobs; i++) {
+    if (runner_job[i].result != BATCH_EXIT_DONE) {
+      failed++;
+    }
+    pages += runner_job[i].pages;
+    if (runner_job[i].cached) {
+      cached++;
+    }
+    if (runner_job[i].unstored) {
+      unstored++;
+    }
+  }
+  for (n = 0; n < runner_workers; n++) {
+    instructions += runner_worker[n].instructions;
+    stolen += runner_worker[n].stolen;
+  }
+  if (seconds <= 0) {
+    seconds = 0.000001;
+  }
+
+  fprintf(fh, "Jobs: %u, %u failed\n", runner_jobs, failed);
+  fprintf(fh, "Workers: %d, %u jobs stolen\n", runner_workers, stolen);
+  if (runner_cache_dir != NULL) {
+    fprintf(fh, "Cache: %u replayed, %u run, %u failed to store\n", cached,
+      runner_jobs - cached, unstored);
+  }
+  fprintf(fh, "Memory: %.1f KB private per job\n",
+    (runner_jobs > cached) ? (pages * 4.0) / (runner_jobs - cached) : 0.0);
+  fprintf(fh, "Time: %.3fs\n", seconds);
+  fprintf(fh, "Throughput: %.2f jobs/s, %.2f MIPS, %.2f MIPS per worker\n",
+    runner_jobs / seconds, instructions / seconds / 1000000.0,
+    instructions / seconds / 1000000.0 / runner_workers);
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stderr, "Usage: %s <options> MANIFEST\n", progname);
+  fprintf(stderr, "Options:\n"
+     "  -j WORKERS Run on WORKERS threads instead of one per CPU\n"
+     "  -o DIR     Write the console output of each job to DIR/NAME.log\n"
+     "  -r FILE    Write the job results to FILE instead of stdout\n"
+     "  -K DIR     Replay the results of jobs run before from DIR, and\n"
+     "             store the others there\n"
+     "  -m FILE    Load CP/M 2.2 binary from FILE instead of '%s'\n"
+     "  -s FILE    Load CBIOS binary from FILE instead of '%s'\n"
+     "\n"
+     "Each MANIFEST line is a job: NAME SCRIPT [X:IMAGE | native | WHEN]...\n"
+     "where SCRIPT is a batch script and WHEN an exit condition, as for\n"
+     "the emulator -X and -e options. Images are never written back.\n"
+     "A result line 'NAME EXIT INSTRUCTIONS SECONDS [ERROR]' is written\n"
+     "for each job in manifest order, and a summary on stderr. The exit\n"
+     "code is 0 only when every job exited with 0.\n"
+     "\n",
+     DEFAULT_CPM22_LOCATION,
+     DEFAULT_CBIOS_LOCATION);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  int c, n;
+  const char *cpm22_location = DEFAULT_CPM22_LOCATION;
+  const char *cbios_location = DEFAULT_CBIOS_LOCATION;
+  const char *results_location = NULL;
+  struct timeval start;
+  double seconds;
+  FILE *fh;
+  uint32_t i;
+  int result = EXIT_SUCCESS;
+
+  runner_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((c = getopt(argc, argv, "j:o:r:K:m:s:h")) != -1) {
+    switch (c) {
+    case 'j':
+      runner_workers = atoi(optarg);
+      if (runner_workers < 1 || runner_workers > RUNNER_WORKERS_MAX) {
+        fprintf(stderr, "Error: Invalid number of workers: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'o':
+      runner_log_dir = optarg;
+      break;
+
+    case 'r':
+      results_location = optarg;
+      break;
+
+    case 'K':
+      runner_cache_dir = optarg;
+      break;
+
+    case 'm':
+      cpm22_location = optarg;
+      break;
+
+    case 's':
+      cbios_location = optarg;
+      break;
+
+    case 'h':
+      display_help(argv[0]);
+      return EXIT_SUCCESS;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (argc - optind != 1) {
+    display_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (runner_workers < 1) {
+    runner_workers = 1;
+  } else if (runner_workers > RUNNER_WORKERS_MAX) {
+    runner_workers = RUNNER_WORKERS_MAX;
+  }
+
+  if (runner_binary_load(cpm22_location, runner_cpm22, sizeof(runner_cpm22),
+    &runner_cpm22_size) != 0) {
+    fprintf(stderr, "Error: Failed to load CP/M 2.2 binary!\n");
+    return EXIT_FAILURE;
+  }
+  if (runner_binary_load(cbios_location, runner_cbios, sizeof(runner_cbios),
+    &runner_cbios_size) != 0) {
+    fprintf(stderr, "Error: Failed to load CBIOS binary!\n");
+    return EXIT_FAILURE;
+  }
+  if (runner_manifest_load(argv[optind]) != 0) {
+    return EXIT_FAILURE;
+  }
+  if ((uint32_t)runner_workers > runner_jobs && runner_jobs > 0) {
+    runner_workers = runner_jobs;
+  }
+
+  gettimeofday(&start, NULL);
+  if (runner_workers_start() != 0) {
+    return EXIT_FAILURE;
+  }
+  for (n = 0; n < runner_workers; n++) {
+    pthread_join(runner_worker[n].thread, NULL);
+  }
+  seconds = runner_elapsed(&start);
+
+  fh = stdout;
+  if (results_location != NULL) {
+    fh = fopen(results_location, "w");
+    if (fh == NULL) {
+      fprintf(stderr, "Error: Unable to open '%s'\n", results_location);
+      return EXIT_FAILURE;
+    }
+  }
+  runner_results(fh);
+  if (fh != stdout) {
+    fclose(fh);
+  }
+  runner_summary(stderr, seconds);
+
+  for (i = 0; i < runner_jobs; i++) {
+    if (runner_job[i].result != BATCH_EXIT_DONE) {
+      result = EXIT_FAILURE;
+    }
+    free(runner_job[i].line);
+  }
+  free(runner_job);
+  for (n = 0; n < runner_workers; n++) {
+    free(runner_worker[n].deque.job);
+  }
+  return result;
+}
@@ -0,0 +1,623 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include "screen.h"
+
+/* Virtual ADM-3A screen.
+
+   Output from CP/M only updates a grid of characters. A console renders the
+   grid when it sees fit by comparing it against a copy of what was last
+   shown, so only the changed runs are sent to the terminal, using whatever
+   cursor motion is the cheapest to get to them. Rows not written to since the
+   last render are skipped without comparing. */
+
+#define SCREEN_BLANK 0x20
+#define SCREEN_REWRITE_MAX 8 /* Longest gap written over instead of moved. */
+#define SCREEN_MOTION_SIZE 32
+
+
+
+void screen_init(screen_t *screen)
+{
+  int i;
+
+  memset(screen->cell, SCREEN_BLANK, sizeof(screen->cell));
+  memset(screen->shown, SCREEN_BLANK, sizeof(screen->shown));
+  for (i = 0; i < SCREEN_ROWS; i++) {
+    screen->dirty[i] = false;
+  }
+  screen->change = false;
+  screen->clear = false;
+  screen->scrolled = 0;
+  screen->bell_pending = false;
+  screen->cursor_row = 0;
+  screen->cursor_col = 0;
+  screen->wrap = false;
+  screen->escape = 0;
+  screen->escape_row = 0;
+  screen->term_valid = false;
+  screen->term_known = false;
+  screen->term_row = 0;
+  screen->term_col = 0;
+  screen->out_len = 0;
+  screen->out_func = NULL;
+  screen->out_context = NULL;
+}
+
+
+
+static void screen_line_feed(screen_t *screen)
+{
+  int i;
+
+  if (screen->cursor_row < (SCREEN_ROWS - 1)) {
+    screen->cursor_row++;
+    return;
+  }
+
+  memmove(screen->cell[0], screen->cell[1], (SCREEN_ROWS - 1) * SCREEN_COLS);
+  memset(screen->cell[SCREEN_ROWS - 1], SCREEN_BLANK, SCREEN_COLS);
+  for (i = 0; i < SCREEN_ROWS; i++) {
+    screen->dirty[i] = true;
+  }
+  screen->scrolled++;
+}
+
+
+
+static void screen_put(screen_t *screen, uint8_t value)
+{
+  if (screen->wrap) {
+    screen->wrap = false;
+    screen->cursor_col = 0;
+    screen_line_feed(screen);
+  }
+
+  screen->cell[screen->cursor_row][screen->cursor_col] = value;
+  screen->dirty[screen->cursor_row] = true;
+
+  if (screen->cursor_col < (SCREEN_COLS - 1)) {
+    screen->cursor_col++;
+  } else {
+    screen->wrap = true;
+  }
+}
+
+
+
+void screen_write(screen_t *screen, uint8_t value)
+{
+  int row, col;
+
+  screen->change = true;
+
+  /* ADM-3A emulation of escape codes. */
+  if (screen->escape == 2) {
+    screen->escape_row = value;
+    screen->escape++;
+    return;
+
+  } else if (screen->escape == 3) {
+    /* Cursor position, both offset by 32. */
+    row = screen->escape_row - 32;
+    col = value - 32;
+    screen->cursor_row = (row < 0) ? 0 :
+      (row >= SCREEN_ROWS) ? SCREEN_ROWS - 1 : row;
+    screen->cursor_col = (col < 0) ? 0 :
+      (col >= SCREEN_COLS) ? SCREEN_COLS - 1 : col;
+    screen->wrap = false;
+    screen->escape++;
+    return;
+
+  } else if (screen->escape == 4) {
+    if (value == 0x3D) {
+      /* Repeated escape code. */
+      screen->escape = 2;
+      return;
+
+    } else {
+      screen->escape = 0;
+    }
+  }
+
+  /* Regular ASCII characters. */
+  if (value >= 0x20 && value < 0x7F) {
+    if (screen->escape == 0) {
+      screen_put(screen, value);
+      return;
+    }
+  }
+
+  /* Check potential non-printable characters. */
+  switch (value) {
+  case 0x07: /* Bell */
+    screen->bell_pending = true;
+    break;
+
+  case 0x08: /* Backspace */
+    screen->wrap = false;
+    if (screen->cursor_col > 0) {
+      screen->cursor_col--;
+    }
+    break;
+
+  case 0x0A: /* Line Feed */
+    screen->wrap = false;
+    screen_line_feed(screen);
+    break;
+
+  case 0x0B: /* Upline */
+    screen->wrap = false;
+    if (screen->cursor_row > 0) {
+      screen->cursor_row--;
+    }
+    break;
+
+  case 0x0C: /* Forward Space */
+    screen->wrap = false;
+    if (screen->cursor_col < (SCREEN_COLS - 1)) {
+      screen->cursor_col++;
+    }
+    break;
+
+  case 0x0D: /* Return */
+    screen->wrap = false;
+    screen->cursor_col = 0;
+    break;
+
+  case 0x1B: /* Escape */
+    if (screen->escape == 0) {
+      screen->escape++;
+    } else {
+      screen->escape = 0;
+    }
+    break;
+
+  case 0x1A: /* Clear Screen */
+    memset(screen->cell, SCREEN_BLANK, sizeof(screen->cell));
+    for (row = 0; row < SCREEN_ROWS; row++) {
+      screen->dirty[row] = true;
+    }
+    screen->clear = true;
+    /* Fallthrough! */
+  case 0x1E: /* Home Cursor */
+    screen->wrap = false;
+    screen->cursor_row = 0;
+    screen->cursor_col = 0;
+    break;
+
+  case 0x3D:
+    if (screen->escape == 1) {
+      screen->escape++;
+    } else {
+      screen_put(screen, '=');
+      screen->escape = 0;
+    }
+    break;
+
+  case 0xA4: /* Copyright Symbol */
+    screen_put(screen, 'c');
+    break;
+
+  default:
+    /* Unknown escape codes and other control characters are ignored. */
+    screen->escape = 0;
+    break;
+  }
+}
+
+
+
+void screen_invalidate(screen_t *screen)
+{
+  /* Terminal contents unknown, next render starts over. */
+  screen->term_valid = false;
+  screen->change = true;
+}
+
+
+
+bool screen_changed(screen_t *screen)
+{
+  return screen->change;
+}
+
+
+
+bool screen_bell(screen_t *screen)
+{
+  bool bell = screen->bell_pending;
+  screen->bell_pending = false;
+  return bell;
+}
+
+
+
+void screen_cursor(screen_t *screen, int *row, int *col)
+{
+  *row = screen->cursor_row;
+  *col = screen->cursor_col;
+}
+
+
+
+const uint8_t *screen_row(screen_t *screen, int row)
+{
+  return screen->cell[row];
+}
+
+
+
+bool screen_find(screen_t *screen, const char *text)
+{
+  int row, col, len;
+
+  len = strlen(text);
+  if (len == 0 || len > SCREEN_COLS) {
+    return false;
+  }
+  for (row = 0; row < SCREEN_ROWS; row++) {
+    for (col = 0; col <= SCREEN_COLS - len; col++) {
+      if (memcmp(&screen->cell[row][col], text, len) == 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+
+
+void screen_update(screen_t *screen, screen_run_t run)
+{
+  int row, col, start;
+
+  /* Report the changed runs, the console keeps track of the terminal. */
+  for (row = 0; row < SCREEN_ROWS; row++) {
+    if (! screen->dirty[row]) {
+      continue;
+    }
+    screen->dirty[row] = false;
+    if (memcmp(screen->cell[row], screen->shown[row], SCREEN_COLS) == 0) {
+      continue;
+    }
+
+    col = 0;
+    while (col < SCREEN_COLS) {
+      if (screen->cell[row][col] == screen->shown[row][col]) {
+        col++;
+        continue;
+      }
+      start = col;
+      while (col < SCREEN_COLS &&
+        screen->cell[row][col] != screen->shown[row][col]) {
+        col++;
+      }
+      run(row, start, &screen->cell[row][start], col - start);
+      memcpy(&screen->shown[row][start], &screen->cell[row][start],
+        col - start);
+    }
+  }
+
+  screen->clear = false;
+  screen->scrolled = 0;
+  screen->change = false;
+}
+
+
+
+static void screen_out_flush(screen_t *screen)
+{
+  if (screen->out_len > 0) {
+    screen->out[screen->out_len] = '\0';
+    (screen->out_func)(screen->out_context, screen->out);
+    screen->out_len = 0;
+  }
+}
+
+
+
+static void screen_out_add(screen_t *screen, const char *s, int len)
+{
+  if (screen->out_len + len >= SCREEN_OUT_SIZE) {
+    screen_out_flush(screen);
+  }
+  memcpy(&screen->out[screen->out_len], s, len);
+  screen->out_len += len;
+}
+
+
+
+static int screen_number(char *s, int n)
+{
+  /* Only up to three digits needed. */
+  if (n >= 100) {
+    s[0] = (n / 100) + 0x30;
+    s[1] = ((n / 10) % 10) + 0x30;
+    s[2] = (n % 10) + 0x30;
+    return 3;
+  } else if (n >= 10) {
+    s[0] = (n / 10) + 0x30;
+    s[1] = (n % 10) + 0x30;
+    return 2;
+  } else {
+    s[0] = n + 0x30;
+    return 1;
+  }
+}
+
+
+
+static int screen_csi(char *s, int n, char final)
+{
+  int len = 0;
+
+  /* ANSI - Control Sequence, parameter left out if 1. */
+  s[len++] = 0x1B;
+  s[len++] = '[';
+  if (n != 1) {
+    len += screen_number(&s[len], n);
+  }
+  s[len++] = final;
+  return len;
+}
+
+
+
+static int screen_horizontal(screen_t *screen, char *s, int row, int from, int to)
+{
+  char cuf[8];
+  int len, i;
+
+  if (to == from) {
+    return 0;
+  }
+
+  if (to > from) {
+    /* Write over what is already shown, or move forward. */
+    len = screen_csi(cuf, to - from, 'C');
+    if (to - from <= len && to - from <= SCREEN_REWRITE_MAX) {
+      for (i = from; i < to; i++) {
+        s[i - from] = screen->shown[row][i];
+      }
+      return to - from;
+    }
+    memcpy(s, cuf, len);
+    return len;
+
+  } else {
+    /* Backspace, or move back. */
+    len = screen_csi(s, from - to, 'D');
+    if (from - to <= len) {
+      for (i = 0; i < from - to; i++) {
+        s[i] = 0x08;
+      }
+      return from - to;
+    }
+    return len;
+  }
+}
+
+
+
+static int screen_absolute(char *s, int row, int col)
+{
+  int len = 0;
+
+  /* ANSI - Cursor Position, parameters left out if 1. */
+  s[len++] = 0x1B;
+  s[len++] = '[';
+  if (row > 0 || col > 0) {
+    len += screen_number(&s[len], row + 1);
+  }
+  if (col > 0) {
+    s[len++] = ';';
+    len += screen_number(&s[len], col + 1);
+  }
+  s[len++] = 'H';
+  return len;
+}
+
+
+
+static void screen_move(screen_t *screen, int row, int col)
+{
+  char best[SCREEN_MOTION_SIZE];
+  char try[SCREEN_MOTION_SIZE];
+  int best_len, len, i;
+
+  if (screen->term_known &&
+    screen->term_row == row && screen->term_col == col) {
+    return;
+  }
+
+  best_len = screen_absolute(best, row, col);
+
+  if (screen->term_known) {
+    /* Vertical, then horizontal from the current column. */
+    len = 0;
+    if (row > screen->term_row) {
+      len = screen_csi(try, row - screen->term_row, 'B');
+    } else if (row < screen->term_row) {
+      len = screen_csi(try, screen->term_row - row, 'A');
+    }
+    len += screen_horizontal(screen, &try[len], row, screen->term_col, col);
+    if (len < best_len) {
+      memcpy(best, try, len);
+      best_len = len;
+    }
+
+    /* Return first, then horizontal from the first column. */
+    len = 0;
+    if (row > screen->term_row && row - screen->term_row <= 4) {
+      for (i = screen->term_row; i < row; i++) {
+        try[len++] = 0x0D;
+        try[len++] = 0x0A;
+      }
+    } else {
+      try[len++] = 0x0D;
+      if (row > screen->term_row) {
+        len += screen_csi(&try[len], row - screen->term_row, 'B');
+      } else if (row < screen->term_row) {
+        len += screen_csi(&try[len], screen->term_row - row, 'A');
+      }
+    }
+    len += screen_horizontal(screen, &try[len], row, 0, col);
+    if (len < best_len) {
+      memcpy(best, try, len);
+      best_len = len;
+    }
+  }
+
+  screen_out_add(screen, best, best_len);
+  screen->term_known = true;
+  screen->term_row = row;
+  screen->term_col = col;
+}
+
+
+
+static void screen_out_str(screen_t *screen, const char *s)
+{
+  screen_out_add(screen, s, strlen(s));
+}
+
+
+
+void screen_render_ansi(screen_t *screen, screen_output_t output,
+  void *context)
+{
+  int row, col, last, shown_last;
+
+  screen->out_func = output;
+  screen->out_context = context;
+
+  if (! screen->term_valid || screen->clear ||
+    screen->scrolled >= SCREEN_ROWS) {
+    /* Start from a known blank screen, and keep scrolling to the rows. */
+    if (! screen->term_valid) {
+      screen_out_str(screen, "\x1B[1;24r");
+      screen->term_valid = true;
+    }
+    screen_out_str(screen, "\x1B[H\x1B[2J");
+    memset(screen->shown, SCREEN_BLANK, sizeof(screen->shown));
+    for (row = 0; row < SCREEN_ROWS; row++) {
+      screen->dirty[row] = true;
+    }
+    screen->term_known = true;
+    screen->term_row = 0;
+    screen->term_col = 0;
+
+  } else if (screen->scrolled > 0) {
+    /* Let the terminal scroll, then only what is new has to be drawn. */
+    screen_move(screen, SCREEN_ROWS - 1, 0);
+    for (row = 0; row < screen->scrolled; row++) {
+      screen_out_add(screen, "\x0A", 1);
+    }
+    memmove(screen->shown[0], screen->shown[screen->scrolled],
+      (SCREEN_ROWS - screen->scrolled) * SCREEN_COLS);
+    memset(screen->shown[SCREEN_ROWS - screen->scrolled], SCREEN_BLANK,
+      screen->scrolled * SCREEN_COLS);
+  }
+  screen->clear = false;
+  screen->scrolled = 0;
+
+  if (screen_bell(screen)) {
+    screen_out_add(screen, "\x07", 1);
+  }
+
+  for (row = 0; row < SCREEN_ROWS; row++) {
+    if (! screen->dirty[row]) {
+      continue;
+    }
+    screen->dirty[row] = false;
+    if (memcmp(screen->cell[row], screen->shown[row], SCREEN_COLS) == 0) {
+      continue;
+    }
+
+    last = SCREEN_COLS - 1;
+    while (last >= 0 && screen->cell[row][last] == SCREEN_BLANK) {
+      last--;
+    }
+    shown_last = SCREEN_COLS - 1;
+    while (shown_last >= 0 && screen->shown[row][shown_last] == SCREEN_BLANK) {
+      shown_last--;
+    }
+
+    for (col = 0; col < SCREEN_COLS; col++) {
+      if (screen->cell[row][col] == screen->shown[row][col]) {
+        continue;
+      }
+
+      if (col > last && shown_last - col >= 3) {
+        /* ANSI - Erase in Line, cheaper than writing the blanks. */
+        screen_move(screen, row, col);
+        screen_out_str(screen, "\x1B[K");
+        memset(&screen->shown[row][col], SCREEN_BLANK, SCREEN_COLS - col);
+        break;
+      }
+
+      screen_move(screen, row, col);
+      screen_out_add(screen, (const char *)&screen->cell[row][col], 1);
+      screen->shown[row][col] = screen->cell[row][col];
+      if (screen->term_col < (SCREEN_COLS - 1)) {
+        screen->term_col++;
+      } else {
+        screen->term_known = false; /* Terminals differ on wrapping. */
+      }
+    }
+  }
+
+  screen_move(screen, screen->cursor_row, screen->cursor_col);
+  screen_out_flush(screen);
+  screen->change = false;
+}
+
+
+
+void screen_close_ansi(screen_t *screen, screen_output_t output,
+  void *context)
+{
+  if (! screen->term_valid) {
+    return;
+  }
+
+  /* Reset scrolling region, which also homes the cursor. */
+  screen->out_func = output;
+  screen->out_context = context;
+  screen_out_str(screen, "\x1B[r");
+  screen->term_known = false;
+  screen_move(screen, screen->cursor_row, screen->cursor_col);
+  screen_out_flush(screen);
+  screen->term_valid = false;
+}
+
+
+
+void screen_dump(screen_t *screen, screen_output_t output,
+  void *context)
+{
+  char line[SCREEN_COLS + 2];
+  int row, last, n;
+
+  /* Cursor line first, then each row as plain text without the trailing
+     blanks. The grid only holds printable ASCII. */
+  n = screen_number(line, screen->cursor_row);
+  line[n++] = ',';
+  n += screen_number(&line[n], screen->cursor_col);
+  line[n] = '\0';
+  output(context, "Cursor: ");
+  output(context, line);
+  output(context, "\n");
+
+  for (row = 0; row < SCREEN_ROWS; row++) {
+    last = SCREEN_COLS - 1;
+    while (last >= 0 && screen->cell[row][last] == SCREEN_BLANK) {
+      last--;
+    }
+    memcpy(line, screen->cell[row], last + 1);
+    line[last + 1] = '\n';
+    line[last + 2] = '\0';
+    output(context, line);
+  }
+}
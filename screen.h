@@ -0,0 +1,59 @@
+#ifndef _SCREEN_H
+#define _SCREEN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* ADM-3A screen */
+#define SCREEN_ROWS 24
+#define SCREEN_COLS 80
+
+typedef void (*screen_output_t)(void *context, const char *s);
+typedef void (*screen_run_t)(int row, int col, const uint8_t text[], int len);
+
+#define SCREEN_OUT_SIZE 256
+
+typedef struct screen_s {
+  uint8_t cell[SCREEN_ROWS][SCREEN_COLS];
+  uint8_t shown[SCREEN_ROWS][SCREEN_COLS];
+  bool dirty[SCREEN_ROWS];
+  bool change;
+  bool clear; /* Cleared since last render. */
+  int scrolled; /* Lines scrolled since last render. */
+  bool bell_pending;
+
+  int cursor_row;
+  int cursor_col;
+  bool wrap; /* Wrap before next character. */
+  int escape;
+  uint8_t escape_row;
+
+  /* Terminal state as known by the ANSI renderer. */
+  bool term_valid;
+  bool term_known;
+  int term_row;
+  int term_col;
+
+  char out[SCREEN_OUT_SIZE];
+  int out_len;
+  screen_output_t out_func;
+  void *out_context;
+} screen_t;
+
+void screen_init(screen_t *screen);
+void screen_write(screen_t *screen, uint8_t value);
+void screen_invalidate(screen_t *screen);
+bool screen_changed(screen_t *screen);
+bool screen_bell(screen_t *screen);
+void screen_cursor(screen_t *screen, int *row, int *col);
+const uint8_t *screen_row(screen_t *screen, int row);
+bool screen_find(screen_t *screen, const char *text);
+void screen_update(screen_t *screen, screen_run_t run);
+void screen_render_ansi(screen_t *screen, screen_output_t output,
+  void *context);
+void screen_close_ansi(screen_t *screen, screen_output_t output,
+  void *context);
+void screen_dump(screen_t *screen, screen_output_t output,
+  void *context);
+
+#endif /* _SCREEN_H */
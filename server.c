@@ -0,0 +1,947 @@
+/* Threads and sockets need more than the base POSIX definitions. */
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "kaytil.h"
+#include "disk.h"
+#include "screen.h"
+
+/* Multi-session server, each connection gets a machine of its own with the
+   screen translated from ADM-3A to ANSI as for the terminal console. The
+   accepting thread deals new sessions out to a fixed pool of workers, and
+   each worker multiplexes its sessions with epoll.
+
+   A worker runs its sessions round robin. By default each may run as many
+   instructions per tick as the emulator does with its slowdown, and waits
+   for the next tick when they are used. A session reading a key that has
+   not arrived is blocked, the reading instruction is retried once input
+   comes. Such a session is not looked at until then, so idle sessions
+   cost no CPU. Output is rendered when a session blocks, or at most every
+   frame interval, and only when the previous render has been sent, so a
+   slow client never holds up the emulation. */
+
+#define DEFAULT_CPM22_LOCATION "cpm22.bin"
+#define DEFAULT_CBIOS_LOCATION "cbios.bin"
+
+#define SERVER_WORKERS_MAX 256
+#define SERVER_EVENTS 64
+#define SERVER_INPUT_SIZE 1024 /* Power of two */
+#define SERVER_OUTPUT_MIN 4096
+#define SERVER_TICK 10000 /* Microseconds */
+#define SERVER_TICK_INSTRUCTIONS 5000 /* Same pace as the slowdown. */
+#define SERVER_SLICE_INSTRUCTIONS 100000 /* At full speed. */
+#define SERVER_FRAME_INTERVAL 20000 /* Microseconds */
+#define SERVER_ACCEPT_BACKOFF 100 /* Milliseconds */
+
+typedef enum {
+  SERVER_RUNNING, /* In the run queue. */
+  SERVER_THROTTLED, /* In the throttled queue until the next tick. */
+  SERVER_WAITING, /* In no queue until a key arrives. */
+} server_state_t;
+
+typedef struct server_session_s {
+  int fd;
+  kaytil_machine_t *machine;
+  disk_t *disk;
+  server_state_t state;
+  bool closed; /* Freed when taken from its queue. */
+  uint32_t budget; /* Instructions left in this tick. */
+  uint32_t events; /* Registered with epoll. */
+  struct server_session_s *next;
+
+  uint8_t input[SERVER_INPUT_SIZE];
+  uint32_t input_head;
+  uint32_t input_tail;
+
+  screen_t screen;
+  bool screen_pending;
+  struct timeval pending_since;
+  char *output;
+  size_t output_len;
+  size_t output_sent;
+  size_t output_max;
+} server_session_t;
+
+typedef struct server_queue_s {
+  server_session_t *head;
+  server_session_t *tail;
+} server_queue_t;
+
+typedef struct server_worker_s {
+  pthread_t thread;
+  int epoll_fd;
+  int wake_pipe[2];
+  pthread_mutex_t mutex;
+  server_queue_t incoming; /* From the accepting thread. */
+  server_queue_t running;
+  server_queue_t throttled;
+  struct timeval tick;
+} server_worker_t;
+
+static uint8_t server_cpm22[KAYTIL_CBIOS_ADDRESS - KAYTIL_CPM22_ADDRESS];
+static uint8_t server_cbios[UINT16_MAX + 1 - KAYTIL_CBIOS_ADDRESS];
+static uint16_t server_cpm22_size;
+static uint16_t server_cbios_size;
+static const char *server_image[DISK_DRIVES];
+
+static server_worker_t server_worker[SERVER_WORKERS_MAX];
+static int server_workers = 0;
+static bool server_full_speed = false;
+static bool server_native_bdos = false;
+
+
+
+static long server_elapsed(const struct timeval *since,
+  const struct timeval *now)
+{
+  return ((now->tv_sec - since->tv_sec) * 1000000) +
+    (now->tv_usec - since->tv_usec);
+}
+
+
+
+static void server_queue_put(server_queue_t *queue, server_session_t *session)
+{
+  session->next = NULL;
+  if (queue->tail == NULL) {
+    queue->head = session;
+  } else {
+    queue->tail->next = session;
+  }
+  queue->tail = session;
+}
+
+
+
+static server_session_t *server_queue_get(server_queue_t *queue)
+{
+  server_session_t *session = queue->head;
+
+  if (session != NULL) {
+    queue->head = session->next;
+    if (queue->head == NULL) {
+      queue->tail = NULL;
+    }
+    session->next = NULL;
+  }
+  return session;
+}
+
+
+
+static uint32_t server_input_used(server_session_t *session)
+{
+  return session->input_head - session->input_tail;
+}
+
+
+
+static uint8_t server_input_get(server_session_t *session)
+{
+  return session->input[session->input_tail++ & (SERVER_INPUT_SIZE - 1)];
+}
+
+
+
+static uint8_t server_input_peek(server_session_t *session, uint32_t n)
+{
+  return session->input[(session->input_tail + n) & (SERVER_INPUT_SIZE - 1)];
+}
+
+
+
+static uint8_t server_console_status(void *context)
+{
+  server_session_t *session = context;
+
+  return (server_input_used(session) > 0) ? 0xFF : 0x00;
+}
+
+
+
+static uint8_t server_console_read(void *context)
+{
+  server_session_t *session = context;
+  uint8_t value;
+
+  if (server_input_used(session) == 0) {
+    kaytil_block(session->machine);
+    return 0x00;
+  }
+
+  value = server_input_get(session);
+  switch (value) {
+  case 0x0A: /* Convert LF to CR */
+    return 0x0D;
+
+  case 0x7F: /* Convert DEL to BS */
+    return 0x08;
+
+  case 0x1B: /* Escape, a lone one is passed on. */
+    if (server_input_used(session) >= 2 &&
+      server_input_peek(session, 0) == '[') {
+      switch (server_input_peek(session, 1)) {
+      case 'A': value = 0x0B; break; /* Cursor Up */
+      case 'B': value = 0x0A; break; /* Cursor Down */
+      case 'C': value = 0x0C; break; /* Cursor Forward/Right */
+      case 'D': value = 0x08; break; /* Cursor Back/Left */
+      default:
+        return value;
+      }
+      session->input_tail += 2;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return value;
+}
+
+
+
+static void server_console_write(void *context, uint8_t value)
+{
+  server_session_t *session = context;
+
+  if (! session->screen_pending) {
+    gettimeofday(&session->pending_since, NULL);
+    session->screen_pending = true;
+  }
+  screen_write(&session->screen, value);
+}
+
+
+
+static const io_console_t server_console = {
+  server_console_status,
+  server_console_read,
+  server_console_write,
+};
+
+
+
+static void server_output(void *context, const char *s)
+{
+  server_session_t *session = context;
+  size_t len = strlen(s);
+  size_t max;
+  char *new;
+
+  if (session->output_len + len > session->output_max) {
+    max = (session->output_max == 0) ? SERVER_OUTPUT_MIN :
+      session->output_max;
+    while (session->output_len + len > max) {
+      max *= 2;
+    }
+    new = realloc(session->output, max);
+    if (new == NULL) {
+      return; /* Just lose it, the next full redraw fixes it. */
+    }
+    session->output = new;
+    session->output_max = max;
+  }
+  memcpy(&session->output[session->output_len], s, len);
+  session->output_len += len;
+}
+
+
+
+static server_session_t *server_session_create(int fd)
+{
+  server_session_t *session;
+  kaytil_config_t config;
+  int i;
+
+  session = calloc(1, sizeof(server_session_t));
+  if (session == NULL) {
+    return NULL;
+  }
+  session->fd = fd;
+  session->state = SERVER_RUNNING;
+  session->budget = SERVER_TICK_INSTRUCTIONS;
+  screen_init(&session->screen);
+
+  session->disk = disk_create();
+  if (session->disk == NULL) {
+    free(session);
+    return NULL;
+  }
+  for (i = 0; i < DISK_DRIVES; i++) {
+    if (server_image[i] != NULL &&
+      disk_image_load(session->disk, i, server_image[i], false) != 0) {
+      disk_destroy(session->disk);
+      free(session);
+      return NULL;
+    }
+  }
+  if (disk_tables_size(session->disk) > DPB_TABLES_SIZE_MAX) {
+    disk_destroy(session->disk);
+    free(session);
+    return NULL;
+  }
+
+  memset(&config, 0, sizeof(config));
+  config.cpm22 = server_cpm22;
+  config.cpm22_size = server_cpm22_size;
+  config.cbios = server_cbios;
+  config.cbios_size = server_cbios_size;
+  config.console = &server_console;
+  config.console_context = session;
+  config.disk = &disk_backend;
+  config.disk_context = session->disk;
+  config.native_bdos = server_native_bdos;
+  config.banks = 1;
+  session->machine = kaytil_create(&config);
+  if (session->machine == NULL) {
+    disk_destroy(session->disk);
+    free(session);
+    return NULL;
+  }
+  return session;
+}
+
+
+
+static void server_session_destroy(server_session_t *session)
+{
+  kaytil_destroy(session->machine);
+  disk_destroy(session->disk);
+  close(session->fd);
+  free(session->output);
+  free(session);
+}
+
+
+
+static void server_session_close(server_worker_t *worker,
+  server_session_t *session)
+{
+  epoll_ctl(worker->epoll_fd, EPOLL_CTL_DEL, session->fd, NULL);
+  session->closed = true;
+  if (session->state == SERVER_WAITING) {
+    /* Freed from the run queue, after the events that may refer to it. */
+    session->state = SERVER_RUNNING;
+    server_queue_put(&worker->running, session);
+  }
+}
+
+
+
+static void server_session_events(server_worker_t *worker,
+  server_session_t *session)
+{
+  struct epoll_event event;
+  uint32_t events = 0;
+
+  /* Read only when there is room, and wait to write only when blocked. */
+  if (server_input_used(session) < SERVER_INPUT_SIZE) {
+    events |= EPOLLIN;
+  }
+  if (session->output_sent < session->output_len) {
+    events |= EPOLLOUT;
+  }
+  if (events == session->events) {
+    return;
+  }
+
+  memset(&event, 0, sizeof(event));
+  event.events = events;
+  event.data.ptr = session;
+  epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, session->fd, &event);
+  session->events = events;
+}
+
+
+
+static int server_session_send(server_session_t *session)
+{
+  ssize_t n;
+
+  while (session->output_sent < session->output_len) {
+    n = send(session->fd, &session->output[session->output_sent],
+      session->output_len - session->output_sent, MSG_NOSIGNAL);
+    if (n == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    session->output_sent += n;
+  }
+  session->output_sent = 0;
+  session->output_len = 0;
+  return 0;
+}
+
+
+
+static int server_session_render(server_session_t *session, bool now)
+{
+  struct timeval time;
+
+  if (! session->screen_pending ||
+    session->output_sent < session->output_len) {
+    return 0; /* Nothing new, or the last render is still on its way. */
+  }
+  if (! now) {
+    gettimeofday(&time, NULL);
+    if (server_elapsed(&session->pending_since, &time) <
+      SERVER_FRAME_INTERVAL) {
+      return 0;
+    }
+  }
+
+  screen_render_ansi(&session->screen, server_output, session);
+  session->screen_pending = false;
+  return server_session_send(session);
+}
+
+
+
+static void server_session_error(server_session_t *session)
+{
+  const char *error;
+
+  /* Last words, the session is closed whether they get there or not. */
+  error = kaytil_error(session->machine);
+  server_session_render(session, true);
+  server_output(session, "\r\nError: ");
+  server_output(session, (error != NULL) ? error : "Out of memory\n");
+  server_output(session, "\r");
+  server_session_send(session);
+}
+
+
+
+static void server_session_input(server_worker_t *worker,
+  server_session_t *session)
+{
+  uint8_t buffer[SERVER_INPUT_SIZE];
+  uint32_t space, i;
+  ssize_t n;
+
+  space = SERVER_INPUT_SIZE - server_input_used(session);
+  if (space == 0) {
+    return;
+  }
+  n = recv(session->fd, buffer, space, 0);
+  if (n == -1 && (errno == EINTR || errno == EAGAIN ||
+    errno == EWOULDBLOCK)) {
+    return;
+  }
+  if (n <= 0) {
+    server_session_close(worker, session); /* Gone. */
+    return;
+  }
+
+  for (i = 0; i < n; i++) {
+    session->input[session->input_head++ & (SERVER_INPUT_SIZE - 1)] =
+      buffer[i];
+  }
+  if (session->state == SERVER_WAITING) {
+    session->state = SERVER_RUNNING;
+    session->budget = SERVER_TICK_INSTRUCTIONS;
+    server_queue_put(&worker->running, session);
+  }
+}
+
+
+
+static void server_session_run(server_worker_t *worker,
+  server_session_t *session)
+{
+  uint64_t before;
+  uint32_t used;
+  int result;
+
+  before = kaytil_instructions(session->machine);
+  result = kaytil_run(session->machine, server_full_speed ?
+    SERVER_SLICE_INSTRUCTIONS : session->budget);
+  if (result == KAYTIL_RUN_ERROR) {
+    server_session_error(session);
+    session->state = SERVER_WAITING;
+    server_session_close(worker, session);
+    return;
+  }
+  used = kaytil_instructions(session->machine) - before;
+
+  if (server_session_render(session, result == KAYTIL_RUN_BLOCKED) != 0) {
+    session->state = SERVER_WAITING;
+    server_session_close(worker, session);
+    return;
+  }
+  server_session_events(worker, session);
+
+  if (result == KAYTIL_RUN_BLOCKED) {
+    session->state = SERVER_WAITING;
+  } else if (! server_full_speed && used >= session->budget) {
+    session->state = SERVER_THROTTLED;
+    server_queue_put(&worker->throttled, session);
+  } else {
+    session->budget -= used;
+    session->state = SERVER_RUNNING;
+    server_queue_put(&worker->running, session);
+  }
+}
+
+
+
+static void server_worker_incoming(server_worker_t *worker)
+{
+  server_session_t *session;
+  struct epoll_event event;
+  uint8_t dummy[64];
+
+  while (read(worker->wake_pipe[0], dummy, sizeof(dummy)) > 0);
+
+  pthread_mutex_lock(&worker->mutex);
+  while ((session = server_queue_get(&worker->incoming)) != NULL) {
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = session;
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, session->fd,
+      &event) != 0) {
+      server_session_destroy(session);
+      continue;
+    }
+    session->events = EPOLLIN;
+    server_queue_put(&worker->running, session);
+  }
+  pthread_mutex_unlock(&worker->mutex);
+}
+
+
+
+static void server_worker_tick(server_worker_t *worker)
+{
+  server_session_t *session;
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  if (server_elapsed(&worker->tick, &now) < SERVER_TICK) {
+    return;
+  }
+  worker->tick = now;
+  while ((session = server_queue_get(&worker->throttled)) != NULL) {
+    session->budget = SERVER_TICK_INSTRUCTIONS;
+    session->state = SERVER_RUNNING;
+    server_queue_put(&worker->running, session);
+  }
+}
+
+
+
+static int server_worker_timeout(server_worker_t *worker)
+{
+  struct timeval now;
+  long left;
+
+  if (worker->running.head != NULL) {
+    return 0;
+  }
+  if (worker->throttled.head == NULL) {
+    return -1; /* Nothing to do until something happens. */
+  }
+  gettimeofday(&now, NULL);
+  left = SERVER_TICK - server_elapsed(&worker->tick, &now);
+  return (left <= 0) ? 0 : (left + 999) / 1000;
+}
+
+
+
+static void *server_worker_main(void *arg)
+{
+  server_worker_t *worker = arg;
+  struct epoll_event events[SERVER_EVENTS];
+  server_session_t *session, *last;
+  bool done;
+  int i, n;
+
+  gettimeofday(&worker->tick, NULL);
+
+  while (1) {
+    n = epoll_wait(worker->epoll_fd, events, SERVER_EVENTS,
+      server_worker_timeout(worker));
+    for (i = 0; i < n; i++) {
+      session = events[i].data.ptr;
+      if (session == NULL) {
+        server_worker_incoming(worker);
+        continue;
+      }
+      if (session->closed) {
+        continue;
+      }
+      if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        if (server_session_send(session) != 0 ||
+          server_session_render(session, true) != 0) {
+          server_session_close(worker, session);
+          continue;
+        }
+      }
+      if (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+        server_session_input(worker, session);
+      }
+      if (! session->closed) {
+        server_session_events(worker, session);
+      }
+    }
+
+    server_worker_tick(worker);
+
+    /* One round over the sessions that were ready when it started. */
+    last = worker->running.tail;
+    done = (last == NULL);
+    while (! done) {
+      session = server_queue_get(&worker->running);
+      done = (session == last);
+      if (session->closed) {
+        server_session_destroy(session);
+      } else {
+        server_session_run(worker, session);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+
+static int server_workers_start(void)
+{
+  server_worker_t *worker;
+  struct epoll_event event;
+  int n;
+
+  for (n = 0; n < server_workers; n++) {
+    worker = &server_worker[n];
+    worker->epoll_fd = epoll_create1(0);
+    if (worker->epoll_fd == -1 || pipe(worker->wake_pipe) != 0) {
+      fprintf(stderr, "Error: epoll_create1() or pipe() failed: %d\n",
+        errno);
+      return -1;
+    }
+    fcntl(worker->wake_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(worker->wake_pipe[1], F_SETFL, O_NONBLOCK);
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->wake_pipe[0], &event);
+    pthread_mutex_init(&worker->mutex, NULL);
+
+    if (pthread_create(&worker->thread, NULL, server_worker_main,
+      worker) != 0) {
+      fprintf(stderr, "Error: pthread_create() failed\n");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+
+static void server_accept(int listen_fd)
+{
+  static int next = 0;
+  server_worker_t *worker;
+  server_session_t *session;
+  uint8_t dummy = 0;
+  int fd, one = 1;
+
+  fd = accept(listen_fd, NULL, NULL);
+  if (fd == -1) {
+    if (errno == EMFILE || errno == ENFILE) {
+      /* Still pending, so back off instead of polling it in a loop. */
+      fprintf(stderr, "Error: Out of file descriptors\n");
+      poll(NULL, 0, SERVER_ACCEPT_BACKOFF);
+    }
+    return;
+  }
+  fcntl(fd, F_SETFL, O_NONBLOCK);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  session = server_session_create(fd);
+  if (session == NULL) {
+    send(fd, "Error: Failed to create machine!\r\n", 34, MSG_NOSIGNAL);
+    close(fd);
+    return;
+  }
+
+  worker = &server_worker[next];
+  next = (next + 1) % server_workers;
+  pthread_mutex_lock(&worker->mutex);
+  server_queue_put(&worker->incoming, session);
+  pthread_mutex_unlock(&worker->mutex);
+  if (write(worker->wake_pipe[1], &dummy, 1) == -1 && errno != EAGAIN) {
+    fprintf(stderr, "Error: write() failed with errno: %d\n", errno);
+  }
+}
+
+
+
+static int server_listen_unix(const char *path)
+{
+  struct sockaddr_un address;
+  int fd;
+
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  unlink(path);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+
+static int server_listen_tcp(int port)
+{
+  struct sockaddr_in address;
+  int fd, one = 1;
+
+  memset(&address, 0, sizeof(address));
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 ||
+    listen(fd, SOMAXCONN) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+
+static int server_binary_load(const char *filename, uint8_t data[],
+  uint16_t max, uint16_t *size)
+{
+  FILE *fh;
+  size_t n;
+
+  fh = fopen(filename, "rb");
+  if (fh == NULL) {
+    return -1;
+  }
+  n = fread(data, sizeof(uint8_t), max, fh);
+  fclose(fh);
+  if (n == 0) {
+    return -1;
+  }
+  *size = n;
+  return 0;
+}
+
+
+
+static void display_help(const char *progname)
+{
+  fprintf(stderr, "Usage: %s <options>\n", progname);
+  fprintf(stderr, "Options:\n"
+     "  -u PATH    Listen on the Unix socket PATH\n"
+     "  -t PORT    Listen on localhost TCP PORT\n"
+     "  -j WORKERS Run sessions on WORKERS threads instead of one per CPU\n"
+     "  -F         Run sessions at full speed instead of the normal pace\n"
+     "  -a IMAGE   Load disk IMAGE in drive A\n"
+     "  -b IMAGE   Load disk IMAGE in drive B\n"
+     "  -c IMAGE   Load disk IMAGE in drive C\n"
+     "  -d IMAGE   Load disk IMAGE in drive D\n"
+     "  -i X:IMAGE Load disk IMAGE in drive X (A to P)\n"
+     "  -n         Use native BDOS functions for speed\n"
+     "  -m FILE    Load CP/M 2.2 binary from FILE instead of '%s'\n"
+     "  -s FILE    Load CBIOS binary from FILE instead of '%s'\n"
+     "\n"
+     "Each connection gets a machine of its own with the disk images\n"
+     "loaded, changes are never written back. Connect with a terminal in\n"
+     "raw mode, for instance: socat -,raw,echo=0 UNIX-CONNECT:PATH\n"
+     "\n",
+     DEFAULT_CPM22_LOCATION,
+     DEFAULT_CBIOS_LOCATION);
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  int c, n, fds;
+  const char *cpm22_location = DEFAULT_CPM22_LOCATION;
+  const char *cbios_location = DEFAULT_CBIOS_LOCATION;
+  const char *unix_path = NULL;
+  int tcp_port = 0;
+  struct pollfd fd[2];
+  struct rlimit limit;
+
+  server_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  while ((c = getopt(argc, argv, "u:t:j:Fa:b:c:d:i:nm:s:h")) != -1) {
+    switch (c) {
+    case 'u':
+      unix_path = optarg;
+      break;
+
+    case 't':
+      tcp_port = atoi(optarg);
+      if (tcp_port < 1 || tcp_port > 65535) {
+        fprintf(stderr, "Error: Invalid TCP port: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'j':
+      server_workers = atoi(optarg);
+      if (server_workers < 1 || server_workers > SERVER_WORKERS_MAX) {
+        fprintf(stderr, "Error: Invalid number of workers: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'F':
+      server_full_speed = true;
+      break;
+
+    case 'a':
+    case 'b':
+    case 'c':
+    case 'd':
+      server_image[c - 0x61] = optarg;
+      break;
+
+    case 'i':
+      if (optarg[0] >= 'a' && optarg[0] <= 'p' && optarg[1] == ':') {
+        server_image[optarg[0] - 0x61] = &optarg[2];
+      } else if (optarg[0] >= 'A' && optarg[0] <= 'P' && optarg[1] == ':') {
+        server_image[optarg[0] - 0x41] = &optarg[2];
+      } else {
+        fprintf(stderr, "Error: Invalid drive specification: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+
+    case 'n':
+      server_native_bdos = true;
+      break;
+
+    case 'm':
+      cpm22_location = optarg;
+      break;
+
+    case 's':
+      cbios_location = optarg;
+      break;
+
+    case 'h':
+      display_help(argv[0]);
+      return EXIT_SUCCESS;
+
+    case '?':
+    default:
+      display_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (unix_path == NULL && tcp_port == 0) {
+    display_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+  if (server_workers < 1) {
+    server_workers = 1;
+  } else if (server_workers > SERVER_WORKERS_MAX) {
+    server_workers = SERVER_WORKERS_MAX;
+  }
+
+  if (server_binary_load(cpm22_location, server_cpm22, sizeof(server_cpm22),
+    &server_cpm22_size) != 0) {
+    fprintf(stderr, "Error: Failed to load CP/M 2.2 binary!\n");
+    return EXIT_FAILURE;
+  }
+  if (server_binary_load(cbios_location, server_cbios, sizeof(server_cbios),
+    &server_cbios_size) != 0) {
+    fprintf(stderr, "Error: Failed to load CBIOS binary!\n");
+    return EXIT_FAILURE;
+  }
+
+  fds = 0;
+  if (unix_path != NULL) {
+    fd[fds].fd = server_listen_unix(unix_path);
+    if (fd[fds].fd == -1) {
+      fprintf(stderr, "Error: Unable to listen on '%s'\n", unix_path);
+      return EXIT_FAILURE;
+    }
+    fd[fds++].events = POLLIN;
+  }
+  if (tcp_port != 0) {
+    fd[fds].fd = server_listen_tcp(tcp_port);
+    if (fd[fds].fd == -1) {
+      fprintf(stderr, "Error: Unable to listen on port %d\n", tcp_port);
+      return EXIT_FAILURE;
+    }
+    fd[fds++].events = POLLIN;
+  }
+
+  /* Every session holds a socket, allow as many as the hard limit. */
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  signal(SIGPIPE, SIG_IGN);
+  if (server_workers_start() != 0) {
+    return EXIT_FAILURE;
+  }
+
+  while (1) {
+    if (poll(fd, fds, -1) == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Error: poll() failed with errno: %d\n", errno);
+      return EXIT_FAILURE;
+    }
+    for (n = 0; n < fds; n++) {
+      if (fd[n].revents & POLLIN) {
+        server_accept(fd[n].fd);
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
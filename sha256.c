@@ -0,0 +1,154 @@
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include "sha256.h"
+
+/* SHA-256 as in FIPS 180-4, for keys that must never collide by chance. */
+
+static const uint32_t sha256_k[64] = {
+  0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5,
+  0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+  0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3,
+  0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+  0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC,
+  0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+  0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7,
+  0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+  0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13,
+  0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+  0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3,
+  0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+  0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5,
+  0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+  0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208,
+  0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+
+static void sha256_block(sha256_t *sha, const uint8_t block[])
+{
+  uint32_t w[64];
+  uint32_t a, b, c, d, e, f, g, h, t1, t2;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = ((uint32_t)block[i * 4] << 24) | (block[(i * 4) + 1] << 16) |
+      (block[(i * 4) + 2] << 8) | block[(i * 4) + 3];
+  }
+  for (i = 16; i < 64; i++) {
+    w[i] = w[i - 16] + w[i - 7] +
+      (SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^
+      (w[i - 15] >> 3)) +
+      (SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^
+      (w[i - 2] >> 10));
+  }
+
+  a = sha->state[0];
+  b = sha->state[1];
+  c = sha->state[2];
+  d = sha->state[3];
+  e = sha->state[4];
+  f = sha->state[5];
+  g = sha->state[6];
+  h = sha->state[7];
+
+  for (i = 0; i < 64; i++) {
+    t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) +
+      ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+    t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) +
+      ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+
+  sha->state[0] += a;
+  sha->state[1] += b;
+  sha->state[2] += c;
+  sha->state[3] += d;
+  sha->state[4] += e;
+  sha->state[5] += f;
+  sha->state[6] += g;
+  sha->state[7] += h;
+}
+
+
+
+void sha256_init(sha256_t *sha)
+{
+  sha->state[0] = 0x6A09E667;
+  sha->state[1] = 0xBB67AE85;
+  sha->state[2] = 0x3C6EF372;
+  sha->state[3] = 0xA54FF53A;
+  sha->state[4] = 0x510E527F;
+  sha->state[5] = 0x9B05688C;
+  sha->state[6] = 0x1F83D9AB;
+  sha->state[7] = 0x5BE0CD19;
+  sha->length = 0;
+  sha->used = 0;
+}
+
+
+
+void sha256_update(sha256_t *sha, const void *data, size_t size)
+{
+  const uint8_t *p = data;
+  size_t n;
+
+  sha->length += size;
+  while (size > 0) {
+    if (sha->used == 0 && size >= SHA256_BLOCK_SIZE) {
+      sha256_block(sha, p);
+      n = SHA256_BLOCK_SIZE;
+    } else {
+      n = SHA256_BLOCK_SIZE - sha->used;
+      if (n > size) {
+        n = size;
+      }
+      memcpy(&sha->block[sha->used], p, n);
+      sha->used += n;
+      if (sha->used == SHA256_BLOCK_SIZE) {
+        sha256_block(sha, sha->block);
+        sha->used = 0;
+      }
+    }
+    p += n;
+    size -= n;
+  }
+}
+
+
+
+void sha256_final(sha256_t *sha, uint8_t digest[SHA256_SIZE])
+{
+  uint64_t bits = sha->length * 8;
+  int i;
+
+  /* Pad with a one bit, zeros and the length in bits at the very end. */
+  sha->block[sha->used++] = 0x80;
+  if (sha->used > SHA256_BLOCK_SIZE - 8) {
+    memset(&sha->block[sha->used], 0, SHA256_BLOCK_SIZE - sha->used);
+    sha256_block(sha, sha->block);
+    sha->used = 0;
+  }
+  memset(&sha->block[sha->used], 0, SHA256_BLOCK_SIZE - 8 - sha->used);
+  for (i = 0; i < 8; i++) {
+    sha->block[SHA256_BLOCK_SIZE - 1 - i] = bits >> (i * 8);
+  }
+  sha256_block(sha, sha->block);
+
+  for (i = 0; i < 8; i++) {
+    digest[i * 4] = sha->state[i] >> 24;
+    digest[(i * 4) + 1] = sha->state[i] >> 16;
+    digest[(i * 4) + 2] = sha->state[i] >> 8;
+    digest[(i * 4) + 3] = sha->state[i];
+  }
+}
@@ -0,0 +1,21 @@
+#ifndef _SHA256_H
+#define _SHA256_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SHA256_SIZE 32
+#define SHA256_BLOCK_SIZE 64
+
+typedef struct sha256_s {
+  uint32_t state[8];
+  uint64_t length; /* In bytes. */
+  uint8_t block[SHA256_BLOCK_SIZE];
+  size_t used;
+} sha256_t;
+
+void sha256_init(sha256_t *sha);
+void sha256_update(sha256_t *sha, const void *data, size_t size);
+void sha256_final(sha256_t *sha, uint8_t digest[SHA256_SIZE]);
+
+#endif /* _SHA256_H */
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "store.h"
+
+/* Content addressed record store shared by all drives of a machine.
+
+   Records are kept once, found by a hash of their contents and reference
+   counted. A drive holds the ID of the record for each of its sectors, so
+   writing a sector means inserting the new contents and releasing the old,
+   which leaves any other drive or sector sharing the old contents intact.
+   Entries with no references are reused before the table grows. */
+
+#define STORE_ENTRIES_MIN 256
+
+struct store_entry_s {
+  uint8_t data[STORE_RECORD_SIZE];
+  uint32_t hash;
+  uint32_t refs; /* Zero when on the free list. */
+  uint32_t next; /* Hash chain or free list. */
+};
+
+
+
+void store_init(store_t *store)
+{
+  store->entry = NULL;
+  store->entries_max = 0;
+  store->entries_used = 0;
+  store->free = STORE_NONE;
+  store->bucket = NULL;
+  store->bucket_mask = 0;
+  memset(&store->stat, 0, sizeof(store_stats_t));
+}
+
+
+
+void store_destroy(store_t *store)
+{
+  free(store->entry);
+  free(store->bucket);
+  store_init(store);
+}
+
+
+
+static uint32_t store_hash(const uint8_t data[])
+{
+  uint32_t hash = 0x9E3779B9;
+  uint32_t word;
+  int i;
+
+  /* Word at a time multiply and rotate, good enough for a hash table. */
+  for (i = 0; i < STORE_RECORD_SIZE; i += 4) {
+    word = data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) |
+      ((uint32_t)data[i + 3] << 24);
+    hash = (hash ^ word) * 0x01000193;
+    hash = (hash << 13) | (hash >> 19);
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6B;
+  hash ^= hash >> 13;
+  return hash;
+}
+
+
+
+static int store_rehash(store_t *store, uint32_t buckets)
+{
+  uint32_t *bucket;
+  uint32_t i, b;
+
+  bucket = malloc(buckets * sizeof(uint32_t));
+  if (bucket == NULL) {
+    return -1;
+  }
+  for (i = 0; i < buckets; i++) {
+    bucket[i] = STORE_NONE;
+  }
+
+  for (i = 0; i < store->entries_used; i++) {
+    if (store->entry[i].refs == 0) {
+      continue;
+    }
+    b = store->entry[i].hash & (buckets - 1);
+    store->entry[i].next = bucket[b];
+    bucket[b] = i;
+  }
+
+  free(store->bucket);
+  store->bucket = bucket;
+  store->bucket_mask = buckets - 1;
+  return 0;
+}
+
+
+
+static uint32_t store_alloc(store_t *store)
+{
+  store_entry_t *entry;
+  uint32_t id, max;
+
+  if (store->free != STORE_NONE) {
+    id = store->free;
+    store->free = store->entry[id].next;
+    return id;
+  }
+
+  if (store->entries_used >= store->entries_max) {
+    max = (store->entries_max == 0) ? STORE_ENTRIES_MIN :
+      store->entries_max * 2;
+    entry = realloc(store->entry, max * sizeof(store_entry_t));
+    if (entry == NULL) {
+      return STORE_NONE;
+    }
+    store->entry = entry;
+    store->entries_max = max;
+  }
+
+  /* Keep the load factor at one or below. */
+  if (store->entries_used + 1 > store->bucket_mask + 1 ||
+    store->bucket == NULL) {
+    if (store_rehash(store, store->entries_max) != 0) {
+      return STORE_NONE;
+    }
+  }
+
+  return store->entries_used++;
+}
+
+
+
+uint32_t store_insert(store_t *store, const uint8_t data[])
+{
+  uint32_t hash, id;
+
+  hash = store_hash(data);
+  store->stat.lookups++;
+
+  if (store->bucket != NULL) {
+    for (id = store->bucket[hash & store->bucket_mask]; id != STORE_NONE;
+      id = store->entry[id].next) {
+      if (store->entry[id].hash == hash &&
+        memcmp(store->entry[id].data, data, STORE_RECORD_SIZE) == 0) {
+        store->entry[id].refs++;
+        store->stat.hits++;
+        store->stat.refs++;
+        return id;
+      }
+    }
+  }
+
+  id = store_alloc(store);
+  if (id == STORE_NONE) {
+    return STORE_NONE;
+  }
+  memcpy(store->entry[id].data, data, STORE_RECORD_SIZE);
+  store->entry[id].hash = hash;
+  store->entry[id].refs = 1;
+  store->entry[id].next = store->bucket[hash & store->bucket_mask];
+  store->bucket[hash & store->bucket_mask] = id;
+
+  store->stat.entries++;
+  store->stat.refs++;
+  return id;
+}
+
+
+
+void store_retain(store_t *store, uint32_t id)
+{
+  store->entry[id].refs++;
+  store->stat.refs++;
+}
+
+
+
+void store_release(store_t *store, uint32_t id)
+{
+  uint32_t *link;
+
+  store->stat.refs--;
+  if (--store->entry[id].refs > 0) {
+    return;
+  }
+
+  /* Unlink from the hash chain and put on the free list. */
+  link = &store->bucket[store->entry[id].hash & store->bucket_mask];
+  while (*link != id) {
+    link = &store->entry[*link].next;
+  }
+  *link = store->entry[id].next;
+
+  store->entry[id].next = store->free;
+  store->free = id;
+  store->stat.entries--;
+}
+
+
+
+const uint8_t *store_data(store_t *store, uint32_t id)
+{
+  return store->entry[id].data;
+}
+
+
+
+void store_stats(store_t *store, store_stats_t *stats)
+{
+  *stats = store->stat;
+}
+
+
+
+void store_dump(store_t *store, FILE *fh)
+{
+  fprintf(fh, "Sector store:\n");
+  fprintf(fh, "  Lookups:    %u\n", store->stat.lookups);
+  fprintf(fh, "  Hits:       %u (%.1f%%)\n", store->stat.hits,
+    (store->stat.lookups > 0) ?
+    (store->stat.hits * 100.0) / store->stat.lookups : 0.0);
+  fprintf(fh, "  Unique:     %u records, %u bytes\n", store->stat.entries,
+    store->stat.entries * STORE_RECORD_SIZE);
+  fprintf(fh, "  Referenced: %u records, %u bytes\n", store->stat.refs,
+    store->stat.refs * STORE_RECORD_SIZE);
+}
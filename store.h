@@ -0,0 +1,38 @@
+#ifndef _STORE_H
+#define _STORE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define STORE_RECORD_SIZE 128
+#define STORE_NONE 0xFFFFFFFF
+
+typedef struct store_stats_s {
+  uint32_t lookups;
+  uint32_t hits;
+  uint32_t entries; /* Unique records held. */
+  uint32_t refs; /* References to them, so records seen by the drives. */
+} store_stats_t;
+
+typedef struct store_entry_s store_entry_t;
+
+typedef struct store_s {
+  store_entry_t *entry;
+  uint32_t entries_max;
+  uint32_t entries_used; /* Including freed ones. */
+  uint32_t free;
+  uint32_t *bucket;
+  uint32_t bucket_mask;
+  store_stats_t stat;
+} store_t;
+
+void store_init(store_t *store);
+void store_destroy(store_t *store);
+uint32_t store_insert(store_t *store, const uint8_t data[]);
+void store_retain(store_t *store, uint32_t id);
+void store_release(store_t *store, uint32_t id);
+const uint8_t *store_data(store_t *store, uint32_t id);
+void store_stats(store_t *store, store_stats_t *stats);
+void store_dump(store_t *store, FILE *fh);
+
+#endif /* _STORE_H */
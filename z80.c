@@ -120,42 +120,42 @@ typedef enum {
 
 
 
-static dt_t dt_r[8] =
+static const dt_t dt_r[8] =
   {DT_R_B, DT_R_C, DT_R_D, DT_R_E, DT_R_H, DT_R_L, DT_R_HLI, DT_R_A};
 
-static dt_t dt_rix[8] =
+static const dt_t dt_rix[8] =
   {DT_R_B, DT_R_C, DT_R_D, DT_R_E, DT_R_IXH, DT_R_IXL, DT_R_IXI, DT_R_A};
 
-static dt_t dt_riy[8] =
+static const dt_t dt_riy[8] =
   {DT_R_B, DT_R_C, DT_R_D, DT_R_E, DT_R_IYH, DT_R_IYL, DT_R_IYI, DT_R_A};
 
-static dt_t dt_rp[4] =
+static const dt_t dt_rp[4] =
   {DT_RP_BC, DT_RP_DE, DT_RP_HL, DT_RP_SP};
 
-static dt_t dt_rpaf[4] =
+static const dt_t dt_rpaf[4] =
   {DT_RP_BC, DT_RP_DE, DT_RP_HL, DT_RP_AF};
 
-static dt_t dt_rpix[4] =
+static const dt_t dt_rpix[4] =
   {DT_RP_BC, DT_RP_DE, DT_RP_IX, DT_RP_SP};
 
-static dt_t dt_rpiy[4] =
+static const dt_t dt_rpiy[4] =
   {DT_RP_BC, DT_RP_DE, DT_RP_IY, DT_RP_SP};
 
-static dt_t dt_cc[8] =
+static const dt_t dt_cc[8] =
   {DT_CC_NZ, DT_CC_Z, DT_CC_NC, DT_CC_C, DT_CC_PO, DT_CC_PE, DT_CC_P, DT_CC_M};
 
-static dt_t dt_alu[8] = 
+static const dt_t dt_alu[8] = 
   {DT_ALU_ADD, DT_ALU_ADC, DT_ALU_SUB, DT_ALU_SBC,
    DT_ALU_AND, DT_ALU_XOR, DT_ALU_OR,  DT_ALU_CP};
 
-static dt_t dt_rot[8] =
+static const dt_t dt_rot[8] =
   {DT_ROT_RLC, DT_ROT_RRC, DT_ROT_RL,  DT_ROT_RR,
    DT_ROT_SLA, DT_ROT_SRA, DT_ROT_SLL, DT_ROT_SRL};
 
-static dt_t dt_im[8] =
+static const dt_t dt_im[8] =
   {DT_IM_0, DT_IM_01, DT_IM_1, DT_IM_2, DT_IM_0, DT_IM_01, DT_IM_1, DT_IM_2};
 
-static dt_t dt_bli[4][4] =
+static const dt_t dt_bli[4][4] =
   {{DT_BLI_LDI,  DT_BLI_CPI,  DT_BLI_INI,  DT_BLI_OUTI},
    {DT_BLI_LDD,  DT_BLI_CPD,  DT_BLI_IND,  DT_BLI_OUTD},
    {DT_BLI_LDIR, DT_BLI_CPIR, DT_BLI_INIR, DT_BLI_OTIR},
@@ -167,12 +167,6 @@ static dt_t dt_bli[4][4] =
 #define z80_trace(...)
 #else
 
-#define Z80_TRACE_BUFFER_SIZE 20
-#define Z80_TRACE_BUFFER_ENTRY 80
-
-static char z80_trace_buffer[Z80_TRACE_BUFFER_SIZE][Z80_TRACE_BUFFER_ENTRY];
-static int z80_trace_buffer_index = 0;
-
 static char *dt_text(dt_t sym)
 {
   switch (sym) {
@@ -309,38 +303,38 @@ static void z80_trace(z80_t *z80, mem_t *mem, int no, const char *format, ...)
 
   snprintf(&buffer[n], Z80_TRACE_BUFFER_ENTRY - n, "\n");
 
-  strncpy(z80_trace_buffer[z80_trace_buffer_index],
+  strncpy(z80->trace_buffer[z80->trace_buffer_index],
     buffer, Z80_TRACE_BUFFER_ENTRY);
-  z80_trace_buffer_index++;
-  if (z80_trace_buffer_index >= Z80_TRACE_BUFFER_SIZE) {
-    z80_trace_buffer_index = 0;
+  z80->trace_buffer_index++;
+  if (z80->trace_buffer_index >= Z80_TRACE_BUFFER_SIZE) {
+    z80->trace_buffer_index = 0;
   }
 }
 
 
 
-void z80_trace_init(void)
+void z80_trace_init(z80_t *z80)
 {
   for (int i = 0; i < Z80_TRACE_BUFFER_SIZE; i++) {
-    z80_trace_buffer[i][0] = '\0';
+    z80->trace_buffer[i][0] = '\0';
   }
-  z80_trace_buffer_index = 0;
+  z80->trace_buffer_index = 0;
 }
 
 
 
-void z80_trace_dump(FILE *fh)
+void z80_trace_dump(FILE *fh, z80_t *z80)
 {
   fprintf(stderr, "PC:    Code:         Mnemonics:     "
                   "A: BC:  DE:  HL:  SP:  IX:  IY:  Flags:\n");
-  for (int i = z80_trace_buffer_index; i < Z80_TRACE_BUFFER_SIZE; i++) {
-    if (z80_trace_buffer[i][0] != '\0') {
-      fprintf(fh, z80_trace_buffer[i]);
+  for (int i = z80->trace_buffer_index; i < Z80_TRACE_BUFFER_SIZE; i++) {
+    if (z80->trace_buffer[i][0] != '\0') {
+      fprintf(fh, z80->trace_buffer[i]);
     }
   }
-  for (int i = 0; i < z80_trace_buffer_index; i++) {
-    if (z80_trace_buffer[i][0] != '\0') {
-      fprintf(fh, z80_trace_buffer[i]);
+  for (int i = 0; i < z80->trace_buffer_index; i++) {
+    if (z80->trace_buffer[i][0] != '\0') {
+      fprintf(fh, z80->trace_buffer[i]);
     }
   }
 }
@@ -761,14 +755,15 @@ static uint8_t z80_srl(z80_t *z80, uint8_t input)
 
 
 
-void z80_init(z80_t *z80)
+void z80_init(z80_t *z80, panic_t *panic)
 {
   memset(z80, 0, sizeof(z80_t));
+  z80->panic = panic;
 }
 
 
 
-void z80_execute(z80_t *z80, mem_t *mem)
+void z80_execute(z80_t *z80, mem_t *mem, io_t *io)
 {
   /* Implementing decoding logic described at: http://z80.info/decoding.htm */
   uint8_t mc[4];
@@ -843,7 +838,8 @@ void z80_execute(z80_t *z80, mem_t *mem)
       z80->pc += 4;
 
     } else {
-      panic("Unhandled DDCB opcode: %02x [x=%d z=%d y=%d]\n", mc[3], x, z, y);
+      panic_raise(z80->panic,
+        "Unhandled DDCB opcode: %02x [x=%d z=%d y=%d]\n", mc[3], x, z, y);
       z80->pc += 4;
     }
 
@@ -912,7 +908,8 @@ void z80_execute(z80_t *z80, mem_t *mem)
       z80->pc += 4;
 
     } else {
-      panic("Unhandled FDCB opcode: %02x [x=%d z=%d y=%d]\n", mc[3], x, z, y);
+      panic_raise(z80->panic,
+        "Unhandled FDCB opcode: %02x [x=%d z=%d y=%d]\n", mc[3], x, z, y);
       z80->pc += 4;
     }
 
@@ -1015,7 +1012,8 @@ void z80_execute(z80_t *z80, mem_t *mem)
       z80->pc += 2;
 
     } else {
-      panic("Unhandled CB opcode: %02x [x=%d z=%d y=%d]\n", mc[1], x, z, y);
+      panic_raise(z80->panic,
+        "Unhandled CB opcode: %02x [x=%d z=%d y=%d]\n", mc[1], x, z, y);
       z80->pc += 2;
     }
 
@@ -1031,16 +1029,18 @@ void z80_execute(z80_t *z80, mem_t *mem)
       dt_t dt = dt_r[y];
       z80_trace(z80, mem, 2, "OUT (C),%s", dt_text(dt));
       switch (dt) {
-      case DT_R_B: io_write(c(z80), b(z80), b(z80), mem); break;
-      case DT_R_C: io_write(c(z80), b(z80), c(z80), mem); break;
-      case DT_R_D: io_write(c(z80), b(z80), d(z80), mem); break;
-      case DT_R_E: io_write(c(z80), b(z80), e(z80), mem); break;
-      case DT_R_H: io_write(c(z80), b(z80), h(z80), mem); break;
-      case DT_R_L: io_write(c(z80), b(z80), l(z80), mem); break;
-      case DT_R_A: io_write(c(z80), b(z80), a(z80), mem); break;
+      case DT_R_B: io_write(io, c(z80), b(z80), b(z80), mem); break;
+      case DT_R_C: io_write(io, c(z80), b(z80), c(z80), mem); break;
+      case DT_R_D: io_write(io, c(z80), b(z80), d(z80), mem); break;
+      case DT_R_E: io_write(io, c(z80), b(z80), e(z80), mem); break;
+      case DT_R_H: io_write(io, c(z80), b(z80), h(z80), mem); break;
+      case DT_R_L: io_write(io, c(z80), b(z80), l(z80), mem); break;
+      case DT_R_A: io_write(io, c(z80), b(z80), a(z80), mem); break;
       default: break;
       }
-      z80->pc += 2;
+      if (! io->blocked) { /* Otherwise the whole instruction is retried. */
+        z80->pc += 2;
+      }
 
     } else if (1 == x && 2 == z && 0 == q) {
       dt_t dt = dt_rp[p];
@@ -1128,7 +1128,7 @@ void z80_execute(z80_t *z80, mem_t *mem)
     } else if (1 == x && 6 == z) {
       dt_t dt = dt_im[y];
       z80_trace(z80, mem, 2, "IM %s", dt_text(dt));
-      panic("Unimplemented IM (%02x)\n", dt);
+      panic_raise(z80->panic, "Unimplemented IM (%02x)\n", dt);
       z80->pc += 2;
 
     } else if (1 == x && 7 == z && 0 == y) {
@@ -1211,20 +1211,21 @@ void z80_execute(z80_t *z80, mem_t *mem)
           z80->pc -= 2; /* Repeat */
         }
         break;
-      case DT_BLI_INI:  panic("Unimplemented INI\n");  break;
-      case DT_BLI_IND:  panic("Unimplemented IND\n");  break;
-      case DT_BLI_INIR: panic("Unimplemented INIR\n"); break;
-      case DT_BLI_INDR: panic("Unimplemented INDR\n"); break;
-      case DT_BLI_OUTI: panic("Unimplemented OUTI\n"); break;
-      case DT_BLI_OUTD: panic("Unimplemented OUTD\n"); break;
-      case DT_BLI_OTIR: panic("Unimplemented OTIR\n"); break;
-      case DT_BLI_OTDR: panic("Unimplemented OTDR\n"); break;
+      case DT_BLI_INI:  panic_raise(z80->panic, "Unimplemented INI\n");  break;
+      case DT_BLI_IND:  panic_raise(z80->panic, "Unimplemented IND\n");  break;
+      case DT_BLI_INIR: panic_raise(z80->panic, "Unimplemented INIR\n"); break;
+      case DT_BLI_INDR: panic_raise(z80->panic, "Unimplemented INDR\n"); break;
+      case DT_BLI_OUTI: panic_raise(z80->panic, "Unimplemented OUTI\n"); break;
+      case DT_BLI_OUTD: panic_raise(z80->panic, "Unimplemented OUTD\n"); break;
+      case DT_BLI_OTIR: panic_raise(z80->panic, "Unimplemented OTIR\n"); break;
+      case DT_BLI_OTDR: panic_raise(z80->panic, "Unimplemented OTDR\n"); break;
       default: break;
       }
       z80->pc += 2;
 
     } else {
-      panic("Unhandled ED opcode: %02x [x=%d z=%d (y=%d | q=%d p=%d)]\n",
+      panic_raise(z80->panic,
+        "Unhandled ED opcode: %02x [x=%d z=%d (y=%d | q=%d p=%d)]\n",
         mc[1], x, z, y, q, p);
       z80->pc += 2;
     }
@@ -1431,7 +1432,8 @@ void z80_execute(z80_t *z80, mem_t *mem)
       z80->pc += 2;
 
     } else {
-      panic("Unhandled DD opcode: %02x [x=%d z=%d (y=%d | q=%d p=%d)]\n",
+      panic_raise(z80->panic,
+        "Unhandled DD opcode: %02x [x=%d z=%d (y=%d | q=%d p=%d)]\n",
         mc[1], x, z, y, q, p);
       z80->pc += 2;
     }
@@ -1638,7 +1640,8 @@ void z80_execute(z80_t *z80, mem_t *mem)
       z80->pc += 2;
 
     } else {
-      panic("Unhandled FD opcode: %02x [x=%d z=%d (y=%d | q=%d p=%d)]\n",
+      panic_raise(z80->panic,
+        "Unhandled FD opcode: %02x [x=%d z=%d (y=%d | q=%d p=%d)]\n",
         mc[1], x, z, y, q, p);
       z80->pc += 2;
     }
@@ -1992,7 +1995,7 @@ void z80_execute(z80_t *z80, mem_t *mem)
 
     } else if (1 == x && (6 == z && 6 == y)) {
       z80_trace(z80, mem, 1, "HALT");
-      panic("Unimplemented HALT\n");
+      panic_raise(z80->panic, "Unimplemented HALT\n");
       z80->pc += 1;
 
     } else if (2 == x) {
@@ -2142,14 +2145,20 @@ void z80_execute(z80_t *z80, mem_t *mem)
     } else if (3 == x && 3 == z && 2 == y) {
       uint8_t value = mc[1];
       z80_trace(z80, mem, 2, "OUT (%02x),A", value);
-      io_write(value, a(z80), a(z80), mem);
-      z80->pc += 2;
+      io_write(io, value, a(z80), a(z80), mem);
+      if (! io->blocked) { /* Otherwise the whole instruction is retried. */
+        z80->pc += 2;
+      }
 
     } else if (3 == x && 3 == z && 3 == y) {
       uint8_t value = mc[1];
+      uint8_t data;
       z80_trace(z80, mem, 2, "IN A,(%02x)", value);
-      a(z80) = io_read(value, a(z80));
-      z80->pc += 2;
+      data = io_read(io, value, a(z80), mem);
+      if (! io->blocked) { /* Otherwise the whole instruction is retried. */
+        a(z80) = data;
+        z80->pc += 2;
+      }
 
     } else if (3 == x && 3 == z && 4 == y) {
       z80_trace(z80, mem, 1, "EX (SP),HL");
@@ -2273,10 +2282,11 @@ void z80_execute(z80_t *z80, mem_t *mem)
       z80->sp--;
       mem_write(mem, z80->sp, (z80->pc + 1) % 256);
       z80->pc = zero_address;
-      panic("Unimplemented RST\n");
+      panic_raise(z80->panic, "Unimplemented RST\n");
 
     } else {
-      panic("Unhandled opcode: %02x [x=%d z=%d (y=%d | q=%d p=%d)]\n",
+      panic_raise(z80->panic,
+        "Unhandled opcode: %02x [x=%d z=%d (y=%d | q=%d p=%d)]\n",
         mc[0], x, z, y, q, p);
       z80->pc += 1;
     }
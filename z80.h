@@ -3,7 +3,13 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include "mem.h"
+#include "io.h"
+#include "panic.h"
+
+#define Z80_TRACE_BUFFER_SIZE 20
+#define Z80_TRACE_BUFFER_ENTRY 80
 
 typedef struct z80_s {
   uint16_t pc; /* Program Counter */
@@ -105,13 +111,19 @@ typedef struct z80_s {
     uint16_t hl_; /* Alternate HL' */
   } u_hl_;
 
+  panic_t *panic;
+
+#ifndef DISABLE_Z80_TRACE
+  char trace_buffer[Z80_TRACE_BUFFER_SIZE][Z80_TRACE_BUFFER_ENTRY];
+  int trace_buffer_index;
+#endif /* DISABLE_Z80_TRACE */
 } z80_t;
 
-void z80_init(z80_t *z80);
-void z80_execute(z80_t *z80, mem_t *mem);
+void z80_init(z80_t *z80, panic_t *panic);
+void z80_execute(z80_t *z80, mem_t *mem, io_t *io);
 
-void z80_trace_init(void);
-void z80_trace_dump(FILE *fh);
+void z80_trace_init(z80_t *z80);
+void z80_trace_dump(FILE *fh, z80_t *z80);
 void z80_dump(FILE *fh, z80_t *z80, mem_t *mem);
 
 #endif /* _Z80_H */